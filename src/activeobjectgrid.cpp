@@ -0,0 +1,133 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "activeobjectgrid.h"
+#include "constants.h"
+#include "util/numeric.h"
+#include <cmath>
+
+#define ACTIVEOBJECTGRID_CELL_SIZE ((f32)MAP_BLOCKSIZE * BS)
+
+v3s16 ActiveObjectGrid::getCell(v3f pos)
+{
+	// Clamp so that far-away positions still map to a cell, leaving
+	// room for the cell loop in getObjectsNear to terminate
+	f32 lim = 32766.0f;
+	f32 x = rangelim(floorf(pos.X / ACTIVEOBJECTGRID_CELL_SIZE), -lim, lim);
+	f32 y = rangelim(floorf(pos.Y / ACTIVEOBJECTGRID_CELL_SIZE), -lim, lim);
+	f32 z = rangelim(floorf(pos.Z / ACTIVEOBJECTGRID_CELL_SIZE), -lim, lim);
+	// NaN compares false everywhere and would survive rangelim
+	if (x != x || y != y || z != z)
+		return v3s16(0, 0, 0);
+	return v3s16(x, y, z);
+}
+
+void ActiveObjectGrid::addToCell(const v3s16 &cell, u16 id)
+{
+	m_cells[cell].push_back(id);
+}
+
+void ActiveObjectGrid::removeFromCell(const v3s16 &cell, u16 id)
+{
+	std::map<v3s16, std::vector<u16> >::iterator it = m_cells.find(cell);
+	if (it == m_cells.end())
+		return;
+
+	std::vector<u16> &ids = it->second;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (ids[i] == id) {
+			ids[i] = ids.back();
+			ids.pop_back();
+			break;
+		}
+	}
+	if (ids.empty())
+		m_cells.erase(it);
+}
+
+void ActiveObjectGrid::insert(u16 id, v3f pos)
+{
+	remove(id);
+	v3s16 cell = getCell(pos);
+	m_object_cells[id] = cell;
+	addToCell(cell, id);
+}
+
+void ActiveObjectGrid::remove(u16 id)
+{
+	std::map<u16, v3s16>::iterator it = m_object_cells.find(id);
+	if (it == m_object_cells.end())
+		return;
+	removeFromCell(it->second, id);
+	m_object_cells.erase(it);
+}
+
+void ActiveObjectGrid::update(u16 id, v3f pos)
+{
+	std::map<u16, v3s16>::iterator it = m_object_cells.find(id);
+	if (it == m_object_cells.end())
+		return;
+
+	v3s16 cell = getCell(pos);
+	if (cell == it->second)
+		return;
+
+	removeFromCell(it->second, id);
+	addToCell(cell, id);
+	it->second = cell;
+}
+
+void ActiveObjectGrid::clear()
+{
+	m_cells.clear();
+	m_object_cells.clear();
+}
+
+void ActiveObjectGrid::getObjectsNear(v3f pos, f32 radius,
+		std::vector<u16> &ids) const
+{
+	v3s16 minc = getCell(pos - v3f(radius, radius, radius));
+	v3s16 maxc = getCell(pos + v3f(radius, radius, radius));
+
+	// For huge radii walking the occupied cells is cheaper
+	u64 volume = (u64)(maxc.X - minc.X + 1) * (maxc.Y - minc.Y + 1) *
+			(maxc.Z - minc.Z + 1);
+	if (volume > m_cells.size()) {
+		for (std::map<v3s16, std::vector<u16> >::const_iterator
+				it = m_cells.begin(); it != m_cells.end(); ++it) {
+			const v3s16 &c = it->first;
+			if (c.X < minc.X || c.X > maxc.X ||
+					c.Y < minc.Y || c.Y > maxc.Y ||
+					c.Z < minc.Z || c.Z > maxc.Z)
+				continue;
+			ids.insert(ids.end(), it->second.begin(), it->second.end());
+		}
+		return;
+	}
+
+	v3s16 c;
+	for (c.Z = minc.Z; c.Z <= maxc.Z; c.Z++)
+	for (c.Y = minc.Y; c.Y <= maxc.Y; c.Y++)
+	for (c.X = minc.X; c.X <= maxc.X; c.X++) {
+		std::map<v3s16, std::vector<u16> >::const_iterator
+				it = m_cells.find(c);
+		if (it != m_cells.end())
+			ids.insert(ids.end(), it->second.begin(), it->second.end());
+	}
+}
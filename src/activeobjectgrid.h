@@ -0,0 +1,55 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ACTIVEOBJECTGRID_HEADER
+#define ACTIVEOBJECTGRID_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <map>
+#include <vector>
+
+/*
+	Uniform grid of active object positions, one cell per mapblock.
+
+	Answers "which objects may be within this radius" without looking
+	at every object. The result is a superset; callers still check the
+	exact distance.
+*/
+class ActiveObjectGrid
+{
+public:
+	void insert(u16 id, v3f pos);
+	void remove(u16 id);
+	// Moves the object to the cell of pos; ignores unknown ids
+	void update(u16 id, v3f pos);
+	void clear();
+
+	// Appends all objects in cells overlapping the sphere's bounding box
+	void getObjectsNear(v3f pos, f32 radius, std::vector<u16> &ids) const;
+
+private:
+	static v3s16 getCell(v3f pos);
+	void addToCell(const v3s16 &cell, u16 id);
+	void removeFromCell(const v3s16 &cell, u16 id);
+
+	std::map<v3s16, std::vector<u16> > m_cells;
+	std::map<u16, v3s16> m_object_cells;
+};
+
+#endif
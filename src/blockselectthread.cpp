@@ -0,0 +1,542 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "blockselectthread.h"
+#include "constants.h"
+#include "debug.h"
+#include "emerge.h"
+#include "map.h"
+#include "mapblock.h"
+#include "profiler.h"
+#include "settings.h"
+#include "util/directiontables.h"
+#include "util/mathconstants.h"
+#include "util/numeric.h"
+#include "threading/mutex_auto_lock.h"
+#include "threading/workerpool.h"
+#include <deque>
+
+
+/*
+	Selects the blocks of one client per item. The clients' states are
+	separate and the copy of the loaded blocks is only read, so they are
+	worked on in parallel.
+*/
+class BlockSelectJob : public WorkerJob
+{
+public:
+	BlockSelectJob(BlockSelectThread *thread):
+		m_thread(thread)
+	{}
+
+	void work(u32 item, u32 thread)
+	{
+		const BlockSelectRequest &request = m_thread->m_requests[item];
+		// Only looked up: the states are made by startRound(), and
+		// inserting here would race with the other items. A result
+		// left empty has no peer and is skipped.
+		std::map<u16, BlockSelectThread::ClientState>::iterator state =
+			m_thread->m_clients.find(request.peer_id);
+		if (state == m_thread->m_clients.end())
+			return;
+		m_thread->selectBlocks(request, state->second,
+			m_thread->m_results[item]);
+	}
+
+private:
+	BlockSelectThread *m_thread;
+};
+
+
+BlockSelectThread::BlockSelectThread(EmergeManager *emerge, s32 num_threads) :
+	Thread("BlockSelect"),
+	m_emerge(emerge),
+	m_idle(true)
+{
+	m_pool = new WorkerPool("BlockSelect", num_threads);
+}
+
+
+BlockSelectThread::~BlockSelectThread()
+{
+	if (isRunning()) {
+		stop();
+		wait();
+	}
+
+	delete m_pool;
+}
+
+
+void BlockSelectThread::stop()
+{
+	Thread::stop();
+
+	// Wake up the thread so that it notices
+	m_round_sem.post();
+}
+
+
+void BlockSelectThread::blockChanged(v3s16 p)
+{
+	MutexAutoLock lock(m_mutex);
+	m_changed_blocks.insert(p);
+}
+
+
+bool BlockSelectThread::isIdle()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_idle;
+}
+
+
+void BlockSelectThread::takeResults(std::vector<BlockSelectResult> &results)
+{
+	results.clear();
+	results.swap(m_results);
+}
+
+
+void BlockSelectThread::startRound(Map *map,
+		std::vector<BlockSelectRequest> &requests,
+		const std::vector<u16> &clients)
+{
+	std::set<v3s16> changed_blocks;
+	{
+		MutexAutoLock lock(m_mutex);
+		changed_blocks.swap(m_changed_blocks);
+	}
+
+	for (std::set<v3s16>::iterator i = changed_blocks.begin();
+			i != changed_blocks.end(); ++i) {
+		MapBlock *block = map->getBlockNoCreateNoEx(*i);
+		if (block == NULL) {
+			m_blocks.erase(*i);
+			continue;
+		}
+
+		BlockSelectInfo &info = m_blocks[*i];
+		info.flags = 0;
+		info.face_connectivity = FACE_CONNECTIVITY_ALL;
+		if (block->isDummy()) {
+			info.flags |= BLOCK_SELECT_DUMMY | BLOCK_SELECT_INVALID;
+			continue;
+		}
+		if (!block->isValid() || !block->isGenerated())
+			info.flags |= BLOCK_SELECT_INVALID;
+		if (block->getDayNightDiff())
+			info.flags |= BLOCK_SELECT_DAYNIGHT;
+		info.face_connectivity = block->getFaceConnectivity();
+	}
+
+	// Forget the clients that are gone
+	std::set<u16> active(clients.begin(), clients.end());
+	for (std::map<u16, ClientState>::iterator i = m_clients.begin();
+			i != m_clients.end();) {
+		if (active.find(i->first) == active.end())
+			m_clients.erase(i++);
+		else
+			++i;
+	}
+
+	for (std::vector<BlockSelectRequest>::iterator i = requests.begin();
+			i != requests.end(); ++i) {
+		ClientState &state = m_clients[i->peer_id];
+		if (i->new_client)
+			state = ClientState();
+
+		for (std::vector<std::pair<v3s16, bool> >::const_iterator
+				c = i->known_changes.begin();
+				c != i->known_changes.end(); ++c) {
+			if (c->second)
+				state.known_blocks.insert(c->first);
+			else
+				state.known_blocks.erase(c->first);
+		}
+		i->known_changes.clear();
+	}
+
+	m_requests.clear();
+	m_requests.swap(requests);
+	m_results.assign(m_requests.size(), BlockSelectResult());
+	if (m_requests.empty())
+		return;
+
+	{
+		MutexAutoLock lock(m_mutex);
+		m_idle = false;
+	}
+	m_round_sem.post();
+}
+
+
+const BlockSelectInfo *BlockSelectThread::getBlockInfo(v3s16 p) const
+{
+	std::map<v3s16, BlockSelectInfo>::const_iterator it = m_blocks.find(p);
+	return it != m_blocks.end() ? &it->second : NULL;
+}
+
+
+void BlockSelectThread::selectBlocks(const BlockSelectRequest &request,
+		ClientState &state, BlockSelectResult &result)
+{
+	DSTACK(FUNCTION_NAME);
+
+	result.peer_id = request.peer_id;
+	result.nothing_to_send = false;
+
+	v3s16 center = request.center;
+
+	const s16 full_d_max = g_settings->getS16("max_block_send_distance");
+
+	s16 nearest_unsent_d = request.nearest_unsent_d;
+
+	/*
+		Find the blocks the camera may see again when it moved to
+		another block or blocks changed, and look at the nearest blocks
+		again as some of them may have become visible
+	*/
+	state.visible_blocks_timer += request.dtime;
+	if (request.visible_blocks_expired)
+		state.visible_blocks_expired = true;
+	bool occlusion_culling = g_settings->getBool(
+			"server_side_occlusion_culling");
+	if (occlusion_culling) {
+		v3s16 camera_block = getNodeBlockPos(
+				floatToInt(request.camera_pos, BS));
+		if (camera_block != state.visible_center ||
+				state.visible_blocks_timer >= (state.visible_blocks_expired ?
+					VISIBLE_BLOCKS_EXPIRED_UPDATE_INTERVAL :
+					VISIBLE_BLOCKS_UPDATE_INTERVAL)) {
+			updateVisibleBlocks(state, camera_block, full_d_max);
+			nearest_unsent_d = 0;
+		}
+	}
+
+	s16 d_start = nearest_unsent_d;
+
+	u16 max_simul_sends_setting = g_settings->getU16
+			("max_simultaneous_block_sends_per_client");
+	u16 max_simul_sends_usually = max_simul_sends_setting;
+
+	/*
+		Decrease send rate if player is building stuff.
+	*/
+	if (request.building)
+		max_simul_sends_usually = LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS;
+
+	/*
+		Number of blocks sending + number of blocks selected for sending
+	*/
+	u32 num_blocks_selected = request.num_sending;
+
+	/*
+		next time d will be continued from the d from which the nearest
+		unsent block was found this time.
+
+		This is because not necessarily any of the blocks found this
+		time are actually sent.
+	*/
+	s16 new_nearest_unsent_d;
+
+	s16 d_max = full_d_max;
+	s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
+
+	// Don't loop very much at a time
+	s16 max_d_increment_at_time = 2;
+	if (d_max > d_start + max_d_increment_at_time)
+		d_max = d_start + max_d_increment_at_time;
+
+	s32 nearest_emerged_d = -1;
+	s32 nearest_emergefull_d = -1;
+	s32 nearest_sent_d = -1;
+
+	s16 d;
+	for (d = d_start; d <= d_max; d++) {
+		/*
+			Get the border/face dot coordinates of a "d-radiused"
+			box
+		*/
+		std::vector<v3s16> list = FacePositionCache::getFacePositions(d);
+
+		std::vector<v3s16>::iterator li;
+		for (li = list.begin(); li != list.end(); ++li) {
+			v3s16 p = *li + center;
+
+			/*
+				Send throttling
+				- Don't allow too many simultaneous transfers
+				- EXCEPT when the blocks are very close
+			*/
+
+			// Start with the usual maximum
+			u16 max_simul_dynamic = max_simul_sends_usually;
+
+			// If block is very close, allow full maximum
+			if (d <= BLOCK_SEND_DISABLE_LIMITS_MAX_D)
+				max_simul_dynamic = max_simul_sends_setting;
+
+			// Don't select too many blocks for sending
+			if (num_blocks_selected >= max_simul_dynamic)
+				goto queue_full_break;
+
+			/*
+				Do not go over-limit
+			*/
+			if (blockpos_over_limit(p))
+				continue;
+
+			// If this is true, inexistent block will be made from scratch
+			bool generate = d <= d_max_gen;
+
+			// Limit the send area vertically to 1/2
+			if (abs(p.Y - center.Y) > full_d_max / 2)
+				continue;
+
+			/*
+				Don't generate or send if not in sight
+				FIXME This only works if the client uses a small enough
+				FOV setting. The default of 72 degrees is fine.
+			*/
+			float camera_fov = (72.0*M_PI/180) * 4./3.;
+			if (isBlockInSight(p, request.camera_pos, request.camera_dir,
+					camera_fov, 10000*BS) == false)
+				continue;
+
+			/*
+				Nor if other blocks hide it from the camera. Like the
+				send limits, this isn't checked for the nearest blocks.
+			*/
+			if (occlusion_culling && d > BLOCK_SEND_DISABLE_LIMITS_MAX_D &&
+					!isBlockVisible(state, p))
+				continue;
+
+			/*
+				Don't send blocks that were sent already or are
+				being transferred
+			*/
+			if (state.known_blocks.find(p) != state.known_blocks.end())
+				continue;
+
+			/*
+				Check if map has this block
+			*/
+			const BlockSelectInfo *info = getBlockInfo(p);
+
+			bool surely_not_found_on_disk = false;
+			bool block_is_invalid = false;
+			if (info != NULL) {
+				// This block will be of use in the future
+				result.touched_blocks.push_back(p);
+
+				// Block is dummy if data doesn't exist.
+				// It means it has been not found from disk and not generated
+				if (info->flags & BLOCK_SELECT_DUMMY)
+					surely_not_found_on_disk = true;
+
+				// Block is valid if lighting is up-to-date, data exists
+				// and it is generated
+				if (info->flags & BLOCK_SELECT_INVALID)
+					block_is_invalid = true;
+
+				/*
+					If block is not close, don't send it unless it is near
+					ground level.
+
+					Block is near ground level if night-time mesh
+					differs from day-time mesh.
+				*/
+				if (d >= 4 && !(info->flags & BLOCK_SELECT_DAYNIGHT))
+					continue;
+			}
+
+			/*
+				If block has been marked to not exist on disk (dummy)
+				and generating new ones is not wanted, skip block.
+			*/
+			if (generate == false && surely_not_found_on_disk == true)
+				continue;
+
+			/*
+				Add inexistent block to emerge queue.
+			*/
+			if (info == NULL || surely_not_found_on_disk || block_is_invalid) {
+				if (m_emerge->enqueueBlockEmerge(request.peer_id, p,
+						generate)) {
+					result.emerged_blocks.push_back(p);
+					if (nearest_emerged_d == -1)
+						nearest_emerged_d = d;
+				} else {
+					if (nearest_emergefull_d == -1)
+						nearest_emergefull_d = d;
+					goto queue_full_break;
+				}
+
+				// get next one.
+				continue;
+			}
+
+			if (nearest_sent_d == -1)
+				nearest_sent_d = d;
+
+			/*
+				Add block to send queue
+			*/
+			PrioritySortedBlockTransfer q((float)d, p, request.peer_id);
+
+			result.blocks.push_back(q);
+
+			num_blocks_selected += 1;
+		}
+	}
+queue_full_break:
+
+	// If nothing was found for sending and nothing was queued for
+	// emerging, continue next time browsing from here
+	if (nearest_emerged_d != -1) {
+		new_nearest_unsent_d = nearest_emerged_d;
+	} else if (nearest_emergefull_d != -1) {
+		new_nearest_unsent_d = nearest_emergefull_d;
+	} else {
+		if (d > full_d_max) {
+			new_nearest_unsent_d = 0;
+			result.nothing_to_send = true;
+		} else {
+			if (nearest_sent_d != -1)
+				new_nearest_unsent_d = nearest_sent_d;
+			else
+				new_nearest_unsent_d = d;
+		}
+	}
+
+	result.nearest_unsent_d = new_nearest_unsent_d;
+}
+
+
+struct VisibilityStep
+{
+	v3s16 pos;
+	// Face of the block the fill came through
+	u8 face;
+	// Directions the fill went in to get here
+	u8 dirs;
+};
+
+void BlockSelectThread::updateVisibleBlocks(ClientState &state,
+		v3s16 camera_block, s16 radius)
+{
+	ScopeProfiler sp(g_profiler, "Server: finding visible blocks", SPT_AVG);
+
+	state.visible_center = camera_block;
+	state.visible_radius = radius;
+	state.visible_blocks_expired = false;
+	state.visible_blocks_timer = 0.0;
+
+	s32 size = 2 * radius + 1;
+	std::vector<u8> &visible = state.visible_blocks;
+	visible.assign(size * size * size, 0);
+
+	std::deque<VisibilityStep> queue;
+
+	// The camera sees through all faces of its block
+	visible[(radius * size + radius) * size + radius] = 0x3f;
+	for (u8 d = 0; d < 6; d++) {
+		VisibilityStep s = {camera_block + g_6dirs[d], (u8)((d + 3) % 6),
+				(u8)(1 << d)};
+		queue.push_back(s);
+		v3s16 r = g_6dirs[d] + v3s16(radius, radius, radius);
+		visible[(r.Z * size + r.Y) * size + r.X] |= 1 << s.face;
+	}
+
+	while (!queue.empty()) {
+		VisibilityStep s = queue.front();
+		queue.pop_front();
+
+		// Blocks that aren't loaded or generated yet might be open
+		u16 connectivity = FACE_CONNECTIVITY_ALL;
+		const BlockSelectInfo *info = getBlockInfo(s.pos);
+		if (info)
+			connectivity = info->face_connectivity;
+
+		for (u8 d = 0; d < 6; d++) {
+			// Don't go back towards the camera
+			if (s.dirs & (1 << ((d + 3) % 6)))
+				continue;
+			if (d == s.face ||
+					!(connectivity & face_connectivity_bit(s.face, d)))
+				continue;
+
+			v3s16 r = s.pos + g_6dirs[d] - camera_block +
+					v3s16(radius, radius, radius);
+			if (r.X < 0 || r.Y < 0 || r.Z < 0 ||
+					r.X >= size || r.Y >= size || r.Z >= size)
+				continue;
+
+			u8 face = (d + 3) % 6;
+			u8 &entered = visible[(r.Z * size + r.Y) * size + r.X];
+			if (entered & (1 << face))
+				continue;
+			entered |= 1 << face;
+
+			VisibilityStep next = {s.pos + g_6dirs[d], face,
+					(u8)(s.dirs | (1 << d))};
+			queue.push_back(next);
+		}
+	}
+}
+
+bool BlockSelectThread::isBlockVisible(const ClientState &state, v3s16 p)
+{
+	s32 size = 2 * state.visible_radius + 1;
+	v3s16 r = p - state.visible_center + v3s16(state.visible_radius,
+			state.visible_radius, state.visible_radius);
+	if (r.X < 0 || r.Y < 0 || r.Z < 0 ||
+			r.X >= size || r.Y >= size || r.Z >= size ||
+			state.visible_blocks.empty())
+		return true;
+	return state.visible_blocks[(r.Z * size + r.Y) * size + r.X] != 0;
+}
+
+
+void *BlockSelectThread::run()
+{
+	DSTACK(FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while (!stopRequested()) {
+		m_round_sem.wait();
+		if (stopRequested())
+			break;
+
+		{
+			ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending",
+					SPT_AVG);
+			BlockSelectJob job(this);
+			m_pool->run(&job, m_requests.size());
+		}
+
+		MutexAutoLock lock(m_mutex);
+		m_idle = true;
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER
+
+	return NULL;
+}
@@ -0,0 +1,184 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BLOCKSELECTTHREAD_HEADER
+#define BLOCKSELECTTHREAD_HEADER
+
+#include "irr_v3d.h"
+#include "clientiface.h"
+#include "threading/thread.h"
+#include "threading/mutex.h"
+#include "threading/semaphore.h"
+#include <map>
+#include <set>
+#include <vector>
+
+class Map;
+class EmergeManager;
+class WorkerPool;
+
+// Flags of BlockSelectInfo
+#define BLOCK_SELECT_DUMMY     0x01 // Not found on disk and not generated
+#define BLOCK_SELECT_INVALID   0x02 // Lighting expired, dummy or not generated
+#define BLOCK_SELECT_DAYNIGHT  0x04 // Day and night meshes differ
+
+// What block selection knows of a loaded block
+struct BlockSelectInfo
+{
+	u8 flags;
+	u16 face_connectivity;
+};
+
+// A client as seen by the server step that asks for its blocks
+struct BlockSelectRequest
+{
+	u16 peer_id;
+	// Set on the first request of a client; known_changes then holds
+	// all the blocks it has or is getting
+	bool new_client;
+	// Blocks the client got or is getting (true) and blocks that have
+	// to be sent again (false), in order
+	std::vector<std::pair<v3s16, bool> > known_changes;
+
+	v3s16 center;
+	v3f camera_pos;
+	v3f camera_dir;
+	s16 nearest_unsent_d;
+	u32 num_sending;
+	// Sends are limited while the player is building
+	bool building;
+	// Blocks have changed since the last request
+	bool visible_blocks_expired;
+	// Seconds since the last request
+	float dtime;
+};
+
+struct BlockSelectResult
+{
+	u16 peer_id;
+	// Distance to start from the next time
+	s16 nearest_unsent_d;
+	// Everything in range has been sent
+	bool nothing_to_send;
+	std::vector<PrioritySortedBlockTransfer> blocks;
+	// Blocks queued for emerging, nearest first
+	std::vector<v3s16> emerged_blocks;
+	// Loaded blocks that were looked at, to be kept loaded
+	std::vector<v3s16> touched_blocks;
+};
+
+/*
+	Selects the blocks to send to the clients next to the server thread.
+
+	The thread works on copies: of the state of the loaded blocks that
+	selection needs, and of the blocks each client has. The server
+	thread keeps these up to date incrementally with blockChanged() and
+	the changes in each request, and only drains the results.
+
+	Selection runs in rounds, and one round at a time. While it is
+	idle, the server thread owns all of the state below and takes the
+	results of the last round before it starts the next one.
+*/
+class BlockSelectThread : public Thread
+{
+public:
+	// num_threads work on the clients of a round, as in WorkerPool
+	BlockSelectThread(EmergeManager *emerge, s32 num_threads);
+	~BlockSelectThread();
+
+	void stop();
+
+	// The block at p was loaded, changed or unloaded. Any thread.
+	void blockChanged(v3s16 p);
+
+	// False while a round is running
+	bool isIdle();
+
+	// Gets the results of the last round. Only while idle.
+	void takeResults(std::vector<BlockSelectResult> &results);
+	/*
+		Brings the copy of the loaded blocks up to date and starts a
+		round for requests. Only while idle, and with the map locked.
+		clients are the peers of all active clients; the copies of
+		the others are dropped.
+	*/
+	void startRound(Map *map, std::vector<BlockSelectRequest> &requests,
+			const std::vector<u16> &clients);
+
+protected:
+	void *run();
+
+private:
+	struct ClientState
+	{
+		// Blocks the client has or is getting
+		std::set<v3s16> known_blocks;
+
+		/*
+			The faces through which updateVisibleBlocks() entered the
+			blocks around visible_center, 0 for the hidden ones.
+		*/
+		std::vector<u8> visible_blocks;
+		v3s16 visible_center;
+		s16 visible_radius;
+		// Set when blocks have changed, and seconds since the last update
+		bool visible_blocks_expired;
+		float visible_blocks_timer;
+
+		ClientState():
+			visible_radius(0),
+			visible_blocks_expired(true),
+			visible_blocks_timer(0.0)
+		{}
+	};
+
+	friend class BlockSelectJob;
+
+	// Finds the blocks that should be sent next to a client
+	void selectBlocks(const BlockSelectRequest &request, ClientState &state,
+			BlockSelectResult &result);
+	/*
+		Flood fills the blocks up to radius from the camera block on
+		each axis through the faces that are connected inside them, only
+		going away from the camera block like the lines of sight do.
+	*/
+	void updateVisibleBlocks(ClientState &state, v3s16 camera_block,
+			s16 radius);
+	// Blocks out of the filled area count as visible
+	static bool isBlockVisible(const ClientState &state, v3s16 p);
+	// Returns NULL if the block is not loaded
+	const BlockSelectInfo *getBlockInfo(v3s16 p) const;
+
+	EmergeManager *m_emerge;
+	WorkerPool *m_pool;
+
+	// Protects m_changed_blocks and m_idle
+	Mutex m_mutex;
+	std::set<v3s16> m_changed_blocks;
+	bool m_idle;
+
+	Semaphore m_round_sem;
+
+	std::map<v3s16, BlockSelectInfo> m_blocks;
+	std::map<u16, ClientState> m_clients;
+	std::vector<BlockSelectRequest> m_requests;
+	std::vector<BlockSelectResult> m_results;
+};
+
+#endif
@@ -1013,8 +1013,12 @@ void Client::sendInit(const std::string &playerName)
 {
 	NetworkPacket pkt(TOSERVER_INIT, 1 + 2 + 2 + (1 + playerName.size()));
 
-	// we don't support network compression yet
+	// Map blocks may use any codec we can read
 	u16 supp_comp_modes = NETPROTO_COMPRESSION_NONE;
+	for (u8 codec = 0; codec < BLOCK_CODEC_MAX; codec++) {
+		if (codec != BLOCK_CODEC_ZLIB && isBlockCodecSupported(codec))
+			supp_comp_modes |= 1 << codec;
+	}
 	pkt << (u8) SER_FMT_VER_HIGHEST_READ << (u16) supp_comp_modes;
 	pkt << (u16) CLIENT_PROTOCOL_VERSION_MIN << (u16) CLIENT_PROTOCOL_VERSION_MAX;
 	pkt << playerName;
@@ -20,18 +20,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <sstream>
 
 #include "clientiface.h"
+#include "blockselectthread.h"
 #include "util/numeric.h"
 #include "util/mathconstants.h"
 #include "player.h"
 #include "settings.h"
 #include "mapblock.h"
 #include "network/connection.h"
+#include "network/serveropcodes.h"
 #include "environment.h"
 #include "map.h"
 #include "emerge.h"
 #include "serverobject.h"              // TODO this is used for cleanup of only
 #include "log.h"
 #include "util/srp.h"
+#include "threading/mutex_auto_lock.h"
 
 const char *ClientInterface::statenames[] = {
 	"Invalid",
@@ -61,11 +64,8 @@ void RemoteClient::ResendBlockIfOnWire(v3s16 p)
 	}
 }
 
-void RemoteClient::GetNextBlocks (
-		ServerEnvironment *env,
-		EmergeManager * emerge,
-		float dtime,
-		std::vector<PrioritySortedBlockTransfer> &dest)
+bool RemoteClient::PrepareNextBlocks(ServerEnvironment *env, float dtime,
+		BlockSelectRequest *request)
 {
 	DSTACK(FUNCTION_NAME);
 
@@ -73,21 +73,22 @@ void RemoteClient::GetNextBlocks (
 	// Increment timers
 	m_nothing_to_send_pause_timer -= dtime;
 	m_nearest_unsent_reset_timer += dtime;
+	m_block_select_dtime += dtime;
 
 	if(m_nothing_to_send_pause_timer >= 0)
-		return;
+		return false;
 
 	Player *player = env->getPlayer(peer_id);
 	// This can happen sometimes; clients and players are not in perfect sync.
 	if(player == NULL)
-		return;
+		return false;
 
 	// Won't send anything if already sending
 	if(m_blocks_sending.size() >= g_settings->getU16
 			("max_simultaneous_block_sends_per_client"))
 	{
 		//infostream<<"Not sending any blocks, Queue full."<<std::endl;
-		return;
+		return false;
 	}
 
 	v3f playerpos = player->getPosition();
@@ -103,14 +104,10 @@ void RemoteClient::GetNextBlocks (
 	v3s16 center = getNodeBlockPos(center_nodepos);
 
 	// Camera position and direction
-	v3f camera_pos = player->getEyePosition();
-	v3f camera_dir = v3f(0,0,1);
+	v3f camera_dir(0,0,1);
 	camera_dir.rotateYZBy(player->getPitch());
 	camera_dir.rotateXZBy(player->getYaw());
 
-	/*infostream<<"camera_dir=("<<camera_dir.X<<","<<camera_dir.Y<<","
-			<<camera_dir.Z<<")"<<std::endl;*/
-
 	/*
 		Get the starting value of the block finder radius.
 	*/
@@ -133,239 +130,49 @@ void RemoteClient::GetNextBlocks (
 		//		<<server->getPlayerName(peer_id)<<std::endl;
 	}
 
-	//s16 last_nearest_unsent_d = m_nearest_unsent_d;
-	s16 d_start = m_nearest_unsent_d;
-
-	//infostream<<"d_start="<<d_start<<std::endl;
-
-	u16 max_simul_sends_setting = g_settings->getU16
-			("max_simultaneous_block_sends_per_client");
-	u16 max_simul_sends_usually = max_simul_sends_setting;
-
-	/*
-		Check the time from last addNode/removeNode.
-
-		Decrease send rate if player is building stuff.
-	*/
 	m_time_from_building += dtime;
-	if(m_time_from_building < g_settings->getFloat(
-				"full_block_send_enable_min_time_from_building"))
-	{
-		max_simul_sends_usually
-			= LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS;
-	}
-
-	/*
-		Number of blocks sending + number of blocks selected for sending
-	*/
-	u32 num_blocks_selected = m_blocks_sending.size();
-
-	/*
-		next time d will be continued from the d from which the nearest
-		unsent block was found this time.
-
-		This is because not necessarily any of the blocks found this
-		time are actually sent.
-	*/
-	s32 new_nearest_unsent_d = -1;
-
-	const s16 full_d_max = g_settings->getS16("max_block_send_distance");
-	s16 d_max = full_d_max;
-	s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
-
-	// Don't loop very much at a time
-	s16 max_d_increment_at_time = 2;
-	if(d_max > d_start + max_d_increment_at_time)
-		d_max = d_start + max_d_increment_at_time;
-
-	s32 nearest_emerged_d = -1;
-	s32 nearest_emergefull_d = -1;
-	s32 nearest_sent_d = -1;
-	//bool queue_is_full = false;
-
-	s16 d;
-	for(d = d_start; d <= d_max; d++) {
-		/*
-			Get the border/face dot coordinates of a "d-radiused"
-			box
-		*/
-		std::vector<v3s16> list = FacePositionCache::getFacePositions(d);
-
-		std::vector<v3s16>::iterator li;
-		for(li = list.begin(); li != list.end(); ++li) {
-			v3s16 p = *li + center;
-
-			/*
-				Send throttling
-				- Don't allow too many simultaneous transfers
-				- EXCEPT when the blocks are very close
-
-				Also, don't send blocks that are already flying.
-			*/
-
-			// Start with the usual maximum
-			u16 max_simul_dynamic = max_simul_sends_usually;
-
-			// If block is very close, allow full maximum
-			if(d <= BLOCK_SEND_DISABLE_LIMITS_MAX_D)
-				max_simul_dynamic = max_simul_sends_setting;
-
-			// Don't select too many blocks for sending
-			if (num_blocks_selected >= max_simul_dynamic) {
-				//queue_is_full = true;
-				goto queue_full_break;
-			}
-
-			// Don't send blocks that are currently being transferred
-			if (m_blocks_sending.find(p) != m_blocks_sending.end())
-				continue;
-
-			/*
-				Do not go over-limit
-			*/
-			if (blockpos_over_limit(p))
-				continue;
 
-			// If this is true, inexistent block will be made from scratch
-			bool generate = d <= d_max_gen;
-
-			{
-				/*// Limit the generating area vertically to 2/3
-				if(abs(p.Y - center.Y) > d_max_gen - d_max_gen / 3)
-					generate = false;*/
-
-				// Limit the send area vertically to 1/2
-				if (abs(p.Y - center.Y) > full_d_max / 2)
-					continue;
-			}
-
-			/*
-				Don't generate or send if not in sight
-				FIXME This only works if the client uses a small enough
-				FOV setting. The default of 72 degrees is fine.
-			*/
-
-			float camera_fov = (72.0*M_PI/180) * 4./3.;
-			if(isBlockInSight(p, camera_pos, camera_dir, camera_fov, 10000*BS) == false)
-			{
-				continue;
-			}
-
-			/*
-				Don't send already sent blocks
-			*/
-			{
-				if(m_blocks_sent.find(p) != m_blocks_sent.end())
-				{
-					continue;
-				}
-			}
-
-			/*
-				Check if map has this block
-			*/
-			MapBlock *block = env->getMap().getBlockNoCreateNoEx(p);
-
-			bool surely_not_found_on_disk = false;
-			bool block_is_invalid = false;
-			if(block != NULL)
-			{
-				// Reset usage timer, this block will be of use in the future.
-				block->resetUsageTimer();
-
-				// Block is dummy if data doesn't exist.
-				// It means it has been not found from disk and not generated
-				if(block->isDummy())
-				{
-					surely_not_found_on_disk = true;
-				}
-
-				// Block is valid if lighting is up-to-date and data exists
-				if(block->isValid() == false)
-				{
-					block_is_invalid = true;
-				}
-
-				if(block->isGenerated() == false)
-					block_is_invalid = true;
-
-				/*
-					If block is not close, don't send it unless it is near
-					ground level.
-
-					Block is near ground level if night-time mesh
-					differs from day-time mesh.
-				*/
-				if(d >= 4)
-				{
-					if(block->getDayNightDiff() == false)
-						continue;
-				}
-			}
-
-			/*
-				If block has been marked to not exist on disk (dummy)
-				and generating new ones is not wanted, skip block.
-			*/
-			if(generate == false && surely_not_found_on_disk == true)
-			{
-				// get next one.
-				continue;
-			}
-
-			/*
-				Add inexistent block to emerge queue.
-			*/
-			if(block == NULL || surely_not_found_on_disk || block_is_invalid)
-			{
-				if (emerge->enqueueBlockEmerge(peer_id, p, generate)) {
-					if (nearest_emerged_d == -1)
-						nearest_emerged_d = d;
-				} else {
-					if (nearest_emergefull_d == -1)
-						nearest_emergefull_d = d;
-					goto queue_full_break;
-				}
-
-				// get next one.
-				continue;
-			}
-
-			if(nearest_sent_d == -1)
-				nearest_sent_d = d;
-
-			/*
-				Add block to send queue
-			*/
-			PrioritySortedBlockTransfer q((float)d, p, peer_id);
-
-			dest.push_back(q);
-
-			num_blocks_selected += 1;
-		}
-	}
-queue_full_break:
-
-	// If nothing was found for sending and nothing was queued for
-	// emerging, continue next time browsing from here
-	if(nearest_emerged_d != -1){
-		new_nearest_unsent_d = nearest_emerged_d;
-	} else if(nearest_emergefull_d != -1){
-		new_nearest_unsent_d = nearest_emergefull_d;
+	request->peer_id = peer_id;
+	request->new_client = !m_block_select_started;
+	request->known_changes.clear();
+	if (!m_block_select_started) {
+		// From now on only the changes are passed on
+		m_block_select_started = true;
+		for (std::set<v3s16>::iterator i = m_blocks_sent.begin();
+				i != m_blocks_sent.end(); ++i)
+			request->known_changes.push_back(std::make_pair(*i, true));
+		for (std::map<v3s16, float>::iterator i = m_blocks_sending.begin();
+				i != m_blocks_sending.end(); ++i)
+			request->known_changes.push_back(std::make_pair(i->first, true));
 	} else {
-		if(d > g_settings->getS16("max_block_send_distance")){
-			new_nearest_unsent_d = 0;
-			m_nothing_to_send_pause_timer = 2.0;
-		} else {
-			if(nearest_sent_d != -1)
-				new_nearest_unsent_d = nearest_sent_d;
-			else
-				new_nearest_unsent_d = d;
-		}
+		request->known_changes.swap(m_known_changes);
 	}
 
-	if(new_nearest_unsent_d != -1)
-		m_nearest_unsent_d = new_nearest_unsent_d;
+	request->center = center;
+	request->camera_pos = player->getEyePosition();
+	request->camera_dir = camera_dir;
+	request->nearest_unsent_d = m_nearest_unsent_d;
+	request->num_sending = m_blocks_sending.size();
+	request->building = m_time_from_building < g_settings->getFloat(
+			"full_block_send_enable_min_time_from_building");
+	request->visible_blocks_expired = m_visible_blocks_expired;
+	request->dtime = m_block_select_dtime;
+
+	m_nearest_unsent_reset = false;
+	m_visible_blocks_expired = false;
+	m_block_select_dtime = 0.0;
+
+	return true;
+}
+
+void RemoteClient::FinishNextBlocks(const BlockSelectResult &result)
+{
+	// Blocks set not sent since the request are looked at again
+	if (!m_nearest_unsent_reset)
+		m_nearest_unsent_d = result.nearest_unsent_d;
+
+	if (result.nothing_to_send)
+		m_nothing_to_send_pause_timer = 2.0;
 }
 
 void RemoteClient::GotBlock(v3s16 p)
@@ -375,15 +182,17 @@ void RemoteClient::GotBlock(v3s16 p)
 	else
 	{
 		m_excess_gotblocks++;
+		addKnownChange(p, true);
 	}
 	m_blocks_sent.insert(p);
 }
 
 void RemoteClient::SentBlock(v3s16 p)
 {
-	if(m_blocks_sending.find(p) == m_blocks_sending.end())
+	if(m_blocks_sending.find(p) == m_blocks_sending.end()) {
 		m_blocks_sending[p] = 0.0;
-	else
+		addKnownChange(p, true);
+	} else
 		infostream<<"RemoteClient::SentBlock(): Sent block"
 				" already in m_blocks_sending"<<std::endl;
 }
@@ -391,16 +200,21 @@ void RemoteClient::SentBlock(v3s16 p)
 void RemoteClient::SetBlockNotSent(v3s16 p)
 {
 	m_nearest_unsent_d = 0;
+	m_nearest_unsent_reset = true;
+	m_visible_blocks_expired = true;
 
 	if(m_blocks_sending.find(p) != m_blocks_sending.end())
 		m_blocks_sending.erase(p);
 	if(m_blocks_sent.find(p) != m_blocks_sent.end())
 		m_blocks_sent.erase(p);
+	addKnownChange(p, false);
 }
 
 void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks)
 {
 	m_nearest_unsent_d = 0;
+	m_nearest_unsent_reset = true;
+	m_visible_blocks_expired = true;
 
 	for(std::map<v3s16, MapBlock*>::iterator
 			i = blocks.begin();
@@ -412,9 +226,17 @@ void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks)
 			m_blocks_sending.erase(p);
 		if(m_blocks_sent.find(p) != m_blocks_sent.end())
 			m_blocks_sent.erase(p);
+		addKnownChange(p, false);
 	}
 }
 
+void RemoteClient::addKnownChange(v3s16 p, bool known)
+{
+	// The first request passes on all known blocks
+	if (m_block_select_started)
+		m_known_changes.push_back(std::make_pair(p, known));
+}
+
 void RemoteClient::notifyEvent(ClientStateEvent event)
 {
 	std::ostringstream myerror;
@@ -676,7 +498,8 @@ void ClientInterface::UpdatePlayerList()
 void ClientInterface::send(u16 peer_id, u8 channelnum,
 		NetworkPacket* pkt, bool reliable)
 {
-	m_con->Send(peer_id, channelnum, pkt, reliable);
+	m_con->Send(peer_id, channelnum, pkt, reliable,
+			clientCommandFactoryTable[pkt->getCommand()].send_class);
 }
 
 void ClientInterface::sendToAll(u16 channelnum,
@@ -689,7 +512,8 @@ void ClientInterface::sendToAll(u16 channelnum,
 		RemoteClient *client = i->second;
 
 		if (client->net_proto_version != 0) {
-			m_con->Send(client->peer_id, channelnum, pkt, reliable);
+			m_con->Send(client->peer_id, channelnum, pkt, reliable,
+					clientCommandFactoryTable[pkt->getCommand()].send_class);
 		}
 	}
 }
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"             // for SER_FMT_VER_INVALID
 #include "threading/mutex.h"
 #include "network/networkpacket.h"
+#include "objectinterest.h"
 
 #include <list>
 #include <vector>
@@ -34,6 +35,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 class MapBlock;
 class ServerEnvironment;
 class EmergeManager;
+struct BlockSelectRequest;
+struct BlockSelectResult;
 
 /*
  * State Transitions
@@ -258,6 +261,10 @@ class RemoteClient
 		m_state(CS_Created),
 		m_nearest_unsent_d(0),
 		m_nearest_unsent_reset_timer(0.0),
+		m_nearest_unsent_reset(false),
+		m_block_select_started(false),
+		m_visible_blocks_expired(true),
+		m_block_select_dtime(0.0),
 		m_excess_gotblocks(0),
 		m_nothing_to_send_pause_timer(0.0),
 		m_name(""),
@@ -274,12 +281,17 @@ class RemoteClient
 	}
 
 	/*
-		Finds block that should be sent next to the client.
+		Updates the timers and fills in request for the next block
+		selection with the player position and the changes to the
+		blocks the client has. Returns false if there is nothing to select.
 		Environment should be locked when this is called.
 		dtime is used for resetting send radius at slow interval
 	*/
-	void GetNextBlocks(ServerEnvironment *env, EmergeManager* emerge,
-			float dtime, std::vector<PrioritySortedBlockTransfer> &dest);
+	bool PrepareNextBlocks(ServerEnvironment *env, float dtime,
+			BlockSelectRequest *request);
+
+	// Takes the state for the next request from the selection result
+	void FinishNextBlocks(const BlockSelectResult &result);
 
 	void GotBlock(v3s16 p);
 
@@ -326,6 +338,9 @@ class RemoteClient
 	*/
 	std::set<u16> m_known_objects;
 
+	// Sends the position updates of the known objects
+	ObjectInterest m_object_interest;
+
 	ClientState getState()
 		{ return m_state; }
 
@@ -345,6 +360,16 @@ class RemoteClient
 	void setDeployedCompressionMode(u16 byteFlag)
 		{ m_deployed_compression = byteFlag; }
 
+	// Codec of the map blocks sent to the client
+	u8 getBlockCodec() const
+	{
+		for (u8 codec = 0; codec < BLOCK_CODEC_MAX; codec++) {
+			if (m_deployed_compression & (1 << codec))
+				return codec;
+		}
+		return BLOCK_CODEC_ZLIB;
+	}
+
 	void confirmSerializationVersion()
 		{ serialization_version = m_pending_serialization_version; }
 
@@ -384,6 +409,20 @@ class RemoteClient
 	s16 m_nearest_unsent_d;
 	v3s16 m_last_center;
 	float m_nearest_unsent_reset_timer;
+	// Set when blocks were set not sent since the last request
+	bool m_nearest_unsent_reset;
+
+	// Records a change for the next BlockSelectRequest
+	void addKnownChange(v3s16 p, bool known);
+
+	// Whether the block selection knows of this client yet
+	bool m_block_select_started;
+	// Changes to the blocks the client has since the last request
+	std::vector<std::pair<v3s16, bool> > m_known_changes;
+	// Set when blocks have changed since the last request
+	bool m_visible_blocks_expired;
+	// Seconds since the last request
+	float m_block_select_dtime;
 
 	/*
 		Blocks that are currently on the line.
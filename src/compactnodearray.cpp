@@ -0,0 +1,119 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "compactnodearray.h"
+#include <cstring>
+
+// Slots of the hash table mapping nodes to palette indices while packing
+#define PALETTE_HASH_SIZE 512
+
+static inline u32 node_key(const MapNode &n)
+{
+	return ((u32)n.param0 << 16) | ((u32)n.param1 << 8) | n.param2;
+}
+
+bool CompactNodeArray::pack(const MapNode *nodes, u32 count)
+{
+	if (count == 0)
+		return false;
+
+	std::vector<MapNode> palette;
+	std::vector<u8> indices(count);
+
+	u32 hash_keys[PALETTE_HASH_SIZE];
+	s16 hash_indices[PALETTE_HASH_SIZE];
+	for (u32 i = 0; i < PALETTE_HASH_SIZE; i++)
+		hash_indices[i] = -1;
+
+	// Runs of the same node are common, so the last one is remembered
+	u32 last_key = ~node_key(nodes[0]);
+	u8 last_index = 0;
+	for (u32 i = 0; i < count; i++) {
+		u32 key = node_key(nodes[i]);
+		if (key != last_key) {
+			u32 slot = (key * 2654435761U) >> 23;
+			while (hash_indices[slot] != -1 && hash_keys[slot] != key)
+				slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+			if (hash_indices[slot] == -1) {
+				if (palette.size() == 256)
+					return false;
+				hash_keys[slot] = key;
+				hash_indices[slot] = palette.size();
+				palette.push_back(nodes[i]);
+			}
+			last_key = key;
+			last_index = hash_indices[slot];
+		}
+		indices[i] = last_index;
+	}
+
+	u8 bits;
+	if (palette.size() == 1)
+		bits = 0;
+	else if (palette.size() <= 2)
+		bits = 1;
+	else if (palette.size() <= 4)
+		bits = 2;
+	else if (palette.size() <= 16)
+		bits = 4;
+	else
+		bits = 8;
+
+	clear();
+	m_palette.swap(palette);
+	m_bits = bits;
+	if (bits == 0)
+		return true;
+
+	u32 size = (count * bits + 7) / 8;
+	m_indices = new u8[size];
+	memset(m_indices, 0, size);
+	for (u32 i = 0; i < count; i++) {
+		u32 bit = i * bits;
+		m_indices[bit >> 3] |= indices[i] << (bit & 7);
+	}
+	return true;
+}
+
+void CompactNodeArray::unpack(MapNode *nodes, u32 count) const
+{
+	if (m_bits == 0) {
+		for (u32 i = 0; i < count; i++)
+			nodes[i] = m_palette[0];
+		return;
+	}
+	for (u32 i = 0; i < count; i++)
+		nodes[i] = get(i);
+}
+
+void CompactNodeArray::clear()
+{
+	m_palette.clear();
+	delete[] m_indices;
+	m_indices = NULL;
+	m_bits = 0;
+}
+
+u32 CompactNodeArray::getMemoryUsage(u32 count) const
+{
+	u32 size = m_palette.size() * sizeof(MapNode);
+	if (m_bits != 0)
+		size += (count * m_bits + 7) / 8;
+	return size;
+}
@@ -0,0 +1,80 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef COMPACTNODEARRAY_HEADER
+#define COMPACTNODEARRAY_HEADER
+
+#include <vector>
+#include "irrlichttypes.h"
+#include "mapnode.h"
+#include "util/basic_macros.h"
+
+/*
+	A read-only array of nodes stored as indices into a palette of its
+	distinct nodes: no indices at all if every node is the same,
+	otherwise 1, 2, 4 or 8 bits per node. Arrays with more than 256
+	distinct nodes can not be stored this way.
+*/
+class CompactNodeArray
+{
+public:
+	CompactNodeArray():
+		m_bits(0),
+		m_indices(NULL)
+	{}
+
+	~CompactNodeArray()
+	{
+		clear();
+	}
+
+	// Returns false and leaves the array as it was if nodes has more
+	// than 256 distinct nodes
+	bool pack(const MapNode *nodes, u32 count);
+	void unpack(MapNode *nodes, u32 count) const;
+
+	inline MapNode get(u32 i) const
+	{
+		if (m_bits == 0)
+			return m_palette[0];
+		u32 bit = i * m_bits;
+		return m_palette[(m_indices[bit >> 3] >> (bit & 7))
+				& ((1 << m_bits) - 1)];
+	}
+
+	inline bool empty() const
+	{
+		return m_palette.empty();
+	}
+
+	void clear();
+
+	u8 getBitsPerNode() const { return m_bits; }
+	// Bytes used by the palette and the indices
+	u32 getMemoryUsage(u32 count) const;
+
+private:
+	std::vector<MapNode> m_palette;
+	u8 m_bits;
+	u8 *m_indices;
+
+	DISABLE_CLASS_COPY(CompactNodeArray);
+};
+
+#endif
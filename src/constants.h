@@ -56,6 +56,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS 0
 // Override for the previous one when distance of block is very low
 #define BLOCK_SEND_DISABLE_LIMITS_MAX_D 1
+// Seconds after which the blocks a client may see are searched again,
+// and at least between the searches for changed blocks
+#define VISIBLE_BLOCKS_UPDATE_INTERVAL 5.0
+#define VISIBLE_BLOCKS_EXPIRED_UPDATE_INTERVAL 0.5
+// Most packets the server handles between two steps
+#define SERVER_RECEIVE_BATCH_MAX 256
+// Chunks generated by --pregenerate between two writes to the map database
+#define PREGENERATE_BATCH_CHUNKS 64
 
 /*
     Map-related things
@@ -578,7 +578,9 @@ GenericCAO::GenericCAO(IGameDef *gamedef, ClientEnvironment *env):
 		m_visuals_expired(false),
 		m_step_distance_counter(0),
 		m_last_light(255),
-		m_is_visible(false)
+		m_is_visible(false),
+		m_position_base_id(0),
+		m_has_position_base(false)
 {
 	if(gamedef == NULL)
 		ClientActiveObject::registerType(getType(), create);
@@ -1571,6 +1573,35 @@ void GenericCAO::updateAttachments()
 	}
 }
 
+void GenericCAO::updatePosition(const ObjectPositionUpdate &update)
+{
+	// Not sent by the server if this object is an attachment.
+	// We might however get here if the server notices the object being detached before the client.
+	m_position = update.position;
+	m_velocity = update.velocity;
+	m_acceleration = update.acceleration;
+	if(fabs(m_prop.automatic_rotate) < 0.001)
+		m_yaw = update.yaw;
+
+	// Place us a bit higher if we're physical, to not sink into
+	// the ground due to sucky collision detection...
+	if(m_prop.physical)
+		m_position += v3f(0,0.002,0);
+
+	if(getParent() != NULL) // Just in case
+		return;
+
+	if(update.do_interpolate)
+	{
+		if(!m_prop.physical)
+			pos_translator.update(m_position, update.is_movement_end,
+					update.update_interval);
+	} else {
+		pos_translator.init(m_position);
+	}
+	updateNodePos();
+}
+
 void GenericCAO::processMessage(const std::string &data)
 {
 	//infostream<<"GenericCAO: Got message"<<std::endl;
@@ -1600,35 +1631,21 @@ void GenericCAO::processMessage(const std::string &data)
 	}
 	else if(cmd == GENERIC_CMD_UPDATE_POSITION)
 	{
-		// Not sent by the server if this object is an attachment.
-		// We might however get here if the server notices the object being detached before the client.
-		m_position = readV3F1000(is);
-		m_velocity = readV3F1000(is);
-		m_acceleration = readV3F1000(is);
-		if(fabs(m_prop.automatic_rotate) < 0.001)
-			m_yaw = readF1000(is);
-		else
-			readF1000(is);
-		bool do_interpolate = readU8(is);
-		bool is_end_position = readU8(is);
-		float update_interval = readF1000(is);
-
-		// Place us a bit higher if we're physical, to not sink into
-		// the ground due to sucky collision detection...
-		if(m_prop.physical)
-			m_position += v3f(0,0.002,0);
-
-		if(getParent() != NULL) // Just in case
-			return;
-
-		if(do_interpolate)
-		{
-			if(!m_prop.physical)
-				pos_translator.update(m_position, is_end_position, update_interval);
-		} else {
-			pos_translator.init(m_position);
-		}
-		updateNodePos();
+		updatePosition(gob_read_update_position(is));
+	}
+	else if(cmd == GENERIC_CMD_UPDATE_POSITION_BASE)
+	{
+		// Only stored, it may be older than the updates received so far
+		m_position_base = gob_read_update_position_base(is,
+				&m_position_base_id);
+		m_has_position_base = true;
+	}
+	else if(cmd == GENERIC_CMD_UPDATE_POSITION_DELTA)
+	{
+		ObjectPositionUpdate update;
+		if (m_has_position_base && gob_read_update_position_delta(is,
+				m_position_base_id, m_position_base, &update))
+			updatePosition(update);
 	}
 	else if(cmd == GENERIC_CMD_SET_TEXTURE_MOD) {
 		std::string mod = deSerializeString(is);
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "clientobject.h"
 #include "object_properties.h"
 #include "itemgroup.h"
+#include "genericobject.h"
 
 /*
 	SmoothTranslator
@@ -101,9 +102,15 @@ class GenericCAO : public ClientActiveObject
 	float m_step_distance_counter;
 	u8 m_last_light;
 	bool m_is_visible;
+	// Position GENERIC_CMD_UPDATE_POSITION_DELTA is relative to
+	ObjectPositionUpdate m_position_base;
+	u8 m_position_base_id;
+	bool m_has_position_base;
 
 	std::vector<u16> m_children;
 
+	void updatePosition(const ObjectPositionUpdate &update);
+
 public:
 	GenericCAO(IGameDef *gamedef, ClientEnvironment *env);
 
@@ -29,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/string.h"
 
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 
 
 #define ENSURE_STATUS_OK(s) \
@@ -65,6 +66,22 @@ bool Database_LevelDB::saveBlock(const v3s16 &pos, const std::string &data)
 	return true;
 }
 
+bool Database_LevelDB::saveBlocks(const std::map<v3s16, std::string> &blocks)
+{
+	leveldb::WriteBatch batch;
+	for (std::map<v3s16, std::string>::const_iterator it = blocks.begin();
+			it != blocks.end(); ++it)
+		batch.Put(i64tos(getBlockAsInteger(it->first)), it->second);
+
+	leveldb::Status status = m_database->Write(leveldb::WriteOptions(), &batch);
+	if (!status.ok()) {
+		warningstream << "saveBlocks: LevelDB error saving "
+			<< blocks.size() << " blocks: " << status.ToString() << std::endl;
+		return false;
+	}
+	return true;
+}
+
 std::string Database_LevelDB::loadBlock(const v3s16 &pos)
 {
 	std::string datastr;
@@ -77,6 +94,26 @@ std::string Database_LevelDB::loadBlock(const v3s16 &pos)
 		return "";
 }
 
+void Database_LevelDB::loadBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blocks)
+{
+	// LevelDB has no multi-key get, but reading from one snapshot
+	// at least gives a consistent view without per-key locking.
+	leveldb::ReadOptions options;
+	options.snapshot = m_database->GetSnapshot();
+
+	std::string datastr;
+	for (std::vector<v3s16>::const_iterator it = positions.begin();
+			it != positions.end(); ++it) {
+		leveldb::Status status = m_database->Get(options,
+			i64tos(getBlockAsInteger(*it)), &datastr);
+		if (status.ok())
+			blocks[*it] = datastr;
+	}
+
+	m_database->ReleaseSnapshot(options.snapshot);
+}
+
 bool Database_LevelDB::deleteBlock(const v3s16 &pos)
 {
 	leveldb::Status status = m_database->Delete(leveldb::WriteOptions(),
@@ -101,6 +101,39 @@ bool Database_Redis::saveBlock(const v3s16 &pos, const std::string &data)
 	return true;
 }
 
+bool Database_Redis::saveBlocks(const std::map<v3s16, std::string> &blocks)
+{
+	// Pipeline all HSETs, then collect the replies in one go
+	for (std::map<v3s16, std::string>::const_iterator it = blocks.begin();
+			it != blocks.end(); ++it) {
+		std::string tmp = i64tos(getBlockAsInteger(it->first));
+		if (redisAppendCommand(ctx, "HSET %s %s %b", hash.c_str(),
+				tmp.c_str(), it->second.c_str(), it->second.size()) != REDIS_OK) {
+			throw FileNotGoodException(std::string(
+				"Redis command 'HSET' failed: ") + ctx->errstr);
+		}
+	}
+
+	bool success = true;
+	for (std::map<v3s16, std::string>::const_iterator it = blocks.begin();
+			it != blocks.end(); ++it) {
+		redisReply *reply;
+		if (redisGetReply(ctx, (void **)&reply) != REDIS_OK) {
+			throw FileNotGoodException(std::string(
+				"Redis command 'HSET' failed: ") + ctx->errstr);
+		}
+
+		if (reply->type == REDIS_REPLY_ERROR) {
+			warningstream << "saveBlocks: saving block " << PP(it->first)
+				<< " failed: " << reply->str << std::endl;
+			success = false;
+		}
+		freeReplyObject(reply);
+	}
+
+	return success;
+}
+
 std::string Database_Redis::loadBlock(const v3s16 &pos)
 {
 	std::string tmp = i64tos(getBlockAsInteger(pos));
@@ -140,6 +173,59 @@ std::string Database_Redis::loadBlock(const v3s16 &pos)
 		"Redis command 'HGET %s %s' gave invalid reply."));
 }
 
+void Database_Redis::loadBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blocks)
+{
+	if (positions.empty())
+		return;
+
+	// HMGET <hash> <key>... fetches everything in a single round-trip
+	std::vector<std::string> keys;
+	keys.reserve(positions.size());
+	for (std::vector<v3s16>::const_iterator it = positions.begin();
+			it != positions.end(); ++it)
+		keys.push_back(i64tos(getBlockAsInteger(*it)));
+
+	std::vector<const char *> argv;
+	std::vector<size_t> argvlen;
+	argv.push_back("HMGET");
+	argvlen.push_back(5);
+	argv.push_back(hash.c_str());
+	argvlen.push_back(hash.size());
+	for (size_t i = 0; i != keys.size(); i++) {
+		argv.push_back(keys[i].c_str());
+		argvlen.push_back(keys[i].size());
+	}
+
+	redisReply *reply = static_cast<redisReply *>(redisCommandArgv(ctx,
+			argv.size(), &argv[0], &argvlen[0]));
+	if (!reply) {
+		throw FileNotGoodException(std::string(
+			"Redis command 'HMGET' failed: ") + ctx->errstr);
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		std::string errstr = reply->str;
+		freeReplyObject(reply);
+		throw FileNotGoodException(std::string(
+			"Redis command 'HMGET' errored: ") + errstr);
+	} else if (reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != positions.size()) {
+		freeReplyObject(reply);
+		throw FileNotGoodException(std::string(
+			"Redis command 'HMGET' gave invalid reply."));
+	}
+
+	for (size_t i = 0; i != reply->elements; i++) {
+		redisReply *element = reply->element[i];
+		// Missing blocks come back as nil
+		if (element->type == REDIS_REPLY_STRING)
+			blocks[positions[i]] = std::string(element->str, element->len);
+	}
+
+	freeReplyObject(reply);
+}
+
 bool Database_Redis::deleteBlock(const v3s16 &pos)
 {
 	std::string tmp = i64tos(getBlockAsInteger(pos));
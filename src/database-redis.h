@@ -42,6 +42,9 @@ class Database_Redis : public Database
 	virtual bool saveBlock(const v3s16 &pos, const std::string &data);
 	virtual std::string loadBlock(const v3s16 &pos);
 	virtual bool deleteBlock(const v3s16 &pos);
+	virtual bool saveBlocks(const std::map<v3s16, std::string> &blocks);
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blocks);
 	virtual void listAllLoadableBlocks(std::vector<v3s16> &dst);
 
 private:
@@ -46,6 +46,9 @@ SQLite format specification:
 	}
 #define SQLOK(s) SQLRES(s, SQLITE_OK)
 
+// Number of blocks fetched by one query of loadBlocks()
+#define READ_MULTI_COUNT 32
+
 #define PREPARE_STATEMENT(name, query) \
 	SQLOK(sqlite3_prepare_v2(m_database, query, -1, &m_stmt_##name, NULL))
 
@@ -62,11 +65,13 @@ Database_SQLite3::Database_SQLite3(const std::string &savedir) :
 	m_savedir(savedir),
 	m_database(NULL),
 	m_stmt_read(NULL),
+	m_stmt_read_multi(NULL),
 	m_stmt_write(NULL),
 	m_stmt_list(NULL),
 	m_stmt_delete(NULL),
 	m_stmt_begin(NULL),
-	m_stmt_end(NULL)
+	m_stmt_end(NULL),
+	m_stmt_rollback(NULL)
 {
 }
 
@@ -124,7 +129,14 @@ void Database_SQLite3::verifyDatabase()
 
 	PREPARE_STATEMENT(begin, "BEGIN");
 	PREPARE_STATEMENT(end, "COMMIT");
+	PREPARE_STATEMENT(rollback, "ROLLBACK");
 	PREPARE_STATEMENT(read, "SELECT `data` FROM `blocks` WHERE `pos` = ? LIMIT 1");
+
+	std::string read_multi = "SELECT `pos`, `data` FROM `blocks` WHERE `pos` IN (?";
+	for (u32 i = 1; i != READ_MULTI_COUNT; i++)
+		read_multi += ", ?";
+	read_multi += ")";
+	PREPARE_STATEMENT(read_multi, read_multi.c_str());
 #ifdef __ANDROID__
 	PREPARE_STATEMENT(write,  "INSERT INTO `blocks` (`pos`, `data`) VALUES (?, ?)");
 #else
@@ -185,6 +197,27 @@ bool Database_SQLite3::saveBlock(const v3s16 &pos, const std::string &data)
 	return true;
 }
 
+bool Database_SQLite3::saveBlocks(const std::map<v3s16, std::string> &blocks)
+{
+	verifyDatabase();
+
+	beginSave();
+	try {
+		for (std::map<v3s16, std::string>::const_iterator it = blocks.begin();
+				it != blocks.end(); ++it)
+			saveBlock(it->first, it->second);
+	} catch (FileNotGoodException &e) {
+		// Don't leave the transaction open, every later BEGIN would fail
+		sqlite3_reset(m_stmt_write);
+		sqlite3_step(m_stmt_rollback);
+		sqlite3_reset(m_stmt_rollback);
+		throw;
+	}
+	endSave();
+
+	return true;
+}
+
 std::string Database_SQLite3::loadBlock(const v3s16 &pos)
 {
 	verifyDatabase();
@@ -209,6 +242,34 @@ std::string Database_SQLite3::loadBlock(const v3s16 &pos)
 	return s;
 }
 
+void Database_SQLite3::loadBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blocks)
+{
+	verifyDatabase();
+
+	for (size_t start = 0; start < positions.size(); start += READ_MULTI_COUNT) {
+		// Fill up the unused parameters of the last query by repeating
+		// its first position, which only matches the same row again.
+		for (size_t i = 0; i != READ_MULTI_COUNT; i++) {
+			size_t index = start + i < positions.size() ? start + i : start;
+			bindPos(m_stmt_read_multi, positions[index], i + 1);
+		}
+
+		while (sqlite3_step(m_stmt_read_multi) == SQLITE_ROW) {
+			const char *data = (const char *)
+				sqlite3_column_blob(m_stmt_read_multi, 1);
+			size_t len = sqlite3_column_bytes(m_stmt_read_multi, 1);
+			if (!data)
+				continue;
+
+			v3s16 pos = getIntegerAsBlock(
+				sqlite3_column_int64(m_stmt_read_multi, 0));
+			blocks[pos] = std::string(data, len);
+		}
+		sqlite3_reset(m_stmt_read_multi);
+	}
+}
+
 void Database_SQLite3::createDatabase()
 {
 	assert(m_database); // Pre-condition
@@ -233,10 +294,12 @@ void Database_SQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 Database_SQLite3::~Database_SQLite3()
 {
 	FINALIZE_STATEMENT(m_stmt_read)
+	FINALIZE_STATEMENT(m_stmt_read_multi)
 	FINALIZE_STATEMENT(m_stmt_write)
 	FINALIZE_STATEMENT(m_stmt_list)
 	FINALIZE_STATEMENT(m_stmt_begin)
 	FINALIZE_STATEMENT(m_stmt_end)
+	FINALIZE_STATEMENT(m_stmt_rollback)
 	FINALIZE_STATEMENT(m_stmt_delete)
 
 	if (sqlite3_close(m_database) != SQLITE_OK) {
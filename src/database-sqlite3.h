@@ -38,6 +38,9 @@ class Database_SQLite3 : public Database
 	virtual bool saveBlock(const v3s16 &pos, const std::string &data);
 	virtual std::string loadBlock(const v3s16 &pos);
 	virtual bool deleteBlock(const v3s16 &pos);
+	virtual bool saveBlocks(const std::map<v3s16, std::string> &blocks);
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blocks);
 	virtual void listAllLoadableBlocks(std::vector<v3s16> &dst);
 	virtual bool initialized() const { return m_initialized; }
 	~Database_SQLite3();
@@ -58,11 +61,13 @@ class Database_SQLite3 : public Database
 
 	sqlite3 *m_database;
 	sqlite3_stmt *m_stmt_read;
+	sqlite3_stmt *m_stmt_read_multi;
 	sqlite3_stmt *m_stmt_write;
 	sqlite3_stmt *m_stmt_list;
 	sqlite3_stmt *m_stmt_delete;
 	sqlite3_stmt *m_stmt_begin;
 	sqlite3_stmt *m_stmt_end;
+	sqlite3_stmt *m_stmt_rollback;
 };
 
 #endif
@@ -67,3 +67,29 @@ v3s16 Database::getIntegerAsBlock(s64 i)
 	return pos;
 }
 
+bool Database::saveBlocks(const std::map<v3s16, std::string> &blocks)
+{
+	bool success = true;
+
+	beginSave();
+	for (std::map<v3s16, std::string>::const_iterator it = blocks.begin();
+			it != blocks.end(); ++it) {
+		if (!saveBlock(it->first, it->second))
+			success = false;
+	}
+	endSave();
+
+	return success;
+}
+
+void Database::loadBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blocks)
+{
+	for (std::vector<v3s16>::const_iterator it = positions.begin();
+			it != positions.end(); ++it) {
+		std::string data = loadBlock(*it);
+		if (!data.empty())
+			blocks[*it] = data;
+	}
+}
+
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef DATABASE_HEADER
 #define DATABASE_HEADER
 
+#include <map>
 #include <vector>
 #include <string>
 #include "irr_v3d.h"
@@ -41,6 +42,16 @@ class Database
 	virtual std::string loadBlock(const v3s16 &pos) = 0;
 	virtual bool deleteBlock(const v3s16 &pos) = 0;
 
+	// Writes many serialized blocks at once. Backends should override this
+	// to do it in a single transaction or round-trip.
+	// Returns false if any of the blocks failed to save.
+	virtual bool saveBlocks(const std::map<v3s16, std::string> &blocks);
+	// Reads many blocks at once. Blocks that are not in the database are
+	// left out of the result. Backends should override this to fetch them
+	// in a single query or round-trip.
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blocks);
+
 	static s64 getBlockAsInteger(const v3s16 &pos);
 	static v3s16 getIntegerAsBlock(s64 i);
 
@@ -232,6 +232,8 @@ void set_default_settings(Settings *settings)
 	// "map-dir" doesn't exist by default.
 	settings->setDefault("workaround_window_size","5");
 	settings->setDefault("max_packets_per_iteration","1024");
+	settings->setDefault("congestion_control", "cubic");
+	settings->setDefault("max_peer_send_rate", "0");
 	settings->setDefault("port", "30000");
 	settings->setDefault("bind_address", "");
 	settings->setDefault("default_game", "minetest");
@@ -263,12 +265,18 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("profiler_print_interval", "0");
 	settings->setDefault("enable_mapgen_debug_info", "false");
 	settings->setDefault("active_object_send_range_blocks", "3");
+	settings->setDefault("active_object_full_update_range", "16");
+	settings->setDefault("active_object_max_update_interval", "1.0");
 	settings->setDefault("active_block_range", "2");
+	settings->setDefault("num_abm_threads", "0");
+	settings->setDefault("num_block_select_threads", "0");
+	settings->setDefault("num_packet_threads", "0");
 	//settings->setDefault("max_simultaneous_block_sends_per_client", "1");
 	// This causes frametime jitter on client side, or does it?
 	settings->setDefault("max_simultaneous_block_sends_per_client", "10");
 	settings->setDefault("max_simultaneous_block_sends_server_total", "40");
 	settings->setDefault("max_block_send_distance", "9");
+	settings->setDefault("server_side_occlusion_culling", "true");
 	settings->setDefault("max_block_generate_distance", "7");
 	settings->setDefault("max_clearobjects_extra_loaded_blocks", "4096");
 	settings->setDefault("time_send_interval", "5");
@@ -277,6 +285,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("max_objects_per_block", "49");
 	settings->setDefault("server_map_save_interval", "5.3");
 	settings->setDefault("sqlite_synchronous", "2");
+	settings->setDefault("map_compression", "zlib");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.1");
 	settings->setDefault("ignore_world_load_errors", "false");
@@ -286,6 +295,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_diskonly", "32");
 	settings->setDefault("emergequeue_limit_generate", "32");
 	settings->setDefault("num_emerge_threads", "1");
+	settings->setDefault("mapgen_noise_cache_size", "256");
 	settings->setDefault("secure.enable_security", "false");
 	settings->setDefault("secure.trusted_mods", "");
 
@@ -305,7 +315,7 @@ void set_default_settings(Settings *settings)
 
 	//liquid stuff
 	settings->setDefault("liquid_loop_max", "100000");
-	settings->setDefault("liquid_queue_purge_time", "0");
+	settings->setDefault("num_liquid_threads", "0");
 	settings->setDefault("liquid_update", "1.0");
 
 	//mapgen stuff
@@ -22,7 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 
 #include <iostream>
-#include <queue>
+#include <deque>
 
 #include "util/container.h"
 #include "util/thread.h"
@@ -45,6 +45,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mg_decoration.h"
 #include "mg_schematic.h"
 #include "nodedef.h"
+#include "porting.h"
 #include "profiler.h"
 #include "scripting_game.h"
 #include "server.h"
@@ -52,6 +53,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "voxel.h"
 
+// Max. number of queued blocks fetched from the database along with
+// the one being emerged
+#define EMERGE_PREFETCH_MAX 64
+
+// While players requested blocks this recently, one emerge thread is kept
+// free of bulk blocks for them
+#define EMERGE_PEER_ACTIVE_TIME_MS 10000
 
 struct MapgenDesc {
 	const char *name;
@@ -70,11 +78,6 @@ class EmergeThread : public Thread {
 	void *run();
 	void signal();
 
-	// Requires queue mutex held
-	bool pushBlock(v3s16 pos);
-
-	void cancelPendingItems();
-
 	static void runCompletionCallbacks(
 		v3s16 pos, EmergeAction action,
 		const EmergeCallbackList &callbacks);
@@ -86,9 +89,12 @@ class EmergeThread : public Thread {
 	Mapgen *m_mapgen;
 
 	Event m_queue_event;
-	std::queue<v3s16> m_block_queue;
+	// Both require queue mutex held
+	bool m_idle;
+	bool m_bulk;
 
 	bool popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata);
+	void prefetchQueuedBlocks(v3s16 pos);
 
 	EmergeAction getBlockOrStartGen(
 		v3s16 pos, bool allow_gen, MapBlock **block, BlockMakeData *data);
@@ -122,8 +128,13 @@ EmergeManager::EmergeManager(IGameDef *gamedef)
 	this->oremgr    = new OreManager(gamedef);
 	this->decomgr   = new DecorationManager(gamedef);
 	this->schemmgr  = new SchematicManager(gamedef);
+	this->noisecache = new NoiseMapCache(
+		g_settings->getU16("mapgen_noise_cache_size"));
 	this->gen_notify_on = 0;
 
+	m_bulk_active = 0;
+	m_last_peer_request = 0;
+
 	// Note that accesses to this variable are not synchronized.
 	// This is because the *only* thread ever starting or stopping
 	// EmergeThreads should be the ServerThread.
@@ -179,6 +190,7 @@ EmergeManager::~EmergeManager()
 	delete oremgr;
 	delete decomgr;
 	delete schemmgr;
+	delete noisecache;
 
 	delete params.sparams;
 }
@@ -266,6 +278,12 @@ bool EmergeManager::isRunning()
 }
 
 
+u32 EmergeManager::getThreadCount()
+{
+	return m_threads.size();
+}
+
+
 bool EmergeManager::enqueueBlockEmerge(
 	u16 peer_id,
 	v3s16 blockpos,
@@ -289,22 +307,57 @@ bool EmergeManager::enqueueBlockEmergeEx(
 	EmergeCompletionCallback callback,
 	void *callback_param)
 {
-	EmergeThread *thread = NULL;
+	MutexAutoLock queuelock(m_queue_mutex);
 
-	{
-		MutexAutoLock queuelock(m_queue_mutex);
+	if (!pushBlockEmergeData(blockpos, peer_id, flags,
+			callback, callback_param))
+		return false;
 
-		if (!pushBlockEmergeData(blockpos, peer_id, flags,
-				callback, callback_param))
-			return false;
+	wakeIdleThread();
 
-		thread = getOptimalThread();
-		thread->pushBlock(blockpos);
-	}
+	return true;
+}
 
-	thread->signal();
 
-	return true;
+void EmergeManager::setPeerPosition(u16 peer_id, v3s16 blockpos)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+	m_scheduler.setPeerPosition(peer_id, blockpos);
+}
+
+
+void EmergeManager::removePeer(u16 peer_id)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	std::vector<v3s16> dropped_blocks;
+	m_scheduler.removePeer(peer_id, &dropped_blocks);
+
+	for (size_t i = 0; i != dropped_blocks.size(); i++) {
+		std::map<v3s16, BlockEmergeData>::iterator it =
+			m_blocks_enqueued.find(dropped_blocks[i]);
+		if (it == m_blocks_enqueued.end() ||
+				it->second.peer_requested != peer_id)
+			continue;
+
+		BlockEmergeData &bedata = it->second;
+		m_peer_queue_count[peer_id]--;
+
+		// Blocks that something else waits for go on in the bulk lane.
+		// If they came from it, the copy that comes second is skipped.
+		if (!bedata.callbacks.empty() ||
+				(bedata.flags & BLOCK_EMERGE_FORCE_QUEUE)) {
+			bedata.peer_requested = PEER_ID_INEXISTENT;
+			m_peer_queue_count[PEER_ID_INEXISTENT]++;
+			m_scheduler.pushBulkBlock(dropped_blocks[i]);
+		} else {
+			m_blocks_enqueued.erase(it);
+		}
+	}
+
+	std::map<u16, u16>::iterator count = m_peer_queue_count.find(peer_id);
+	if (count != m_peer_queue_count.end() && count->second == 0)
+		m_peer_queue_count.erase(count);
 }
 
 
@@ -405,13 +458,34 @@ bool EmergeManager::pushBlockEmergeData(
 	if (callback)
 		bedata.callbacks.push_back(std::make_pair(callback, callback_param));
 
+	bool bulk = peer_requested == PEER_ID_INEXISTENT ||
+		(flags & BLOCK_EMERGE_FORCE_QUEUE);
+
+	if (!bulk)
+		m_last_peer_request = porting::getTimeMs();
+
 	if (update_existing) {
 		bedata.flags |= flags;
+
+		// A player now waits for a block from the bulk lane, so it also
+		// joins the player's lane. Whichever lane gets to it first takes
+		// it, the other one finds it gone.
+		if (!bulk && bedata.peer_requested == PEER_ID_INEXISTENT) {
+			m_peer_queue_count[PEER_ID_INEXISTENT]--;
+			bedata.peer_requested = peer_requested;
+			count_peer++;
+			m_scheduler.pushPeerBlock(peer_requested, pos);
+		}
 	} else {
 		bedata.flags = flags;
 		bedata.peer_requested = peer_requested;
 
 		count_peer++;
+
+		if (bulk)
+			m_scheduler.pushBulkBlock(pos);
+		else
+			m_scheduler.pushPeerBlock(peer_requested, pos);
 	}
 
 	return true;
@@ -445,77 +519,198 @@ bool EmergeManager::popBlockEmergeData(
 }
 
 
-EmergeThread *EmergeManager::getOptimalThread()
+bool EmergeManager::popNextBlockEmergeData(
+	v3s16 *pos,
+	BlockEmergeData *bedata,
+	bool *bulk)
 {
-	size_t nthreads = m_threads.size();
-
-	FATAL_ERROR_IF(nthreads == 0, "No emerge threads!");
+	// Positions of blocks that were taken through the other lane
+	// are skipped
+	while (m_scheduler.popPeerBlock(pos)) {
+		if (popBlockEmergeData(*pos, bedata)) {
+			*bulk = false;
+			return true;
+		}
+	}
 
-	size_t index = 0;
-	size_t nitems_lowest = m_threads[0]->m_block_queue.size();
+	if (!canStartBulkBlock())
+		return false;
 
-	for (size_t i = 1; i < nthreads; i++) {
-		size_t nitems = m_threads[i]->m_block_queue.size();
-		if (nitems < nitems_lowest) {
-			index = i;
-			nitems_lowest = nitems;
+	while (m_scheduler.popBulkBlock(pos)) {
+		if (popBlockEmergeData(*pos, bedata)) {
+			*bulk = true;
+			m_bulk_active++;
+			return true;
 		}
 	}
 
-	return m_threads[index];
+	return false;
+}
+
+
+bool EmergeManager::canStartBulkBlock()
+{
+	if (m_bulk_active + 1 < m_threads.size())
+		return true;
+
+	// Keep the last thread for players, while there are any
+	return m_threads.size() == 1 ||
+		porting::getTimeMs() - m_last_peer_request > EMERGE_PEER_ACTIVE_TIME_MS;
+}
+
+
+void EmergeManager::wakeIdleThread()
+{
+	if (m_idle_threads.empty())
+		return;
+
+	EmergeThread *thread = m_idle_threads.back();
+	m_idle_threads.pop_back();
+
+	thread->m_idle = false;
+	thread->signal();
 }
 
 
 ////
-//// EmergeThread
+//// EmergeScheduler
 ////
 
-EmergeThread::EmergeThread(Server *server, int ethreadid) :
-	enable_mapgen_debug_info(false),
-	id(ethreadid),
-	m_server(server),
-	m_map(NULL),
-	m_emerge(NULL),
-	m_mapgen(NULL)
+EmergeScheduler::EmergeScheduler()
 {
-	m_name = "Emerge-" + itos(ethreadid);
+	m_last_peer = 0;
 }
 
 
-EmergeThread::~EmergeThread()
+void EmergeScheduler::pushPeerBlock(u16 peer_id, v3s16 pos)
 {
-	//cancelPendingItems();
+	m_peer_blocks[peer_id].push_back(pos);
 }
 
 
-void EmergeThread::signal()
+void EmergeScheduler::pushBulkBlock(v3s16 pos)
 {
-	m_queue_event.signal();
+	m_bulk_blocks.push_back(pos);
 }
 
 
-bool EmergeThread::pushBlock(v3s16 pos)
+void EmergeScheduler::setPeerPosition(u16 peer_id, v3s16 blockpos)
 {
-	m_block_queue.push(pos);
-	return true;
+	m_peer_positions[peer_id] = blockpos;
 }
 
 
-void EmergeThread::cancelPendingItems()
+void EmergeScheduler::removePeer(u16 peer_id,
+	std::vector<v3s16> *dropped_blocks)
 {
-	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
+	m_peer_positions.erase(peer_id);
 
-	while (!m_block_queue.empty()) {
-		BlockEmergeData bedata;
-		v3s16 pos;
+	std::map<u16, std::vector<v3s16> >::iterator it =
+		m_peer_blocks.find(peer_id);
+	if (it == m_peer_blocks.end())
+		return;
+
+	dropped_blocks->insert(dropped_blocks->end(),
+		it->second.begin(), it->second.end());
+	m_peer_blocks.erase(it);
+}
 
-		pos = m_block_queue.front();
-		m_block_queue.pop();
 
-		m_emerge->popBlockEmergeData(pos, &bedata);
+bool EmergeScheduler::popPeerBlock(v3s16 *pos)
+{
+	if (m_peer_blocks.empty())
+		return false;
 
-		runCompletionCallbacks(pos, EMERGE_CANCELLED, bedata.callbacks);
+	// The next peer after the one that had the last turn
+	std::map<u16, std::vector<v3s16> >::iterator it =
+		m_peer_blocks.upper_bound(m_last_peer);
+	if (it == m_peer_blocks.end())
+		it = m_peer_blocks.begin();
+
+	u16 peer_id = it->first;
+	std::vector<v3s16> &blocks = it->second;
+
+	// Without a known position, the blocks are taken in the order they came
+	size_t nearest = 0;
+	std::map<u16, v3s16>::iterator ppos = m_peer_positions.find(peer_id);
+	if (ppos != m_peer_positions.end()) {
+		v3s16 center = ppos->second;
+		s32 nearest_d = S32_MAX;
+		for (size_t i = 0; i != blocks.size(); i++) {
+			v3s16 d = blocks[i] - center;
+			s32 dist = (s32)d.X * d.X + (s32)d.Y * d.Y + (s32)d.Z * d.Z;
+			if (dist < nearest_d) {
+				nearest = i;
+				nearest_d = dist;
+			}
+		}
 	}
+
+	*pos = blocks[nearest];
+	if (ppos == m_peer_positions.end()) {
+		blocks.erase(blocks.begin());
+	} else {
+		blocks[nearest] = blocks.back();
+		blocks.pop_back();
+	}
+
+	if (blocks.empty())
+		m_peer_blocks.erase(it);
+
+	m_last_peer = peer_id;
+
+	return true;
+}
+
+
+bool EmergeScheduler::popBulkBlock(v3s16 *pos)
+{
+	if (m_bulk_blocks.empty())
+		return false;
+
+	*pos = m_bulk_blocks.front();
+	m_bulk_blocks.pop_front();
+
+	return true;
+}
+
+
+void EmergeScheduler::getNextBulkBlocks(std::vector<v3s16> *positions,
+	size_t max) const
+{
+	size_t count = MYMIN(m_bulk_blocks.size(), max);
+	for (size_t i = 0; i != count; i++)
+		positions->push_back(m_bulk_blocks[i]);
+}
+
+
+////
+//// EmergeThread
+////
+
+EmergeThread::EmergeThread(Server *server, int ethreadid) :
+	enable_mapgen_debug_info(false),
+	id(ethreadid),
+	m_server(server),
+	m_map(NULL),
+	m_emerge(NULL),
+	m_mapgen(NULL),
+	m_idle(false),
+	m_bulk(false)
+{
+	m_name = "Emerge-" + itos(ethreadid);
+}
+
+
+EmergeThread::~EmergeThread()
+{
+	//cancelPendingItems();
+}
+
+
+void EmergeThread::signal()
+{
+	m_queue_event.signal();
 }
 
 
@@ -540,15 +735,23 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
 {
 	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
 
-	if (m_block_queue.empty())
-		return false;
+	if (m_bulk) {
+		m_bulk = false;
+		m_emerge->m_bulk_active--;
 
-	*pos = m_block_queue.front();
-	m_block_queue.pop();
+		// A thread held back from bulk blocks may take one now
+		m_emerge->wakeIdleThread();
+	}
 
-	m_emerge->popBlockEmergeData(*pos, bedata);
+	if (m_emerge->popNextBlockEmergeData(pos, bedata, &m_bulk))
+		return true;
 
-	return true;
+	if (!m_idle) {
+		m_idle = true;
+		m_emerge->m_idle_threads.push_back(this);
+	}
+
+	return false;
 }
 
 
@@ -563,6 +766,7 @@ EmergeAction EmergeThread::getBlockOrStartGen(
 		return EMERGE_FROM_MEMORY;
 
 	// 2). Attempt to load block from disk
+	prefetchQueuedBlocks(pos);
 	*block = m_map->loadBlock(pos);
 	if (*block && (*block)->isGenerated())
 		return EMERGE_FROM_DISK;
@@ -576,9 +780,38 @@ EmergeAction EmergeThread::getBlockOrStartGen(
 }
 
 
+void EmergeThread::prefetchQueuedBlocks(v3s16 pos)
+{
+	// Most of our queue is going to be looked up in the database
+	// as well, so fetch it along with this block in one query.
+	std::vector<v3s16> positions;
+	positions.push_back(pos);
+
+	// Blocks of players are taken by distance, so only the bulk
+	// lane tells which blocks come next
+	if (m_bulk) {
+		MutexAutoLock queuelock(m_emerge->m_queue_mutex);
+		m_emerge->m_scheduler.getNextBulkBlocks(&positions,
+			EMERGE_PREFETCH_MAX);
+	}
+
+	m_map->prefetchBlocks(positions);
+}
+
+
 MapBlock *EmergeThread::finishGen(v3s16 pos, BlockMakeData *bmdata,
 	std::map<v3s16, MapBlock *> *modified_blocks)
 {
+	/*
+		Copy the generated nodes into arrays of their own while nothing
+		is locked, so that the env lock is only needed to swap them in
+	*/
+	{
+		ScopeProfiler sp(g_profiler,
+			"EmergeThread: prepare blit back", SPT_AVG);
+		bmdata->vmanip->prepareBlitBack();
+	}
+
 	MutexAutoLock envlock(m_server->m_env_mutex);
 	ScopeProfiler sp(g_profiler,
 		"EmergeThread: after Mapgen::makeChunk", SPT_AVG);
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define EMERGE_HEADER
 
 #include <map>
+#include <deque>
 #include "irr_v3d.h"
 #include "util/container.h"
 #include "mapgen.h" // for MapgenParams
@@ -88,6 +89,41 @@ struct BlockEmergeData {
 	EmergeCallbackList callbacks;
 };
 
+/*
+	The order in which the emerge threads take queued blocks. Blocks
+	requested by players come first. The peers take turns, and each turn
+	takes the block nearest to that peer's player. Forced and Lua requests
+	wait in a separate lane, in the order they came in, so that bulk emerges
+	don't hold up the blocks around players.
+
+	Not thread-safe; the EmergeManager guards it with its queue mutex.
+*/
+class EmergeScheduler {
+public:
+	EmergeScheduler();
+
+	void pushPeerBlock(u16 peer_id, v3s16 pos);
+	void pushBulkBlock(v3s16 pos);
+
+	// Blocks of a peer are taken nearest to this position first
+	void setPeerPosition(u16 peer_id, v3s16 blockpos);
+	// Forgets the peer; its blocks that were not taken yet are added to
+	// dropped_blocks
+	void removePeer(u16 peer_id, std::vector<v3s16> *dropped_blocks);
+
+	bool popPeerBlock(v3s16 *pos);
+	bool popBulkBlock(v3s16 *pos);
+
+	// Adds up to max bulk blocks that are next in line to positions
+	void getNextBulkBlocks(std::vector<v3s16> *positions, size_t max) const;
+
+private:
+	std::map<u16, std::vector<v3s16> > m_peer_blocks;
+	std::map<u16, v3s16> m_peer_positions;
+	u16 m_last_peer;
+	std::deque<v3s16> m_bulk_blocks;
+};
+
 class EmergeManager {
 public:
 	INodeDefManager *ndef;
@@ -106,6 +142,9 @@ class EmergeManager {
 	DecorationManager *decomgr;
 	SchematicManager *schemmgr;
 
+	// 2D noise maps shared by the mapgens of all threads
+	NoiseMapCache *noisecache;
+
 	// Methods
 	EmergeManager(IGameDef *gamedef);
 	~EmergeManager();
@@ -116,6 +155,10 @@ class EmergeManager {
 	void startThreads();
 	void stopThreads();
 	bool isRunning();
+	u32 getThreadCount();
+
+	void setPeerPosition(u16 peer_id, v3s16 blockpos);
+	void removePeer(u16 peer_id);
 
 	bool enqueueBlockEmerge(
 		u16 peer_id,
@@ -152,16 +195,24 @@ class EmergeManager {
 	Mutex m_queue_mutex;
 	std::map<v3s16, BlockEmergeData> m_blocks_enqueued;
 	std::map<u16, u16> m_peer_queue_count;
+	EmergeScheduler m_scheduler;
+	std::vector<EmergeThread *> m_idle_threads;
+	// Threads working on bulk blocks, and when a player last requested one
+	u32 m_bulk_active;
+	u32 m_last_peer_request;
 
 	u16 m_qlimit_total;
 	u16 m_qlimit_diskonly;
 	u16 m_qlimit_generate;
 
 	// Requires m_queue_mutex held
-	EmergeThread *getOptimalThread();
 	bool pushBlockEmergeData(v3s16 pos, u16 peer_requested, u16 flags,
 		EmergeCompletionCallback callback, void *callback_param);
 	bool popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata);
+	bool popNextBlockEmergeData(v3s16 *pos, BlockEmergeData *bedata,
+		bool *bulk);
+	bool canStartBulkBlock();
+	void wakeIdleThread();
 
 	friend class EmergeThread;
 
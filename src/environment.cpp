@@ -45,6 +45,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 #include "util/serialize.h"
 #include "threading/mutex_auto_lock.h"
+#include "threading/workerpool.h"
+#include "noise.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -357,6 +359,8 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_recommended_send_interval(0.1),
 	m_max_lag_estimate(0.1)
 {
+	m_abm_scan_pool = new WorkerPool("ABMScan",
+			g_settings->getS16("num_abm_threads"));
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -368,6 +372,8 @@ ServerEnvironment::~ServerEnvironment()
 	// Convert all objects to static and delete the active objects
 	deactivateFarObjects(true);
 
+	delete m_abm_scan_pool;
+
 	// Drop/delete map
 	m_map->drop();
 
@@ -555,11 +561,22 @@ struct ActiveABM
 	std::set<content_t> required_neighbors;
 };
 
+// A node that passed an ABM's chance and neighbor checks
+struct ABMTrigger
+{
+	ActiveABM *aabm;
+	v3s16 p;
+	MapNode n;
+};
+
 class ABMHandler
 {
 private:
 	ServerEnvironment *m_env;
-	std::map<content_t, std::vector<ActiveABM> > m_aabms;
+	// Indexed by content id; empty if no ABM is triggered by it
+	std::vector<std::vector<ActiveABM> > m_aabms;
+	// All contents that trigger some ABM
+	ContentBitmap m_trigger_contents;
 public:
 	ABMHandler(std::vector<ABMWithState> &abms,
 			float dtime_s, ServerEnvironment *env,
@@ -618,14 +635,10 @@ class ABMHandler
 						k != ids.end(); ++k)
 				{
 					content_t c = *k;
-					std::map<content_t, std::vector<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::vector<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
+					if(c >= m_aabms.size())
+						m_aabms.resize(c + 1);
+					m_aabms[c].push_back(aabm);
+					m_trigger_contents.add(c);
 				}
 			}
 		}
@@ -658,16 +671,38 @@ class ABMHandler
 		return active_object_count;
 
 	}
-	void apply(MapBlock *block)
+	// Whether a node next to p is one of the required neighbors of aabm
+	bool hasRequiredNeighbor(ServerMap *map, const ActiveABM &aabm, v3s16 p)
+	{
+		v3s16 p1;
+		for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
+		for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
+		for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
+		{
+			if(p1 == p)
+				continue;
+			MapNode n = map->getNodeNoEx(p1);
+			if(aabm.required_neighbors.count(n.getContent()) != 0)
+				return true;
+		}
+		return false;
+	}
+	/*
+		Finds the nodes of a block that trigger an ABM. This only reads
+		from the map, so several blocks may be scanned in parallel as long
+		as nothing modifies the map meanwhile.
+	*/
+	void scan(MapBlock *block, PcgRandom &rand,
+			std::vector<ABMTrigger> &triggers)
 	{
 		if(m_aabms.empty())
 			return;
 
-		ServerMap *map = &m_env->getServerMap();
+		// Skip blocks without any triggering content
+		if(!block->getContentBitmap().intersects(m_trigger_contents))
+			return;
 
-		u32 active_object_count_wider;
-		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
-		m_env->m_added_objects = 0;
+		ServerMap *map = &m_env->getServerMap();
 
 		v3s16 p0;
 		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
@@ -678,52 +713,104 @@ class ABMHandler
 			content_t c = n.getContent();
 			v3s16 p = p0 + block->getPosRelative();
 
-			std::map<content_t, std::vector<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
+			if(c >= m_aabms.size() || m_aabms[c].empty())
 				continue;
+			std::vector<ActiveABM> &aabms = m_aabms[c];
 
 			for(std::vector<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); ++i) {
-				if(myrand() % i->chance != 0)
+					i = aabms.begin(); i != aabms.end(); ++i) {
+				if(rand.next() % i->chance != 0)
 					continue;
 
 				// Check neighbors
-				if(!i->required_neighbors.empty())
-				{
-					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
-					{
-						if(p1 == p)
-							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
-							goto neighbor_found;
-						}
-					}
-					// No required neighbor found
+				if(!i->required_neighbors.empty() &&
+						!hasRequiredNeighbor(map, *i, p))
 					continue;
-				}
-neighbor_found:
 
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
+				ABMTrigger trigger;
+				trigger.aabm = &(*i);
+				trigger.p = p;
+				trigger.n = n;
+				triggers.push_back(trigger);
+			}
+		}
+	}
+	/*
+		Calls the ABMs found by scan(). Must be run on the server thread.
+	*/
+	void trigger(MapBlock *block, const std::vector<ABMTrigger> &triggers)
+	{
+		if(triggers.empty())
+			return;
+
+		ServerMap *map = &m_env->getServerMap();
 
-				// Count surrounding objects again if the abms added any
-				if(m_env->m_added_objects > 0) {
-					active_object_count = countObjects(block, map, active_object_count_wider);
-					m_env->m_added_objects = 0;
-				}
+		u32 active_object_count_wider;
+		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
+		m_env->m_added_objects = 0;
+
+		for(std::vector<ABMTrigger>::const_iterator
+				i = triggers.begin(); i != triggers.end(); ++i) {
+			// Skip nodes changed by an earlier ABM in this pass, or
+			// whose required neighbors it removed
+			MapNode n = map->getNodeNoEx(i->p);
+			if(n.getContent() != i->n.getContent())
+				continue;
+			if(!i->aabm->required_neighbors.empty() &&
+					!hasRequiredNeighbor(map, *i->aabm, i->p))
+				continue;
+
+			// Call all the trigger variations
+			i->aabm->abm->trigger(m_env, i->p, n);
+			i->aabm->abm->trigger(m_env, i->p, n,
+					active_object_count, active_object_count_wider);
+
+			// Count surrounding objects again if the abms added any
+			if(m_env->m_added_objects > 0) {
+				active_object_count = countObjects(block, map, active_object_count_wider);
+				m_env->m_added_objects = 0;
 			}
 		}
 	}
+	void apply(MapBlock *block)
+	{
+		PcgRandom rand(myrand());
+		std::vector<ABMTrigger> triggers;
+		scan(block, rand, triggers);
+		trigger(block, triggers);
+	}
+};
+
+/*
+	Scans blocks for ABM triggers; the map must not be modified while
+	it runs.
+*/
+class ABMScanJob : public WorkerJob
+{
+public:
+	ABMScanJob(ABMHandler *handler, u32 num_threads,
+			const std::vector<MapBlock*> &blocks,
+			std::vector<std::vector<ABMTrigger> > &triggers):
+		m_handler(handler),
+		m_blocks(blocks),
+		m_triggers(triggers)
+	{
+		m_triggers.clear();
+		m_triggers.resize(blocks.size());
+		for (u32 i = 0; i < num_threads; i++)
+			m_rands.push_back(PcgRandom(myrand(), myrand()));
+	}
+
+	void work(u32 item, u32 thread)
+	{
+		m_handler->scan(m_blocks[item], m_rands[thread], m_triggers[item]);
+	}
+
+private:
+	ABMHandler *m_handler;
+	const std::vector<MapBlock*> &m_blocks;
+	std::vector<std::vector<ABMTrigger> > &m_triggers;
+	std::vector<PcgRandom> m_rands;
 };
 
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
@@ -780,6 +867,53 @@ void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
 	m_abms.push_back(ABMWithState(abm));
 }
 
+void ServerEnvironment::applyActiveBlockModifiers(
+		const std::set<v3s16> &active_blocks, float dtime_s)
+{
+	// Initialize handling of ActiveBlockModifiers
+	ABMHandler abmhandler(m_abms, dtime_s, this, true);
+
+	std::vector<v3s16> block_positions;
+	std::vector<MapBlock*> blocks;
+	for(std::set<v3s16>::const_iterator
+			i = active_blocks.begin();
+			i != active_blocks.end(); ++i)
+	{
+		v3s16 p = *i;
+
+		/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
+				<<") being handled"<<std::endl;*/
+
+		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+		if(block == NULL)
+			continue;
+
+		// Set current time as timestamp
+		block->setTimestampNoChangedFlag(m_game_time);
+
+		block_positions.push_back(p);
+		blocks.push_back(block);
+	}
+
+	/* Find ActiveBlockModifier triggers in parallel */
+	std::vector<std::vector<ABMTrigger> > triggers;
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg /1s", SPT_AVG);
+		ABMScanJob job(&abmhandler, m_abm_scan_pool->getThreadCount(),
+				blocks, triggers);
+		m_abm_scan_pool->run(&job, blocks.size());
+	}
+
+	/* Run them; this may modify or even delete blocks */
+	for(size_t i = 0; i < block_positions.size(); i++)
+	{
+		MapBlock *block = m_map->getBlockNoCreateNoEx(block_positions[i]);
+		if(block == NULL)
+			continue;
+		abmhandler.trigger(block, triggers[i]);
+	}
+}
+
 bool ServerEnvironment::setNode(v3s16 p, const MapNode &n)
 {
 	INodeDefManager *ndef = m_gamedef->ndef();
@@ -845,12 +979,16 @@ bool ServerEnvironment::swapNode(v3s16 p, const MapNode &n)
 
 void ServerEnvironment::getObjectsInsideRadius(std::vector<u16> &objects, v3f pos, float radius)
 {
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	std::vector<u16> candidates;
+	m_active_object_grid.getObjectsNear(pos, radius, candidates);
+
+	for(std::vector<u16>::iterator i = candidates.begin();
+			i != candidates.end(); ++i)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+		u16 id = *i;
+		ServerActiveObject* obj = getActiveObject(id);
+		if(obj == NULL)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
@@ -903,6 +1041,7 @@ void ServerEnvironment::clearAllObjects()
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 			i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 
 	// Get list of loaded blocks
@@ -1172,28 +1311,7 @@ void ServerEnvironment::step(float dtime)
 		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
 		TimeTaker timer("modify in active blocks");
 
-		// Initialize handling of ActiveBlockModifiers
-		ABMHandler abmhandler(m_abms, abm_interval, this, true);
-
-		for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
-		{
-			v3s16 p = *i;
-
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block == NULL)
-				continue;
-
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
-		}
+		applyActiveBlockModifiers(m_active_blocks.m_list, abm_interval);
 
 		u32 time_ms = timer.stop(true);
 		u32 max_time_ms = 200;
@@ -1320,27 +1438,55 @@ void ServerEnvironment::getAddedActiveObjects(Player *player, s16 radius,
 		player_radius_f = 0;
 
 	/*
-		Go through the object list,
+		Collect candidates from the object grid. A player radius of 0
+		means players are sent at any distance, so those are taken
+		from the player list instead.
+	*/
+	v3f player_pos = player->getPosition();
+	std::vector<u16> candidates;
+	ptrdiff_t grid_count = 0;
+	if (player_radius_f == 0) {
+		m_active_object_grid.getObjectsNear(player_pos, radius_f, candidates);
+		grid_count = candidates.size();
+		for (std::vector<Player*>::iterator i = m_players.begin();
+				i != m_players.end(); ++i) {
+			PlayerSAO *sao = (*i)->getPlayerSAO();
+			if (sao != NULL && sao->getId() != 0)
+				candidates.push_back(sao->getId());
+		}
+	} else {
+		m_active_object_grid.getObjectsNear(player_pos,
+				MYMAX(radius_f, player_radius_f), candidates);
+	}
+
+	/*
+		Go through the candidates,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i) {
-		u16 id = i->first;
+	for(std::vector<u16>::iterator
+			i = candidates.begin();
+			i != candidates.end(); ++i) {
+		u16 id = *i;
 
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if(object == NULL)
 			continue;
 
+		// Without a player radius, players found in the grid are
+		// duplicates of the ones appended from the player list
+		if (player_radius_f == 0 && i - candidates.begin() < grid_count &&
+				object->getType() == ACTIVEOBJECT_TYPE_PLAYER)
+			continue;
+
 		// Discard if removed or deactivating
 		if(object->m_removed || object->m_pending_deactivation)
 			continue;
 
-		f32 distance_f = object->getBasePosition().getDistanceFrom(player->getPosition());
+		f32 distance_f = object->getBasePosition().getDistanceFrom(player_pos);
 		if (object->getType() == ACTIVEOBJECT_TYPE_PLAYER) {
 			// Discard if too far
 			if (distance_f > player_radius_f && player_radius_f != 0)
@@ -1496,6 +1642,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 
 	m_active_objects[object->getId()] = object;
+	m_active_object_grid.insert(object->getId(), object->getBasePosition());
 
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1622,6 +1769,7 @@ void ServerEnvironment::removeRemovedObjects()
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 			i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -1983,6 +2131,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 			i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -42,8 +42,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "threading/mutex.h"
 #include "threading/atomic.h"
 #include "network/networkprotocol.h" // for AccessDeniedCode
+#include "activeobjectgrid.h"
 
 class ServerEnvironment;
+class WorkerPool;
 class ActiveBlockModifier;
 class ServerActiveObject;
 class ITextureSource;
@@ -306,6 +308,13 @@ class ServerEnvironment : public Environment
 
 	void addActiveBlockModifier(ActiveBlockModifier *abm);
 
+	/*
+		Runs the ABMs whose interval has passed on the given blocks. The
+		blocks are scanned for triggering nodes in parallel first.
+	*/
+	void applyActiveBlockModifiers(const std::set<v3s16> &active_blocks,
+			float dtime_s);
+
 	/*
 		Other stuff
 		-------------------------------------------
@@ -319,6 +328,10 @@ class ServerEnvironment : public Environment
 	// Find all active objects inside a radius around a point
 	void getObjectsInsideRadius(std::vector<u16> &objects, v3f pos, float radius);
 
+	// Called by ServerActiveObject when its base position changes
+	void updateActiveObjectPosition(u16 id, v3f pos)
+	{ m_active_object_grid.update(id, pos); }
+
 	// Clear all objects, loading and going through every MapBlock
 	void clearAllObjects();
 
@@ -394,6 +407,8 @@ class ServerEnvironment : public Environment
 	const std::string m_path_world;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// Positions of the objects in m_active_objects, for radius queries
+	ActiveObjectGrid m_active_object_grid;
 	// Outgoing network message buffer for active objects
 	std::queue<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -411,6 +426,8 @@ class ServerEnvironment : public Environment
 	// A helper variable for incrementing the latter
 	float m_game_time_fraction_counter;
 	std::vector<ABMWithState> m_abms;
+	// Threads scanning active blocks for ABM triggers
+	WorkerPool *m_abm_scan_pool;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval;
 	// Estimate for general maximum lag as determined by server.
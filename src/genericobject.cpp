@@ -19,7 +19,19 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "genericobject.h"
 #include <sstream>
+#include <cstdlib>
 #include "util/serialize.h"
+#include "util/numeric.h"
+
+// Flags of GENERIC_CMD_UPDATE_POSITION_DELTA: the fields that differ
+// from the base, and the values of the booleans
+#define POSITION_DELTA_POSITION     0x01
+#define POSITION_DELTA_VELOCITY     0x02
+#define POSITION_DELTA_ACCELERATION 0x04
+#define POSITION_DELTA_YAW          0x08
+#define POSITION_DELTA_INTERVAL     0x10
+#define POSITION_DELTA_INTERPOLATE  0x20
+#define POSITION_DELTA_MOVEMENT_END 0x40
 
 std::string gob_cmd_set_properties(const ObjectProperties &prop)
 {
@@ -65,6 +77,134 @@ std::string gob_cmd_update_position(
 	return os.str();
 }
 
+std::string gob_cmd_update_position(const ObjectPositionUpdate &update)
+{
+	return gob_cmd_update_position(update.position, update.velocity,
+			update.acceleration, update.yaw, update.do_interpolate,
+			update.is_movement_end, update.update_interval);
+}
+
+ObjectPositionUpdate gob_read_update_position(std::istream &is)
+{
+	ObjectPositionUpdate update;
+	update.position = readV3F1000(is);
+	update.velocity = readV3F1000(is);
+	update.acceleration = readV3F1000(is);
+	update.yaw = readF1000(is);
+	update.do_interpolate = readU8(is);
+	update.is_movement_end = readU8(is);
+	update.update_interval = readF1000(is);
+	return update;
+}
+
+std::string gob_cmd_update_position_base(u8 base_id,
+		const ObjectPositionUpdate &base)
+{
+	std::ostringstream os(std::ios::binary);
+	// command
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_BASE);
+	// base id
+	writeU8(os, base_id);
+	// fields of GENERIC_CMD_UPDATE_POSITION
+	os << gob_cmd_update_position(base).substr(1);
+	return os.str();
+}
+
+ObjectPositionUpdate gob_read_update_position_base(std::istream &is,
+		u8 *base_id)
+{
+	*base_id = readU8(is);
+	return gob_read_update_position(is);
+}
+
+// Difference in fixed point units, false if it doesn't fit into s16
+static bool get_position_delta(v3f base, v3f value, v3s16 *delta)
+{
+	v3s32 d(myround(value.X * FIXEDPOINT_FACTOR) - myround(base.X * FIXEDPOINT_FACTOR),
+		myround(value.Y * FIXEDPOINT_FACTOR) - myround(base.Y * FIXEDPOINT_FACTOR),
+		myround(value.Z * FIXEDPOINT_FACTOR) - myround(base.Z * FIXEDPOINT_FACTOR));
+	if (abs(d.X) > S16_MAX || abs(d.Y) > S16_MAX || abs(d.Z) > S16_MAX)
+		return false;
+	*delta = v3s16(d.X, d.Y, d.Z);
+	return true;
+}
+
+static v3f apply_position_delta(v3f base, v3s16 delta)
+{
+	return base + v3f(delta.X, delta.Y, delta.Z) / FIXEDPOINT_FACTOR;
+}
+
+std::string gob_cmd_update_position_delta(u8 base_id,
+		const ObjectPositionUpdate &base, const ObjectPositionUpdate &update)
+{
+	v3s16 position, velocity, acceleration;
+	if (!get_position_delta(base.position, update.position, &position) ||
+			!get_position_delta(base.velocity, update.velocity, &velocity) ||
+			!get_position_delta(base.acceleration, update.acceleration,
+				&acceleration))
+		return "";
+
+	u8 flags = 0;
+	if (position != v3s16(0, 0, 0))
+		flags |= POSITION_DELTA_POSITION;
+	if (velocity != v3s16(0, 0, 0))
+		flags |= POSITION_DELTA_VELOCITY;
+	if (acceleration != v3s16(0, 0, 0))
+		flags |= POSITION_DELTA_ACCELERATION;
+	if (update.yaw != base.yaw)
+		flags |= POSITION_DELTA_YAW;
+	if (update.update_interval != base.update_interval)
+		flags |= POSITION_DELTA_INTERVAL;
+	if (update.do_interpolate)
+		flags |= POSITION_DELTA_INTERPOLATE;
+	if (update.is_movement_end)
+		flags |= POSITION_DELTA_MOVEMENT_END;
+
+	std::ostringstream os(std::ios::binary);
+	// command
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_DELTA);
+	// base id
+	writeU8(os, base_id);
+	// flags
+	writeU8(os, flags);
+	// changed fields, vectors as difference to the base
+	if (flags & POSITION_DELTA_POSITION)
+		writeV3S16(os, position);
+	if (flags & POSITION_DELTA_VELOCITY)
+		writeV3S16(os, velocity);
+	if (flags & POSITION_DELTA_ACCELERATION)
+		writeV3S16(os, acceleration);
+	if (flags & POSITION_DELTA_YAW)
+		writeF1000(os, update.yaw);
+	if (flags & POSITION_DELTA_INTERVAL)
+		writeF1000(os, update.update_interval);
+	return os.str();
+}
+
+bool gob_read_update_position_delta(std::istream &is, u8 base_id,
+		const ObjectPositionUpdate &base, ObjectPositionUpdate *update)
+{
+	if (readU8(is) != base_id)
+		return false;
+
+	u8 flags = readU8(is);
+	*update = base;
+	if (flags & POSITION_DELTA_POSITION)
+		update->position = apply_position_delta(base.position, readV3S16(is));
+	if (flags & POSITION_DELTA_VELOCITY)
+		update->velocity = apply_position_delta(base.velocity, readV3S16(is));
+	if (flags & POSITION_DELTA_ACCELERATION)
+		update->acceleration = apply_position_delta(base.acceleration,
+				readV3S16(is));
+	if (flags & POSITION_DELTA_YAW)
+		update->yaw = readF1000(is);
+	if (flags & POSITION_DELTA_INTERVAL)
+		update->update_interval = readF1000(is);
+	update->do_interpolate = flags & POSITION_DELTA_INTERPOLATE;
+	update->is_movement_end = flags & POSITION_DELTA_MOVEMENT_END;
+	return true;
+}
+
 std::string gob_cmd_set_texture_mod(const std::string &mod)
 {
 	std::ostringstream os(std::ios::binary);
@@ -35,7 +35,9 @@ enum GenericCMD {
 	GENERIC_CMD_SET_BONE_POSITION,
 	GENERIC_CMD_ATTACH_TO,
 	GENERIC_CMD_SET_PHYSICS_OVERRIDE,
-	GENERIC_CMD_UPDATE_NAMETAG_ATTRIBUTES
+	GENERIC_CMD_UPDATE_NAMETAG_ATTRIBUTES,
+	GENERIC_CMD_UPDATE_POSITION_BASE,
+	GENERIC_CMD_UPDATE_POSITION_DELTA
 };
 
 #include "object_properties.h"
@@ -52,6 +54,46 @@ std::string gob_cmd_update_position(
 	f32 update_interval
 );
 
+// Fields of GENERIC_CMD_UPDATE_POSITION
+struct ObjectPositionUpdate
+{
+	ObjectPositionUpdate():
+		yaw(0),
+		do_interpolate(false),
+		is_movement_end(false),
+		update_interval(0)
+	{}
+
+	v3f position;
+	v3f velocity;
+	v3f acceleration;
+	f32 yaw;
+	bool do_interpolate;
+	bool is_movement_end;
+	f32 update_interval;
+};
+
+std::string gob_cmd_update_position(const ObjectPositionUpdate &update);
+// Reads the fields following the command
+ObjectPositionUpdate gob_read_update_position(std::istream &is);
+
+/*
+	Position updates relative to a base the client keeps per object
+	(protocol 27). The base is only stored by the client, as it is sent
+	reliably and may arrive late; deltas name the base they are against
+	and are dropped if the client has another one.
+*/
+std::string gob_cmd_update_position_base(u8 base_id,
+		const ObjectPositionUpdate &base);
+ObjectPositionUpdate gob_read_update_position_base(std::istream &is,
+		u8 *base_id);
+// Returns "" if the update is too far from the base to be sent as delta
+std::string gob_cmd_update_position_delta(u8 base_id,
+		const ObjectPositionUpdate &base, const ObjectPositionUpdate &update);
+// Returns false if the delta is against another base than base_id
+bool gob_read_update_position_delta(std::istream &is, u8 base_id,
+		const ObjectPositionUpdate &base, ObjectPositionUpdate *update);
+
 std::string gob_cmd_set_texture_mod(const std::string &mod);
 
 std::string gob_cmd_set_sprite(
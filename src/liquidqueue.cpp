@@ -0,0 +1,86 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "liquidqueue.h"
+#include "mapblock.h"
+#include <cstring>
+
+LiquidQueue::LiquidQueue():
+	m_size(0)
+{
+}
+
+LiquidQueue::~LiquidQueue()
+{
+	clear();
+}
+
+void LiquidQueue::push_back(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	BlockQueue *queue;
+	std::map<v3s16, BlockQueue*>::iterator it = m_blocks.find(blockpos);
+	if (it == m_blocks.end()) {
+		queue = new BlockQueue;
+		memset(queue->queued, 0, sizeof(queue->queued));
+		m_blocks[blockpos] = queue;
+		m_order.push_back(blockpos);
+	} else {
+		queue = it->second;
+	}
+
+	v3s16 relpos = p - blockpos * MAP_BLOCKSIZE;
+	u32 i = (relpos.Z * MAP_BLOCKSIZE + relpos.Y) * MAP_BLOCKSIZE + relpos.X;
+	u32 bit = 1 << (i & 31);
+	if (queue->queued[i >> 5] & bit)
+		return;
+	queue->queued[i >> 5] |= bit;
+	queue->nodes.push_back(p);
+	m_size++;
+}
+
+void LiquidQueue::popBlocks(u32 max_nodes,
+		std::vector<LiquidBlockNodes> &blocks)
+{
+	u32 count = 0;
+	while (count < max_nodes && !m_order.empty()) {
+		v3s16 blockpos = m_order.front();
+		m_order.pop_front();
+		std::map<v3s16, BlockQueue*>::iterator it = m_blocks.find(blockpos);
+		BlockQueue *queue = it->second;
+		m_blocks.erase(it);
+
+		blocks.push_back(LiquidBlockNodes());
+		blocks.back().blockpos = blockpos;
+		blocks.back().nodes.swap(queue->nodes);
+		count += blocks.back().nodes.size();
+		delete queue;
+	}
+	m_size -= count;
+}
+
+void LiquidQueue::clear()
+{
+	for (std::map<v3s16, BlockQueue*>::iterator
+			it = m_blocks.begin(); it != m_blocks.end(); ++it)
+		delete it->second;
+	m_blocks.clear();
+	m_order.clear();
+	m_size = 0;
+}
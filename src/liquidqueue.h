@@ -0,0 +1,81 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LIQUIDQUEUE_HEADER
+#define LIQUIDQUEUE_HEADER
+
+#include <deque>
+#include <map>
+#include <vector>
+#include "irrlichttypes.h"
+#include "irr_v3d.h"
+#include "constants.h"
+#include "util/basic_macros.h"
+
+// Queued nodes of one map block
+struct LiquidBlockNodes
+{
+	v3s16 blockpos;
+	std::vector<v3s16> nodes;
+};
+
+/*
+	Queue of nodes waiting for a liquid transformation, kept per map
+	block so that the nodes of a block are transformed together.
+
+	A node is queued at most once, so the queue can not hold more than
+	the nodes of the blocks with flowing liquid in them.
+*/
+class LiquidQueue
+{
+public:
+	LiquidQueue();
+	~LiquidQueue();
+
+	// Does nothing if p is already queued
+	void push_back(v3s16 p);
+
+	u32 size() const { return m_size; }
+
+	/*
+		Takes the nodes of whole blocks, in the order the blocks were
+		queued, until at least max_nodes nodes are taken or the queue
+		is empty. Nodes queued after this are queued again.
+	*/
+	void popBlocks(u32 max_nodes, std::vector<LiquidBlockNodes> &blocks);
+
+	void clear();
+
+private:
+	struct BlockQueue
+	{
+		std::vector<v3s16> nodes;
+		// A bit for each node of the block, set while it is queued
+		u32 queued[MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE / 32];
+	};
+
+	std::map<v3s16, BlockQueue*> m_blocks;
+	// Blocks in m_blocks, in the order they got their first node
+	std::deque<v3s16> m_order;
+	u32 m_size;
+
+	DISABLE_CLASS_COPY(LiquidQueue);
+};
+
+#endif
@@ -112,6 +112,7 @@ static bool determine_subgame(GameParams *game_params);
 
 static bool run_dedicated_server(const GameParams &game_params, const Settings &cmd_args);
 static bool migrate_database(const GameParams &game_params, const Settings &cmd_args);
+static bool pregenerate_map(const GameParams &game_params, const Settings &cmd_args);
 
 /**********************************************************************/
 
@@ -295,6 +296,8 @@ static void set_allowed_options(OptionList *allowed_options)
 			_("Set gameid (\"--gameid list\" prints available ones)"))));
 	allowed_options->insert(std::make_pair("migrate", ValueSpec(VALUETYPE_STRING,
 			_("Migrate from current map backend to another (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("pregenerate", ValueSpec(VALUETYPE_STRING,
+			_("Generate the map between two positions on all processors, then exit, e.g. \"(-1000,-100,-1000) (1000,100,1000)\" (Only works when using minetestserver or with --server)"))));
 	allowed_options->insert(std::make_pair("terminal", ValueSpec(VALUETYPE_FLAG,
 			_("Feature an interactive terminal (Only works when using minetestserver or with --server)"))));
 #ifndef SERVER
@@ -830,6 +833,10 @@ static bool run_dedicated_server(const GameParams &game_params, const Settings &
 	if (cmd_args.exists("migrate"))
 		return migrate_database(game_params, cmd_args);
 
+	// Offline map generation
+	if (cmd_args.exists("pregenerate"))
+		return pregenerate_map(game_params, cmd_args);
+
 	if (cmd_args.exists("terminal")) {
 #if USE_CURSES
 		bool name_ok = true;
@@ -976,3 +983,41 @@ static bool migrate_database(const GameParams &game_params, const Settings &cmd_
 	return true;
 }
 
+static bool pregenerate_map(const GameParams &game_params, const Settings &cmd_args)
+{
+	// Parentheses are optional
+	std::string area = cmd_args.get("pregenerate");
+	std::replace(area.begin(), area.end(), '(', ' ');
+	std::replace(area.begin(), area.end(), ')', ' ');
+
+	v3s16 minp, maxp;
+	if (sscanf(area.c_str(), "%hd ,%hd ,%hd %hd ,%hd ,%hd",
+			&minp.X, &minp.Y, &minp.Z, &maxp.X, &maxp.Y, &maxp.Z) != 6) {
+		errorstream << "Invalid area for --pregenerate, expected two "
+			<< "positions like \"(-1000,-100,-1000) (1000,100,1000)\""
+			<< std::endl;
+		return false;
+	}
+
+	// Nothing else is running, so use every processor for map generation
+	g_settings->set("num_emerge_threads",
+		itos(Thread::getNumberOfProcessors()));
+
+	try {
+		Server server(game_params.world_path, game_params.game_spec, false,
+			false);
+
+		bool &kill = *porting::signal_handler_killstatus();
+		if (!server.pregenerate(minp, maxp, kill))
+			return false;
+	} catch (const ModError &e) {
+		errorstream << "ModError: " << e.what() << std::endl;
+		return false;
+	} catch (const ServerError &e) {
+		errorstream << "ServerError: " << e.what() << std::endl;
+		return false;
+	}
+
+	actionstream << "Pregeneration finished" << std::endl;
+	return true;
+}
@@ -42,7 +42,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "database.h"
 #include "database-dummy.h"
 #include "database-sqlite3.h"
+#include "mapsavethread.h"
+#include "threads.h"
+#include "threading/atomic.h"
+#include "voxelalgorithms.h"
+#include "threading/workerpool.h"
 #include <deque>
+#include <algorithm>
 #include <queue>
 #if USE_LEVELDB
 #include "database-leveldb.h"
@@ -53,19 +59,56 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+// Limits of the queue in front of the map database
+#define MAP_SAVE_QUEUE_LIMIT 4096
+#define MAP_SAVE_BATCH_SIZE  256
+// Unused prefetched blocks are dropped beyond this
+#define MAP_PREFETCH_LIMIT   1024
+
+// Deferred lighting batches of this size light both light banks in parallel
+#define LIGHTING_PARALLEL_MIN_EDITS 8
+
+// Blocks kept in memory but unused for this long are palette-compressed,
+// and drop the serializations cached for sending them
+#define MAP_BLOCK_COMPACT_TIMEOUT 10.0
+
+// The zstd dictionary of a world is trained from its first saved blocks,
+// and kept if it makes the rest of them this much smaller
+#define MAP_ZSTD_DICT_FILE      "map_zstd.dict"
+#define MAP_ZSTD_DICT_SAMPLES   256
+#define MAP_ZSTD_DICT_SIZE      (8 * 1024)
+#define MAP_ZSTD_DICT_MIN_GAIN  0.05
+
 
 /*
 	Map
 */
 
+// Source of Map::m_block_index_generation values
+static Atomic<u32> g_block_index_generation;
+
+/*
+	Per-thread cache of the last block found by Map::getBlockNoCreateNoEx.
+	It is only valid while the map and its generation still match.
+*/
+struct MapBlockLookupCache {
+	const Map *map;
+	u32 generation;
+	s16 x, y, z;
+	MapBlock *block;
+};
+
+static THREAD_LOCAL MapBlockLookupCache g_block_lookup_cache =
+	{NULL, 0, 0, 0, 0, NULL};
+
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
 	m_sector_cache(NULL),
-	m_transforming_liquid_loop_count_multiplier(1.0f),
-	m_unprocessed_count(0),
-	m_inc_trending_up_start_time(0),
-	m_queue_size_timer_started(false)
+	m_block_index_generation(++g_block_index_generation),
+	m_lighting_pool(NULL),
+	m_liquid_pool(NULL),
+	m_lighting_deferred(false)
 {
 }
 
@@ -138,14 +181,36 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
+	MapBlockLookupCache &cache = g_block_lookup_cache;
+	u32 generation = m_block_index_generation;
+	if (cache.map == this && cache.generation == generation &&
+			cache.x == p3d.X && cache.y == p3d.Y && cache.z == p3d.Z)
+		return cache.block;
+
+	MapBlock *block = m_block_index.get(p3d);
+	if (block == NULL)
 		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
+
+	cache.map = this;
+	cache.generation = generation;
+	cache.x = p3d.X;
+	cache.y = p3d.Y;
+	cache.z = p3d.Z;
+	cache.block = block;
 	return block;
 }
 
+void Map::indexBlock(MapBlock *block)
+{
+	m_block_index.insert(block->getPos(), block);
+}
+
+void Map::unindexBlock(MapBlock *block)
+{
+	if (m_block_index.remove(block->getPos()))
+		m_block_index_generation = ++g_block_index_generation;
+}
+
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
 {
 	MapBlock *block = getBlockNoCreateNoEx(p3d);
@@ -410,20 +475,6 @@ void Map::unspreadLight(enum LightBank bank,
 		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
 }
 
-/*
-	A single-node wrapper of the above
-*/
-void Map::unLightNeighbors(enum LightBank bank,
-		v3s16 pos, u8 lightwas,
-		std::set<v3s16> & light_sources,
-		std::map<v3s16, MapBlock*>  & modified_blocks)
-{
-	std::map<v3s16, u8> from_nodes;
-	from_nodes[pos] = lightwas;
-
-	unspreadLight(bank, from_nodes, light_sources, modified_blocks);
-}
-
 /*
 	Lights neighbors of from_nodes, collects all them and then
 	goes on recursively.
@@ -565,108 +616,6 @@ void Map::spreadLight(enum LightBank bank,
 		spreadLight(bank, lighted_nodes, modified_blocks);
 }
 
-/*
-	A single-node source variation of the above.
-*/
-void Map::lightNeighbors(enum LightBank bank,
-		v3s16 pos,
-		std::map<v3s16, MapBlock*> & modified_blocks)
-{
-	std::set<v3s16> from_nodes;
-	from_nodes.insert(pos);
-	spreadLight(bank, from_nodes, modified_blocks);
-}
-
-v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
-{
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	u8 brightest_light = 0;
-	v3s16 brightest_pos(0,0,0);
-	bool found_something = false;
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++){
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-		MapNode n2;
-		bool is_valid_position;
-		n2 = getNodeNoEx(n2pos, &is_valid_position);
-		if (!is_valid_position)
-			continue;
-
-		if(n2.getLight(bank, nodemgr) > brightest_light || found_something == false){
-			brightest_light = n2.getLight(bank, nodemgr);
-			brightest_pos = n2pos;
-			found_something = true;
-		}
-	}
-
-	if(found_something == false)
-		throw InvalidPositionException();
-
-	return brightest_pos;
-}
-
-/*
-	Propagates sunlight down from a node.
-	Starting point gets sunlight.
-
-	Returns the lowest y value of where the sunlight went.
-
-	Mud is turned into grass in where the sunlight stops.
-*/
-s16 Map::propagateSunlight(v3s16 start,
-		std::map<v3s16, MapBlock*> & modified_blocks)
-{
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	s16 y = start.Y;
-	for(; ; y--)
-	{
-		v3s16 pos(start.X, y, start.Z);
-
-		v3s16 blockpos = getNodeBlockPos(pos);
-		MapBlock *block;
-		try{
-			block = getBlockNoCreate(blockpos);
-		}
-		catch(InvalidPositionException &e)
-		{
-			break;
-		}
-
-		v3s16 relpos = pos - blockpos*MAP_BLOCKSIZE;
-		bool is_valid_position;
-		MapNode n = block->getNode(relpos, &is_valid_position);
-		if (!is_valid_position)
-			break;
-
-		if(nodemgr->get(n).sunlight_propagates)
-		{
-			n.setLight(LIGHTBANK_DAY, LIGHT_SUN, nodemgr);
-			block->setNode(relpos, n);
-
-			modified_blocks[blockpos] = block;
-		}
-		else
-		{
-			// Sunlight goes no further
-			break;
-		}
-	}
-	return y + 1;
-}
-
 void Map::updateLighting(enum LightBank bank,
 		std::map<v3s16, MapBlock*> & a_blocks,
 		std::map<v3s16, MapBlock*> & modified_blocks)
@@ -919,156 +868,112 @@ void Map::updateLighting(std::map<v3s16, MapBlock*> & a_blocks,
 	}
 }
 
-/*
-*/
-void Map::addNodeAndUpdate(v3s16 p, MapNode n,
-		std::map<v3s16, MapBlock*> &modified_blocks,
-		bool remove_metadata)
+void Map::setLightingDeferred(bool deferred)
 {
-	INodeDefManager *ndef = m_gamedef->ndef();
+	m_lighting_deferred = deferred;
+}
 
-	/*PrintInfo(m_dout);
-	m_dout<<"Map::addNodeAndUpdate(): p=("
-			<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
+void Map::updateDeferredLighting(std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	if (m_lighting_edits.empty())
+		return;
 
-	/*
-		From this node to nodes underneath:
-		If lighting is sunlight (1.0), unlight neighbours and
-		set lighting to 0.
-		Else discontinue.
-	*/
+	voxalgo::updateLightingNodes(this, m_gamedef->ndef(), m_lighting_edits,
+			modified_blocks,
+			m_lighting_edits.size() >= LIGHTING_PARALLEL_MIN_EDITS ?
+				m_lighting_pool : NULL);
+	m_lighting_edits.clear();
 
-	v3s16 toppos = p + v3s16(0,1,0);
-	//v3s16 bottompos = p + v3s16(0,-1,0);
+	for (std::map<v3s16, MapBlock*>::iterator
+			i = modified_blocks.begin();
+			i != modified_blocks.end(); ++i)
+		i->second->expireDayNightDiff();
+}
 
-	bool node_under_sunlight = true;
-	std::set<v3s16> light_sources;
+void Map::flushDeferredLighting()
+{
+	if (m_lighting_edits.empty())
+		return;
 
-	/*
-		Collect old node for rollback
-	*/
-	RollbackNode rollback_oldnode(this, p, m_gamedef);
+	std::map<v3s16, MapBlock*> modified_blocks;
+	updateDeferredLighting(modified_blocks);
 
-	/*
-		If there is a node at top and it doesn't have sunlight,
-		there has not been any sunlight going down.
+	MapEditEvent event;
+	event.type = MEET_OTHER;
+	for (std::map<v3s16, MapBlock*>::iterator
+			i = modified_blocks.begin();
+			i != modified_blocks.end(); ++i)
+		event.modified_blocks.insert(i->first);
+	dispatchEvent(&event);
+}
 
-		Otherwise there probably is.
-	*/
+/*
+	Sets a node whose light is not known yet and lights it, or queues
+	it for updateDeferredLighting().
+*/
+void Map::setNodeAndLight(v3s16 p, MapNode n,
+		std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	INodeDefManager *ndef = m_gamedef->ndef();
 
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock *block = getBlockNoCreate(blockpos);
+	v3s16 relpos = p - blockpos * MAP_BLOCKSIZE;
 	bool is_valid_position;
-	MapNode topnode = getNodeNoEx(toppos, &is_valid_position);
-
-	if(is_valid_position && topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
-		node_under_sunlight = false;
-
-	/*
-		Remove all light that has come out of this node
-	*/
-
-	enum LightBank banks[] =
-	{
-		LIGHTBANK_DAY,
-		LIGHTBANK_NIGHT
-	};
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		u8 lightwas = getNodeNoEx(p).getLight(bank, ndef);
-
-		// Add the block of the added node to modified_blocks
-		v3s16 blockpos = getNodeBlockPos(p);
-		MapBlock * block = getBlockNoCreate(blockpos);
-		assert(block != NULL);
-		modified_blocks[blockpos] = block;
-
-		assert(isValidPosition(p));
+	MapNode oldnode = block->getNodeNoCheck(relpos, &is_valid_position);
+	if (!is_valid_position)
+		throw InvalidPositionException();
 
-		// Unlight neighbours of node.
-		// This means setting light of all consequent dimmer nodes
-		// to 0.
-		// This also collects the nodes at the border which will spread
-		// light again into this.
-		unLightNeighbors(bank, p, lightwas, light_sources, modified_blocks);
+	n.setLight(LIGHTBANK_DAY, 0, ndef);
+	n.setLight(LIGHTBANK_NIGHT, 0, ndef);
+	setNode(p, n);
+	modified_blocks[blockpos] = block;
 
-		n.setLight(bank, 0, ndef);
+	if (m_lighting_deferred) {
+		m_lighting_edits.push_back(std::make_pair(p, oldnode));
+		return;
 	}
 
+	std::vector<std::pair<v3s16, MapNode> > oldnodes;
+	oldnodes.push_back(std::make_pair(p, oldnode));
+	voxalgo::updateLightingNodes(this, ndef, oldnodes, modified_blocks,
+			NULL);
+
 	/*
-		If node lets sunlight through and is under sunlight, it has
-		sunlight too.
+		Update information about whether day and night light differ
 	*/
-	if(node_under_sunlight && ndef->get(n).sunlight_propagates)
+	for(std::map<v3s16, MapBlock*>::iterator
+			i = modified_blocks.begin();
+			i != modified_blocks.end(); ++i)
 	{
-		n.setLight(LIGHTBANK_DAY, LIGHT_SUN, ndef);
+		i->second->expireDayNightDiff();
 	}
+}
 
-	/*
-		Remove node metadata
-	*/
-	if (remove_metadata) {
-		removeNodeMetadata(p);
-	}
+/*
+*/
+void Map::addNodeAndUpdate(v3s16 p, MapNode n,
+		std::map<v3s16, MapBlock*> &modified_blocks,
+		bool remove_metadata)
+{
+	INodeDefManager *ndef = m_gamedef->ndef();
 
 	/*
-		Set the node on the map
+		Collect old node for rollback
 	*/
-
-	setNode(p, n);
+	RollbackNode rollback_oldnode(this, p, m_gamedef);
 
 	/*
-		If node is under sunlight and doesn't let sunlight through,
-		take all sunlighted nodes under it and clear light from them
-		and from where the light has been spread.
-		TODO: This could be optimized by mass-unlighting instead
-			  of looping
+		Remove node metadata
 	*/
-	if(node_under_sunlight && !ndef->get(n).sunlight_propagates)
-	{
-		s16 y = p.Y - 1;
-		for(;; y--){
-			//m_dout<<"y="<<y<<std::endl;
-			v3s16 n2pos(p.X, y, p.Z);
-
-			MapNode n2;
-
-			n2 = getNodeNoEx(n2pos, &is_valid_position);
-			if (!is_valid_position)
-				break;
-
-			if(n2.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN)
-			{
-				unLightNeighbors(LIGHTBANK_DAY,
-						n2pos, n2.getLight(LIGHTBANK_DAY, ndef),
-						light_sources, modified_blocks);
-				n2.setLight(LIGHTBANK_DAY, 0, ndef);
-				setNode(n2pos, n2);
-			}
-			else
-				break;
-		}
-	}
-
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Spread light from all nodes that might be capable of doing so
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
+	if (remove_metadata) {
+		removeNodeMetadata(p);
 	}
 
 	/*
-		Update information about whether day and night light differ
+		Set the node on the map and update the lighting
 	*/
-	for(std::map<v3s16, MapBlock*>::iterator
-			i = modified_blocks.begin();
-			i != modified_blocks.end(); ++i)
-	{
-		i->second->expireDayNightDiff();
-	}
+	setNodeAndLight(p, n, modified_blocks);
 
 	/*
 		Report for rollback
@@ -1098,6 +1003,7 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	{
 		v3s16 p2 = p + dirs[i];
 
+		bool is_valid_position;
 		MapNode n2 = getNodeNoEx(p2, &is_valid_position);
 		if(is_valid_position
 				&& (ndef->get(n2).isLiquid() || n2.getContent() == CONTENT_AIR))
@@ -1114,14 +1020,6 @@ void Map::removeNodeAndUpdate(v3s16 p,
 {
 	INodeDefManager *ndef = m_gamedef->ndef();
 
-	/*PrintInfo(m_dout);
-	m_dout<<"Map::removeNodeAndUpdate(): p=("
-			<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
-
-	bool node_under_sunlight = true;
-
-	v3s16 toppos = p + v3s16(0,1,0);
-
 	// Node will be replaced with this
 	content_t replace_material = CONTENT_AIR;
 
@@ -1130,35 +1028,6 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	*/
 	RollbackNode rollback_oldnode(this, p, m_gamedef);
 
-	/*
-		If there is a node at top and it doesn't have sunlight,
-		there will be no sunlight going down.
-	*/
-	bool is_valid_position;
-	MapNode topnode = getNodeNoEx(toppos, &is_valid_position);
-
-	if(is_valid_position && topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
-		node_under_sunlight = false;
-
-	std::set<v3s16> light_sources;
-
-	enum LightBank banks[] =
-	{
-		LIGHTBANK_DAY,
-		LIGHTBANK_NIGHT
-	};
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Unlight neighbors (in case the node is a light source)
-		*/
-		unLightNeighbors(bank, p,
-				getNodeNoEx(p).getLight(bank, ndef),
-				light_sources, modified_blocks);
-	}
-
 	/*
 		Remove node metadata
 	*/
@@ -1166,87 +1035,9 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	removeNodeMetadata(p);
 
 	/*
-		Remove the node.
-		This also clears the lighting.
-	*/
-
-	MapNode n(replace_material);
-	setNode(p, n);
-
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Recalculate lighting
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
-	}
-
-	// Add the block of the removed node to modified_blocks
-	v3s16 blockpos = getNodeBlockPos(p);
-	MapBlock * block = getBlockNoCreate(blockpos);
-	assert(block != NULL);
-	modified_blocks[blockpos] = block;
-
-	/*
-		If the removed node was under sunlight, propagate the
-		sunlight down from it and then light all neighbors
-		of the propagated blocks.
+		Remove the node and update the lighting
 	*/
-	if(node_under_sunlight)
-	{
-		s16 ybottom = propagateSunlight(p, modified_blocks);
-		/*m_dout<<"Node was under sunlight. "
-				"Propagating sunlight";
-		m_dout<<" -> ybottom="<<ybottom<<std::endl;*/
-		s16 y = p.Y;
-		for(; y >= ybottom; y--)
-		{
-			v3s16 p2(p.X, y, p.Z);
-			/*m_dout<<"lighting neighbors of node ("
-					<<p2.X<<","<<p2.Y<<","<<p2.Z<<")"
-					<<std::endl;*/
-			lightNeighbors(LIGHTBANK_DAY, p2, modified_blocks);
-		}
-	}
-	else
-	{
-		// Set the lighting of this node to 0
-		// TODO: Is this needed? Lighting is cleared up there already.
-		MapNode n = getNodeNoEx(p, &is_valid_position);
-		if (is_valid_position) {
-			n.setLight(LIGHTBANK_DAY, 0, ndef);
-			setNode(p, n);
-		} else {
-			FATAL_ERROR("Invalid position");
-		}
-	}
-
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		// Get the brightest neighbour node and propagate light from it
-		v3s16 n2p = getBrightestNeighbour(bank, p);
-		try{
-			//MapNode n2 = getNode(n2p);
-			lightNeighbors(bank, n2p, modified_blocks);
-		}
-		catch(InvalidPositionException &e)
-		{
-		}
-	}
-
-	/*
-		Update information about whether day and night light differ
-	*/
-	for(std::map<v3s16, MapBlock*>::iterator
-			i = modified_blocks.begin();
-			i != modified_blocks.end(); ++i)
-	{
-		i->second->expireDayNightDiff();
-	}
+	setNodeAndLight(p, MapNode(replace_material), modified_blocks);
 
 	/*
 		Report for rollback
@@ -1423,6 +1214,9 @@ void Map::timerUpdate(float dtime, float unload_timeout, u32 max_loaded_blocks,
 {
 	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
 
+	// Queued edits may refer to blocks that are unloaded below
+	flushDeferredLighting();
+
 	// Profile modified reasons
 	Profiler modprofiler;
 
@@ -1471,6 +1265,11 @@ void Map::timerUpdate(float dtime, float unload_timeout, u32 max_loaded_blocks,
 
 					deleted_blocks_count++;
 				} else {
+					if (block->refGet() == 0 && block->getUsageTimer()
+							> MAP_BLOCK_COMPACT_TIMEOUT) {
+						block->compact();
+						block->clearNetworkCache();
+					}
 					all_blocks_deleted = false;
 					block_count_all++;
 				}
@@ -1528,6 +1327,17 @@ void Map::timerUpdate(float dtime, float unload_timeout, u32 max_loaded_blocks,
 			deleted_blocks_count++;
 			block_count_all--;
 		}
+		// Compress the idle blocks that stay loaded
+		while (!mapblock_queue.empty()
+				&& mapblock_queue.top().block->getUsageTimer()
+					> MAP_BLOCK_COMPACT_TIMEOUT) {
+			MapBlock *block = mapblock_queue.top().block;
+			mapblock_queue.pop();
+			if (block->refGet() == 0) {
+				block->compact();
+				block->clearNetworkCache();
+			}
+		}
 		// Delete empty sectors
 		for (std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
 			si != m_sectors.end(); ++si) {
@@ -1592,377 +1402,396 @@ enum NeighborType {
 struct NodeNeighbor {
 	MapNode n;
 	NeighborType t;
-	v3s16 p;
-	bool l; //can liquid
+	u16 dir; // index in g_6dirs
 
 	NodeNeighbor()
 		: n(CONTENT_AIR)
 	{ }
 
-	NodeNeighbor(const MapNode &node, NeighborType n_type, v3s16 pos)
-		: n(node),
-		  t(n_type),
-		  p(pos)
-	{ }
-};
-
-void Map::transforming_liquid_add(v3s16 p) {
-        m_transforming_liquid.push_back(p);
-}
-
-s32 Map::transforming_liquid_size() {
-        return m_transforming_liquid.size();
-}
-
-void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
-{
-
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	DSTACK(FUNCTION_NAME);
-	//TimeTaker timer("transformLiquids()");
-
-	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
+	NodeNeighbor(const MapNode &node, NeighborType n_type, u16 n_dir)
+		: n(node),
+		  t(n_type),
+		  dir(n_dir)
+	{ }
+};
 
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+void Map::transforming_liquid_add(v3s16 p) {
+        m_transforming_liquid.push_back(p);
+}
 
-	// list of nodes that due to viscosity have not reached their max level height
-	std::deque<v3s16> must_reflow;
+s32 Map::transforming_liquid_size() {
+        return m_transforming_liquid.size();
+}
 
-	// List of MapBlocks that will require a lighting update (due to lava)
-	std::map<v3s16, MapBlock*> lighting_modified_blocks;
+/*
+	Transformation of one liquid node, decided from the map without
+	modifying it
+*/
+struct LiquidTransform
+{
+	bool changed;
+	MapNode newnode;
+	// Neighbours to queue, as bits of g_6dirs indices
+	u8 queue_dirs;
+	// Has not reached its level yet due to viscosity
+	bool reflow;
+};
 
-	u32 liquid_loop_max = g_settings->getS32("liquid_loop_max");
-	u32 loop_max = liquid_loop_max;
+static void transformLiquid(Map *map, INodeDefManager *nodemgr, v3s16 p0,
+		LiquidTransform &t)
+{
+	t.changed = false;
+	t.queue_dirs = 0;
+	t.reflow = false;
 
-#if 0
+	MapNode n0 = map->getNodeNoEx(p0);
 
-	/* If liquid_loop_max is not keeping up with the queue size increase
-	 * loop_max up to a maximum of liquid_loop_max * dedicated_server_step.
+	/*
+		Collect information about current node
 	 */
-	if (m_transforming_liquid.size() > loop_max * 2) {
-		// "Burst" mode
-		float server_step = g_settings->getFloat("dedicated_server_step");
-		if (m_transforming_liquid_loop_count_multiplier - 1.0 < server_step)
-			m_transforming_liquid_loop_count_multiplier *= 1.0 + server_step / 10;
-	} else {
-		m_transforming_liquid_loop_count_multiplier = 1.0;
-	}
-
-	loop_max *= m_transforming_liquid_loop_count_multiplier;
-#endif
-
-	while(m_transforming_liquid.size() != 0)
-	{
-		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size || loopcount >= loop_max)
+	s8 liquid_level = -1;
+	content_t liquid_kind = CONTENT_IGNORE;
+	LiquidType liquid_type = nodemgr->get(n0).liquid_type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
 			break;
-		loopcount++;
-
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.front();
-		m_transforming_liquid.pop_front();
-
-		MapNode n0 = getNodeNoEx(p0);
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this is an air node, it *could* be transformed into a liquid. otherwise,
+			// continue with the next node.
+			if (n0.getContent() != CONTENT_AIR)
+				return;
+			liquid_kind = CONTENT_AIR;
+			break;
+	}
 
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		content_t liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = nodemgr->get(n0).liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 1:
+				nt = NEIGHBOR_UPPER;
 				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
+			case 4:
+				nt = NEIGHBOR_LOWER;
 				break;
+		}
+		v3s16 npos = p0 + dirs[i];
+		NodeNeighbor nb(map->getNodeNoEx(npos), nt, i);
+		switch (nodemgr->get(nb.n.getContent()).liquid_type) {
 			case LIQUID_NONE:
-				// if this is an air node, it *could* be transformed into a liquid. otherwise,
-				// continue with the next node.
-				if (n0.getContent() != CONTENT_AIR)
-					continue;
-				liquid_kind = CONTENT_AIR;
+				if (nb.n.getContent() == CONTENT_AIR) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						t.queue_dirs |= 1 << i;
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER) {
+						flowing_down = true;
+					}
+				} else {
+					neutrals[num_neutrals++] = nb;
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					// Do not count bottom source, it will screw things up
+					if(dirs[i].Y != -1)
+						sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
 				break;
 		}
+	}
 
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
-			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb(getNodeNoEx(npos), nt, npos);
-			switch (nodemgr->get(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (nb.n.getContent() == CONTENT_AIR) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER) {
-							flowing_down = true;
-						}
-					} else {
-						neutrals[num_neutrals++] = nb;
-					}
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+
+	u8 range = nodemgr->get(liquid_kind).liquid_range;
+	if (range > LIQUID_LEVEL_MAX+1)
+		range = LIQUID_LEVEL_MAX+1;
+
+	if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
+	} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		new_node_content = liquid_kind;
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+		if (new_node_level < (LIQUID_LEVEL_MAX+1-range))
+			new_node_content = CONTENT_AIR;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+			switch (flows[i].t) {
+				case NEIGHBOR_UPPER:
+					if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+						max_node_level = LIQUID_LEVEL_MAX;
+						if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+							max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+					} else if (nb_liquid_level > max_node_level)
+						max_node_level = nb_liquid_level;
 					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						// Do not count bottom source, it will screw things up
-						if(dirs[i].Y != -1)
-							sources[num_sources++] = nb;
-					}
+				case NEIGHBOR_LOWER:
 					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
+				case NEIGHBOR_SAME_LEVEL:
+					if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+						nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
+						max_node_level = nb_liquid_level - 1;
 					}
 					break;
 			}
 		}
 
-		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-
-		u8 range = nodemgr->get(liquid_kind).liquid_range;
-		if (range > LIQUID_LEVEL_MAX+1)
-			range = LIQUID_LEVEL_MAX+1;
-
-		if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
-		} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
+		u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				t.reflow = true;
+		} else
+			new_node_level = max_node_level;
+
+		if (max_node_level >= (LIQUID_LEVEL_MAX+1-range))
 			new_node_content = liquid_kind;
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-			if (new_node_level < (LIQUID_LEVEL_MAX+1-range))
-				new_node_content = CONTENT_AIR;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level)
-							max_node_level = nb_liquid_level;
-						break;
-					case NEIGHBOR_LOWER:
-						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
-							max_node_level = nb_liquid_level - 1;
-						}
-						break;
-				}
-			}
-
-			u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else
-				new_node_level = max_node_level;
-
-			if (max_node_level >= (LIQUID_LEVEL_MAX+1-range))
-				new_node_content = liquid_kind;
-			else
-				new_node_content = CONTENT_AIR;
-
-		}
-
-		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-										 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-										 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-										 == flowing_down)))
-			continue;
+		else
+			new_node_content = CONTENT_AIR;
 
+	}
 
-		/*
-			update the current node
-		 */
-		MapNode n00 = n0;
-		//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-		n0.setContent(new_node_content);
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+									 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+									 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+									 == flowing_down)))
+		return;
 
-		// Find out whether there is a suspect for this action
-		std::string suspect;
-		if(m_gamedef->rollback()) {
-			suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
-		}
 
-		if(m_gamedef->rollback() && !suspect.empty()){
-			// Blame suspect
-			RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
-			// Get old node for rollback
-			RollbackNode rollback_oldnode(this, p0, m_gamedef);
-			// Set node
-			setNode(p0, n0);
-			// Report
-			RollbackNode rollback_newnode(this, p0, m_gamedef);
-			RollbackAction action;
-			action.setSetNode(p0, rollback_oldnode, rollback_newnode);
-			m_gamedef->rollback()->reportAction(action);
-		} else {
-			// Set node
-			setNode(p0, n0);
-		}
+	/*
+		update the current node
+	 */
+	//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
+	if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bit to 0
+		n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+	t.newnode = n0;
+	t.changed = true;
 
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if(block != NULL) {
-			modified_blocks[blockpos] =  block;
-			// If new or old node emits light, MapBlock requires lighting update
-			if(nodemgr->get(n0).light_source != 0 ||
-					nodemgr->get(n00).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
-		}
+	/*
+		enqueue neighbors for update if neccessary
+	 */
+	switch (nodemgr->get(n0.getContent()).liquid_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					t.queue_dirs |= 1 << flows[i].dir;
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					t.queue_dirs |= 1 << airs[i].dir;
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				t.queue_dirs |= 1 << flows[i].dir;
+			break;
+	}
+}
 
-		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (nodemgr->get(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
-		}
+/*
+	Transforms the queued nodes of a set of blocks. Every node is
+	decided from the map as it was before the pass, so the blocks can
+	be worked on in parallel.
+*/
+class LiquidTransformJob : public WorkerJob
+{
+public:
+	LiquidTransformJob(Map *map, INodeDefManager *nodemgr,
+			const std::vector<LiquidBlockNodes> &blocks,
+			std::vector<std::vector<LiquidTransform> > &results):
+		m_map(map),
+		m_nodemgr(nodemgr),
+		m_blocks(blocks),
+		m_results(results)
+	{
+		m_results.resize(blocks.size());
 	}
-	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 
-	for (std::deque<v3s16>::iterator iter = must_reflow.begin(); iter != must_reflow.end(); ++iter)
-		m_transforming_liquid.push_back(*iter);
+	void work(u32 item, u32 thread)
+	{
+		const std::vector<v3s16> &nodes = m_blocks[item].nodes;
+		std::vector<LiquidTransform> &results = m_results[item];
+		results.resize(nodes.size());
+		for (size_t i = 0; i < nodes.size(); i++)
+			transformLiquid(m_map, m_nodemgr, nodes[i], results[i]);
+	}
 
-	updateLighting(lighting_modified_blocks, modified_blocks);
+private:
+	Map *m_map;
+	INodeDefManager *m_nodemgr;
+	const std::vector<LiquidBlockNodes> &m_blocks;
+	std::vector<std::vector<LiquidTransform> > &m_results;
+};
 
+void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
+{
 
-	/* ----------------------------------------------------------------------
-	 * Manage the queue so that it does not grow indefinately
-	 */
-	u16 time_until_purge = g_settings->getU16("liquid_queue_purge_time");
+	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if (time_until_purge == 0)
-		return; // Feature disabled
+	DSTACK(FUNCTION_NAME);
+	//TimeTaker timer("transformLiquids()");
 
-	time_until_purge *= 1000;	// seconds -> milliseconds
+	if (m_transforming_liquid.size() == 0)
+		return;
 
-	u32 curr_time = getTime(PRECISION_MILLI);
-	u32 prev_unprocessed = m_unprocessed_count;
-	m_unprocessed_count = m_transforming_liquid.size();
+	/*
+		Take one pass worth of queued nodes; the nodes queued by this
+		pass are done by the next one
+	*/
+	std::vector<LiquidBlockNodes> blocks;
+	m_transforming_liquid.popBlocks(g_settings->getS32("liquid_loop_max"),
+			blocks);
 
-	// if unprocessed block count is decreasing or stable
-	if (m_unprocessed_count <= prev_unprocessed) {
-		m_queue_size_timer_started = false;
-	} else {
-		if (!m_queue_size_timer_started)
-			m_inc_trending_up_start_time = curr_time;
-		m_queue_size_timer_started = true;
+	std::vector<std::vector<LiquidTransform> > results;
+	{
+		LiquidTransformJob job(this, nodemgr, blocks, results);
+		if (m_liquid_pool != NULL) {
+			m_liquid_pool->run(&job, blocks.size());
+		} else {
+			for (u32 i = 0; i < blocks.size(); i++)
+				job.work(i, 0);
+		}
 	}
 
-	// Account for curr_time overflowing
-	if (m_queue_size_timer_started && m_inc_trending_up_start_time > curr_time)
-		m_queue_size_timer_started = false;
+	// list of nodes that due to viscosity have not reached their max level height
+	std::vector<v3s16> must_reflow;
+
+	// Nodes that emit light or did so, with their old node
+	std::vector<std::pair<v3s16, MapNode> > lighting_nodes;
+
+	for (size_t b = 0; b < blocks.size(); b++) {
+		const std::vector<v3s16> &nodes = blocks[b].nodes;
+		MapBlock *block = getBlockNoCreateNoEx(blocks[b].blockpos);
+		for (size_t i = 0; i < nodes.size(); i++) {
+			const LiquidTransform &t = results[b][i];
+			v3s16 p0 = nodes[i];
+
+			if (t.changed) {
+				MapNode n00 = getNodeNoEx(p0);
+				MapNode n0 = t.newnode;
+
+				// Find out whether there is a suspect for this action
+				std::string suspect;
+				if(m_gamedef->rollback()) {
+					suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
+				}
 
-	/* If the queue has been growing for more than liquid_queue_purge_time seconds
-	 * and the number of unprocessed blocks is still > liquid_loop_max then we
-	 * cannot keep up; dump the oldest blocks from the queue so that the queue
-	 * has liquid_loop_max items in it
-	 */
-	if (m_queue_size_timer_started
-			&& curr_time - m_inc_trending_up_start_time > time_until_purge
-			&& m_unprocessed_count > liquid_loop_max) {
+				if(m_gamedef->rollback() && !suspect.empty()){
+					// Blame suspect
+					RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
+					// Get old node for rollback
+					RollbackNode rollback_oldnode(this, p0, m_gamedef);
+					// Set node
+					setNode(p0, n0);
+					// Report
+					RollbackNode rollback_newnode(this, p0, m_gamedef);
+					RollbackAction action;
+					action.setSetNode(p0, rollback_oldnode, rollback_newnode);
+					m_gamedef->rollback()->reportAction(action);
+				} else {
+					// Set node
+					setNode(p0, n0);
+				}
 
-		size_t dump_qty = m_unprocessed_count - liquid_loop_max;
+				if(block != NULL) {
+					modified_blocks[blocks[b].blockpos] = block;
+					// If new or old node emits light, it requires a lighting update
+					if(nodemgr->get(n0).light_source != 0 ||
+							nodemgr->get(n00).light_source != 0)
+						lighting_nodes.push_back(std::make_pair(p0, n00));
+				}
+			}
 
-		infostream << "transformLiquids(): DUMPING " << dump_qty
-		           << " blocks from the queue" << std::endl;
+			for (u16 d = 0; d < 6; d++)
+				if (t.queue_dirs & (1 << d))
+					m_transforming_liquid.push_back(p0 + g_6dirs[d]);
+			if (t.reflow)
+				must_reflow.push_back(p0);
+		}
+	}
 
-		while (dump_qty--)
-			m_transforming_liquid.pop_front();
+	for (std::vector<v3s16>::iterator iter = must_reflow.begin(); iter != must_reflow.end(); ++iter)
+		m_transforming_liquid.push_back(*iter);
 
-		m_queue_size_timer_started = false; // optimistically assume we can keep up now
-		m_unprocessed_count = m_transforming_liquid.size();
+	if (!lighting_nodes.empty()) {
+		std::map<v3s16, MapBlock*> lighting_modified_blocks;
+		voxalgo::updateLightingNodes(this, nodemgr, lighting_nodes,
+				lighting_modified_blocks,
+				lighting_nodes.size() >= LIGHTING_PARALLEL_MIN_EDITS ?
+					m_lighting_pool : NULL);
+		for (std::map<v3s16, MapBlock*>::iterator
+				i = lighting_modified_blocks.begin();
+				i != lighting_modified_blocks.end(); ++i) {
+			i->second->expireDayNightDiff();
+			modified_blocks[i->first] = i->second;
+		}
 	}
 }
 
@@ -2110,16 +1939,65 @@ void Map::removeNodeTimer(v3s16 p)
 	block->m_node_timers.remove(p_rel);
 }
 
+/*
+	Trains the zstd dictionary of a world from the samples collected by
+	ServerMap, so that the server thread isn't held up by it.
+*/
+class ZstdDictionaryThread : public Thread
+{
+public:
+	ZstdDictionaryThread(ServerMap *map, std::vector<std::string> &samples) :
+		Thread("ZstdDictionary"),
+		m_map(map)
+	{
+		m_samples.swap(samples);
+	}
+
+protected:
+	void *run()
+	{
+		DSTACK(FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		m_map->trainZstdDictionary(m_samples);
+
+		END_DEBUG_EXCEPTION_HANDLER
+
+		return NULL;
+	}
+
+private:
+	ServerMap *m_map;
+	std::vector<std::string> m_samples;
+};
+
 /*
 	ServerMap
 */
 ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emerge):
 	Map(dout_server, gamedef),
 	m_emerge(emerge),
-	m_map_metadata_changed(true)
+	m_map_metadata_changed(true),
+	m_block_codec(BLOCK_CODEC_ZLIB),
+	m_zstd_dict(NULL),
+	m_zstd_dict_thread(NULL),
+	m_zstd_dict_sample_blocks(0),
+	m_zstd_dict_sampling(false)
 {
 	verbosestream<<FUNCTION_NAME<<std::endl;
 
+	// The server lights the node edits of a step together
+	setLightingDeferred(true);
+	m_lighting_pool = new WorkerPool("Lighting", 2);
+	m_liquid_pool = new WorkerPool("Liquid",
+			g_settings->getS16("num_liquid_threads"));
+
+	if (g_settings->exists("liquid_queue_purge_time")) {
+		warningstream << "The setting liquid_queue_purge_time is no longer "
+			"used; the liquid queue holds each node at most once instead"
+			<< std::endl;
+	}
+
 	/*
 		Try to load map; if not found, create a new one.
 	*/
@@ -2134,6 +2012,9 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 	}
 	std::string backend = conf.get("backend");
 	dbase = createDatabase(backend, savedir, conf);
+	m_save_thread = new MapSaveThread(dbase,
+		MAP_SAVE_QUEUE_LIMIT, MAP_SAVE_BATCH_SIZE);
+	m_save_thread->start();
 
 	if (!conf.updateConfigFile(conf_path.c_str()))
 		errorstream << "ServerMap::ServerMap(): Failed to update world.mt!" << std::endl;
@@ -2141,6 +2022,17 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
 
+	std::string codec_name = g_settings->get("map_compression");
+	if (!parseBlockCodec(codec_name, &m_block_codec)
+			|| !isBlockCodecSupported(m_block_codec)) {
+		warningstream << "ServerMap: map_compression \"" << codec_name
+			<< "\" is not supported, using zlib" << std::endl;
+		m_block_codec = BLOCK_CODEC_ZLIB;
+	}
+	loadZstdDictionary();
+	m_zstd_dict_sampling = m_block_codec == BLOCK_CODEC_ZSTD
+		&& m_zstd_dict == NULL;
+
 	try
 	{
 		// If directory exists, check contents and load if possible
@@ -2227,9 +2119,17 @@ ServerMap::~ServerMap()
 	}
 
 	/*
-		Close database if it was opened
+		Write out everything still queued, then close the database
 	*/
+	delete m_save_thread;
 	delete dbase;
+	if (m_zstd_dict_thread) {
+		m_zstd_dict_thread->wait();
+		delete m_zstd_dict_thread;
+	}
+	delete m_zstd_dict;
+	delete m_lighting_pool;
+	delete m_liquid_pool;
 
 #if 0
 	/*
@@ -2365,10 +2265,10 @@ void ServerMap::finishBlockMake(BlockMakeData *data,
 	}
 
 	/*
-		Blit generated stuff to map
-		NOTE: blitBackAll adds nearly everything to changed_blocks
+		Swap the generated nodes into the map
+		NOTE: blitBackPrepared adds nearly everything to changed_blocks
 	*/
-	data->vmanip->blitBackAll(changed_blocks);
+	data->vmanip->blitBackPrepared(changed_blocks);
 
 	EMERGE_DBG_OUT("finishBlockMake: changed_blocks.size()="
 		<< changed_blocks->size());
@@ -2533,6 +2433,7 @@ MapBlock * ServerMap::generateBlock(
 	/*
 		Blit data back on map, update lighting, add mobs and whatever this does
 	*/
+	data.vmanip->prepareBlitBack();
 	finishBlockMake(&data, modified_blocks);
 
 	/*
@@ -2886,6 +2787,9 @@ void ServerMap::save(ModifiedState save_level)
 		return;
 	}
 
+	// Do not save blocks with edits that are not lit yet
+	flushDeferredLighting();
+
 	if(save_level == MOD_STATE_CLEAN)
 		infostream<<"ServerMap: Saving whole map, this can take time."
 				<<std::endl;
@@ -2969,6 +2873,9 @@ void ServerMap::listAllLoadableBlocks(std::vector<v3s16> &dst)
 		errorstream << "Map::listAllLoadableBlocks(): Result will be missing "
 				<< "all blocks that are stored in flat files." << std::endl;
 	}
+	m_save_thread->flush();
+
+	MutexAutoLock dblock(m_save_thread->getDatabaseMutex());
 	dbase->listAllLoadableBlocks(dst);
 }
 
@@ -3235,19 +3142,34 @@ Database *ServerMap::createDatabase(
 		throw BaseException(std::string("Database backend ") + name + " not supported.");
 }
 
-void ServerMap::beginSave()
-{
-	dbase->beginSave();
-}
-
 void ServerMap::endSave()
 {
-	dbase->endSave();
+	// Everything queued since the last call makes up one batch
+	m_save_thread->commit();
 }
 
 bool ServerMap::saveBlock(MapBlock *block)
 {
-	return saveBlock(block, dbase);
+	v3s16 p3d = block->getPos();
+
+	// Dummy blocks are not written
+	if (block->isDummy()) {
+		warningstream << "saveBlock: Not writing dummy block "
+			<< PP(p3d) << std::endl;
+		return true;
+	}
+
+	if (m_block_codec == BLOCK_CODEC_ZSTD)
+		addZstdDictionarySample(block);
+
+	// The save thread owns the data from here on and hands out the
+	// queued copy if the block gets loaded again in the meantime,
+	// so the block counts as written.
+	m_save_thread->queueBlock(p3d,
+		serializeBlock(block, m_block_codec, getZstdDictionary()));
+	m_prefetched_blocks.erase(p3d);
+	block->resetModified();
+	return true;
 }
 
 bool ServerMap::saveBlock(MapBlock *block, Database *db)
@@ -3261,8 +3183,21 @@ bool ServerMap::saveBlock(MapBlock *block, Database *db)
 		return true;
 	}
 
+	bool ret = db->saveBlock(p3d, serializeBlock(block));
+	if (ret) {
+		// We just wrote it to the disk so clear modified flag
+		block->resetModified();
+	}
+	return ret;
+}
+
+std::string ServerMap::serializeBlock(MapBlock *block, u8 codec,
+		const ZstdDictionary *dict)
+{
 	// Format used for writing
 	u8 version = SER_FMT_VER_HIGHEST_WRITE;
+	if (codec != BLOCK_CODEC_ZLIB)
+		version = SER_FMT_VER_BLOCK_CODEC;
 
 	/*
 		[0] u8 serialization version
@@ -3270,15 +3205,100 @@ bool ServerMap::saveBlock(MapBlock *block, Database *db)
 	*/
 	std::ostringstream o(std::ios_base::binary);
 	o.write((char*) &version, 1);
-	block->serialize(o, version, true);
+	block->serialize(o, version, true, codec, dict);
 
-	std::string data = o.str();
-	bool ret = db->saveBlock(p3d, data);
-	if (ret) {
-		// We just wrote it to the disk so clear modified flag
-		block->resetModified();
+	return o.str();
+}
+
+const ZstdDictionary *ServerMap::getZstdDictionary()
+{
+	MutexAutoLock lock(m_zstd_dict_mutex);
+	return m_zstd_dict;
+}
+
+void ServerMap::loadZstdDictionary()
+{
+	std::string path = m_savedir + DIR_DELIM + MAP_ZSTD_DICT_FILE;
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if (!is.good())
+		return;
+
+	std::ostringstream os(std::ios_base::binary);
+	os << is.rdbuf();
+	try {
+		m_zstd_dict = new ZstdDictionary(os.str());
+	} catch (SerializationError &e) {
+		// Blocks compressed with it can not be loaded either
+		errorstream << "ServerMap: Could not load " << path << ": "
+			<< e.what() << std::endl;
 	}
-	return ret;
+}
+
+void ServerMap::addZstdDictionarySample(MapBlock *block)
+{
+	MutexAutoLock lock(m_zstd_dict_mutex);
+	if (!m_zstd_dict_sampling)
+		return;
+
+	// The samples are the parts that get compressed, not whole blocks
+	std::string nodes;
+	std::string metadata;
+	block->serializeCodecParts(SER_FMT_VER_BLOCK_CODEC, true,
+		&nodes, &metadata);
+	m_zstd_dict_samples.push_back(nodes);
+	if (!metadata.empty())
+		m_zstd_dict_samples.push_back(metadata);
+	if (++m_zstd_dict_sample_blocks < MAP_ZSTD_DICT_SAMPLES)
+		return;
+
+	// Train only once, on a thread of its own
+	m_zstd_dict_sampling = false;
+	m_zstd_dict_thread = new ZstdDictionaryThread(this, m_zstd_dict_samples);
+	m_zstd_dict_thread->start();
+}
+
+void ServerMap::trainZstdDictionary(const std::vector<std::string> &samples)
+{
+	// Test on a quarter of the samples, a dictionary does not pay off
+	// for every world
+	size_t num_training = samples.size() * 3 / 4;
+	std::vector<std::string> training(samples.begin(),
+		samples.begin() + num_training);
+	ZstdDictionary *dict = ZstdDictionary::train(training,
+		MAP_ZSTD_DICT_SIZE);
+	if (dict == NULL) {
+		warningstream << "ServerMap: Could not train a zstd dictionary"
+			<< std::endl;
+		return;
+	}
+
+	size_t plain_size = 0;
+	size_t dict_size = 0;
+	for (size_t i = num_training; i < samples.size(); i++) {
+		std::ostringstream plain(std::ios_base::binary);
+		std::ostringstream with_dict(std::ios_base::binary);
+		compressBlockData(samples[i], plain, BLOCK_CODEC_ZSTD);
+		compressBlockData(samples[i], with_dict, BLOCK_CODEC_ZSTD, dict);
+		plain_size += plain.str().size();
+		dict_size += with_dict.str().size();
+	}
+	infostream << "ServerMap: zstd dictionary of " << dict->getData().size()
+		<< " bytes compresses test samples to " << dict_size
+		<< " instead of " << plain_size << " bytes" << std::endl;
+	if (dict_size > plain_size * (1.0 - MAP_ZSTD_DICT_MIN_GAIN)) {
+		delete dict;
+		return;
+	}
+
+	// Blocks compressed with it need the dictionary on disk first
+	std::string path = m_savedir + DIR_DELIM + MAP_ZSTD_DICT_FILE;
+	if (!fs::safeWriteToFile(path, dict->getData())) {
+		errorstream << "ServerMap: Could not write " << path << std::endl;
+		delete dict;
+		return;
+	}
+	MutexAutoLock lock(m_zstd_dict_mutex);
+	m_zstd_dict = dict;
 }
 
 void ServerMap::loadBlock(std::string sectordir, std::string blockfile,
@@ -3322,7 +3342,7 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile,
 		}
 
 		// Read basic data
-		block->deSerialize(is, version, true);
+		block->deSerialize(is, version, true, getZstdDictionary());
 
 		// If it's a new block, insert it to the map
 		if(created_new)
@@ -3389,7 +3409,7 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 		}
 
 		// Read basic data
-		block->deSerialize(is, version, true);
+		block->deSerialize(is, version, true, getZstdDictionary());
 
 		// If it's a new block, insert it to the map
 		if(created_new)
@@ -3434,7 +3454,20 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	std::string ret;
 
-	ret = dbase->loadBlock(blockpos);
+	bool prefetched = false;
+	std::map<v3s16, std::string>::iterator it =
+		m_prefetched_blocks.find(blockpos);
+	if (it != m_prefetched_blocks.end()) {
+		ret.swap(it->second);
+		m_prefetched_blocks.erase(it);
+		prefetched = true;
+	}
+
+	// Blocks waiting to be written are newer than what's in the database
+	if (!m_save_thread->getQueuedBlock(blockpos, &ret) && !prefetched) {
+		MutexAutoLock dblock(m_save_thread->getDatabaseMutex());
+		ret = dbase->loadBlock(blockpos);
+	}
 	if (ret != "") {
 		loadBlock(&ret, blockpos, createSector(p2d), false);
 		return getBlockNoCreateNoEx(blockpos);
@@ -3498,10 +3531,45 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	return getBlockNoCreateNoEx(blockpos);
 }
 
+void ServerMap::prefetchBlocks(const std::vector<v3s16> &positions)
+{
+	// Drop leftovers of emerges that got cancelled
+	if (m_prefetched_blocks.size() > MAP_PREFETCH_LIMIT)
+		m_prefetched_blocks.clear();
+
+	std::vector<v3s16> wanted;
+	for (std::vector<v3s16>::const_iterator it = positions.begin();
+			it != positions.end(); ++it) {
+		if (getBlockNoCreateNoEx(*it) ||
+				m_prefetched_blocks.find(*it) != m_prefetched_blocks.end())
+			continue;
+		wanted.push_back(*it);
+	}
+
+	if (wanted.empty())
+		return;
+
+	std::map<v3s16, std::string> blocks;
+	{
+		MutexAutoLock dblock(m_save_thread->getDatabaseMutex());
+		dbase->loadBlocks(wanted, blocks);
+	}
+
+	for (std::vector<v3s16>::iterator it = wanted.begin();
+			it != wanted.end(); ++it)
+		m_prefetched_blocks[*it].swap(blocks[*it]);
+}
+
 bool ServerMap::deleteBlock(v3s16 blockpos)
 {
-	if (!dbase->deleteBlock(blockpos))
-		return false;
+	m_prefetched_blocks.erase(blockpos);
+	{
+		// Also waits for a write of this block that is in progress
+		MutexAutoLock dblock(m_save_thread->getDatabaseMutex());
+		m_save_thread->dequeueBlock(blockpos);
+		if (!dbase->deleteBlock(blockpos))
+			return false;
+	}
 
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
 	if (block) {
@@ -3530,6 +3598,7 @@ MMVManip::MMVManip(Map *map):
 
 MMVManip::~MMVManip()
 {
+	clearPreparedBlocks();
 }
 
 void MMVManip::initialEmerge(v3s16 blockpos_min, v3s16 blockpos_max,
@@ -3647,4 +3716,77 @@ void MMVManip::blitBackAll(std::map<v3s16, MapBlock*> *modified_blocks,
 	}
 }
 
+struct MMVManip::PreparedBlock
+{
+	v3s16 pos;
+	// After the swap, the nodes that the block had
+	MapNode *nodes;
+	ContentBitmap content;
+	// Whether some nodes were not set by the vmanip
+	bool has_ignore;
+	bool swapped;
+};
+
+void MMVManip::prepareBlitBack()
+{
+	clearPreparedBlocks();
+
+	if (m_area.getExtent() == v3s16(0,0,0))
+		return;
+
+	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+
+	for (std::map<v3s16, u8>::iterator
+			i = m_loaded_blocks.begin();
+			i != m_loaded_blocks.end(); ++i) {
+		if (i->second & VMANIP_BLOCK_DATA_INEXIST)
+			continue;
+
+		PreparedBlock *prepared = new PreparedBlock;
+		prepared->pos     = i->first;
+		prepared->nodes   = new MapNode[MapBlock::nodecount];
+		prepared->swapped = false;
+		// copyTo() skips CONTENT_IGNORE, which then keeps the map's node
+		std::fill(prepared->nodes, prepared->nodes + MapBlock::nodecount,
+			MapNode(CONTENT_IGNORE));
+		copyTo(prepared->nodes, data_area, v3s16(0,0,0),
+			i->first * MAP_BLOCKSIZE, data_size);
+		prepared->content.addNodes(prepared->nodes, MapBlock::nodecount);
+		prepared->has_ignore = prepared->content.contains(CONTENT_IGNORE);
+
+		m_prepared_blocks.push_back(prepared);
+	}
+}
+
+void MMVManip::blitBackPrepared(std::map<v3s16, MapBlock*> *modified_blocks)
+{
+	for (size_t i = 0; i != m_prepared_blocks.size(); i++) {
+		PreparedBlock *prepared = m_prepared_blocks[i];
+		if (prepared->swapped)
+			continue;
+
+		MapBlock *block = m_map->getBlockNoCreateNoEx(prepared->pos);
+		if (block == NULL)
+			continue;
+
+		// What is swapped out is freed later, outside of the lock
+		block->swapNodes(prepared->nodes, prepared->content,
+			prepared->has_ignore);
+		prepared->swapped = true;
+
+		if (modified_blocks)
+			(*modified_blocks)[prepared->pos] = block;
+	}
+}
+
+void MMVManip::clearPreparedBlocks()
+{
+	for (size_t i = 0; i != m_prepared_blocks.size(); i++) {
+		delete[] m_prepared_blocks[i]->nodes;
+		delete m_prepared_blocks[i];
+	}
+	m_prepared_blocks.clear();
+}
+
 //END
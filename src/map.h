@@ -33,6 +33,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "modifiedstate.h"
 #include "util/container.h"
 #include "nodetimer.h"
+#include "mapblockindex.h"
+#include "liquidqueue.h"
+#include "serialization.h"
+#include "threading/mutex.h"
+#include "threading/atomic.h"
 
 class Settings;
 class Database;
@@ -44,7 +49,10 @@ class NodeMetadata;
 class IGameDef;
 class IRollbackManager;
 class EmergeManager;
+class MapSaveThread;
 class ServerEnvironment;
+class WorkerPool;
+class ZstdDictionaryThread;
 struct BlockMakeData;
 struct MapgenParams;
 
@@ -189,6 +197,10 @@ class Map /*: public NodeContainer*/
 	// Returns NULL if not found
 	MapBlock * getBlockNoCreateNoEx(v3s16 p);
 
+	// Keep the block index in sync; called by MapSector
+	void indexBlock(MapBlock *block);
+	void unindexBlock(MapBlock *block);
+
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool create_blank=true)
 	{ return getBlockNoCreateNoEx(p); }
@@ -211,24 +223,10 @@ class Map /*: public NodeContainer*/
 			std::set<v3s16> & light_sources,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
-	void unLightNeighbors(enum LightBank bank,
-			v3s16 pos, u8 lightwas,
-			std::set<v3s16> & light_sources,
-			std::map<v3s16, MapBlock*> & modified_blocks);
-
 	void spreadLight(enum LightBank bank,
 			std::set<v3s16> & from_nodes,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
-	void lightNeighbors(enum LightBank bank,
-			v3s16 pos,
-			std::map<v3s16, MapBlock*> & modified_blocks);
-
-	v3s16 getBrightestNeighbour(enum LightBank bank, v3s16 p);
-
-	s16 propagateSunlight(v3s16 start,
-			std::map<v3s16, MapBlock*> & modified_blocks);
-
 	void updateLighting(enum LightBank bank,
 			std::map<v3s16, MapBlock*>  & a_blocks,
 			std::map<v3s16, MapBlock*> & modified_blocks);
@@ -236,6 +234,17 @@ class Map /*: public NodeContainer*/
 	void updateLighting(std::map<v3s16, MapBlock*>  & a_blocks,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
+	/*
+		While lighting is deferred, node edits are only queued for
+		lighting; updateDeferredLighting() lights all queued edits in
+		one batch. timerUpdate() lights any edits still queued.
+	*/
+	void setLightingDeferred(bool deferred);
+	void updateDeferredLighting(std::map<v3s16, MapBlock*> &modified_blocks);
+	// Lights queued edits and sends a MEET_OTHER event for them; called
+	// before light is read by mods, which expect it to be up to date
+	void flushDeferredLighting();
+
 	/*
 		These handle lighting but not faces.
 	*/
@@ -294,6 +303,14 @@ class Map /*: public NodeContainer*/
 	// For debug printing. Prints "Map: ", "ServerMap: " or "ClientMap: "
 	virtual void PrintInfo(std::ostream &out);
 
+	/*
+		Transforms the queued liquid nodes, at most liquid_loop_max
+		per call. The nodes of a block are decided together, and the
+		blocks in parallel; the changes are then written back in one go.
+		Every node is decided from the map as it was before the call, so
+		the result does not depend on the order of the queue, and liquid
+		spreads by at most one node per call.
+	*/
 	void transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks);
 
 	/*
@@ -357,14 +374,34 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	// Flat index of all blocks in m_sectors, for fast lookups
+	MapBlockIndex m_block_index;
+	// Changed on every removal from m_block_index, invalidating the
+	// per-thread lookup caches. Unique across all Map instances.
+	// Like the index, it is only changed by the thread owning the map
+	// (on the server, with the env lock held). Other threads read it with
+	// that lock held, or while the owner waits for them, as in WorkerPool
+	// jobs; it is atomic so that they see the latest value.
+	Atomic<u32> m_block_index_generation;
+
 	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	LiquidQueue m_transforming_liquid;
+
+	// Threads computing the light banks of large edit batches in
+	// parallel, or NULL to compute them in the calling thread
+	WorkerPool *m_lighting_pool;
+	// Threads deciding liquid transformations, or NULL to decide them
+	// in the calling thread
+	WorkerPool *m_liquid_pool;
 
 private:
-	f32 m_transforming_liquid_loop_count_multiplier;
-	u32 m_unprocessed_count;
-	u32 m_inc_trending_up_start_time; // milliseconds
-	bool m_queue_size_timer_started;
+
+	void setNodeAndLight(v3s16 p, MapNode n,
+			std::map<v3s16, MapBlock*> &modified_blocks);
+
+	bool m_lighting_deferred;
+	// Edited positions with the nodes they had before, see setNodeAndLight()
+	std::vector<std::pair<v3s16, MapNode> > m_lighting_edits;
 
 	DISABLE_CLASS_COPY(Map);
 };
@@ -401,6 +438,7 @@ class ServerMap : public Map
 		Blocks are generated by using these and makeBlock().
 	*/
 	bool initBlockMake(v3s16 blockpos, BlockMakeData *data);
+	// data->vmanip->prepareBlitBack() has to be called before
 	void finishBlockMake(BlockMakeData *data,
 		std::map<v3s16, MapBlock*> *changed_blocks);
 
@@ -456,8 +494,7 @@ class ServerMap : public Map
 	// Returns true if the database file does not exist
 	bool loadFromFolders();
 
-	// Call these before and after saving of blocks
-	void beginSave();
+	// Call this after saving of blocks; saving itself is asynchronous
 	void endSave();
 
 	void save(ModifiedState save_level);
@@ -486,11 +523,19 @@ class ServerMap : public Map
 	// Returns true if sector now resides in memory
 	//bool deFlushSector(v2s16 p2d);
 
+	// Queues the block for writing by the save thread
 	bool saveBlock(MapBlock *block);
+	// Writes the block to the given database right away
 	static bool saveBlock(MapBlock *block, Database *db);
+	// Uses the oldest format that can hold the codec
+	static std::string serializeBlock(MapBlock *block,
+			u8 codec = BLOCK_CODEC_ZLIB, const ZstdDictionary *dict = NULL);
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
+	// Reads the given blocks from the database in one go and keeps them
+	// for loadBlock(). Blocks that are in memory or known already are skipped.
+	void prefetchBlocks(const std::vector<v3s16> &positions);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
@@ -506,7 +551,19 @@ class ServerMap : public Map
 	u64 getSeed();
 	s16 getWaterLevel();
 
+	// Codec of the blocks written, from map_compression
+	u8 getBlockCodec() const { return m_block_codec; }
+	// NULL until the world has a trained dictionary
+	const ZstdDictionary *getZstdDictionary();
+
 private:
+	void loadZstdDictionary();
+	// Starts training the world's dictionary once enough blocks have
+	// been added
+	void addZstdDictionarySample(MapBlock *block);
+	// Trains, tests and stores a dictionary; runs on ZstdDictionaryThread
+	void trainZstdDictionary(const std::vector<std::string> &samples);
+
 	// Emerge manager
 	EmergeManager *m_emerge;
 
@@ -527,6 +584,26 @@ class ServerMap : public Map
 	*/
 	bool m_map_metadata_changed;
 	Database *dbase;
+	MapSaveThread *m_save_thread;
+
+	u8 m_block_codec;
+	// Set at most once, then used for all zstd blocks of the world
+	ZstdDictionary *m_zstd_dict;
+	// Protects m_zstd_dict and the sampling state below
+	Mutex m_zstd_dict_mutex;
+	// Trains m_zstd_dict once, after enough samples
+	ZstdDictionaryThread *m_zstd_dict_thread;
+	// Uncompressed node data and metadata of the blocks saved while
+	// there is no dictionary yet
+	std::vector<std::string> m_zstd_dict_samples;
+	u32 m_zstd_dict_sample_blocks;
+	bool m_zstd_dict_sampling;
+
+	friend class ZstdDictionaryThread;
+
+	// Database contents fetched by prefetchBlocks() but not loaded yet.
+	// An empty string means the block is not in the database.
+	std::map<v3s16, std::string> m_prefetched_blocks;
 };
 
 
@@ -555,6 +632,16 @@ class MMVManip : public VoxelManipulator
 	void blitBackAll(std::map<v3s16, MapBlock*> * modified_blocks,
 		bool overwrite_generated = true);
 
+	/*
+		blitBackAll() in two steps, for a map that other threads use.
+		prepareBlitBack() copies the nodes of each block into an array of
+		its own and doesn't touch the map. blitBackPrepared() then only
+		swaps the arrays into the blocks, so only it needs the map locked.
+		The arrays swapped out are freed along with the MMVManip.
+	*/
+	void prepareBlitBack();
+	void blitBackPrepared(std::map<v3s16, MapBlock*> *modified_blocks);
+
 	bool m_is_dirty;
 
 protected:
@@ -565,6 +652,12 @@ class MMVManip : public VoxelManipulator
 		value = flags describing the block
 	*/
 	std::map<v3s16, u8> m_loaded_blocks;
+
+private:
+	struct PreparedBlock;
+	std::vector<PreparedBlock *> m_prepared_blocks;
+
+	void clearPreparedBlocks();
 };
 
 #endif
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <algorithm>
 #include "map.h"
 #include "light.h"
 #include "nodedef.h"
@@ -38,6 +39,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+// Network formats cached per block
+#define MAPBLOCK_NETWORK_CACHE_SIZE 4
+
 static const char *modified_reason_strings[] = {
 	"initial",
 	"reallocate",
@@ -73,10 +77,14 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_gamedef(gamedef),
 		m_modified(MOD_STATE_WRITE_NEEDED),
 		m_modified_reason(MOD_REASON_INITIAL),
+		m_modification_counter(0),
+		m_network_cache_counter(0),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
 		m_day_night_differs_expired(true),
+		m_face_connectivity(FACE_CONNECTIVITY_ALL),
+		m_face_connectivity_counter(0),
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
@@ -126,14 +134,14 @@ MapNode MapBlock::getNodeParent(v3s16 p, bool *is_valid_position)
 	if (isValidPosition(p) == false)
 		return m_parent->getNodeNoEx(getPosRelative() + p, is_valid_position);
 
-	if (data == NULL) {
+	if (isDummy()) {
 		if (is_valid_position)
 			*is_valid_position = false;
 		return MapNode(CONTENT_IGNORE);
 	}
 	if (is_valid_position)
 		*is_valid_position = true;
-	return data[p.Z * zstride + p.Y * ystride + p.X];
+	return getNodeAt(p.Z * zstride + p.Y * ystride + p.X);
 }
 
 std::string MapBlock::getModifiedReasonString()
@@ -357,6 +365,15 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
+	if (isCompact()) {
+		MapNode *tmp_nodes = new MapNode[nodecount];
+		m_compact_data.unpack(tmp_nodes, nodecount);
+		dst.copyFrom(tmp_nodes, data_area, v3s16(0,0,0),
+				getPosRelative(), data_size);
+		delete[] tmp_nodes;
+		return;
+	}
+
 	// Copy from data to VoxelManipulator
 	dst.copyFrom(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
@@ -367,9 +384,78 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
+	expand();
+
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	updateContentBitmap();
+	m_modification_counter++;
+}
+
+void MapBlock::swapNodes(MapNode *&nodes, const ContentBitmap &content,
+		bool keep_ignored)
+{
+	if (keep_ignored && !isDummy()) {
+		for (u32 i = 0; i < nodecount; i++) {
+			if (nodes[i].getContent() == CONTENT_IGNORE)
+				nodes[i] = getNodeAt(i);
+		}
+	}
+
+	std::swap(data, nodes);
+	m_compact_data.clear();
+
+	if (keep_ignored)
+		updateContentBitmap();
+	else
+		m_content_bitmap = content;
+	m_modification_counter++;
+}
+
+void MapBlock::updateContentBitmap()
+{
+	m_content_bitmap.clear();
+	if (isDummy())
+		return;
+
+	// Long runs of the same content are common, skip them cheaply
+	content_t last = getNodeAt(0).getContent();
+	m_content_bitmap.add(last);
+	for (u32 i = 1; i < nodecount; i++) {
+		content_t c = getNodeAt(i).getContent();
+		if (c != last) {
+			m_content_bitmap.add(c);
+			last = c;
+		}
+	}
+}
+
+bool MapBlock::compact()
+{
+	if (data == NULL)
+		return isCompact();
+
+	if (!m_compact_data.pack(data, nodecount))
+		return false;
+	delete[] data;
+	data = NULL;
+	return true;
+}
+
+void MapBlock::expandCompact()
+{
+	data = new MapNode[nodecount];
+	m_compact_data.unpack(data, nodecount);
+	m_compact_data.clear();
+}
+
+u32 MapBlock::getNodeMemoryUsage()
+{
+	if (data != NULL)
+		return nodecount * sizeof(MapNode);
+	return m_compact_data.getMemoryUsage(nodecount);
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -379,7 +465,7 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
-	if (data == NULL) {
+	if (isDummy()) {
 		m_day_night_differs = false;
 		return;
 	}
@@ -390,7 +476,7 @@ void MapBlock::actuallyUpdateDayNightDiff()
 		Check if any lighting value differs
 	*/
 	for (u32 i = 0; i < nodecount; i++) {
-		MapNode &n = data[i];
+		MapNode n = getNodeAt(i);
 
 		differs = !n.isLightDayNightEq(nodemgr);
 		if (differs)
@@ -404,7 +490,7 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	if (differs) {
 		bool only_air = true;
 		for (u32 i = 0; i < nodecount; i++) {
-			MapNode &n = data[i];
+			MapNode n = getNodeAt(i);
 			if (n.getContent() != CONTENT_AIR) {
 				only_air = false;
 				break;
@@ -422,7 +508,7 @@ void MapBlock::expireDayNightDiff()
 {
 	//INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -431,6 +517,75 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+void MapBlock::updateFaceConnectivity()
+{
+	m_face_connectivity_counter = m_modification_counter;
+	m_face_connectivity = FACE_CONNECTIVITY_ALL;
+	if (isDummy())
+		return;
+
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+
+	// Opaque nodes and the ones already filled
+	bool closed[MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE];
+	bool any_closed = false;
+	for (u32 i = 0; i < nodecount; i++) {
+		content_t c = getNodeAt(i).getContent();
+		closed[i] = c != CONTENT_IGNORE &&
+				nodemgr->get(c).drawtype == NDT_NORMAL;
+		any_closed |= closed[i];
+	}
+	if (!any_closed)
+		return;
+
+	/*
+		Fill every open space and connect the faces it touches
+	*/
+	m_face_connectivity = 0;
+	std::vector<u16> stack;
+	for (u32 start = 0; start < nodecount; start++) {
+		if (closed[start])
+			continue;
+
+		u8 faces = 0;
+		closed[start] = true;
+		stack.push_back(start);
+		while (!stack.empty()) {
+			u16 i = stack.back();
+			stack.pop_back();
+			s16 x = i % MAP_BLOCKSIZE;
+			s16 y = i / ystride % MAP_BLOCKSIZE;
+			s16 z = i / zstride;
+
+			// Faces in the order of g_6dirs
+			static const s16 strides[6] = {
+					MAP_BLOCKSIZE * MAP_BLOCKSIZE, MAP_BLOCKSIZE, 1,
+					-MAP_BLOCKSIZE * MAP_BLOCKSIZE, -MAP_BLOCKSIZE, -1};
+			bool at_face[6] = {z == MAP_BLOCKSIZE - 1, y == MAP_BLOCKSIZE - 1,
+					x == MAP_BLOCKSIZE - 1, z == 0, y == 0, x == 0};
+			for (u8 d = 0; d < 6; d++) {
+				if (at_face[d]) {
+					faces |= 1 << d;
+					continue;
+				}
+				u16 next = i + strides[d];
+				if (!closed[next]) {
+					closed[next] = true;
+					stack.push_back(next);
+				}
+			}
+		}
+
+		for (u8 a = 0; a < 6; a++)
+		for (u8 b = a + 1; b < 6; b++) {
+			if ((faces & (1 << a)) && (faces & (1 << b)))
+				m_face_connectivity |= face_connectivity_bit(a, b);
+		}
+		if (m_face_connectivity == FACE_CONNECTIVITY_ALL)
+			return;
+	}
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -440,7 +595,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeAt(p2d.Y * zstride + y * ystride + p2d.X);
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -554,12 +709,13 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	}
 }
 
-void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+void MapBlock::serialize(std::ostream &os, u8 version, bool disk, u8 codec,
+		const ZstdDictionary *dict)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -578,33 +734,29 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		flags |= 0x08;
 	writeU8(os, flags);
 
+	// Older versions are always zlib compressed
+	if(version >= SER_FMT_VER_BLOCK_CODEC)
+		writeU8(os, codec);
+	else
+		codec = BLOCK_CODEC_ZLIB;
+
 	/*
 		Bulk node data
 	*/
 	NameIdMapping nimap;
-	if(disk)
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	if(codec == BLOCK_CODEC_ZLIB)
 	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
-		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
-
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
-				content_width, params_width, true);
-		delete[] tmp_nodes;
+		serializeNodes(os, version, disk, &nimap, true);
 	}
 	else
 	{
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
+		std::ostringstream oss(std::ios_base::binary);
+		serializeNodes(oss, version, disk, &nimap, false);
+		compressBlockData(oss.str(), os, codec, dict);
 	}
 
 	/*
@@ -612,7 +764,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	*/
 	std::ostringstream oss(std::ios_base::binary);
 	m_node_metadata.serialize(oss);
-	compressZlib(oss.str(), os);
+	compressBlockData(oss.str(), os, codec, dict);
 
 	/*
 		Data that goes to disk, but not the network
@@ -640,9 +792,44 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	}
 }
 
+void MapBlock::serializeCodecParts(u8 version, bool disk,
+		std::string *nodes, std::string *metadata)
+{
+	NameIdMapping nimap;
+	std::ostringstream oss(std::ios_base::binary);
+	serializeNodes(oss, version, disk, &nimap, false);
+	*nodes = oss.str();
+
+	oss.str("");
+	m_node_metadata.serialize(oss);
+	*metadata = oss.str();
+}
+
+void MapBlock::serializeNodes(std::ostream &os, u8 version, bool disk,
+		NameIdMapping *nimap, bool compressed)
+{
+	u8 content_width = 2;
+	u8 params_width = 2;
+	MapNode *nodes = data;
+	if(disk || isCompact())
+	{
+		nodes = new MapNode[nodecount];
+		for(u32 i=0; i<nodecount; i++)
+			nodes[i] = getNodeAt(i);
+		if(disk)
+			getBlockNodeIdMapping(nimap, nodes, m_gamedef->ndef());
+	}
+
+	MapNode::serializeBulk(os, version, nodes, nodecount,
+			content_width, params_width, compressed);
+
+	if(nodes != data)
+		delete[] nodes;
+}
+
 void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 {
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -655,7 +842,47 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 	}
 }
 
-void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
+SharedBuffer<u8> MapBlock::serializeNetwork(u8 version, u16 net_proto_version,
+		u8 codec)
+{
+	if (m_network_cache_counter != m_modification_counter) {
+		m_network_cache.clear();
+		m_network_cache_counter = m_modification_counter;
+	}
+
+	for (size_t i = 0; i < m_network_cache.size(); i++) {
+		const MapBlockNetworkData &cached = m_network_cache[i];
+		if (cached.version == version
+				&& cached.net_proto_version == net_proto_version
+				&& cached.codec == codec)
+			return cached.data;
+	}
+
+	std::ostringstream os(std::ios_base::binary);
+	serialize(os, version, false, codec);
+	serializeNetworkSpecific(os, net_proto_version);
+	std::string s = os.str();
+
+	// Clients of many formats at once are rare; forget the oldest one
+	if (m_network_cache.size() >= MAPBLOCK_NETWORK_CACHE_SIZE)
+		m_network_cache.erase(m_network_cache.begin());
+
+	MapBlockNetworkData cached;
+	cached.version = version;
+	cached.net_proto_version = net_proto_version;
+	cached.codec = codec;
+	cached.data = SharedBuffer<u8>((const u8 *)s.c_str(), s.size());
+	m_network_cache.push_back(cached);
+	return cached.data;
+}
+
+void MapBlock::clearNetworkCache()
+{
+	m_network_cache.clear();
+}
+
+void MapBlock::deSerialize(std::istream &is, u8 version, bool disk,
+		const ZstdDictionary *dict)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -664,6 +891,10 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 
 	m_day_night_differs_expired = false;
 
+	// The nodes are read into the full array
+	expand();
+	m_modification_counter++;
+
 	if(version <= 21)
 	{
 		deSerialize_pre22(is, version, disk);
@@ -676,6 +907,12 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	m_lighting_expired = (flags & 0x04) ? true : false;
 	m_generated = (flags & 0x08) ? false : true;
 
+	u8 codec = BLOCK_CODEC_ZLIB;
+	if(version >= SER_FMT_VER_BLOCK_CODEC)
+		codec = readU8(is);
+	if(!isBlockCodecSupported(codec))
+		throw SerializationError("MapBlock::deSerialize(): unsupported codec");
+
 	/*
 		Bulk node data
 	*/
@@ -687,8 +924,19 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		throw SerializationError("MapBlock::deSerialize(): invalid content_width");
 	if(params_width != 2)
 		throw SerializationError("MapBlock::deSerialize(): invalid params_width");
-	MapNode::deSerializeBulk(is, version, data, nodecount,
-			content_width, params_width, true);
+	if(codec == BLOCK_CODEC_ZLIB)
+	{
+		MapNode::deSerializeBulk(is, version, data, nodecount,
+				content_width, params_width, true);
+	}
+	else
+	{
+		std::ostringstream oss(std::ios_base::binary);
+		decompressBlockData(is, oss, codec, dict);
+		std::istringstream iss(oss.str(), std::ios_base::binary);
+		MapNode::deSerializeBulk(iss, version, data, nodecount,
+				content_width, params_width, false);
+	}
 
 	/*
 		NodeMetadata
@@ -698,7 +946,7 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	// Ignore errors
 	try {
 		std::ostringstream oss(std::ios_base::binary);
-		decompressZlib(is, oss);
+		decompressBlockData(is, oss, codec, dict);
 		std::istringstream iss(oss.str(), std::ios_base::binary);
 		if (version >= 23)
 			m_node_metadata.deSerialize(iss, m_gamedef->idef());
@@ -753,6 +1001,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		}
 	}
 
+	updateContentBitmap();
+
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Done."<<std::endl);
 }
@@ -986,6 +1236,7 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 		}
 	}
 
+	updateContentBitmap();
 }
 
 /*
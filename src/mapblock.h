@@ -28,8 +28,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "constants.h"
 #include "staticobject.h"
 #include "nodemetadata.h"
+#include "compactnodearray.h"
 #include "nodetimer.h"
 #include "modifiedstate.h"
+#include "serialization.h"
 #include "util/numeric.h" // getContainerPos
 #include "settings.h"
 
@@ -38,9 +40,65 @@ class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
 class VoxelManipulator;
+class NameIdMapping;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
+/*
+	A set of content ids folded into a fixed number of bits.
+	contains() may report a content that was never added, but never
+	misses one that was.
+*/
+class ContentBitmap
+{
+public:
+	ContentBitmap() { clear(); }
+
+	void clear()
+	{
+		for (u32 i = 0; i < WORDS; i++)
+			m_bits[i] = 0;
+	}
+
+	inline void add(content_t c)
+	{
+		m_bits[(c >> 5) % WORDS] |= (u32)1 << (c & 31);
+	}
+
+	void addNodes(const MapNode *nodes, u32 count)
+	{
+		if (count == 0)
+			return;
+
+		content_t last = nodes[0].getContent();
+		add(last);
+		for (u32 i = 1; i < count; i++) {
+			content_t c = nodes[i].getContent();
+			if (c != last) {
+				add(c);
+				last = c;
+			}
+		}
+	}
+
+	inline bool contains(content_t c) const
+	{
+		return (m_bits[(c >> 5) % WORDS] & ((u32)1 << (c & 31))) != 0;
+	}
+
+	bool intersects(const ContentBitmap &other) const
+	{
+		for (u32 i = 0; i < WORDS; i++)
+			if (m_bits[i] & other.m_bits[i])
+				return true;
+		return false;
+	}
+
+private:
+	static const u32 WORDS = 32;
+	u32 m_bits[WORDS];
+};
+
 /*// Named by looking towards z+
 enum{
 	FACE_BACK=0,
@@ -51,6 +109,23 @@ enum{
 	FACE_LEFT
 };*/
 
+// All pairs of faces connected, see MapBlock::getFaceConnectivity()
+#define FACE_CONNECTIVITY_ALL 0x7fff
+
+/*
+	Bit of MapBlock::getFaceConnectivity() for the faces towards
+	g_6dirs[a] and g_6dirs[b], a != b
+*/
+inline u16 face_connectivity_bit(u8 a, u8 b)
+{
+	if (a > b) {
+		u8 t = a;
+		a = b;
+		b = t;
+	}
+	return 1 << (a * (11 - a) / 2 + b - a - 1);
+}
+
 // NOTE: If this is enabled, set MapBlock to be initialized with
 //       CONTENT_IGNORE.
 /*enum BlockGenerationStatus
@@ -123,6 +198,17 @@ class NodeContainer
 #define MOD_REASON_EXPIRE_DAYNIGHTDIFF       (1 << 18)
 #define MOD_REASON_UNKNOWN                   (1 << 19)
 
+/*
+	A block serialized in one of the network formats
+*/
+struct MapBlockNetworkData
+{
+	u8 version;
+	u16 net_proto_version;
+	u8 codec;
+	SharedBuffer<u8> data;
+};
+
 ////
 //// MapBlock itself
 ////
@@ -146,9 +232,11 @@ class MapBlock /*: public NodeContainer*/
 	void reallocate()
 	{
 		delete[] data;
+		m_compact_data.clear();
 		data = new MapNode[nodecount];
 		for (u32 i = 0; i < nodecount; i++)
 			data[i] = MapNode(CONTENT_IGNORE);
+		updateContentBitmap();
 
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_REALLOCATE);
 	}
@@ -158,6 +246,7 @@ class MapBlock /*: public NodeContainer*/
 	////
 	void raiseModified(u32 mod, u32 reason=MOD_REASON_UNKNOWN)
 	{
+		m_modification_counter++;
 		if (mod > m_modified) {
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -192,7 +281,7 @@ class MapBlock /*: public NodeContainer*/
 
 	inline bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_compact_data.empty());
 	}
 
 	inline void unDummify()
@@ -243,7 +332,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if (m_lighting_expired)
 			return false;
-		if (data == NULL)
+		if (isDummy())
 			return false;
 		return true;
 	}
@@ -276,7 +365,7 @@ class MapBlock /*: public NodeContainer*/
 
 	inline bool isValidPosition(s16 x, s16 y, s16 z)
 	{
-		return data != NULL
+		return !isDummy()
 			&& x >= 0 && x < MAP_BLOCKSIZE
 			&& y >= 0 && y < MAP_BLOCKSIZE
 			&& z >= 0 && z < MAP_BLOCKSIZE;
@@ -294,7 +383,7 @@ class MapBlock /*: public NodeContainer*/
 		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
 
-		return data[z * zstride + y * ystride + x];
+		return getNodeAt(z * zstride + y * ystride + x);
 	}
 
 	inline MapNode getNode(v3s16 p, bool *valid_position)
@@ -314,7 +403,9 @@ class MapBlock /*: public NodeContainer*/
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
+		expand();
 		data[z * zstride + y * ystride + x] = n;
+		m_content_bitmap.add(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE);
 	}
 
@@ -329,11 +420,11 @@ class MapBlock /*: public NodeContainer*/
 
 	inline MapNode getNodeNoCheck(s16 x, s16 y, s16 z, bool *valid_position)
 	{
-		*valid_position = data != NULL;
-		if (!valid_position)
+		*valid_position = !isDummy();
+		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
 
-		return data[z * zstride + y * ystride + x];
+		return getNodeAt(z * zstride + y * ystride + x);
 	}
 
 	inline MapNode getNodeNoCheck(v3s16 p, bool *valid_position)
@@ -343,10 +434,12 @@ class MapBlock /*: public NodeContainer*/
 
 	inline void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if (data == NULL)
+		if (isDummy())
 			throw InvalidPositionException();
 
+		expand();
 		data[z * zstride + y * ystride + x] = n;
+		m_content_bitmap.add(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE_NO_CHECK);
 	}
 
@@ -379,6 +472,13 @@ class MapBlock /*: public NodeContainer*/
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
 
+	// Replaces the nodes by a full array of them, which the block then
+	// owns. The previous array (NULL if compact) is returned in nodes.
+	// With keep_ignored, CONTENT_IGNORE in the new array keeps the old
+	// node, like copyFrom() does.
+	void swapNodes(MapNode *&nodes, const ContentBitmap &content,
+		bool keep_ignored);
+
 	// Update day-night lighting difference flag.
 	// Sets m_day_night_differs to appropriate value.
 	// These methods don't care about neighboring blocks.
@@ -395,6 +495,18 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Which faces of the block can be seen from each other through the
+		nodes that aren't drawn as opaque cubes, as bits from
+		face_connectivity_bit(). Updated when needed after changes.
+	*/
+	inline u16 getFaceConnectivity()
+	{
+		if (m_face_connectivity_counter != m_modification_counter)
+			updateFaceConnectivity();
+		return m_face_connectivity;
+	}
+
 	////
 	//// Miscellaneous stuff
 	////
@@ -409,6 +521,30 @@ class MapBlock /*: public NodeContainer*/
 	*/
 	s16 getGroundLevel(v2s16 p2d);
 
+	/*
+		While a block is only read, its nodes can be kept in a compact
+		form (see CompactNodeArray) instead of a full array. Writing a
+		node expands the block again; this is invisible to users of the
+		node accessors. Returns false if the block can not be compacted.
+	*/
+	bool compact();
+	inline bool isCompact()
+	{
+		return data == NULL && !m_compact_data.empty();
+	}
+	// Bytes used by the nodes of the block
+	u32 getNodeMemoryUsage();
+
+	/*
+		Contents the block may contain. Setting nodes only adds to this;
+		it is rebuilt when the node data is replaced as a whole.
+	*/
+	const ContentBitmap &getContentBitmap() const
+	{
+		return m_content_bitmap;
+	}
+	void updateContentBitmap();
+
 	////
 	//// Timestamp (see m_timestamp)
 	////
@@ -505,20 +641,42 @@ class MapBlock /*: public NodeContainer*/
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
 	// Precondition: version >= SER_FMT_VER_LOWEST_WRITE
-	void serialize(std::ostream &os, u8 version, bool disk);
+	// codec is only used from SER_FMT_VER_BLOCK_CODEC on; dict only by zstd
+	void serialize(std::ostream &os, u8 version, bool disk,
+			u8 codec = BLOCK_CODEC_ZLIB, const ZstdDictionary *dict = NULL);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
-	void deSerialize(std::istream &is, u8 version, bool disk);
+	// Throws SerializationError if zstd data needs another dict
+	void deSerialize(std::istream &is, u8 version, bool disk,
+			const ZstdDictionary *dict = NULL);
+	// The node data and metadata that serialize() passes through
+	// compressBlockData(), uncompressed
+	void serializeCodecParts(u8 version, bool disk,
+			std::string *nodes, std::string *metadata);
 
 	void serializeNetworkSpecific(std::ostream &os, u16 net_proto_version);
 	void deSerializeNetworkSpecific(std::istream &is);
 
+	// serialize() and serializeNetworkSpecific() for the network. The
+	// result is shared by all clients of the same format until the block
+	// is changed.
+	SharedBuffer<u8> serializeNetwork(u8 version, u16 net_proto_version,
+			u8 codec);
+	void clearNetworkCache();
+
 private:
 	/*
 		Private methods
 	*/
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
+	// Writes the bulk node data, zlib compressed if compressed is set.
+	// If disk is set, the ids are mapped to nimap.
+	void serializeNodes(std::ostream &os, u8 version, bool disk,
+			NameIdMapping *nimap, bool compressed);
+
+	// Flood fills the open nodes to find m_face_connectivity
+	void updateFaceConnectivity();
 
 	/*
 		Used only internally, because changes can't be tracked
@@ -529,9 +687,24 @@ class MapBlock /*: public NodeContainer*/
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
+		expand();
 		return data[z * zstride + y * ystride + x];
 	}
 
+	// Node at an index of the node array; the block must not be a dummy
+	inline MapNode getNodeAt(u32 i)
+	{
+		return data != NULL ? data[i] : m_compact_data.get(i);
+	}
+
+	// Turns a compact block back into a full array
+	inline void expand()
+	{
+		if (data == NULL && !m_compact_data.empty())
+			expandCompact();
+	}
+	void expandCompact();
+
 	inline MapNode &getNodeRef(v3s16 &p)
 	{
 		return getNodeRef(p.X, p.Y, p.Z);
@@ -576,10 +749,14 @@ class MapBlock /*: public NodeContainer*/
 	IGameDef *m_gamedef;
 
 	/*
-		If NULL, block is a dummy block.
+		If NULL and m_compact_data is empty, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode *data;
+	// The nodes while the block is compact; data is NULL then
+	CompactNodeArray m_compact_data;
+
+	ContentBitmap m_content_bitmap;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -589,6 +766,12 @@ class MapBlock /*: public NodeContainer*/
 	u32 m_modified;
 	u32 m_modified_reason;
 
+	// Raised by all changes that can show in the serialized block
+	u32 m_modification_counter;
+	// Made by serializeNetwork() at m_network_cache_counter
+	std::vector<MapBlockNetworkData> m_network_cache;
+	u32 m_network_cache_counter;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
@@ -612,6 +795,10 @@ class MapBlock /*: public NodeContainer*/
 	bool m_day_night_differs;
 	bool m_day_night_differs_expired;
 
+	// Made by updateFaceConnectivity() at m_face_connectivity_counter
+	u16 m_face_connectivity;
+	u32 m_face_connectivity_counter;
+
 	bool m_generated;
 
 	/*
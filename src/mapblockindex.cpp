@@ -0,0 +1,129 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapblockindex.h"
+#include <cstring>
+
+// Must be a power of two
+#define MAPBLOCKINDEX_INITIAL_CAPACITY 1024
+
+MapBlockIndex::MapBlockIndex():
+	m_slots(NULL),
+	m_mask(0),
+	m_count(0)
+{
+	resize(MAPBLOCKINDEX_INITIAL_CAPACITY);
+}
+
+MapBlockIndex::~MapBlockIndex()
+{
+	delete[] m_slots;
+}
+
+MapBlock *MapBlockIndex::get(v3s16 p) const
+{
+	u64 key = packPos(p);
+	u32 i = hashKey(key) & m_mask;
+	for (;;) {
+		const Slot &slot = m_slots[i];
+		if (slot.block == NULL)
+			return NULL;
+		if (slot.key == key)
+			return slot.block;
+		i = (i + 1) & m_mask;
+	}
+}
+
+void MapBlockIndex::insert(v3s16 p, MapBlock *block)
+{
+	// Keep the load factor at or below 1/2
+	if ((m_count + 1) * 2 > m_mask + 1)
+		resize((m_mask + 1) * 2);
+
+	u64 key = packPos(p);
+	u32 i = hashKey(key) & m_mask;
+	while (m_slots[i].block != NULL) {
+		if (m_slots[i].key == key) {
+			m_slots[i].block = block;
+			return;
+		}
+		i = (i + 1) & m_mask;
+	}
+	m_slots[i].key = key;
+	m_slots[i].block = block;
+	m_count++;
+}
+
+bool MapBlockIndex::remove(v3s16 p)
+{
+	u64 key = packPos(p);
+	u32 i = hashKey(key) & m_mask;
+	for (;;) {
+		if (m_slots[i].block == NULL)
+			return false;
+		if (m_slots[i].key == key)
+			break;
+		i = (i + 1) & m_mask;
+	}
+
+	// Shift back following entries whose probe sequence passes the hole
+	u32 j = i;
+	for (;;) {
+		j = (j + 1) & m_mask;
+		if (m_slots[j].block == NULL)
+			break;
+		u32 home = hashKey(m_slots[j].key) & m_mask;
+		bool movable = (j > i) ? (home <= i || home > j)
+				: (home <= i && home > j);
+		if (movable) {
+			m_slots[i] = m_slots[j];
+			i = j;
+		}
+	}
+	m_slots[i].block = NULL;
+	m_count--;
+	return true;
+}
+
+void MapBlockIndex::clear()
+{
+	memset(m_slots, 0, sizeof(Slot) * (m_mask + 1));
+	m_count = 0;
+}
+
+void MapBlockIndex::resize(u32 capacity)
+{
+	Slot *old_slots = m_slots;
+	u32 old_capacity = old_slots ? m_mask + 1 : 0;
+
+	m_slots = new Slot[capacity];
+	memset(m_slots, 0, sizeof(Slot) * capacity);
+	m_mask = capacity - 1;
+
+	for (u32 k = 0; k < old_capacity; k++) {
+		if (old_slots[k].block == NULL)
+			continue;
+		u32 i = hashKey(old_slots[k].key) & m_mask;
+		while (m_slots[i].block != NULL)
+			i = (i + 1) & m_mask;
+		m_slots[i] = old_slots[k];
+	}
+
+	delete[] old_slots;
+}
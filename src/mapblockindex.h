@@ -0,0 +1,83 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPBLOCKINDEX_HEADER
+#define MAPBLOCKINDEX_HEADER
+
+#include "irrlichttypes.h"
+#include "irr_v3d.h"
+#include "util/basic_macros.h"
+
+class MapBlock;
+
+/*
+	Open-addressing hash table from block position to MapBlock.
+
+	Used by Map as a flat lookup index next to the sector/block tree,
+	which is kept for ordered iteration. Linear probing is used, and
+	removal shifts the following entries back so no tombstones are
+	left behind.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+	~MapBlockIndex();
+
+	// Returns NULL if there is no block at p
+	MapBlock *get(v3s16 p) const;
+	// Inserts or replaces the block at p
+	void insert(v3s16 p, MapBlock *block);
+	// Returns false if there was no block at p
+	bool remove(v3s16 p);
+	void clear();
+
+	u32 size() const { return m_count; }
+
+private:
+	struct Slot {
+		u64 key;
+		MapBlock *block; // NULL for an empty slot
+	};
+
+	static inline u64 packPos(v3s16 p)
+	{
+		return (u64)(u16)p.X |
+			((u64)(u16)p.Y << 16) |
+			((u64)(u16)p.Z << 32);
+	}
+
+	static inline u32 hashKey(u64 key)
+	{
+		u32 h = (u32)(key & 0xffff) * 73856093U ^
+			(u32)((key >> 16) & 0xffff) * 19349663U ^
+			(u32)(key >> 32) * 83492791U;
+		return h ^ (h >> 15);
+	}
+
+	void resize(u32 capacity);
+
+	Slot *m_slots;
+	u32 m_mask;
+	u32 m_count;
+
+	DISABLE_CLASS_COPY(MapBlockIndex);
+};
+
+#endif
@@ -39,6 +39,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "filesys.h"
 #include "log.h"
+#include "threading/mutex_auto_lock.h"
 
 FlagDesc flagdesc_mapgen[] = {
 	{"trees",       MG_TREES},
@@ -80,6 +81,8 @@ Mapgen::Mapgen()
 	biomemap  = NULL;
 	heatmap   = NULL;
 	humidmap  = NULL;
+
+	noisecache = NULL;
 }
 
 
@@ -99,6 +102,8 @@ Mapgen::Mapgen(int mapgenid, MapgenParams *params, EmergeManager *emerge) :
 	biomemap  = NULL;
 	heatmap   = NULL;
 	humidmap  = NULL;
+
+	noisecache = emerge->noisecache;
 }
 
 
@@ -414,6 +419,125 @@ void GenerateNotifier::getEvents(
 }
 
 
+////
+//// NoiseMapCache
+////
+
+NoiseMapCache::NoiseMapCache(u32 max_maps)
+{
+	m_max_maps = max_maps;
+}
+
+
+NoiseMapCache::~NoiseMapCache()
+{
+	std::map<MapKey, CachedMap>::iterator it;
+	for (it = m_maps.begin(); it != m_maps.end(); ++it)
+		delete[] it->second.values;
+}
+
+
+NoiseMapCache::MapKey::MapKey(Noise *noise, float x, float y, u64 persist_id)
+{
+	const NoiseParams &np = noise->np;
+	float floats[9] = {
+		np.offset, np.scale, np.spread.X, np.spread.Y, np.spread.Z,
+		np.persist, np.lacunarity, x, y
+	};
+	memcpy(v, floats, sizeof(floats));
+	v[9]  = np.seed;
+	v[10] = np.octaves;
+	v[11] = np.flags;
+	v[12] = noise->seed;
+	v[13] = noise->sx;
+	v[14] = noise->sy;
+	v[15] = persist_id & U32_MAX;
+	v[16] = persist_id >> 32;
+}
+
+
+bool NoiseMapCache::MapKey::operator<(const MapKey &other) const
+{
+	return memcmp(v, other.v, sizeof(v)) < 0;
+}
+
+
+u64 NoiseMapCache::getMapId(Noise *noise, float x, float y, u64 persist_id)
+{
+	MapKey key(noise, x, y, persist_id);
+
+	// 64 bit FNV-1a over the key
+	u64 hash = 14695981039346656037ULL;
+	const u8 *bytes = (const u8 *)key.v;
+	for (size_t i = 0; i != sizeof(key.v); i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	// 0 means "no persistence map"
+	return hash ? hash : 1;
+}
+
+
+float *NoiseMapCache::perlinMap2D(Noise *noise, float x, float y,
+	float *persistence_map, u64 persist_id)
+{
+	if (m_max_maps == 0 || (persistence_map && !persist_id))
+		return noise->perlinMap2D(x, y, persistence_map);
+
+	MapKey key(noise, x, y, persist_id);
+	u32 count = noise->sx * noise->sy;
+
+	{
+		MutexAutoLock lock(m_mutex);
+		std::map<MapKey, CachedMap>::iterator it = m_maps.find(key);
+		if (it != m_maps.end()) {
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lru_pos);
+			memcpy(noise->result, it->second.values, count * sizeof(float));
+			return noise->result;
+		}
+	}
+
+	// Calculated outside of the lock so that the other emerge threads
+	// aren't held up by it
+	noise->perlinMap2D(x, y, persistence_map);
+	insert(key, noise->result, count);
+
+	return noise->result;
+}
+
+
+void NoiseMapCache::insert(const MapKey &key, const float *values, u32 count)
+{
+	MutexAutoLock lock(m_mutex);
+
+	// Another thread may have calculated the same map meanwhile
+	if (m_maps.find(key) != m_maps.end())
+		return;
+
+	if (m_maps.size() >= m_max_maps) {
+		std::map<MapKey, CachedMap>::iterator oldest = m_maps.find(m_lru.back());
+		delete[] oldest->second.values;
+		m_maps.erase(oldest);
+		m_lru.pop_back();
+	}
+
+	m_lru.push_front(key);
+
+	CachedMap &cached = m_maps[key];
+	cached.values  = new float[count];
+	memcpy(cached.values, values, count * sizeof(float));
+	cached.lru_pos = m_lru.begin();
+}
+
+
+u32 NoiseMapCache::size()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_maps.size();
+}
+
+
 ////
 //// MapgenParams
 ////
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include "util/string.h"
 #include "util/container.h"
+#include "threading/mutex.h"
 
 #define DEFAULT_MAPGEN "v6"
 
@@ -102,6 +103,52 @@ class GenerateNotifier {
 	std::list<GenNotifyEvent> m_notify_events;
 };
 
+/*
+	2D noise maps of recently generated chunk columns, shared by the mapgens
+	of all emerge threads.  The chunks of a column have the same 2D noise, so
+	with it, a column's maps are calculated only once instead of once per chunk.
+*/
+class NoiseMapCache {
+public:
+	NoiseMapCache(u32 max_maps);
+	~NoiseMapCache();
+
+	// Fills noise->result like noise->perlinMap2D(x, y, persistence_map).
+	// A map made with a persistence map is only cached if persist_id tells
+	// which one it was (see getMapId()), otherwise it is always calculated.
+	float *perlinMap2D(Noise *noise, float x, float y,
+		float *persistence_map=NULL, u64 persist_id=0);
+
+	// Identifies the map noise->perlinMap2D(x, y) would calculate
+	static u64 getMapId(Noise *noise, float x, float y, u64 persist_id=0);
+
+	u32 size();
+
+private:
+	// Everything the values of a map depend on, floats stored by their bits
+	struct MapKey {
+		u32 v[17];
+
+		MapKey(Noise *noise, float x, float y, u64 persist_id);
+		bool operator<(const MapKey &other) const;
+	};
+
+	struct CachedMap {
+		float *values;
+		std::list<MapKey>::iterator lru_pos;
+	};
+
+	void insert(const MapKey &key, const float *values, u32 count);
+
+	u32 m_max_maps;
+	std::map<MapKey, CachedMap> m_maps;
+	// Least recently used map at the back
+	std::list<MapKey> m_lru;
+	Mutex m_mutex;
+
+	DISABLE_CLASS_COPY(NoiseMapCache);
+};
+
 struct MapgenSpecificParams {
 	virtual void readParams(const Settings *settings) = 0;
 	virtual void writeParams(Settings *settings) const = 0;
@@ -158,6 +205,7 @@ class Mapgen {
 	v3s16 csize;
 
 	GenerateNotifier gennotify;
+	NoiseMapCache *noisecache;
 
 	Mapgen();
 	Mapgen(int mapgenid, MapgenParams *params, EmergeManager *emerge);
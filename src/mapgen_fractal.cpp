@@ -343,18 +343,18 @@ void MapgenFractal::calculateNoise()
 	int y = node_min.Y - 1;
 	int z = node_min.Z;
 
-	noise_seabed->perlinMap2D(x, z);
-	noise_filler_depth->perlinMap2D(x, z);
+	noisecache->perlinMap2D(noise_seabed, x, z);
+	noisecache->perlinMap2D(noise_filler_depth, x, z);
 
 	if (flags & MG_CAVES) {
 		noise_cave1->perlinMap3D(x, y, z);
 		noise_cave2->perlinMap3D(x, y, z);
 	}
 
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
-	noise_heat_blend->perlinMap2D(x, z);
-	noise_humidity_blend->perlinMap2D(x, z);
+	noisecache->perlinMap2D(noise_heat, x, z);
+	noisecache->perlinMap2D(noise_humidity, x, z);
+	noisecache->perlinMap2D(noise_heat_blend, x, z);
+	noisecache->perlinMap2D(noise_humidity_blend, x, z);
 
 	for (s32 i = 0; i < csize.X * csize.Z; i++) {
 		noise_heat->result[i] += noise_heat_blend->result[i];
@@ -327,8 +327,8 @@ void MapgenV5::calculateNoise()
 	int y = node_min.Y - 1;
 	int z = node_min.Z;
 
-	noise_factor->perlinMap2D(x, z);
-	noise_height->perlinMap2D(x, z);
+	noisecache->perlinMap2D(noise_factor, x, z);
+	noisecache->perlinMap2D(noise_height, x, z);
 	noise_ground->perlinMap3D(x, y, z);
 
 	if (flags & MG_CAVES) {
@@ -336,11 +336,11 @@ void MapgenV5::calculateNoise()
 		noise_cave2->perlinMap3D(x, y, z);
 	}
 
-	noise_filler_depth->perlinMap2D(x, z);
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
-	noise_heat_blend->perlinMap2D(x, z);
-	noise_humidity_blend->perlinMap2D(x, z);
+	noisecache->perlinMap2D(noise_filler_depth, x, z);
+	noisecache->perlinMap2D(noise_heat, x, z);
+	noisecache->perlinMap2D(noise_humidity, x, z);
+	noisecache->perlinMap2D(noise_heat_blend, x, z);
+	noisecache->perlinMap2D(noise_humidity_blend, x, z);
 
 	for (s32 i = 0; i < csize.X * csize.Z; i++) {
 		noise_heat->result[i] += noise_heat_blend->result[i];
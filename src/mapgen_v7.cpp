@@ -348,12 +348,14 @@ void MapgenV7::calculateNoise()
 	int y = node_min.Y - 1;
 	int z = node_min.Z;
 
-	noise_terrain_persist->perlinMap2D(x, z);
+	// 2D noise is shared with the other chunks of the column through the cache
+	noisecache->perlinMap2D(noise_terrain_persist, x, z);
 	float *persistmap = noise_terrain_persist->result;
+	u64 persist_id = NoiseMapCache::getMapId(noise_terrain_persist, x, z);
 
-	noise_terrain_base->perlinMap2D(x, z, persistmap);
-	noise_terrain_alt->perlinMap2D(x, z, persistmap);
-	noise_height_select->perlinMap2D(x, z);
+	noisecache->perlinMap2D(noise_terrain_base, x, z, persistmap, persist_id);
+	noisecache->perlinMap2D(noise_terrain_alt, x, z, persistmap, persist_id);
+	noisecache->perlinMap2D(noise_height_select, x, z);
 
 	if (flags & MG_CAVES) {
 		noise_cave1->perlinMap3D(x, y, z);
@@ -362,16 +364,16 @@ void MapgenV7::calculateNoise()
 
 	if ((spflags & MGV7_RIDGES) && node_max.Y >= water_level) {
 		noise_ridge->perlinMap3D(x, y, z);
-		noise_ridge_uwater->perlinMap2D(x, z);
+		noisecache->perlinMap2D(noise_ridge_uwater, x, z);
 	}
 
 	// Mountain noises are calculated in generateMountainTerrain()
 
-	noise_filler_depth->perlinMap2D(x, z);
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
-	noise_heat_blend->perlinMap2D(x, z);
-	noise_humidity_blend->perlinMap2D(x, z);
+	noisecache->perlinMap2D(noise_filler_depth, x, z);
+	noisecache->perlinMap2D(noise_heat, x, z);
+	noisecache->perlinMap2D(noise_humidity, x, z);
+	noisecache->perlinMap2D(noise_heat_blend, x, z);
+	noisecache->perlinMap2D(noise_humidity_blend, x, z);
 
 	for (s32 i = 0; i < csize.X * csize.Z; i++) {
 		noise_heat->result[i] += noise_heat_blend->result[i];
@@ -548,7 +550,7 @@ void MapgenV7::generateBaseTerrain(s16 *stone_surface_min_y, s16 *stone_surface_
 int MapgenV7::generateMountainTerrain(s16 ymax)
 {
 	noise_mountain->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
-	noise_mount_height->perlinMap2D(node_min.X, node_min.Z);
+	noisecache->perlinMap2D(noise_mount_height, node_min.X, node_min.Z);
 
 	MapNode n_stone(c_stone);
 	u32 j = 0;
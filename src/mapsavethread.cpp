@@ -0,0 +1,240 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapsavethread.h"
+#include "database.h"
+#include "debug.h"
+#include "log.h"
+#include "threading/mutex_auto_lock.h"
+
+
+MapSaveThread::MapSaveThread(Database *db, u32 queue_limit, u32 batch_size) :
+	Thread("MapSave"),
+	m_db(db),
+	m_queue_limit(queue_limit),
+	m_batch_size(batch_size),
+	m_failed_batches(0),
+	m_write_failing(false)
+{
+	if (m_batch_size < 1)
+		m_batch_size = 1;
+	if (m_queue_limit < m_batch_size)
+		m_queue_limit = m_batch_size;
+}
+
+
+MapSaveThread::~MapSaveThread()
+{
+	if (isRunning()) {
+		stop();
+		wait();
+	}
+
+	// Thread was never started or died, don't lose any blocks
+	while (writeBatch());
+
+	if (!m_queue.empty()) {
+		errorstream << "MapSaveThread: " << m_queue.size()
+			<< " blocks could not be written to the database" << std::endl;
+	}
+}
+
+
+void MapSaveThread::stop()
+{
+	Thread::stop();
+
+	// Wake up the thread so that it notices
+	m_queue_sem.post();
+}
+
+
+void MapSaveThread::queueBlock(const v3s16 &pos, const std::string &data)
+{
+	for (;;) {
+		{
+			MutexAutoLock lock(m_queue_mutex);
+
+			std::map<v3s16, std::string>::iterator it = m_queue.find(pos);
+			if (it != m_queue.end()) {
+				// Overwriting a queued copy doesn't grow the queue
+				it->second = data;
+				return;
+			}
+
+			// Blocking the server on a failing database helps nobody;
+			// the blocks are kept until it works again
+			if (m_queue.size() < m_queue_limit || m_write_failing) {
+				m_queue[pos] = data;
+				if (m_queue.size() % m_batch_size == 0)
+					m_queue_sem.post();
+				return;
+			}
+		}
+
+		// Queue is full, let the writer catch up
+		if (isRunning()) {
+			m_queue_sem.post();
+			waitBatchDone();
+		} else {
+			writeBatch();
+		}
+	}
+}
+
+
+bool MapSaveThread::getQueuedBlock(const v3s16 &pos, std::string *data)
+{
+	MutexAutoLock lock(m_queue_mutex);
+
+	std::map<v3s16, std::string>::const_iterator it = m_queue.find(pos);
+	if (it == m_queue.end()) {
+		it = m_writing.find(pos);
+		if (it == m_writing.end())
+			return false;
+	}
+
+	*data = it->second;
+	return true;
+}
+
+
+void MapSaveThread::dequeueBlock(const v3s16 &pos)
+{
+	MutexAutoLock lock(m_queue_mutex);
+	m_queue.erase(pos);
+}
+
+
+void MapSaveThread::commit()
+{
+	m_queue_sem.post();
+}
+
+
+void MapSaveThread::flush()
+{
+	if (!isRunning()) {
+		while (writeBatch());
+		return;
+	}
+
+	u32 failed_batches;
+	{
+		MutexAutoLock lock(m_queue_mutex);
+		failed_batches = m_failed_batches;
+	}
+
+	for (;;) {
+		{
+			MutexAutoLock lock(m_queue_mutex);
+			if (m_queue.empty() && m_writing.empty())
+				return;
+			if (m_failed_batches != failed_batches)
+				return;
+		}
+
+		m_queue_sem.post();
+		waitBatchDone();
+	}
+}
+
+
+u32 MapSaveThread::getQueueSize()
+{
+	MutexAutoLock lock(m_queue_mutex);
+	return m_queue.size() + m_writing.size();
+}
+
+
+void MapSaveThread::waitBatchDone()
+{
+	// Time out now and then; several threads may be waiting for
+	// the same batch and only one of them gets woken up.
+	m_done_sem.wait(100);
+}
+
+
+bool MapSaveThread::writeBatch()
+{
+	// Holding this throughout means that a block dequeued by whoever
+	// holds it next is neither being written nor queued again.
+	MutexAutoLock dblock(m_db_mutex);
+
+	{
+		MutexAutoLock lock(m_queue_mutex);
+
+		if (m_queue.empty())
+			return false;
+
+		if (m_queue.size() <= m_batch_size) {
+			m_writing.swap(m_queue);
+		} else {
+			std::map<v3s16, std::string>::iterator end = m_queue.begin();
+			for (u32 i = 0; i != m_batch_size; i++)
+				++end;
+			m_writing.insert(m_queue.begin(), end);
+			m_queue.erase(m_queue.begin(), end);
+		}
+	}
+
+	// m_writing is only modified by us with m_queue_mutex held, so it can be
+	// read without the lock while getQueuedBlock() looks things up in it.
+	bool success = m_db->saveBlocks(m_writing);
+
+	if (!success) {
+		errorstream << "MapSaveThread: Failed to write some of "
+			<< m_writing.size() << " blocks to the database, "
+			"will try again" << std::endl;
+	}
+
+	{
+		MutexAutoLock lock(m_queue_mutex);
+		// Newer copies queued meanwhile are kept
+		if (!success) {
+			m_queue.insert(m_writing.begin(), m_writing.end());
+			m_failed_batches++;
+		}
+		m_write_failing = !success;
+		m_writing.clear();
+	}
+
+	m_done_sem.post();
+	return success;
+}
+
+
+void *MapSaveThread::run()
+{
+	DSTACK(FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while (!stopRequested()) {
+		m_queue_sem.wait();
+
+		while (writeBatch());
+	}
+
+	// Write out whatever was queued after the last wakeup
+	while (writeBatch());
+
+	END_DEBUG_EXCEPTION_HANDLER
+
+	return NULL;
+}
@@ -0,0 +1,103 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPSAVETHREAD_HEADER
+#define MAPSAVETHREAD_HEADER
+
+#include "irr_v3d.h"
+#include "threading/thread.h"
+#include "threading/mutex.h"
+#include "threading/semaphore.h"
+#include <map>
+#include <string>
+
+class Database;
+
+/*
+	Writes serialized MapBlocks to the map database in the background.
+
+	The server thread only serializes blocks and queues them here; the
+	thread writes them out in large batches through Database::saveBlocks()
+	whenever a batch is full or commit() is called. queueBlock() blocks
+	only when the queue is full.
+
+	Everything else accessing the database must hold getDatabaseMutex(),
+	and should look in the queue first as it holds the newest copies.
+
+	A batch that fails to be written is queued again. While writes fail,
+	queueBlock() lets the queue grow beyond its limit instead of blocking.
+*/
+class MapSaveThread : public Thread
+{
+public:
+	MapSaveThread(Database *db, u32 queue_limit, u32 batch_size);
+	~MapSaveThread();
+
+	void stop();
+
+	// Queues a serialized block for writing, replacing any older
+	// copy still waiting. Blocks while the queue is full.
+	void queueBlock(const v3s16 &pos, const std::string &data);
+	// Gets a block that is queued or being written.
+	// Returns false if there is none.
+	bool getQueuedBlock(const v3s16 &pos, std::string *data);
+	// Drops a queued block, eg. because it is going to be deleted.
+	// getDatabaseMutex() must be held, so that no write of the block
+	// is in progress.
+	void dequeueBlock(const v3s16 &pos);
+	// Starts writing everything queued so far without waiting for it
+	void commit();
+	// Waits until all blocks queued so far have been written, or until
+	// writing fails
+	void flush();
+
+	u32 getQueueSize();
+
+	Mutex &getDatabaseMutex() { return m_db_mutex; }
+
+protected:
+	void *run();
+
+private:
+	// Returns false if there was nothing to write or writing failed
+	bool writeBatch();
+	// Waits for the next batch to finish; m_queue_mutex must not be held
+	void waitBatchDone();
+
+	Database *m_db;
+	u32 m_queue_limit;
+	u32 m_batch_size;
+
+	// Protects m_queue, m_writing and m_failed_batches
+	Mutex m_queue_mutex;
+	// Held by writeBatch() from taking a batch until it is written
+	Mutex m_db_mutex;
+
+	std::map<v3s16, std::string> m_queue;
+	// Batch currently being written; kept for getQueuedBlock()
+	std::map<v3s16, std::string> m_writing;
+	// Batches that failed to be written, and whether the last one did
+	u32 m_failed_batches;
+	bool m_write_failing;
+
+	Semaphore m_queue_sem;
+	Semaphore m_done_sem;
+};
+
+#endif
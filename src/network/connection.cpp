@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <iomanip>
+#include <cmath>
 #include <errno.h>
 #include "connection.h"
 #include "serialization.h"
@@ -67,10 +68,32 @@ static inline float CALC_DTIME(unsigned int lasttime, unsigned int curtime) {
  /* starting value for window size */
 #define MIN_RELIABLE_WINDOW_SIZE 0x40
 
+/* CUBIC window growth constant (packets/s^3) and multiplicative decrease */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+/* credit for sending paced packets in a burst, in packets and in seconds */
+#define PACING_MIN_BURST 4
+#define PACING_MAX_BURST_TIME 0.01
+
+/* bytes of credit a send class gets per round and weight */
+#define SEND_SCHEDULER_QUANTUM 1024
+/* send budget that can be saved up for a burst, in seconds */
+#define SEND_BUDGET_MAX_BURST_TIME 0.1
+
 #define MAX_UDP_PEERS 65535
 
 #define PING_TIMEOUT 5.0
 
+// Most packets put on or taken from the wire with one system call
+#define CONNECTION_SEND_BATCH 64
+#define CONNECTION_RECEIVE_BATCH 32
+
+// use IPv6 minimum allowed MTU as receive buffer size as this is
+// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
+// infrastructure
+#define CONNECTION_RECEIVE_SIZE 1500
+
 static u16 readPeerId(u8 *packetdata)
 {
 	return readU16(&packetdata[4]);
@@ -83,47 +106,39 @@ static u8 readChannel(u8 *packetdata)
 BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 		u32 protocol_id, u16 sender_peer_id, u8 channel)
 {
-	u32 packet_size = datasize + BASE_HEADER_SIZE;
-	BufferedPacket p(packet_size);
+	return makePacket(address, PacketBuffer(data, datasize),
+			protocol_id, sender_peer_id, channel);
+}
+
+BufferedPacket makePacket(Address &address, const PacketBuffer &data,
+		u32 protocol_id, u16 sender_peer_id, u8 channel)
+{
+	BufferedPacket p(data.prepend(BASE_HEADER_SIZE));
 	p.address = address;
 
 	writeU32(&p.data[0], protocol_id);
 	writeU16(&p.data[4], sender_peer_id);
 	writeU8(&p.data[6], channel);
 
-	memcpy(&p.data[BASE_HEADER_SIZE], data, datasize);
-
 	return p;
 }
 
-BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
-		u32 protocol_id, u16 sender_peer_id, u8 channel)
-{
-	return makePacket(address, *data, data.getSize(),
-			protocol_id, sender_peer_id, channel);
-}
-
-SharedBuffer<u8> makeOriginalPacket(
-		SharedBuffer<u8> data)
+PacketBuffer makeOriginalPacket(
+		PacketBuffer data)
 {
-	u32 header_size = 1;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	PacketBuffer b = data.prepend(ORIGINAL_HEADER_SIZE);
 
 	writeU8(&(b[0]), TYPE_ORIGINAL);
-	if (data.getSize() > 0) {
-		memcpy(&(b[header_size]), *data, data.getSize());
-	}
 	return b;
 }
 
-std::list<SharedBuffer<u8> > makeSplitPacket(
-		SharedBuffer<u8> data,
+std::list<PacketBuffer> makeSplitPacket(
+		PacketBuffer data,
 		u32 chunksize_max,
 		u16 seqnum)
 {
 	// Chunk packets, containing the TYPE_SPLIT header
-	std::list<SharedBuffer<u8> > chunks;
+	std::list<PacketBuffer> chunks;
 
 	u32 chunk_header_size = 7;
 	u32 maximum_data_size = chunksize_max - chunk_header_size;
@@ -137,15 +152,14 @@ std::list<SharedBuffer<u8> > makeSplitPacket(
 			end = data.getSize() - 1;
 
 		u32 payload_size = end - start + 1;
-		u32 packet_size = chunk_header_size + payload_size;
 
-		SharedBuffer<u8> chunk(packet_size);
+		PacketBuffer chunk = data.view(start, payload_size)
+				.prepend(chunk_header_size);
 
 		writeU8(&chunk[0], TYPE_SPLIT);
 		writeU16(&chunk[1], seqnum);
 		// [3] u16 chunk_count is written at next stage
 		writeU16(&chunk[5], chunk_num);
-		memcpy(&chunk[chunk_header_size], &data[start], payload_size);
 
 		chunks.push_back(chunk);
 		chunk_count++;
@@ -155,7 +169,7 @@ std::list<SharedBuffer<u8> > makeSplitPacket(
 	}
 	while(end != data.getSize() - 1);
 
-	for(std::list<SharedBuffer<u8> >::iterator i = chunks.begin();
+	for(std::list<PacketBuffer>::iterator i = chunks.begin();
 		i != chunks.end(); ++i)
 	{
 		// Write chunk_count
@@ -165,13 +179,13 @@ std::list<SharedBuffer<u8> > makeSplitPacket(
 	return chunks;
 }
 
-std::list<SharedBuffer<u8> > makeAutoSplitPacket(
-		SharedBuffer<u8> data,
+std::list<PacketBuffer> makeAutoSplitPacket(
+		PacketBuffer data,
 		u32 chunksize_max,
 		u16 &split_seqnum)
 {
 	u32 original_header_size = 1;
-	std::list<SharedBuffer<u8> > list;
+	std::list<PacketBuffer> list;
 	if (data.getSize() + original_header_size > chunksize_max)
 	{
 		list = makeSplitPacket(data, chunksize_max, split_seqnum);
@@ -185,19 +199,15 @@ std::list<SharedBuffer<u8> > makeAutoSplitPacket(
 	return list;
 }
 
-SharedBuffer<u8> makeReliablePacket(
-		SharedBuffer<u8> data,
+PacketBuffer makeReliablePacket(
+		PacketBuffer data,
 		u16 seqnum)
 {
-	u32 header_size = 3;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	PacketBuffer b = data.prepend(RELIABLE_HEADER_SIZE);
 
 	writeU8(&b[0], TYPE_RELIABLE);
 	writeU16(&b[1], seqnum);
 
-	memcpy(&b[header_size], *data, data.getSize());
-
 	return b;
 }
 
@@ -205,109 +215,129 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
-ReliablePacketBuffer::ReliablePacketBuffer(): m_list_size(0) {}
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_slots(MIN_RELIABLE_WINDOW_SIZE),
+	m_size(0),
+	m_oldest_non_answered_ack(0),
+	m_newest(0),
+	m_time(0.0),
+	m_loss_scan_next(0)
+{
+}
 
 void ReliablePacketBuffer::print()
 {
 	MutexAutoLock listlock(m_list_mutex);
 	LOG(dout_con<<"Dump of ReliablePacketBuffer:" << std::endl);
+	if (m_size == 0)
+		return;
 	unsigned int index = 0;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		LOG(dout_con<<index<< ":" << s << std::endl);
-		index++;
+	for (u16 s = m_oldest_non_answered_ack; ; s++) {
+		if (getSlot(s).used) {
+			LOG(dout_con<<index<< ":" << s << std::endl);
+			index++;
+		}
+		if (s == m_newest)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
 	MutexAutoLock listlock(m_list_mutex);
-	return m_list.empty();
+	return m_size == 0;
 }
 
 u32 ReliablePacketBuffer::size()
 {
-	return m_list_size;
+	return m_size;
 }
 
 bool ReliablePacketBuffer::containsPacket(u16 seqnum)
 {
-	return !(findPacket(seqnum) == m_list.end());
+	MutexAutoLock listlock(m_list_mutex);
+	return findSlot(seqnum) != NULL;
+}
+
+ReliablePacketBuffer::Slot *ReliablePacketBuffer::findSlot(u16 seqnum)
+{
+	Slot &slot = getSlot(seqnum);
+	if (!slot.used || slot.seqnum != seqnum)
+		return NULL;
+	return &slot;
 }
 
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+BufferedPacket ReliablePacketBuffer::takePacket(Slot &slot)
 {
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if (s == seqnum)
-			break;
+	BufferedPacket p = slot.packet;
+	p.time = m_time - slot.send_time;
+	p.totaltime = m_time - slot.insert_time;
+
+	u16 seqnum = slot.seqnum;
+	slot = Slot();
+	--m_size;
+
+	if (m_size == 0) {
+		m_oldest_non_answered_ack = 0;
+		m_newest = 0;
+		m_resends.clear();
+		m_losses.clear();
+		return p;
+	}
+
+	// Every seqnum in the buffer is within the ring, so the next used
+	// slot in either direction holds the next packet
+	if (seqnum == m_oldest_non_answered_ack) {
+		do {
+			m_oldest_non_answered_ack++;
+		} while (!getSlot(m_oldest_non_answered_ack).used);
+	} else if (seqnum == m_newest) {
+		do {
+			m_newest--;
+		} while (!getSlot(m_newest).used);
 	}
-	return i;
+	return p;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+
+void ReliablePacketBuffer::grow(u32 span)
 {
-	return m_list.end();
+	u32 capacity = m_slots.size();
+	while (capacity < span)
+		capacity *= 2;
+
+	std::vector<Slot> slots(capacity);
+	for (size_t i = 0; i < m_slots.size(); i++) {
+		if (m_slots[i].used)
+			slots[m_slots[i].seqnum & (capacity - 1)] = m_slots[i];
+	}
+	m_slots.swap(slots);
 }
+
 bool ReliablePacketBuffer::getFirstSeqnum(u16& result)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	if (m_size == 0)
 		return false;
-	BufferedPacket p = *m_list.begin();
-	result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	result = m_oldest_non_answered_ack;
 	return true;
 }
 
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	if (m_size == 0)
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
-
-	if (m_list_size == 0) {
-		m_oldest_non_answered_ack = 0;
-	} else {
-		m_oldest_non_answered_ack =
-				readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
-	}
-	return p;
+	return takePacket(getSlot(m_oldest_non_answered_ack));
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	RPBSearchResult r = findPacket(seqnum);
-	if (r == notFound()) {
+	Slot *slot = findSlot(seqnum);
+	if (slot == NULL) {
 		LOG(dout_con<<"Sequence number: " << seqnum
 				<< " not found in reliable buffer"<<std::endl);
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-
-
-	RPBSearchResult next = r;
-	++next;
-	if (next != notFound()) {
-		u16 s = readU16(&(next->data[BASE_HEADER_SIZE+1]));
-		m_oldest_non_answered_ack = s;
-	}
-
-	m_list.erase(r);
-	--m_list_size;
-
-	if (m_list_size == 0)
-	{ m_oldest_non_answered_ack = 0; }
-	else
-	{ m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);	}
-	return p;
+	return takePacket(*slot);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 {
@@ -336,48 +366,28 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 		return;
 	}
 
-	++m_list_size;
-	sanity_check(m_list_size <= SEQNUM_MAX+1);	// FIXME: Handle the error?
-
-	// Find the right place for the packet and insert it there
-	// If list is empty, just add it
-	if (m_list.empty())
-	{
-		m_list.push_back(p);
+	if (m_size == 0) {
 		m_oldest_non_answered_ack = seqnum;
-		// Done.
-		return;
-	}
-
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
+		m_newest = seqnum;
+	} else {
+		// Order the seqnums from next_expected, this handles wrap around
+		u16 offset = seqnum - next_expected;
+		if (offset < (u16)(m_oldest_non_answered_ack - next_expected))
+			m_oldest_non_answered_ack = seqnum;
+		if (offset > (u16)(m_newest - next_expected))
+			m_newest = seqnum;
 
-	/* case seqnum is smaller then next_expected seqnum */
-	/* this is true e.g. on wrap around */
-	if (seqnum < next_expected) {
-		while(((s < seqnum) || (s >= next_expected)) && (i != m_list.end())) {
-			++i;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-	/* non wrap around case (at least for incoming and next_expected */
-	else
-	{
-		while(((s < seqnum) && (s >= next_expected)) && (i != m_list.end())) {
-			++i;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
+		u32 span = (u16)(m_newest - m_oldest_non_answered_ack) + 1;
+		if (span > m_slots.size())
+			grow(span);
 	}
 
-	if (s == seqnum) {
+	Slot &slot = getSlot(seqnum);
+	if (slot.used) {
+		sanity_check(slot.seqnum == seqnum);
 		if (
-			(readU16(&(i->data[BASE_HEADER_SIZE+1])) != seqnum) ||
-			(i->data.getSize() != p.data.getSize()) ||
-			(i->address != p.address)
+			(slot.packet.data.getSize() != p.data.getSize()) ||
+			(slot.packet.address != p.address)
 			)
 		{
 			/* if this happens your maximum transfer window may be to big */
@@ -385,8 +395,8 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 					"Duplicated seqnum %d non matching packet detected:\n",
 					seqnum);
 			fprintf(stderr, "Old: seqnum: %05d size: %04d, address: %s\n",
-					readU16(&(i->data[BASE_HEADER_SIZE+1])),i->data.getSize(),
-					i->address.serializeString().c_str());
+					slot.seqnum, slot.packet.data.getSize(),
+					slot.packet.address.serializeString().c_str());
 			fprintf(stderr, "New: seqnum: %05d size: %04u, address: %s\n",
 					readU16(&(p.data[BASE_HEADER_SIZE+1])),p.data.getSize(),
 					p.address.serializeString().c_str());
@@ -395,29 +405,35 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 
 		/* nothing to do this seems to be a resent packet */
 		/* for paranoia reason data should be compared */
-		--m_list_size;
-	}
-	/* insert or push back */
-	else if (i != m_list.end()) {
-		m_list.insert(i, p);
-	}
-	else {
-		m_list.push_back(p);
+		return;
 	}
 
-	/* update last packet number */
-	m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
+	slot.packet = p;
+	slot.seqnum = seqnum;
+	slot.used = true;
+	slot.insert_time = m_time - p.totaltime;
+	slot.send_time = m_time - p.time;
+	m_resends.push_back(ResendEntry(seqnum, slot.send_time));
+	++m_size;
+
+	// Buffers that are never asked for timed out packets only collect
+	// stale entries, drop them once there are many
+	if (m_resends.size() > 2 * m_slots.size()) {
+		std::deque<ResendEntry> resends;
+		for (size_t i = 0; i < m_resends.size(); i++) {
+			Slot *resend_slot = findSlot(m_resends[i].seqnum);
+			if (resend_slot != NULL &&
+					resend_slot->send_time == m_resends[i].send_time)
+				resends.push_back(m_resends[i]);
+		}
+		m_resends.swap(resends);
+	}
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
-	{
-		i->time += dtime;
-		i->totaltime += dtime;
-	}
+	m_time += dtime;
 }
 
 std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
@@ -425,21 +441,87 @@ std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
 {
 	MutexAutoLock listlock(m_list_mutex);
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
-	{
-		if (i->time >= timeout) {
-			timed_outs.push_back(*i);
+	while (!m_resends.empty()) {
+		ResendEntry entry = m_resends.front();
+		Slot *slot = findSlot(entry.seqnum);
 
-			//this packet will be sent right afterwards reset timeout here
-			i->time = 0.0;
-			if (timed_outs.size() >= max_packets)
-				break;
+		// Skip packets that have been acked or sent again since
+		if (slot == NULL || slot->send_time != entry.send_time) {
+			m_resends.pop_front();
+			continue;
 		}
+
+		if (m_time - entry.send_time < timeout)
+			break;
+
+		m_resends.pop_front();
+		timed_outs.push_back(resendPacket(*slot));
+
+		if (timed_outs.size() >= max_packets)
+			break;
 	}
 	return timed_outs;
 }
 
+unsigned int ReliablePacketBuffer::markLosses(u16 acked_seqnum)
+{
+	MutexAutoLock listlock(m_list_mutex);
+	if (m_size == 0)
+		return 0;
+
+	// Offsets from the oldest packet, a stale seqnum ends up far outside
+	// the window
+	u16 acked = acked_seqnum - m_oldest_non_answered_ack;
+	if (acked >= MAX_RELIABLE_WINDOW_SIZE)
+		return 0;
+	u16 scan = m_loss_scan_next - m_oldest_non_answered_ack;
+	if (scan >= MAX_RELIABLE_WINDOW_SIZE)
+		scan = 0;
+
+	unsigned int count = 0;
+	for (; scan + FAST_RETRANSMIT_THRESHOLD <= acked; scan++) {
+		Slot *slot = findSlot(m_oldest_non_answered_ack + scan);
+		if (slot != NULL && slot->packet.resend_count == 0) {
+			m_losses.push_back(ResendEntry(slot->seqnum, slot->send_time));
+			count++;
+		}
+	}
+	m_loss_scan_next = m_oldest_non_answered_ack + scan;
+	return count;
+}
+
+std::list<BufferedPacket> ReliablePacketBuffer::getLosses(
+		unsigned int max_packets)
+{
+	MutexAutoLock listlock(m_list_mutex);
+	std::list<BufferedPacket> losses;
+	while (!m_losses.empty() && losses.size() < max_packets) {
+		ResendEntry entry = m_losses.front();
+		m_losses.pop_front();
+		Slot *slot = findSlot(entry.seqnum);
+
+		// Skip packets that have been acked or sent again since
+		if (slot == NULL || slot->send_time != entry.send_time)
+			continue;
+
+		losses.push_back(resendPacket(*slot));
+	}
+	return losses;
+}
+
+BufferedPacket ReliablePacketBuffer::resendPacket(Slot &slot)
+{
+	slot.packet.resend_count++;
+	BufferedPacket p = slot.packet;
+	p.time = m_time - slot.send_time;
+	p.totaltime = m_time - slot.insert_time;
+
+	//this packet will be sent right afterwards reset timeout here
+	slot.send_time = m_time;
+	m_resends.push_back(ResendEntry(slot.seqnum, m_time));
+	return p;
+}
+
 /*
 	IncomingSplitBuffer
 */
@@ -457,13 +539,13 @@ IncomingSplitBuffer::~IncomingSplitBuffer()
 	This will throw a GotSplitPacketException when a full
 	split packet is constructed.
 */
-SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
+PacketBuffer IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 {
 	MutexAutoLock listlock(m_map_mutex);
 	u32 headersize = BASE_HEADER_SIZE + 7;
 	if (p.data.getSize() < headersize) {
 		errorstream << "Invalid data size for split packet" << std::endl;
-		return SharedBuffer<u8>();
+		return PacketBuffer();
 	}
 	u8 type = readU8(&p.data[BASE_HEADER_SIZE+0]);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
@@ -473,15 +555,14 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	if (type != TYPE_SPLIT) {
 		errorstream << "IncomingSplitBuffer::insert(): type is not split"
 			<< std::endl;
-		return SharedBuffer<u8>();
+		return PacketBuffer();
 	}
 
 	// Add if doesn't exist
 	if (m_buf.find(seqnum) == m_buf.end())
 	{
-		IncomingSplitPacket *sp = new IncomingSplitPacket();
-		sp->chunk_count = chunk_count;
-		sp->reliable = reliable;
+		IncomingSplitPacket *sp = new IncomingSplitPacket(chunk_count,
+				reliable);
 		m_buf[seqnum] = sp;
 	}
 
@@ -497,43 +578,42 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 				<<" != sp->reliable="<<sp->reliable
 				<<std::endl);
 
+	u32 chunkdatasize = p.data.getSize() - headersize;
+	if (chunk_num >= sp->chunk_count || chunkdatasize == 0) {
+		errorstream << "IncomingSplitBuffer::insert(): invalid chunk"
+			<< std::endl;
+		return PacketBuffer();
+	}
+
 	// If chunk already exists, ignore it.
 	// Sometimes two identical packets may arrive when there is network
 	// lag and the server re-sends stuff.
-	if (sp->chunks.find(chunk_num) != sp->chunks.end())
-		return SharedBuffer<u8>();
-
-	// Cut chunk data out of packet
-	u32 chunkdatasize = p.data.getSize() - headersize;
-	SharedBuffer<u8> chunkdata(chunkdatasize);
-	memcpy(*chunkdata, &(p.data[headersize]), chunkdatasize);
+	if (sp->chunks[chunk_num].getSize() != 0)
+		return PacketBuffer();
 
-	// Set chunk data in buffer
-	sp->chunks[chunk_num] = chunkdata;
+	// Set chunk data in buffer, sharing the received packet
+	sp->chunks[chunk_num] = p.data.view(headersize, chunkdatasize);
+	sp->chunks_received++;
 
 	// If not all chunks are received, return empty buffer
 	if (sp->allReceived() == false)
-		return SharedBuffer<u8>();
+		return PacketBuffer();
 
 	// Calculate total size
 	u32 totalsize = 0;
-	for(std::map<u16, SharedBuffer<u8> >::iterator i = sp->chunks.begin();
-		i != sp->chunks.end(); ++i)
-	{
-		totalsize += i->second.getSize();
-	}
+	for(u32 chunk_i=0; chunk_i<sp->chunk_count; chunk_i++)
+		totalsize += sp->chunks[chunk_i].getSize();
 
-	SharedBuffer<u8> fulldata(totalsize);
+	PacketBuffer fulldata(totalsize);
 
 	// Copy chunks to data buffer
 	u32 start = 0;
 	for(u32 chunk_i=0; chunk_i<sp->chunk_count;
 			chunk_i++)
 	{
-		SharedBuffer<u8> buf = sp->chunks[chunk_i];
-		u16 chunkdatasize = buf.getSize();
-		memcpy(&fulldata[start], *buf, chunkdatasize);
-		start += chunkdatasize;;
+		const PacketBuffer &buf = sp->chunks[chunk_i];
+		memcpy(&fulldata[start], *buf, buf.getSize());
+		start += buf.getSize();
 	}
 
 	// Remove sp from buffer
@@ -569,12 +649,148 @@ void IncomingSplitBuffer::removeUnreliableTimedOuts(float dtime, float timeout)
 	}
 }
 
+/*
+	SendScheduler
+*/
+
+static const u32 send_class_weights[SEND_CLASS_COUNT] = {
+	8, // SEND_CLASS_CONTROL
+	4, // SEND_CLASS_OBJECTS
+	4, // SEND_CLASS_INTERFACE
+	2, // SEND_CLASS_BLOCKS
+	1, // SEND_CLASS_MEDIA
+};
+
+static const char *send_class_names[SEND_CLASS_COUNT] = {
+	"control",
+	"objects",
+	"interface",
+	"blocks",
+	"media",
+};
+
+SendScheduler::SendScheduler():
+	m_current(0),
+	m_credited(false),
+	m_size(0),
+	m_rate(0),
+	m_budget(0)
+{
+	for (u32 i = 0; i < SEND_CLASS_COUNT; i++)
+		m_deficits[i] = 0;
+	for (u32 i = 0; i < CHANNEL_COUNT; i++)
+		m_reliable_pushed[i] = m_reliable_taken[i] = 0;
+}
+
+void SendScheduler::push(const ConnectionCommand &c)
+{
+	assert(c.send_class < SEND_CLASS_COUNT); // Pre-condition
+	assert(c.channelnum < CHANNEL_COUNT); // Pre-condition
+	QueuedCommand q;
+	q.command = c;
+	q.reliable_seqnum = 0;
+	if (c.reliable)
+		q.reliable_seqnum = m_reliable_pushed[c.channelnum]++;
+	m_queues[c.send_class].push_back(q);
+	m_size++;
+}
+
+void SendScheduler::step(float dtime, u32 rate)
+{
+	m_rate = rate;
+	if (rate != 0)
+		m_budget = MYMIN(m_budget + dtime * rate,
+				rate * SEND_BUDGET_MAX_BURST_TIME);
+}
+
+bool SendScheduler::pop(const bool channel_ready[CHANNEL_COUNT],
+		ConnectionCommand &c)
+{
+	if (m_size == 0 || (m_rate != 0 && m_budget <= 0))
+		return false;
+
+	// A big packet may take several rounds of credit, give up only after
+	// going once through the classes without finding a ready one
+	bool any_ready = false;
+	u32 visited = 0;
+	for (;;) {
+		std::deque<QueuedCommand> &queue = m_queues[m_current];
+		if (queue.empty()) {
+			m_deficits[m_current] = 0;
+		} else if (isInOrder(queue.front()) &&
+				(!queue.front().command.reliable ||
+				channel_ready[queue.front().command.channelnum])) {
+			any_ready = true;
+			if (!m_credited) {
+				m_deficits[m_current] += send_class_weights[m_current] *
+						SEND_SCHEDULER_QUANTUM;
+				m_credited = true;
+			}
+			if (queue.front().command.data.getSize() <=
+					m_deficits[m_current]) {
+				take((SendClass)m_current, c);
+				return true;
+			}
+		}
+
+		m_current = (m_current + 1) % SEND_CLASS_COUNT;
+		m_credited = false;
+		if (++visited == SEND_CLASS_COUNT) {
+			if (!any_ready)
+				return false;
+			any_ready = false;
+			visited = 0;
+		}
+	}
+}
+
+bool SendScheduler::popAny(ConnectionCommand &c)
+{
+	// The oldest queued command is always in order, so this only
+	// fails when empty
+	for (u32 i = 0; i < SEND_CLASS_COUNT; i++) {
+		if (!m_queues[i].empty() && isInOrder(m_queues[i].front())) {
+			take((SendClass)i, c);
+			return true;
+		}
+	}
+	return false;
+}
+
+void SendScheduler::take(SendClass send_class, ConnectionCommand &c)
+{
+	std::deque<QueuedCommand> &queue = m_queues[send_class];
+	c = queue.front().command;
+	queue.pop_front();
+	m_size--;
+	if (c.reliable)
+		m_reliable_taken[c.channelnum]++;
+
+	u32 size = c.data.getSize();
+	m_deficits[send_class] -= MYMIN(size, m_deficits[send_class]);
+	if (queue.empty())
+		m_deficits[send_class] = 0;
+	if (m_rate != 0)
+		m_budget -= size;
+}
+
 /*
 	Channel
 */
 
 Channel::Channel() :
 		window_size(MIN_RELIABLE_WINDOW_SIZE),
+		m_congestion_control(CONGESTION_CONTROL_LEGACY),
+		m_cc_time(0.0),
+		m_cwnd(MIN_RELIABLE_WINDOW_SIZE),
+		m_ssthresh(MAX_RELIABLE_WINDOW_SIZE),
+		m_w_max(0.0),
+		m_w_est(0.0),
+		m_cubic_k(0.0),
+		m_epoch_start(-1.0),
+		m_last_reduction(-1.0),
+		m_srtt(-1.0),
+		m_pacing_credit(0.0),
 		next_incoming_seqnum(SEQNUM_INITIAL),
 		next_outgoing_seqnum(SEQNUM_INITIAL),
 		next_outgoing_split_seqnum(SEQNUM_INITIAL),
@@ -634,6 +850,13 @@ u16 Channel::getOutgoingSequenceNumber(bool& successful)
 	u16 retval = next_outgoing_seqnum;
 	u16 lowest_unacked_seqnumber;
 
+	/* a lost packet keeps the lowest seqnum while the packets after it are
+	 * acked, the congestion controlled window only limits the packets on the
+	 * wire and lets the seqnums run further ahead */
+	int seqnum_window = window_size;
+	if (m_congestion_control != CONGESTION_CONTROL_LEGACY)
+		seqnum_window = MYMIN(window_size * 4, MAX_RELIABLE_WINDOW_SIZE);
+
 	/* shortcut if there ain't any packet in outgoing list */
 	if (outgoing_reliables_sent.empty())
 	{
@@ -647,7 +870,7 @@ u16 Channel::getOutgoingSequenceNumber(bool& successful)
 			// ugly cast but this one is required in order to tell compiler we
 			// know about difference of two unsigned may be negative in general
 			// but we already made sure it won't happen in this case
-			if (((u16)(next_outgoing_seqnum - lowest_unacked_seqnumber)) > window_size) {
+			if (((u16)(next_outgoing_seqnum - lowest_unacked_seqnumber)) > seqnum_window) {
 				successful = false;
 				return 0;
 			}
@@ -657,7 +880,7 @@ u16 Channel::getOutgoingSequenceNumber(bool& successful)
 			// know about difference of two unsigned may be negative in general
 			// but we already made sure it won't happen in this case
 			if ((next_outgoing_seqnum + (u16)(SEQNUM_MAX - lowest_unacked_seqnumber)) >
-				window_size) {
+				seqnum_window) {
 				successful = false;
 				return 0;
 			}
@@ -720,6 +943,18 @@ void Channel::UpdateTimers(float dtime,bool legacy_peer)
 	bpm_counter += dtime;
 	packet_loss_counter += dtime;
 
+	{
+		MutexAutoLock internal(m_internal_mutex);
+		m_cc_time += dtime;
+		if (m_congestion_control != CONGESTION_CONTROL_LEGACY && m_srtt > 0) {
+			// Allow short bursts only, packets that couldn't be sent in
+			// time don't build up credit
+			float rate = getPacingRate();
+			m_pacing_credit = MYMIN(m_pacing_credit + dtime * rate,
+					MYMAX(PACING_MIN_BURST, rate * PACING_MAX_BURST_TIME));
+		}
+	}
+
 	if (packet_loss_counter > 1.0)
 	{
 		packet_loss_counter -= 1.0;
@@ -746,7 +981,8 @@ void Channel::UpdateTimers(float dtime,bool legacy_peer)
 		}
 
 		/* dynamic window size is only available for non legacy peers */
-		if (!legacy_peer) {
+		if (!legacy_peer &&
+				getCongestionControl() == CONGESTION_CONTROL_LEGACY) {
 			float successfull_to_lost_ratio = 0.0;
 			bool done = false;
 
@@ -840,6 +1076,116 @@ void Channel::UpdateTimers(float dtime,bool legacy_peer)
 	}
 }
 
+void Channel::setCongestionControl(CongestionControl type)
+{
+	MutexAutoLock internal(m_internal_mutex);
+	m_congestion_control = type;
+	if (type != CONGESTION_CONTROL_LEGACY) {
+		// Start over with slow start from the smallest window
+		m_cwnd = MIN_RELIABLE_WINDOW_SIZE;
+		m_ssthresh = MAX_RELIABLE_WINDOW_SIZE;
+		m_w_max = 0.0;
+		m_epoch_start = -1.0;
+		m_last_reduction = -1.0;
+		m_pacing_credit = PACING_MIN_BURST;
+		window_size = m_cwnd;
+	}
+}
+
+void Channel::reportAck(float srtt)
+{
+	MutexAutoLock internal(m_internal_mutex);
+	if (m_congestion_control == CONGESTION_CONTROL_LEGACY)
+		return;
+	m_srtt = srtt;
+
+	/* don't grow the window while the sender doesn't even use half of it */
+	if (outgoing_reliables_sent.size() < (u32)window_size / 2)
+		return;
+
+	if (m_cwnd < m_ssthresh) {
+		m_cwnd += 1;
+	} else {
+		if (m_epoch_start < 0) {
+			// First ack since the last reduction, start a new cubic epoch
+			// which reaches the window of the last congestion event after K
+			m_epoch_start = m_cc_time;
+			if (m_cwnd < m_w_max) {
+				m_cubic_k = pow((m_w_max - m_cwnd) / CUBIC_C, 1.0 / 3);
+			} else {
+				m_cubic_k = 0;
+				m_w_max = m_cwnd;
+			}
+			m_w_est = m_cwnd;
+		}
+		float t = m_cc_time - m_epoch_start + MYMAX(m_srtt, 0) - m_cubic_k;
+		float target = m_w_max + CUBIC_C * t * t * t;
+
+		// Never grow slower than an AIMD window would
+		m_w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) / m_cwnd;
+		target = MYMIN(MYMAX(target, m_w_est), 1.5 * m_cwnd);
+
+		if (target > m_cwnd)
+			m_cwnd += (target - m_cwnd) / m_cwnd;
+	}
+	m_cwnd = rangelim(m_cwnd, MIN_RELIABLE_WINDOW_SIZE,
+			MAX_RELIABLE_WINDOW_SIZE);
+	window_size = m_cwnd;
+}
+
+void Channel::reportLoss()
+{
+	MutexAutoLock internal(m_internal_mutex);
+	if (m_congestion_control == CONGESTION_CONTROL_LEGACY)
+		return;
+
+	/* losses within a round trip of the last reduction belong to the same
+	 * congestion event */
+	float rtt = (m_srtt > 0) ? m_srtt : RESEND_TIMEOUT_MIN;
+	if (m_last_reduction >= 0 && m_cc_time - m_last_reduction < rtt)
+		return;
+	m_last_reduction = m_cc_time;
+
+	// Remember a lower maximum if the window didn't get back to the last
+	// one, this leaves bandwidth to newer connections
+	if (m_cwnd < m_w_max)
+		m_w_max = m_cwnd * (1 + CUBIC_BETA) / 2;
+	else
+		m_w_max = m_cwnd;
+
+	m_cwnd = MYMAX(m_cwnd * CUBIC_BETA, MIN_RELIABLE_WINDOW_SIZE);
+	m_ssthresh = m_cwnd;
+	m_epoch_start = -1.0;
+	window_size = m_cwnd;
+}
+
+float Channel::getPacingRate()
+{
+	// Spread a window over a round trip, faster while probing for bandwidth
+	float gain = (m_cwnd < m_ssthresh) ? 2.0 : 1.25;
+	return gain * m_cwnd / m_srtt;
+}
+
+bool Channel::takePacingCredit()
+{
+	MutexAutoLock internal(m_internal_mutex);
+	if (m_congestion_control == CONGESTION_CONTROL_LEGACY || m_srtt <= 0)
+		return true;
+	if (m_pacing_credit < 1.0)
+		return false;
+	m_pacing_credit -= 1.0;
+	return true;
+}
+
+float Channel::getPacingDelay()
+{
+	MutexAutoLock internal(m_internal_mutex);
+	if (m_congestion_control == CONGESTION_CONTROL_LEGACY || m_srtt <= 0 ||
+			m_pacing_credit >= 1.0)
+		return 0.0;
+	return (1.0 - m_pacing_credit) / getPacingRate();
+}
+
 
 /*
 	Peer
@@ -1014,7 +1360,10 @@ UDPPeer::UDPPeer(u16 a_id, Address a_address, Connection* connection) :
 	Peer(a_address,a_id,connection),
 	m_pending_disconnect(false),
 	resend_timeout(0.5),
-	m_legacy_peer(true)
+	m_srtt(-1.0),
+	m_rttvar(0.0),
+	m_legacy_peer(true),
+	m_congestion_control(CONGESTION_CONTROL_LEGACY)
 {
 }
 
@@ -1031,10 +1380,15 @@ bool UDPPeer::getAddress(MTProtocols type,Address& toset)
 
 void UDPPeer::setNonLegacyPeer()
 {
+	// A repeated request must not reset the congestion controllers
+	if (!m_legacy_peer)
+		return;
 	m_legacy_peer = false;
+	m_congestion_control = m_connection->getCongestionControl();
 	for(unsigned int i=0; i< CHANNEL_COUNT; i++)
 	{
-		channels->setWindowSize(g_settings->getU16("max_packets_per_iteration"));
+		channels[i].setWindowSize(g_settings->getU16("max_packets_per_iteration"));
+		channels[i].setCongestionControl(m_congestion_control);
 	}
 }
 
@@ -1046,6 +1400,17 @@ void UDPPeer::reportRTT(float rtt)
 	RTTStatistics(rtt,"rudp",MAX_RELIABLE_WINDOW_SIZE*10);
 
 	float timeout = getStat(AVG_RTT) * RESEND_TIMEOUT_FACTOR;
+	if (m_congestion_control != CONGESTION_CONTROL_LEGACY) {
+		MutexAutoLock usage_lock(m_exclusive_access_mutex);
+		if (m_srtt < 0) {
+			m_srtt = rtt;
+			m_rttvar = rtt / 2;
+		} else {
+			m_rttvar = 0.75 * m_rttvar + 0.25 * fabs(m_srtt - rtt);
+			m_srtt = 0.875 * m_srtt + 0.125 * rtt;
+		}
+		timeout = m_srtt + 4 * m_rttvar;
+	}
 	if (timeout < RESEND_TIMEOUT_MIN)
 		timeout = RESEND_TIMEOUT_MIN;
 	if (timeout > RESEND_TIMEOUT_MAX)
@@ -1055,7 +1420,7 @@ void UDPPeer::reportRTT(float rtt)
 	resend_timeout = timeout;
 }
 
-bool UDPPeer::Ping(float dtime,SharedBuffer<u8>& data)
+bool UDPPeer::Ping(float dtime,PacketBuffer& data)
 {
 	m_ping_timer += dtime;
 	if (m_ping_timer >= PING_TIMEOUT)
@@ -1075,10 +1440,7 @@ void UDPPeer::PutReliableSendCommand(ConnectionCommand &c,
 	if (m_pending_disconnect)
 		return;
 
-	if ( channels[c.channelnum].queued_commands.empty() &&
-			/* don't queue more packets then window size */
-			(channels[c.channelnum].queued_reliables.size()
-			< (channels[c.channelnum].getWindowSize()/2))) {
+	if (isChannelReady(c.channelnum)) {
 		LOG(dout_con<<m_connection->getDesc()
 				<<" processing reliable command for peer id: " << c.peer_id
 				<<" data size: " << c.data.getSize() << std::endl);
@@ -1094,6 +1456,14 @@ void UDPPeer::PutReliableSendCommand(ConnectionCommand &c,
 	}
 }
 
+bool UDPPeer::isChannelReady(u8 channelnum)
+{
+	return channels[channelnum].queued_commands.empty() &&
+			/* don't queue more packets then window size */
+			(channels[channelnum].queued_reliables.size()
+			< (channels[channelnum].getWindowSize()/2));
+}
+
 bool UDPPeer::processReliableSendCommand(
 				ConnectionCommand &c,
 				unsigned int max_packet_size)
@@ -1107,7 +1477,7 @@ bool UDPPeer::processReliableSendCommand(
 
 	sanity_check(c.data.getSize() < MAX_RELIABLE_WINDOW_SIZE*512);
 
-	std::list<SharedBuffer<u8> > originals;
+	std::list<PacketBuffer> originals;
 	u16 split_sequence_number = channels[c.channelnum].readNextSplitSeqNum();
 
 	if (c.raw)
@@ -1124,7 +1494,7 @@ bool UDPPeer::processReliableSendCommand(
 	std::queue<BufferedPacket> toadd;
 	volatile u16 initial_sequence_number = 0;
 
-	for(std::list<SharedBuffer<u8> >::iterator i = originals.begin();
+	for(std::list<PacketBuffer>::iterator i = originals.begin();
 		i != originals.end(); ++i)
 	{
 		u16 seqnum = channels[c.channelnum].getOutgoingSequenceNumber(have_sequence_number);
@@ -1139,7 +1509,7 @@ bool UDPPeer::processReliableSendCommand(
 			have_initial_sequence_number = true;
 		}
 
-		SharedBuffer<u8> reliable = makeReliablePacket(*i, seqnum);
+		PacketBuffer reliable = makeReliablePacket(*i, seqnum);
 
 		// Add base headers and make a packet
 		BufferedPacket p = con::makePacket(address, reliable,
@@ -1205,7 +1575,9 @@ void UDPPeer::RunCommandQueues(
 	for (unsigned int i = 0; i < CHANNEL_COUNT; i++) {
 		unsigned int commands_processed = 0;
 
-		if ((channels[i].queued_commands.size() > 0) &&
+		/* go on while the window takes them, waiting for the next iteration
+		 * would leave it unused */
+		while ((channels[i].queued_commands.size() > 0) &&
 				(channels[i].queued_reliables.size() < maxtransfer) &&
 				(commands_processed < maxcommands)) {
 			try {
@@ -1217,15 +1589,18 @@ void UDPPeer::RunCommandQueues(
 				// Packet is processed, remove it from queue
 				if (processReliableSendCommand(c,max_packet_size)) {
 					channels[i].queued_commands.pop_front();
+					commands_processed++;
 				} else {
 					LOG(dout_con << m_connection->getDesc()
 							<< " Failed to queue packets for peer_id: " << c.peer_id
 							<< ", delaying sending of " << c.data.getSize()
 							<< " bytes" << std::endl);
+					break;
 				}
 			}
 			catch (ItemNotFoundException &e) {
 				// intentionally empty
+				break;
 			}
 		}
 	}
@@ -1243,7 +1618,7 @@ void UDPPeer::setNextSplitSequenceNumber(u8 channel, u16 seqnum)
 	channels[channel].setNextSplitSeqNum(seqnum);
 }
 
-SharedBuffer<u8> UDPPeer::addSpiltPacket(u8 channel,
+PacketBuffer UDPPeer::addSpiltPacket(u8 channel,
 											BufferedPacket toadd,
 											bool reliable)
 {
@@ -1261,9 +1636,11 @@ ConnectionSendThread::ConnectionSendThread(unsigned int max_packet_size,
 	m_connection(NULL),
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
-	m_max_commands_per_iteration(1),
+	m_max_commands_per_iteration(256),
 	m_max_data_packets_per_iteration(g_settings->getU16("max_packets_per_iteration")),
-	m_max_packets_requeued(256)
+	m_max_packets_requeued(256),
+	m_send_wait_ms(50),
+	m_peer_send_rate(g_settings->getU16("max_peer_send_rate") * 1024)
 {
 }
 
@@ -1289,7 +1666,7 @@ void * ConnectionSendThread::run()
 		m_iteration_packets_avaialble = m_max_data_packets_per_iteration;
 
 		/* wait for trigger or timeout */
-		m_send_sleep_semaphore.wait(50);
+		m_send_sleep_semaphore.wait(m_send_wait_ms);
 
 		/* remove all triggers */
 		while(m_send_sleep_semaphore.wait(0)) {}
@@ -1316,6 +1693,8 @@ void * ConnectionSendThread::run()
 		/* send non reliable packets */
 		sendPackets(dtime);
 
+		flushSends();
+
 		END_DEBUG_EXCEPTION_HANDLER
 	}
 
@@ -1346,6 +1725,9 @@ bool ConnectionSendThread::packetsQueued()
 		if (dynamic_cast<UDPPeer*>(&peer) == 0)
 			continue;
 
+		if (!dynamic_cast<UDPPeer*>(&peer)->m_send_scheduler.empty())
+			return true;
+
 		for(u16 i=0; i < CHANNEL_COUNT; i++) {
 			Channel *channel = &(dynamic_cast<UDPPeer*>(&peer))->channels[i];
 
@@ -1380,7 +1762,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 				<< ";" << *j << ";RELIABLE]");
 		PROFILE(ScopeProfiler peerprofiler(g_profiler, peerIdentifier.str(), SPT_AVG));
 
-		SharedBuffer<u8> data(2); // data for sending ping, required here because of goto
+		PacketBuffer data(2); // data for sending ping, required here because of goto
 
 		/*
 			Check peer timeout
@@ -1418,15 +1800,36 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			if (numpeers == 0)
 				return;
 
-			// Re-send timed out outgoing reliables
+			// Re-send the reliables the acks of later ones showed lost, and
+			// the timed out ones
+			std::list<BufferedPacket> losses = channel->
+					outgoing_reliables_sent.getLosses(
+							m_max_data_packets_per_iteration/numpeers);
 			timed_outs = channel->
 					outgoing_reliables_sent.getTimedOuts(resend_timeout,
 							(m_max_data_packets_per_iteration/numpeers));
 
-			channel->UpdatePacketLossCounter(timed_outs.size());
-			g_profiler->graphAdd("packets_lost", timed_outs.size());
+			if (!losses.empty() || !timed_outs.empty())
+				channel->reportLoss();
+			channel->UpdatePacketLossCounter(losses.size() + timed_outs.size());
+			g_profiler->graphAdd("packets_lost",
+					losses.size() + timed_outs.size());
+
+			m_iteration_packets_avaialble -= losses.size() + timed_outs.size();
+
+			for(std::list<BufferedPacket>::iterator k = losses.begin();
+				k != losses.end(); ++k)
+			{
+				channel->UpdateBytesLost(k->data.getSize());
+
+				LOG(derr_con<<m_connection->getDesc()
+						<<"RE-SENDING lost RELIABLE to "
+						<< k->address.serializeString()
+						<<": seqnum="<<readU16(&(k->data[BASE_HEADER_SIZE+1]))
+						<<std::endl);
 
-			m_iteration_packets_avaialble -= timed_outs.size();
+				rawSend(*k);
+			}
 
 			for(std::list<BufferedPacket>::iterator k = timed_outs.begin();
 				k != timed_outs.end(); ++k)
@@ -1436,7 +1839,6 @@ void ConnectionSendThread::runTimeouts(float dtime)
 				u16 seqnum  = readU16(&(k->data[BASE_HEADER_SIZE+1]));
 
 				channel->UpdateBytesLost(k->data.getSize());
-				k->resend_count++;
 
 				LOG(derr_con<<m_connection->getDesc()
 						<<"RE-SENDING timed-out RELIABLE to "
@@ -1485,17 +1887,35 @@ void ConnectionSendThread::runTimeouts(float dtime)
 
 void ConnectionSendThread::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_connection->m_udpSocket.Send(packet.address, *packet.data,
-				packet.data.getSize());
-		LOG(dout_con <<m_connection->getDesc()
-				<< " rawSend: " << packet.data.getSize()
-				<< " bytes sent" << std::endl);
-	} catch(SendFailedException &e) {
+	m_send_batch.push_back(packet);
+	if (m_send_batch.size() >= CONNECTION_SEND_BATCH)
+		flushSends();
+}
+
+void ConnectionSendThread::flushSends()
+{
+	if (m_send_batch.empty())
+		return;
+
+	std::vector<UDPDatagram> datagrams(m_send_batch.size());
+	for (size_t i = 0; i < m_send_batch.size(); i++) {
+		datagrams[i].address = m_send_batch[i].address;
+		datagrams[i].data = *m_send_batch[i].data;
+		datagrams[i].size = m_send_batch[i].data.getSize();
+	}
+
+	int sent = m_connection->m_udpSocket.SendMany(&datagrams[0],
+			datagrams.size());
+	LOG(dout_con <<m_connection->getDesc()
+			<< " rawSend: " << sent << " of " << datagrams.size()
+			<< " packets sent" << std::endl);
+	if (sent != (int)datagrams.size()) {
 		LOG(derr_con<<m_connection->getDesc()
-				<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl);
+				<<"Connection::flushSends(): failed to send "
+				<<(datagrams.size() - sent)<<" packets"<<std::endl);
 	}
+
+	m_send_batch.clear();
 }
 
 void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* channel)
@@ -1519,7 +1939,7 @@ void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* chan
 }
 
 bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		PacketBuffer data, bool reliable)
 {
 	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 	if (!peer) {
@@ -1540,7 +1960,7 @@ bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
 		if (!have_sequence_number_for_raw_packet)
 			return false;
 
-		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
+		PacketBuffer reliable = makeReliablePacket(data, seqnum);
 		Address peer_address;
 		peer->getAddress(MTP_MINETEST_RELIABLE_UDP, peer_address);
 
@@ -1549,9 +1969,12 @@ bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
 				m_connection->GetProtocolID(), m_connection->GetPeerID(),
 				channelnum);
 
-		// first check if our send window is already maxed out
-		if (channel->outgoing_reliables_sent.size()
-				< channel->getWindowSize()) {
+		// first check if our send window is already maxed out, and keep
+		// the order of the packets waiting for it or for pacing
+		if (channel->queued_reliables.empty() &&
+				(channel->outgoing_reliables_sent.size()
+				< channel->getWindowSize()) &&
+				channel->takePacingCredit()) {
 			LOG(dout_con<<m_connection->getDesc()
 					<<" INFO: sending a reliable packet to peer_id " << peer_id
 					<<" channel: " << channelnum
@@ -1608,13 +2031,13 @@ void ConnectionSendThread::processReliableCommand(ConnectionCommand &c)
 	case CONNCMD_SEND:
 		LOG(dout_con<<m_connection->getDesc()
 				<<"UDP processing reliable CONNCMD_SEND"<<std::endl);
-		sendReliable(c);
+		schedule(c);
 		return;
 
 	case CONNCMD_SEND_TO_ALL:
 		LOG(dout_con<<m_connection->getDesc()
 				<<"UDP processing CONNCMD_SEND_TO_ALL"<<std::endl);
-		sendToAllReliable(c);
+		scheduleToAll(c);
 		return;
 
 	case CONCMD_CREATE_PEER:
@@ -1682,12 +2105,12 @@ void ConnectionSendThread::processNonReliableCommand(ConnectionCommand &c)
 	case CONNCMD_SEND:
 		LOG(dout_con<<m_connection->getDesc()
 				<<" UDP processing CONNCMD_SEND"<<std::endl);
-		send(c.peer_id, c.channelnum, c.data);
+		schedule(c);
 		return;
 	case CONNCMD_SEND_TO_ALL:
 		LOG(dout_con<<m_connection->getDesc()
 				<<" UDP processing CONNCMD_SEND_TO_ALL"<<std::endl);
-		sendToAll(c.channelnum, c.data);
+		scheduleToAll(c);
 		return;
 	case CONCMD_ACK:
 		LOG(dout_con<<m_connection->getDesc()
@@ -1750,7 +2173,7 @@ void ConnectionSendThread::disconnect()
 	LOG(dout_con<<m_connection->getDesc()<<" disconnecting"<<std::endl);
 
 	// Create and send DISCO packet
-	SharedBuffer<u8> data(2);
+	PacketBuffer data(2);
 	writeU8(&data[0], TYPE_CONTROL);
 	writeU8(&data[1], CONTROLTYPE_DISCO);
 
@@ -1770,27 +2193,28 @@ void ConnectionSendThread::disconnect_peer(u16 peer_id)
 {
 	LOG(dout_con<<m_connection->getDesc()<<" disconnecting peer"<<std::endl);
 
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+
+	// Packets sent before disconnecting still go out, whatever their class
+	UDPPeer *udp_peer = dynamic_cast<UDPPeer*>(&peer);
+	if (udp_peer) {
+		ConnectionCommand c;
+		while (udp_peer->m_send_scheduler.popAny(c))
+			dispatch(c);
+	}
+
 	// Create and send DISCO packet
-	SharedBuffer<u8> data(2);
+	PacketBuffer data(2);
 	writeU8(&data[0], TYPE_CONTROL);
 	writeU8(&data[1], CONTROLTYPE_DISCO);
 	sendAsPacket(peer_id, 0,data,false);
 
-	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
-
-	if (!peer)
-		return;
-
-	if (dynamic_cast<UDPPeer*>(&peer) == 0)
-	{
-		return;
-	}
-
-	dynamic_cast<UDPPeer*>(&peer)->m_pending_disconnect = true;
+	if (udp_peer)
+		udp_peer->m_pending_disconnect = true;
 }
 
 void ConnectionSendThread::send(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data)
+		PacketBuffer data)
 {
 	assert(channelnum < CHANNEL_COUNT); // Pre-condition
 
@@ -1811,16 +2235,16 @@ void ConnectionSendThread::send(u16 peer_id, u8 channelnum,
 	u16 split_sequence_number = peer->getNextSplitSequenceNumber(channelnum);
 
 	u32 chunksize_max = m_max_packet_size - BASE_HEADER_SIZE;
-	std::list<SharedBuffer<u8> > originals;
+	std::list<PacketBuffer> originals;
 
 	originals = makeAutoSplitPacket(data, chunksize_max,split_sequence_number);
 
 	peer->setNextSplitSequenceNumber(channelnum,split_sequence_number);
 
-	for(std::list<SharedBuffer<u8> >::iterator i = originals.begin();
+	for(std::list<PacketBuffer>::iterator i = originals.begin();
 		i != originals.end(); ++i)
 	{
-		SharedBuffer<u8> original = *i;
+		PacketBuffer original = *i;
 		sendAsPacket(peer_id, channelnum, original);
 	}
 }
@@ -1834,19 +2258,23 @@ void ConnectionSendThread::sendReliable(ConnectionCommand &c)
 	peer->PutReliableSendCommand(c,m_max_packet_size);
 }
 
-void ConnectionSendThread::sendToAll(u8 channelnum, SharedBuffer<u8> data)
+void ConnectionSendThread::schedule(ConnectionCommand &c)
 {
-	std::list<u16> peerids = m_connection->getPeerIDs();
-
-	for (std::list<u16>::iterator i = peerids.begin();
-			i != peerids.end();
-			++i)
-	{
-		send(*i, channelnum, data);
+	PeerHelper peer = m_connection->getPeerNoEx(c.peer_id);
+	if (!peer) {
+		LOG(dout_con<<m_connection->getDesc()<<" peer: peer_id="<<c.peer_id
+				<< ">>>NOT<<< found on scheduling packet"
+				<< ", size: " << c.data.getSize() <<std::endl);
+		return;
 	}
+
+	if (dynamic_cast<UDPPeer*>(&peer) == 0)
+		return;
+
+	dynamic_cast<UDPPeer*>(&peer)->m_send_scheduler.push(c);
 }
 
-void ConnectionSendThread::sendToAllReliable(ConnectionCommand &c)
+void ConnectionSendThread::scheduleToAll(ConnectionCommand &c)
 {
 	std::list<u16> peerids = m_connection->getPeerIDs();
 
@@ -1854,12 +2282,32 @@ void ConnectionSendThread::sendToAllReliable(ConnectionCommand &c)
 			i != peerids.end();
 			++i)
 	{
-		PeerHelper peer = m_connection->getPeerNoEx(*i);
+		c.peer_id = *i;
+		schedule(c);
+	}
+}
 
-		if (!peer)
-			continue;
+void ConnectionSendThread::dispatch(ConnectionCommand &c)
+{
+	if (c.reliable)
+		sendReliable(c);
+	else
+		send(c.peer_id, c.channelnum, c.data);
+}
 
-		peer->PutReliableSendCommand(c,m_max_packet_size);
+void ConnectionSendThread::runSendScheduler(UDPPeer *peer, float dtime)
+{
+	SendScheduler &scheduler = peer->m_send_scheduler;
+	scheduler.step(dtime, m_peer_send_rate);
+
+	ConnectionCommand c;
+	bool channel_ready[CHANNEL_COUNT];
+	for (;;) {
+		for (u8 i = 0; i < CHANNEL_COUNT; i++)
+			channel_ready[i] = peer->isChannelReady(i);
+		if (!scheduler.pop(channel_ready, c))
+			break;
+		dispatch(c);
 	}
 }
 
@@ -1868,6 +2316,9 @@ void ConnectionSendThread::sendPackets(float dtime)
 	std::list<u16> peerIds = m_connection->getPeerIDs();
 	std::list<u16> pendingDisconnect;
 	std::map<u16,bool> pending_unreliable;
+	u32 queued[SEND_CLASS_COUNT] = {0};
+
+	m_send_wait_ms = 50;
 
 	for(std::list<u16>::iterator
 			j = peerIds.begin();
@@ -1891,6 +2342,13 @@ void ConnectionSendThread::sendPackets(float dtime)
 			pendingDisconnect.push_back(*j);
 		}
 
+		// pass the packets the channels are ready for on in order of
+		// their classes
+		runSendScheduler(dynamic_cast<UDPPeer*>(&peer), dtime);
+		for (u32 i = 0; i < SEND_CLASS_COUNT; i++)
+			queued[i] += dynamic_cast<UDPPeer*>(&peer)->
+					m_send_scheduler.getQueueSize((SendClass)i);
+
 		PROFILE(std::stringstream peerIdentifier);
 		PROFILE(peerIdentifier << "sendPackets[" << m_connection->getDesc() << ";" << *j << ";RELIABLE]");
 		PROFILE(ScopeProfiler peerprofiler(g_profiler, peerIdentifier.str(), SPT_AVG));
@@ -1932,6 +2390,13 @@ void ConnectionSendThread::sendPackets(float dtime)
 							< dynamic_cast<UDPPeer*>(&peer)->channels[i].getWindowSize())&&
 							(peer->m_increment_packets_remaining > 0))
 			{
+				if (!dynamic_cast<UDPPeer*>(&peer)->channels[i].takePacingCredit()) {
+					// come back as soon as the next one may be sent
+					unsigned int delay_ms = ceil(1000 *
+							dynamic_cast<UDPPeer*>(&peer)->channels[i].getPacingDelay());
+					m_send_wait_ms = rangelim(delay_ms, 1, m_send_wait_ms);
+					break;
+				}
 				BufferedPacket p = dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.front();
 				dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.pop();
 				Channel* channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[i]);
@@ -1946,6 +2411,10 @@ void ConnectionSendThread::sendPackets(float dtime)
 		}
 	}
 
+	for (u32 i = 0; i < SEND_CLASS_COUNT; i++)
+		g_profiler->avg(std::string("ConnectionSend: queued ") +
+				send_class_names[i] + " packets", queued[i]);
+
 	if (m_outgoing_queue.size())
 	{
 		LOG(dout_con<<m_connection->getDesc()
@@ -2004,7 +2473,7 @@ void ConnectionSendThread::sendPackets(float dtime)
 }
 
 void ConnectionSendThread::sendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool ack)
+		PacketBuffer data, bool ack)
 {
 	OutgoingPacket packet(peer_id, channelnum, data, false, ack);
 	m_outgoing_queue.push(packet);
@@ -2012,8 +2481,14 @@ void ConnectionSendThread::sendAsPacket(u16 peer_id, u8 channelnum,
 
 ConnectionReceiveThread::ConnectionReceiveThread(unsigned int max_packet_size) :
 	Thread("ConnectionReceive"),
-	m_connection(NULL)
+	m_connection(NULL),
+	m_datagrams(CONNECTION_RECEIVE_BATCH),
+	m_receive_buffers(CONNECTION_RECEIVE_BATCH)
 {
+	for (u32 i = 0; i < CONNECTION_RECEIVE_BATCH; i++) {
+		m_receive_buffers[i] = PacketBuffer(CONNECTION_RECEIVE_SIZE);
+		m_datagrams[i].data = *m_receive_buffers[i];
+	}
 }
 
 void * ConnectionReceiveThread::run()
@@ -2107,44 +2582,45 @@ void * ConnectionReceiveThread::run()
 // Receive packets from the network and buffers and create ConnectionEvents
 void ConnectionReceiveThread::receive()
 {
-	// use IPv6 minimum allowed MTU as receive buffer size as this is
-	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
-	// infrastructure
-	unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
-
 	bool packet_queued = true;
 
 	unsigned int loop_count = 0;
+	int received_count = 0;
+	int next_datagram = 0;
 
 	/* first of all read packets from socket */
 	/* check for incoming data available */
-	while( (loop_count < 10) &&
-			(m_connection->m_udpSocket.WaitData(50))) {
-		loop_count++;
+	while((next_datagram < received_count) || ((loop_count < 10) &&
+			(m_connection->m_udpSocket.WaitData(50)))) {
+		if (next_datagram == received_count) {
+			/* buffers still shared with received data can't be reused */
+			for (u32 i = 0; i < m_receive_buffers.size(); i++) {
+				if (!m_receive_buffers[i].isUnique()) {
+					m_receive_buffers[i] = PacketBuffer(CONNECTION_RECEIVE_SIZE);
+					m_datagrams[i].data = *m_receive_buffers[i];
+				}
+			}
+			/* take all packets that are waiting at once */
+			loop_count++;
+			received_count = m_connection->m_udpSocket.ReceiveMany(
+					&m_datagrams[0], m_datagrams.size(),
+					CONNECTION_RECEIVE_SIZE);
+			next_datagram = 0;
+			if (received_count == 0)
+				continue;
+		}
+		UDPDatagram &datagram = m_datagrams[next_datagram];
+		const PacketBuffer &buffer = m_receive_buffers[next_datagram];
+		next_datagram++;
 		try {
 			if (packet_queued) {
-				bool data_left = true;
-				u16 peer_id;
-				SharedBuffer<u8> resultdata;
-				while(data_left) {
-					try {
-						data_left = getFromBuffers(peer_id, resultdata);
-						if (data_left) {
-							ConnectionEvent e;
-							e.dataReceived(peer_id, resultdata);
-							m_connection->putEvent(e);
-						}
-					}
-					catch(ProcessedSilentlyException &e) {
-						/* try reading again */
-					}
-				}
+				deliverBufferedPackets();
 				packet_queued = false;
 			}
 
-			Address sender;
-			s32 received_size = m_connection->m_udpSocket.Receive(sender, *packetdata, packet_maxsize);
+			Address sender = datagram.address;
+			u8 *packetdata = (u8 *)datagram.data;
+			s32 received_size = datagram.size;
 
 			if ((received_size < BASE_HEADER_SIZE) ||
 				(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
@@ -2158,8 +2634,8 @@ void ConnectionReceiveThread::receive()
 				continue;
 			}
 
-			u16 peer_id          = readPeerId(*packetdata);
-			u8 channelnum        = readChannel(*packetdata);
+			u16 peer_id          = readPeerId(packetdata);
+			u8 channelnum        = readChannel(packetdata);
 
 			if (channelnum > CHANNEL_COUNT-1) {
 				LOG(derr_con<<m_connection->getDesc()
@@ -2234,14 +2710,13 @@ void ConnectionReceiveThread::receive()
 
 			// Throw the received packet to channel->processPacket()
 
-			// Make a new SharedBuffer from the data without the base headers
-			SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-			memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-					strippeddata.getSize());
+			// The data without the base headers, sharing the receive buffer
+			PacketBuffer strippeddata = buffer.view(BASE_HEADER_SIZE,
+					received_size - BASE_HEADER_SIZE);
 
 			try{
 				// Process it (the result is some data with no headers made by us)
-				SharedBuffer<u8> resultdata = processPacket
+				PacketBuffer resultdata = processPacket
 						(channel, strippeddata, peer_id, channelnum, false);
 
 				LOG(dout_con<<m_connection->getDesc()
@@ -2264,9 +2739,36 @@ void ConnectionReceiveThread::receive()
 		catch(ProcessedSilentlyException &e) {
 		}
 	}
+
+	/* the last packet may have been the one the buffered packets were
+	 * waiting for, don't hold them back until more data arrives */
+	if (loop_count > 0)
+		deliverBufferedPackets();
+}
+
+void ConnectionReceiveThread::deliverBufferedPackets()
+{
+	bool data_left = true;
+	u16 peer_id;
+	PacketBuffer resultdata;
+	while(data_left) {
+		try {
+			data_left = getFromBuffers(peer_id, resultdata);
+			if (data_left) {
+				ConnectionEvent e;
+				e.dataReceived(peer_id, resultdata);
+				m_connection->putEvent(e);
+			}
+		}
+		catch(ProcessedSilentlyException &e) {
+			/* try reading again */
+		}
+		catch(InvalidIncomingDataException &e) {
+		}
+	}
 }
 
-bool ConnectionReceiveThread::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst)
+bool ConnectionReceiveThread::getFromBuffers(u16 &peer_id, PacketBuffer &dst)
 {
 	std::list<u16> peerids = m_connection->getPeerIDs();
 
@@ -2293,7 +2795,7 @@ bool ConnectionReceiveThread::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst
 }
 
 bool ConnectionReceiveThread::checkIncomingBuffers(Channel *channel,
-		u16 &peer_id, SharedBuffer<u8> &dst)
+		u16 &peer_id, PacketBuffer &dst)
 {
 	u16 firstseqnum = 0;
 	if (channel->incoming_reliables.getFirstSeqnum(firstseqnum))
@@ -2316,8 +2818,8 @@ bool ConnectionReceiveThread::checkIncomingBuffers(Channel *channel,
 
 			u32 headers_size = BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE;
 			// Get out the inside packet and re-process it
-			SharedBuffer<u8> payload(p.data.getSize() - headers_size);
-			memcpy(*payload, &p.data[headers_size], payload.getSize());
+			PacketBuffer payload = p.data.view(headers_size,
+					p.data.getSize() - headers_size);
 
 			dst = processPacket(channel, payload, peer_id, channelnum, true);
 			return true;
@@ -2326,8 +2828,8 @@ bool ConnectionReceiveThread::checkIncomingBuffers(Channel *channel,
 	return false;
 }
 
-SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
-		SharedBuffer<u8> packetdata, u16 peer_id, u8 channelnum, bool reliable)
+PacketBuffer ConnectionReceiveThread::processPacket(Channel *channel,
+		PacketBuffer packetdata, u16 peer_id, u8 channelnum, bool reliable)
 {
 	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 
@@ -2397,10 +2899,20 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 						dynamic_cast<UDPPeer*>(&peer)->reportRTT(rtt);
 					}
 				}
+				if (channel->getCongestionControl() != CONGESTION_CONTROL_LEGACY) {
+					channel->reportAck(
+							dynamic_cast<UDPPeer*>(&peer)->getSmoothedRTT());
+					// resend the packets this ack shows lost right away
+					if (channel->outgoing_reliables_sent.markLosses(seqnum) > 0)
+						m_connection->TriggerSend();
+				}
 				//put bytes for max bandwidth calculation
 				channel->UpdateBytesSent(p.data.getSize(),1);
-				if (channel->outgoing_reliables_sent.size() == 0)
+				if ((channel->outgoing_reliables_sent.size() == 0) ||
+						(channel->outgoing_reliables_sent.size() + 1 ==
+						channel->getWindowSize()))
 				{
+					// the window was full, queued packets may go now
 					m_connection->TriggerSend();
 				}
 			}
@@ -2436,7 +2948,7 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 
 			ConnectionCommand cmd;
 
-			SharedBuffer<u8> reply(2);
+			PacketBuffer reply(2);
 			writeU8(&reply[0], TYPE_CONTROL);
 			writeU8(&reply[1], CONTROLTYPE_ENABLE_BIG_SEND_WINDOW);
 			cmd.disableLegacy(PEER_ID_SERVER,reply);
@@ -2487,9 +2999,8 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 				<<"RETURNING TYPE_ORIGINAL to user"
 				<<std::endl);
 		// Get the inside packet out and return it
-		SharedBuffer<u8> payload(packetdata.getSize() - ORIGINAL_HEADER_SIZE);
-		memcpy(*payload, &(packetdata[ORIGINAL_HEADER_SIZE]), payload.getSize());
-		return payload;
+		return packetdata.view(ORIGINAL_HEADER_SIZE,
+				packetdata.getSize() - ORIGINAL_HEADER_SIZE);
 	}
 	else if (type == TYPE_SPLIT)
 	{
@@ -2507,7 +3018,7 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 					channelnum);
 
 			// Buffer the packet
-			SharedBuffer<u8> data =
+			PacketBuffer data =
 					peer->addSpiltPacket(channelnum,packet,reliable);
 
 			if (data.getSize() != 0)
@@ -2638,8 +3149,8 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 		channel->incNextIncomingSeqNum();
 
 		// Get out the inside packet and re-process it
-		SharedBuffer<u8> payload(packetdata.getSize() - RELIABLE_HEADER_SIZE);
-		memcpy(*payload, &packetdata[RELIABLE_HEADER_SIZE], payload.getSize());
+		PacketBuffer payload = packetdata.view(RELIABLE_HEADER_SIZE,
+				packetdata.getSize() - RELIABLE_HEADER_SIZE);
 
 		return processPacket(channel, payload, peer_id, channelnum, true);
 	}
@@ -2671,9 +3182,13 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_bc_peerhandler(peerhandler),
 	m_bc_receive_timeout(0),
 	m_shutting_down(false),
-	m_next_remote_peer_id(2)
+	m_next_remote_peer_id(2),
+	m_congestion_control(CONGESTION_CONTROL_LEGACY)
 
 {
+	if (g_settings->get("congestion_control") == "cubic")
+		m_congestion_control = CONGESTION_CONTROL_CUBIC;
+
 	m_udpSocket.setTimeoutMs(5);
 
 	m_sendThread.setParent(this);
@@ -2870,23 +3385,34 @@ void Connection::Disconnect()
 }
 
 void Connection::Receive(NetworkPacket* pkt)
+{
+	if (!receive(pkt, m_bc_receive_timeout))
+		throw NoIncomingDataException("No incoming data");
+}
+
+bool Connection::TryReceive(NetworkPacket* pkt)
+{
+	return receive(pkt, 0);
+}
+
+bool Connection::receive(NetworkPacket* pkt, u32 timeout_ms)
 {
 	for(;;) {
-		ConnectionEvent e = waitEvent(m_bc_receive_timeout);
+		ConnectionEvent e = waitEvent(timeout_ms);
 		if (e.type != CONNEVENT_NONE)
 			LOG(dout_con << getDesc() << ": Receive: got event: "
 					<< e.describe() << std::endl);
 		switch(e.type) {
 		case CONNEVENT_NONE:
-			throw NoIncomingDataException("No incoming data");
+			return false;
 		case CONNEVENT_DATA_RECEIVED:
 			// Data size is lesser than command size, ignoring packet
 			if (e.data.getSize() < 2) {
 				continue;
 			}
 
-			pkt->putRawPacket(*e.data, e.data.getSize(), e.peer_id);
-			return;
+			pkt->putRawPacket(e.data, e.peer_id);
+			return true;
 		case CONNEVENT_PEER_ADDED: {
 			UDPPeer tmp(e.peer_id, e.address, this);
 			if (m_bc_peerhandler)
@@ -2904,17 +3430,17 @@ void Connection::Receive(NetworkPacket* pkt)
 					"(port already in use?)");
 		}
 	}
-	throw NoIncomingDataException("No incoming data");
+	return false;
 }
 
 void Connection::Send(u16 peer_id, u8 channelnum,
-		NetworkPacket* pkt, bool reliable)
+		NetworkPacket* pkt, bool reliable, SendClass send_class)
 {
 	assert(channelnum < CHANNEL_COUNT); // Pre-condition
 
 	ConnectionCommand c;
 
-	c.send(peer_id, channelnum, pkt, reliable);
+	c.send(peer_id, channelnum, pkt, reliable, send_class);
 	putCommand(c);
 }
 
@@ -3015,7 +3541,7 @@ u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
 			<< "createPeer(): giving peer_id=" << peer_id_new << std::endl);
 
 	ConnectionCommand cmd;
-	SharedBuffer<u8> reply(4);
+	PacketBuffer reply(4);
 	writeU8(&reply[0], TYPE_CONTROL);
 	writeU8(&reply[1], CONTROLTYPE_SET_PEER_ID);
 	writeU16(&reply[2], peer_id_new);
@@ -3066,7 +3592,7 @@ void Connection::sendAck(u16 peer_id, u8 channelnum, u16 seqnum)
 			" seqnum: " << seqnum << std::endl);
 
 	ConnectionCommand c;
-	SharedBuffer<u8> ack(4);
+	PacketBuffer ack(4);
 	writeU8(&ack[0], TYPE_CONTROL);
 	writeU8(&ack[1], CONTROLTYPE_ACK);
 	writeU16(&ack[2], seqnum);
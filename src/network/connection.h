@@ -33,6 +33,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <map>
+#include <vector>
+#include <deque>
 
 class NetworkPacket;
 
@@ -172,7 +174,11 @@ struct BufferedPacket
 		data(a_size), time(0.0), totaltime(0.0), absolute_send_time(-1),
 		resend_count(0)
 	{}
-	Buffer<u8> data; // Data of the packet, including headers
+	BufferedPacket(const PacketBuffer &a_data):
+		data(a_data), time(0.0), totaltime(0.0), absolute_send_time(-1),
+		resend_count(0)
+	{}
+	PacketBuffer data; // Data of the packet, including headers
 	float time; // Seconds from buffering the packet or re-sending
 	float totaltime; // Seconds from buffering the packet
 	unsigned int absolute_send_time;
@@ -180,50 +186,60 @@ struct BufferedPacket
 	unsigned int resend_count;
 };
 
+/*
+	The functions adding headers put them in front of the data with
+	PacketBuffer::prepend(), which doesn't copy the data if the room in
+	front of it is free.
+*/
+
 // This adds the base headers to the data and makes a packet out of it
 BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 		u32 protocol_id, u16 sender_peer_id, u8 channel);
-BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
+BufferedPacket makePacket(Address &address, const PacketBuffer &data,
 		u32 protocol_id, u16 sender_peer_id, u8 channel);
 
 // Add the TYPE_ORIGINAL header to the data
-SharedBuffer<u8> makeOriginalPacket(
-		SharedBuffer<u8> data);
+PacketBuffer makeOriginalPacket(
+		PacketBuffer data);
 
 // Split data in chunks and add TYPE_SPLIT headers to them
-std::list<SharedBuffer<u8> > makeSplitPacket(
-		SharedBuffer<u8> data,
+// The chunks are views of the data, only the first one can use its room
+std::list<PacketBuffer> makeSplitPacket(
+		PacketBuffer data,
 		u32 chunksize_max,
 		u16 seqnum);
 
 // Depending on size, make a TYPE_ORIGINAL or TYPE_SPLIT packet
 // Increments split_seqnum if a split packet is made
-std::list<SharedBuffer<u8> > makeAutoSplitPacket(
-		SharedBuffer<u8> data,
+std::list<PacketBuffer> makeAutoSplitPacket(
+		PacketBuffer data,
 		u32 chunksize_max,
 		u16 &split_seqnum);
 
 // Add the TYPE_RELIABLE header to the data
-SharedBuffer<u8> makeReliablePacket(
-		SharedBuffer<u8> data,
+PacketBuffer makeReliablePacket(
+		PacketBuffer data,
 		u16 seqnum);
 
 struct IncomingSplitPacket
 {
-	IncomingSplitPacket()
-	{
-		time = 0.0;
-		reliable = false;
-	}
-	// Key is chunk number, value is data without headers
-	std::map<u16, SharedBuffer<u8> > chunks;
+	IncomingSplitPacket(u32 a_chunk_count, bool a_reliable):
+		chunks(a_chunk_count),
+		chunk_count(a_chunk_count),
+		chunks_received(0),
+		time(0.0),
+		reliable(a_reliable)
+	{}
+	// Indexed by chunk number, data without headers; empty if missing
+	std::vector<PacketBuffer> chunks;
 	u32 chunk_count;
+	u32 chunks_received;
 	float time; // Seconds from adding
 	bool reliable; // If true, isn't deleted on timeout
 
 	bool allReceived()
 	{
-		return (chunks.size() == chunk_count);
+		return (chunks_received == chunk_count);
 	}
 };
 
@@ -313,11 +329,21 @@ with a buffer in the receiving and transmitting end.
 #define SEQNUM_INITIAL 65500
 
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
+	A buffer which stores reliable packets for fast access by seqnum and
+	to the smallest one.
+
+	The packets are kept in a ring indexed by seqnum, which grows to hold
+	the span of seqnums in the buffer. Packets waiting for a resend are
+	kept in the order they were sent, so timed out ones are found without
+	looking at the others.
+
+	Every reliable packet is acked on its own, so the acks tell the sender
+	exactly which packets arrived. A packet that is still waiting when one
+	sent FAST_RETRANSMIT_THRESHOLD or more seqnums after it is acked is
+	taken as lost and resent without waiting for its timeout.
 */
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+#define FAST_RETRANSMIT_THRESHOLD 3
 
 class ReliablePacketBuffer
 {
@@ -334,20 +360,65 @@ class ReliablePacketBuffer
 	std::list<BufferedPacket> getTimedOuts(float timeout,
 			unsigned int max_packets);
 
+	/*
+		Call after acked_seqnum has been popped. Returns the number of
+		packets newly taken as lost; each packet is taken as lost at most
+		once, and not at all once resent for a timeout.
+	*/
+	unsigned int markLosses(u16 acked_seqnum);
+	std::list<BufferedPacket> getLosses(unsigned int max_packets);
+
 	void print();
 	bool empty();
 	bool containsPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u32 size();
 
 
 private:
-	RPBSearchResult findPacket(u16 seqnum);
-
-	std::list<BufferedPacket> m_list;
-	u32 m_list_size;
-
+	struct Slot
+	{
+		Slot(): packet(0), seqnum(0), used(false),
+			insert_time(0.0), send_time(0.0) {}
+		BufferedPacket packet;
+		u16 seqnum;
+		bool used;
+		// Values of m_time when the packet was inserted and last sent
+		double insert_time;
+		double send_time;
+	};
+
+	struct ResendEntry
+	{
+		ResendEntry(u16 a_seqnum, double a_send_time):
+			seqnum(a_seqnum), send_time(a_send_time) {}
+		u16 seqnum;
+		double send_time;
+	};
+
+	Slot &getSlot(u16 seqnum)
+		{ return m_slots[seqnum & (m_slots.size() - 1)]; }
+	Slot *findSlot(u16 seqnum);
+	BufferedPacket takePacket(Slot &slot);
+	BufferedPacket resendPacket(Slot &slot);
+	void grow(u32 span);
+
+	// Size is a power of two
+	std::vector<Slot> m_slots;
+	u32 m_size;
+
+	// Smallest and largest seqnum in the buffer
 	u16 m_oldest_non_answered_ack;
+	u16 m_newest;
+
+	// Sum of the incrementTimeouts() times
+	double m_time;
+	// Sends of the buffered packets, oldest first; may contain entries
+	// for packets that have been popped or sent again since
+	std::deque<ResendEntry> m_resends;
+	// Packets taken as lost and not resent yet
+	std::deque<ResendEntry> m_losses;
+	// Next seqnum markLosses() looks at
+	u16 m_loss_scan_next;
 
 	Mutex m_list_mutex;
 };
@@ -364,7 +435,7 @@ class IncomingSplitBuffer
 		Returns a reference counted buffer of length != 0 when a full split
 		packet is constructed. If not, returns one of length 0.
 	*/
-	SharedBuffer<u8> insert(BufferedPacket &p, bool reliable);
+	PacketBuffer insert(BufferedPacket &p, bool reliable);
 
 	void removeUnreliableTimedOuts(float dtime, float timeout);
 
@@ -379,11 +450,11 @@ struct OutgoingPacket
 {
 	u16 peer_id;
 	u8 channelnum;
-	SharedBuffer<u8> data;
+	PacketBuffer data;
 	bool reliable;
 	bool ack;
 
-	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
+	OutgoingPacket(u16 peer_id_, u8 channelnum_, PacketBuffer data_,
 			bool reliable_,bool ack_=false):
 		peer_id(peer_id_),
 		channelnum(channelnum_),
@@ -394,6 +465,25 @@ struct OutgoingPacket
 	}
 };
 
+/*
+	Classes of the packets sent to a peer, each gets its own queue in the
+	SendScheduler of the peer
+*/
+enum SendClass
+{
+	// Login, definitions and player state
+	SEND_CLASS_CONTROL,
+	// Active objects and particles
+	SEND_CLASS_OBJECTS,
+	// Inventories, HUD, chat, formspecs and sounds
+	SEND_CLASS_INTERFACE,
+	// Map blocks and node changes
+	SEND_CLASS_BLOCKS,
+	// Media files
+	SEND_CLASS_MEDIA,
+	SEND_CLASS_COUNT
+};
+
 enum ConnectionCommandType{
 	CONNCMD_NONE,
 	CONNCMD_SERVE,
@@ -413,11 +503,13 @@ struct ConnectionCommand
 	Address address;
 	u16 peer_id;
 	u8 channelnum;
-	Buffer<u8> data;
+	PacketBuffer data;
 	bool reliable;
 	bool raw;
+	SendClass send_class;
 
-	ConnectionCommand(): type(CONNCMD_NONE), peer_id(PEER_ID_INEXISTENT), reliable(false), raw(false) {}
+	ConnectionCommand(): type(CONNCMD_NONE), peer_id(PEER_ID_INEXISTENT),
+		reliable(false), raw(false), send_class(SEND_CLASS_CONTROL) {}
 
 	void serve(Address address_)
 	{
@@ -439,16 +531,17 @@ struct ConnectionCommand
 		peer_id = peer_id_;
 	}
 	void send(u16 peer_id_, u8 channelnum_,
-			NetworkPacket* pkt, bool reliable_)
+			NetworkPacket* pkt, bool reliable_, SendClass send_class_)
 	{
 		type = CONNCMD_SEND;
 		peer_id = peer_id_;
 		channelnum = channelnum_;
-		data = pkt->oldForgePacket();
+		data = pkt->getRawPacket();
 		reliable = reliable_;
+		send_class = send_class_;
 	}
 
-	void ack(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_)
+	void ack(u16 peer_id_, u8 channelnum_, PacketBuffer data_)
 	{
 		type = CONCMD_ACK;
 		peer_id = peer_id_;
@@ -457,7 +550,7 @@ struct ConnectionCommand
 		reliable = false;
 	}
 
-	void createPeer(u16 peer_id_, SharedBuffer<u8> data_)
+	void createPeer(u16 peer_id_, PacketBuffer data_)
 	{
 		type = CONCMD_CREATE_PEER;
 		peer_id = peer_id_;
@@ -467,7 +560,7 @@ struct ConnectionCommand
 		raw = true;
 	}
 
-	void disableLegacy(u16 peer_id_, SharedBuffer<u8> data_)
+	void disableLegacy(u16 peer_id_, PacketBuffer data_)
 	{
 		type = CONCMD_DISABLE_LEGACY;
 		peer_id = peer_id_;
@@ -478,6 +571,86 @@ struct ConnectionCommand
 	}
 };
 
+/*
+	Orders the packets queued for a peer by their class, with deficit round
+	robin: every round, each class that has a packet ready to be sent gets
+	credit for its weight times SEND_SCHEDULER_QUANTUM bytes and sends
+	packets while the credit lasts. So while a class has packets queued it
+	gets at least its share of the sends, whatever the other classes queue,
+	and the shares of idle classes go to the busy ones.
+
+	The reliable packets of a channel are still sent in the order they were
+	queued, whatever their class: one waits until the older ones of its
+	channel have been taken. So classes only overtake each other across
+	channels and with unreliable packets.
+
+	The bytes sent per second can be limited by a budget.
+*/
+class SendScheduler
+{
+public:
+	SendScheduler();
+
+	void push(const ConnectionCommand &c);
+
+	// Adds dtime seconds of budget, rate is in bytes per second or 0
+	// for no limit
+	void step(float dtime, u32 rate);
+
+	/*
+		Takes the next command to send into c. Reliable commands are only
+		taken for the channels that are ready to send them. Returns false
+		if there is none or the budget is used up.
+	*/
+	bool pop(const bool channel_ready[CHANNEL_COUNT], ConnectionCommand &c);
+
+	// Takes the oldest command of the first class that may send one,
+	// ignoring the weights and the budget
+	bool popAny(ConnectionCommand &c);
+
+	bool empty() const { return m_size == 0; }
+	u32 getQueueSize(SendClass send_class) const
+		{ return m_queues[send_class].size(); }
+
+private:
+	struct QueuedCommand
+	{
+		ConnectionCommand command;
+		// Order of a reliable command among those of its channel
+		u32 reliable_seqnum;
+	};
+
+	// Whether no older reliable command of the same channel is queued
+	bool isInOrder(const QueuedCommand &q) const
+	{
+		return !q.command.reliable || q.reliable_seqnum ==
+				m_reliable_taken[q.command.channelnum];
+	}
+	void take(SendClass send_class, ConnectionCommand &c);
+
+	std::deque<QueuedCommand> m_queues[SEND_CLASS_COUNT];
+	// Reliable commands queued and taken per channel
+	u32 m_reliable_pushed[CHANNEL_COUNT];
+	u32 m_reliable_taken[CHANNEL_COUNT];
+	// Bytes each class may send in the current round
+	u32 m_deficits[SEND_CLASS_COUNT];
+	// Class being served, and whether it got its credit for this round
+	u8 m_current;
+	bool m_credited;
+	u32 m_size;
+
+	u32 m_rate;
+	float m_budget;
+};
+
+enum CongestionControl
+{
+	// Window adjusted once a second from the ratio of lost packets
+	CONGESTION_CONTROL_LEGACY,
+	// CUBIC window (RFC 8312) with slow start and paced sends
+	CONGESTION_CONTROL_CUBIC
+};
+
 class Channel
 {
 
@@ -518,6 +691,25 @@ class Channel
 
 	void UpdateTimers(float dtime, bool legacy_peer);
 
+	void setCongestionControl(CongestionControl type);
+	CongestionControl getCongestionControl()
+		{ MutexAutoLock lock(m_internal_mutex); return m_congestion_control; };
+
+	/*
+		Congestion controller input: a packet has been acked, srtt is the
+		smoothed round trip time of the peer (negative if not known yet),
+		or packets have been lost.
+	*/
+	void reportAck(float srtt);
+	void reportLoss();
+
+	/*
+		Send pacing: takes the credit for sending one new reliable packet,
+		returns false if it has to wait getPacingDelay() seconds.
+	*/
+	bool takePacingCredit();
+	float getPacingDelay();
+
 	const float getCurrentDownloadRateKB()
 		{ MutexAutoLock lock(m_internal_mutex); return cur_kbps; };
 	const float getMaxDownloadRateKB()
@@ -544,9 +736,24 @@ class Channel
 
 	void setWindowSize(unsigned int size) { window_size = size; };
 private:
+	float getPacingRate();
+
 	Mutex m_internal_mutex;
 	int window_size;
 
+	CongestionControl m_congestion_control;
+	// CUBIC state, windows are in packets and times in seconds
+	double m_cc_time;
+	float m_cwnd;
+	float m_ssthresh;
+	float m_w_max;
+	float m_w_est;
+	float m_cubic_k;
+	double m_epoch_start;
+	double m_last_reduction;
+	float m_srtt;
+	float m_pacing_credit;
+
 	u16 next_incoming_seqnum;
 
 	u16 next_outgoing_seqnum;
@@ -707,15 +914,15 @@ class Peer {
 
 		virtual u16 getNextSplitSequenceNumber(u8 channel) { return 0; };
 		virtual void setNextSplitSequenceNumber(u8 channel, u16 seqnum) {};
-		virtual SharedBuffer<u8> addSpiltPacket(u8 channel,
+		virtual PacketBuffer addSpiltPacket(u8 channel,
 												BufferedPacket toadd,
 												bool reliable)
 				{
 					fprintf(stderr,"Peer: addSplitPacket called, this is supposed to be never called!\n");
-					return SharedBuffer<u8>(0);
+					return PacketBuffer(0);
 				};
 
-		virtual bool Ping(float dtime, SharedBuffer<u8>& data) { return false; };
+		virtual bool Ping(float dtime, PacketBuffer& data) { return false; };
 
 		virtual float getStat(rtt_stat_type type) const {
 			switch (type) {
@@ -795,6 +1002,10 @@ class UDPPeer : public Peer
 	void PutReliableSendCommand(ConnectionCommand &c,
 							unsigned int max_packet_size);
 
+	// True if PutReliableSendCommand() turns commands for the channel into
+	// packets right away instead of queueing them
+	bool isChannelReady(u8 channelnum);
+
 	bool isActive()
 	{ return ((hasSentWithID()) && (!m_pending_deletion)); };
 
@@ -808,7 +1019,7 @@ class UDPPeer : public Peer
 	u16 getNextSplitSequenceNumber(u8 channel);
 	void setNextSplitSequenceNumber(u8 channel, u16 seqnum);
 
-	SharedBuffer<u8> addSpiltPacket(u8 channel,
+	PacketBuffer addSpiltPacket(u8 channel,
 									BufferedPacket toadd,
 									bool reliable);
 
@@ -820,6 +1031,9 @@ class UDPPeer : public Peer
 	*/
 	void reportRTT(float rtt);
 
+	float getSmoothedRTT()
+		{ MutexAutoLock lock(m_exclusive_access_mutex); return m_srtt; }
+
 	void RunCommandQueues(
 					unsigned int max_packet_size,
 					unsigned int maxcommands,
@@ -830,19 +1044,26 @@ class UDPPeer : public Peer
 
 	void setResendTimeout(float timeout)
 		{ MutexAutoLock lock(m_exclusive_access_mutex); resend_timeout = timeout; }
-	bool Ping(float dtime,SharedBuffer<u8>& data);
+	bool Ping(float dtime,PacketBuffer& data);
 
 	Channel channels[CHANNEL_COUNT];
 	bool m_pending_disconnect;
+	// Commands to send, taken by the send thread as the channels are ready
+	SendScheduler m_send_scheduler;
 private:
 	// This is changed dynamically
 	float resend_timeout;
+	// Smoothed round trip time and its variation (RFC 6298), used by the
+	// congestion controlled channels
+	float m_srtt;
+	float m_rttvar;
 
 	bool processReliableSendCommand(
 					ConnectionCommand &c,
 					unsigned int max_packet_size);
 
 	bool m_legacy_peer;
+	CongestionControl m_congestion_control;
 };
 
 /*
@@ -861,7 +1082,7 @@ struct ConnectionEvent
 {
 	enum ConnectionEventType type;
 	u16 peer_id;
-	Buffer<u8> data;
+	PacketBuffer data;
 	bool timeout;
 	Address address;
 
@@ -885,7 +1106,7 @@ struct ConnectionEvent
 		return "Invalid ConnectionEvent";
 	}
 
-	void dataReceived(u16 peer_id_, SharedBuffer<u8> data_)
+	void dataReceived(u16 peer_id_, PacketBuffer data_)
 	{
 		type = CONNEVENT_DATA_RECEIVED;
 		peer_id = peer_id_;
@@ -931,9 +1152,11 @@ class ConnectionSendThread : public Thread {
 
 private:
 	void runTimeouts    (float dtime);
+	// Queues the packet for the next flushSends()
 	void rawSend        (const BufferedPacket &packet);
+	void flushSends     ();
 	bool rawSendAsPacket(u16 peer_id, u8 channelnum,
-							SharedBuffer<u8> data, bool reliable);
+							PacketBuffer data, bool reliable);
 
 	void processReliableCommand (ConnectionCommand &c);
 	void processNonReliableCommand (ConnectionCommand &c);
@@ -942,16 +1165,20 @@ class ConnectionSendThread : public Thread {
 	void disconnect     ();
 	void disconnect_peer(u16 peer_id);
 	void send           (u16 peer_id, u8 channelnum,
-							SharedBuffer<u8> data);
+							PacketBuffer data);
 	void sendReliable   (ConnectionCommand &c);
-	void sendToAll      (u8 channelnum,
-							SharedBuffer<u8> data);
-	void sendToAllReliable(ConnectionCommand &c);
+
+	// Queues the command in the SendScheduler of its peer, or of all peers
+	void schedule       (ConnectionCommand &c);
+	void scheduleToAll  (ConnectionCommand &c);
+	// Sends a command taken from a SendScheduler
+	void dispatch       (ConnectionCommand &c);
+	void runSendScheduler(UDPPeer *peer, float dtime);
 
 	void sendPackets    (float dtime);
 
 	void sendAsPacket   (u16 peer_id, u8 channelnum,
-							SharedBuffer<u8> data,bool ack=false);
+							PacketBuffer data,bool ack=false);
 
 	void sendAsPacketReliable(BufferedPacket& p, Channel* channel);
 
@@ -962,11 +1189,18 @@ class ConnectionSendThread : public Thread {
 	float                 m_timeout;
 	std::queue<OutgoingPacket> m_outgoing_queue;
 	Semaphore             m_send_sleep_semaphore;
+	// Packets put on the wire together by flushSends()
+	std::vector<BufferedPacket> m_send_batch;
 
 	unsigned int          m_iteration_packets_avaialble;
 	unsigned int          m_max_commands_per_iteration;
 	unsigned int          m_max_data_packets_per_iteration;
 	unsigned int          m_max_packets_requeued;
+	// How long to sleep at most before the next iteration, shortened
+	// while paced packets are waiting
+	unsigned int          m_send_wait_ms;
+	// Bytes per second sent to a peer at most, 0 for no limit
+	u32                   m_peer_send_rate;
 };
 
 class ConnectionReceiveThread : public Thread {
@@ -983,13 +1217,16 @@ class ConnectionReceiveThread : public Thread {
 private:
 	void receive();
 
+	// Hands the buffered reliable packets that are next in order on
+	void deliverBufferedPackets();
+
 	// Returns next data from a buffer if possible
 	// If found, returns true; if not, false.
 	// If found, sets peer_id and dst
-	bool getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst);
+	bool getFromBuffers(u16 &peer_id, PacketBuffer &dst);
 
 	bool checkIncomingBuffers(Channel *channel, u16 &peer_id,
-							SharedBuffer<u8> &dst);
+							PacketBuffer &dst);
 
 	/*
 		Processes a packet with the basic header stripped out.
@@ -999,12 +1236,16 @@ class ConnectionReceiveThread : public Thread {
 			channelnum: channel on which the packet was sent
 			reliable: true if recursing into a reliable packet
 	*/
-	SharedBuffer<u8> processPacket(Channel *channel,
-							SharedBuffer<u8> packetdata, u16 peer_id,
+	PacketBuffer processPacket(Channel *channel,
+							PacketBuffer packetdata, u16 peer_id,
 							u8 channelnum, bool reliable);
 
 
 	Connection*           m_connection;
+	// Datagrams received together, each into one of m_receive_buffers.
+	// A buffer is replaced once received data keeps a view of it.
+	std::vector<UDPDatagram> m_datagrams;
+	std::vector<PacketBuffer> m_receive_buffers;
 };
 
 class Connection
@@ -1027,7 +1268,10 @@ class Connection
 	bool Connected();
 	void Disconnect();
 	void Receive(NetworkPacket* pkt);
-	void Send(u16 peer_id, u8 channelnum, NetworkPacket* pkt, bool reliable);
+	// Returns false at once if nothing has been received
+	bool TryReceive(NetworkPacket* pkt);
+	void Send(u16 peer_id, u8 channelnum, NetworkPacket* pkt, bool reliable,
+			SendClass send_class = SEND_CLASS_CONTROL);
 	u16 GetPeerID() { return m_peer_id; }
 	Address GetPeerAddress(u16 peer_id);
 	float getPeerStat(u16 peer_id, rtt_stat_type type);
@@ -1036,6 +1280,11 @@ class Connection
 	const std::string getDesc();
 	void DisconnectPeer(u16 peer_id);
 
+	// Used for the peers that haven't been set up yet
+	void setCongestionControl(CongestionControl type)
+		{ m_congestion_control = type; }
+	CongestionControl getCongestionControl() { return m_congestion_control; }
+
 protected:
 	PeerHelper getPeer(u16 peer_id);
 	PeerHelper getPeerNoEx(u16 peer_id);
@@ -1068,6 +1317,8 @@ class Connection
 private:
 	std::list<Peer*> getPeers();
 
+	bool receive(NetworkPacket* pkt, u32 timeout_ms);
+
 	MutexedQueue<ConnectionEvent> m_event_queue;
 
 	u16 m_peer_id;
@@ -1089,6 +1340,8 @@ class Connection
 	bool m_shutting_down;
 
 	u16 m_next_remote_peer_id;
+
+	CongestionControl m_congestion_control;
 };
 
 } // namespace
@@ -25,18 +25,26 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 NetworkPacket::NetworkPacket(u16 command, u32 datasize, u16 peer_id):
 m_datasize(datasize), m_read_offset(0), m_command(command), m_peer_id(peer_id)
 {
-	m_data.resize(m_datasize);
+	allocate();
 }
 
 NetworkPacket::NetworkPacket(u16 command, u32 datasize):
 m_datasize(datasize), m_read_offset(0), m_command(command), m_peer_id(0)
 {
-	m_data.resize(m_datasize);
+	allocate();
 }
 
 NetworkPacket::~NetworkPacket()
 {
-	m_data.clear();
+}
+
+void NetworkPacket::allocate()
+{
+	// The command is kept in front of the data, so that getRawPacket()
+	// doesn't need to copy
+	PacketBuffer raw(2 + m_datasize);
+	writeU16(&raw[0], m_command);
+	m_data = raw.view(2, m_datasize);
 }
 
 void NetworkPacket::checkReadOffset(u32 from_offset, u32 field_size)
@@ -49,35 +57,32 @@ void NetworkPacket::checkReadOffset(u32 from_offset, u32 field_size)
 	}
 }
 
-void NetworkPacket::putRawPacket(u8 *data, u32 datasize, u16 peer_id)
+void NetworkPacket::putRawPacket(const PacketBuffer &data, u16 peer_id)
 {
 	// If a m_command is already set, we are rewriting on same packet
 	// This is not permitted
 	assert(m_command == 0);
 
-	m_datasize = datasize - 2;
+	m_datasize = data.getSize() - 2;
 	m_peer_id = peer_id;
 
 	// split command and datas
 	m_command = readU16(&data[0]);
-	m_data = std::vector<u8>(&data[2], &data[2 + m_datasize]);
+	m_data = data.view(2, m_datasize);
 }
 
 char* NetworkPacket::getString(u32 from_offset)
 {
 	checkReadOffset(from_offset, 0);
 
-	return (char*)&m_data[from_offset];
+	return (char*)*m_data + from_offset;
 }
 
 void NetworkPacket::putRawString(const char* src, u32 len)
 {
-	if (m_read_offset + len > m_datasize) {
-		m_datasize = m_read_offset + len;
-		m_data.resize(m_datasize);
-	}
+	checkDataSize(len);
 
-	memcpy(&m_data[m_read_offset], src, len);
+	memcpy(*m_data + m_read_offset, src, len);
 	m_read_offset += len;
 }
 
@@ -507,14 +512,7 @@ NetworkPacket& NetworkPacket::operator<<(video::SColor src)
 	return *this;
 }
 
-Buffer<u8> NetworkPacket::oldForgePacket()
+PacketBuffer NetworkPacket::getRawPacket()
 {
-	Buffer<u8> sb(m_datasize + 2);
-	writeU16(&sb[0], m_command);
-
-	u8* datas = getU8Ptr(0);
-
-	if (datas != NULL)
-		memcpy(&sb[2], datas, m_datasize);
-	return sb;
+	return m_data.expand(2);
 }
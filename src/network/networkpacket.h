@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define NETWORKPACKET_HEADER
 
 #include "util/pointer.h"
+#include "network/packetbuffer.h"
 #include "util/numeric.h"
 #include "networkprotocol.h"
 
@@ -34,7 +35,8 @@ class NetworkPacket
 				m_peer_id(0) {}
 		~NetworkPacket();
 
-		void putRawPacket(u8 *data, u32 datasize, u16 peer_id);
+		// Takes the command and data from a received packet, sharing its buffer
+		void putRawPacket(const PacketBuffer &data, u16 peer_id);
 
 		// Getters
 		u32 getSize() { return m_datasize; }
@@ -108,9 +110,10 @@ class NetworkPacket
 		NetworkPacket& operator>>(video::SColor& dst);
 		NetworkPacket& operator<<(video::SColor src);
 
-		// Temp, we remove SharedBuffer when migration finished
-		Buffer<u8> oldForgePacket();
+		// Command and data as sent, sharing the buffer of the packet
+		PacketBuffer getRawPacket();
 private:
+		void allocate();
 		void checkReadOffset(u32 from_offset, u32 field_size);
 
 		inline void checkDataSize(u32 field_size)
@@ -118,10 +121,13 @@ class NetworkPacket
 			if (m_read_offset + field_size > m_datasize) {
 				m_datasize = m_read_offset + field_size;
 				m_data.resize(m_datasize);
+			} else {
+				// The buffer may have been handed to the connection
+				m_data.makeUnique();
 			}
 		}
 
-		std::vector<u8> m_data;
+		PacketBuffer m_data;
 		u32 m_datasize;
 		u32 m_read_offset;
 		u16 m_command;
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef NETWORKPROTOCOL_HEADER
 #define NETWORKPROTOCOL_HEADER
 #include "util/string.h"
+#include "serialization.h"
 
 /*
 	changes by PROTOCOL_VERSION:
@@ -132,9 +133,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		Rename GENERIC_CMD_SET_ATTACHMENT to GENERIC_CMD_ATTACH_TO
 	PROTOCOL_VERSION 26:
 		Add TileDef tileable_horizontal, tileable_vertical flags
+	PROTOCOL_VERSION 27:
+		Add GENERIC_CMD_UPDATE_POSITION_BASE and
+			GENERIC_CMD_UPDATE_POSITION_DELTA for positions of objects
+			relative to a base the client keeps
 */
 
-#define LATEST_PROTOCOL_VERSION 26
+#define LATEST_PROTOCOL_VERSION 27
 
 // Server's supported network protocol range
 #define SERVER_PROTOCOL_VERSION_MIN 13
@@ -897,8 +902,13 @@ enum AccessDeniedCode {
 	SERVER_ACCESSDENIED_MAX,
 };
 
+// Flags; the block flags allow map blocks of serialization version
+// SER_FMT_VER_BLOCK_CODEC and up to use the codec instead of zlib
 enum NetProtoCompressionMode {
 	NETPROTO_COMPRESSION_NONE = 0,
+	NETPROTO_COMPRESSION_BLOCK_NONE = 1 << BLOCK_CODEC_NONE,
+	NETPROTO_COMPRESSION_BLOCK_ZSTD = 1 << BLOCK_CODEC_ZSTD,
+	NETPROTO_COMPRESSION_BLOCK_LZ4 = 1 << BLOCK_CODEC_LZ4,
 };
 
 const static std::string accessDeniedStrings[SERVER_ACCESSDENIED_MAX] = {
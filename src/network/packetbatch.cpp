@@ -0,0 +1,76 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "network/packetbatch.h"
+#include "network/networkpacket.h"
+#include "network/serveropcodes.h"
+#include "threading/workerpool.h"
+
+// Handles the packets of the peers, one peer per item
+class PacketBatchJob : public WorkerJob
+{
+public:
+	PacketBatchJob(PacketBatchHandler *handler,
+			std::vector<std::vector<NetworkPacket*> > &packets):
+		m_handler(handler),
+		m_packets(packets)
+	{
+	}
+
+	void work(u32 item, u32 thread)
+	{
+		std::vector<NetworkPacket*> &packets = m_packets[item];
+		for (size_t i = 0; i < packets.size(); i++)
+			m_handler->processPacket(packets[i]);
+	}
+
+private:
+	PacketBatchHandler *m_handler;
+	std::vector<std::vector<NetworkPacket*> > &m_packets;
+};
+
+PacketBatch::PacketBatch():
+	m_any_env_free(false)
+{
+}
+
+void PacketBatch::add(NetworkPacket *pkt)
+{
+	u16 command = pkt->getCommand();
+	if (command < TOSERVER_NUM_MSG_TYPES &&
+			toServerCommandTable[command].env_access == TOSERVER_ENV_FREE)
+		m_any_env_free = true;
+
+	std::map<u16, u32>::iterator it = m_peer_items.find(pkt->getPeerId());
+	if (it == m_peer_items.end()) {
+		it = m_peer_items.insert(std::make_pair(pkt->getPeerId(),
+				(u32)m_packets.size())).first;
+		m_packets.push_back(std::vector<NetworkPacket*>());
+	}
+	m_packets[it->second].push_back(pkt);
+}
+
+void PacketBatch::process(WorkerPool *pool, PacketBatchHandler *handler)
+{
+	// Packets that all lock the environment would just wait for each
+	// other, so the helpers are only woken if some of them don't
+	PacketBatchJob job(handler, m_packets);
+	pool->run(&job, m_packets.size(),
+			m_any_env_free ? 1 : m_packets.size() + 1);
+}
@@ -0,0 +1,67 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PACKETBATCH_HEADER
+#define PACKETBATCH_HEADER
+
+#include "irrlichttypes.h"
+#include <map>
+#include <vector>
+
+class NetworkPacket;
+class WorkerPool;
+
+/*
+	Handles the packets of a PacketBatch. processPacket() is called on
+	the threads of a WorkerPool, so it must not throw.
+*/
+class PacketBatchHandler
+{
+public:
+	virtual ~PacketBatchHandler() {}
+	virtual void processPacket(NetworkPacket *pkt) = 0;
+};
+
+/*
+	Packets received together, grouped by peer. The peers are handled in
+	parallel, the packets of one peer one after another in the order they
+	were added.
+*/
+class PacketBatch
+{
+public:
+	PacketBatch();
+
+	// The batch doesn't take ownership of the packet
+	void add(NetworkPacket *pkt);
+
+	size_t getPeerCount() const { return m_packets.size(); }
+
+	// Hands every packet to handler and returns once all are handled
+	void process(WorkerPool *pool, PacketBatchHandler *handler);
+
+private:
+	// Index in m_packets of each peer
+	std::map<u16, u32> m_peer_items;
+	std::vector<std::vector<NetworkPacket*> > m_packets;
+	// Whether some packet is handled without the environment locked
+	bool m_any_env_free;
+};
+
+#endif
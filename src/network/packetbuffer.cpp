@@ -0,0 +1,263 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "packetbuffer.h"
+#include "threading/mutex.h"
+#include "threading/mutex_auto_lock.h"
+#include "util/numeric.h"
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Storages are pooled in sizes of powers of two from this one on
+#define PACKET_POOL_MIN_STORAGE 64
+#define PACKET_POOL_SIZES 11
+#define PACKET_POOL_NO_SIZE 0xff
+
+struct PacketStorage
+{
+	Atomic<u32> refcount;
+	// Start of the bytes in use; the room before it is free for prepend()
+	Atomic<u32> front;
+	u32 capacity;
+	u8 size_index;
+	u8 *data;
+};
+
+/*
+	Keeps released storages for reuse, as the connection threads create
+	and drop buffers for every packet.
+*/
+class PacketPool
+{
+public:
+	~PacketPool()
+	{
+		for (u32 i = 0; i < PACKET_POOL_SIZES; i++) {
+			for (size_t j = 0; j < m_free[i].size(); j++)
+				destroy(m_free[i][j]);
+		}
+	}
+
+	PacketStorage *allocate(u32 capacity)
+	{
+		u8 size_index = PACKET_POOL_NO_SIZE;
+		if (capacity <= PACKET_POOL_MAX_STORAGE) {
+			size_index = 0;
+			while ((u32)PACKET_POOL_MIN_STORAGE << size_index < capacity)
+				size_index++;
+			capacity = PACKET_POOL_MIN_STORAGE << size_index;
+
+			MutexAutoLock lock(m_mutex);
+			std::vector<PacketStorage *> &storages = m_free[size_index];
+			if (!storages.empty()) {
+				PacketStorage *storage = storages.back();
+				storages.pop_back();
+				return storage;
+			}
+		}
+
+		u8 *memory = new u8[sizeof(PacketStorage) + capacity];
+		PacketStorage *storage = new (memory) PacketStorage;
+		storage->capacity = capacity;
+		storage->size_index = size_index;
+		storage->data = memory + sizeof(PacketStorage);
+		return storage;
+	}
+
+	void release(PacketStorage *storage)
+	{
+		if (storage->size_index != PACKET_POOL_NO_SIZE) {
+			MutexAutoLock lock(m_mutex);
+			std::vector<PacketStorage *> &storages = m_free[storage->size_index];
+			if (storages.size() * storage->capacity < PACKET_POOL_MAX_BYTES_PER_SIZE) {
+				storages.push_back(storage);
+				return;
+			}
+		}
+		destroy(storage);
+	}
+
+private:
+	static void destroy(PacketStorage *storage)
+	{
+		storage->~PacketStorage();
+		delete[] (u8 *)storage;
+	}
+
+	Mutex m_mutex;
+	std::vector<PacketStorage *> m_free[PACKET_POOL_SIZES];
+};
+
+static PacketPool g_packet_pool;
+
+static PacketStorage *newStorage(u32 size)
+{
+	PacketStorage *storage =
+		g_packet_pool.allocate(PACKET_BUFFER_HEADROOM + size);
+	storage->refcount = 1;
+	storage->front = PACKET_BUFFER_HEADROOM;
+	return storage;
+}
+
+PacketBuffer::PacketBuffer():
+	m_storage(NULL),
+	m_data(NULL),
+	m_size(0)
+{
+}
+
+PacketBuffer::PacketBuffer(u32 size):
+	m_storage(NULL),
+	m_data(NULL),
+	m_size(size)
+{
+	if (size == 0)
+		return;
+	m_storage = newStorage(size);
+	m_data = m_storage->data + PACKET_BUFFER_HEADROOM;
+	memset(m_data, 0, size);
+}
+
+PacketBuffer::PacketBuffer(const u8 *data, u32 size):
+	m_storage(NULL),
+	m_data(NULL),
+	m_size(size)
+{
+	if (size == 0)
+		return;
+	m_storage = newStorage(size);
+	m_data = m_storage->data + PACKET_BUFFER_HEADROOM;
+	memcpy(m_data, data, size);
+}
+
+PacketBuffer::PacketBuffer(const PacketBuffer &buffer):
+	m_storage(buffer.m_storage),
+	m_data(buffer.m_data),
+	m_size(buffer.m_size)
+{
+	if (m_storage)
+		m_storage->refcount++;
+}
+
+PacketBuffer &PacketBuffer::operator=(const PacketBuffer &buffer)
+{
+	if (buffer.m_storage)
+		buffer.m_storage->refcount++;
+	drop();
+	m_storage = buffer.m_storage;
+	m_data = buffer.m_data;
+	m_size = buffer.m_size;
+	return *this;
+}
+
+PacketBuffer::~PacketBuffer()
+{
+	drop();
+}
+
+void PacketBuffer::drop()
+{
+	if (m_storage && --m_storage->refcount == 0)
+		g_packet_pool.release(m_storage);
+	m_storage = NULL;
+}
+
+PacketBuffer PacketBuffer::view(u32 offset, u32 size) const
+{
+	assert(offset + size <= m_size);
+	PacketBuffer b(*this);
+	b.m_data += offset;
+	b.m_size = size;
+	return b;
+}
+
+PacketBuffer PacketBuffer::expand(u32 size) const
+{
+	assert(m_storage && m_data - m_storage->data >= (ptrdiff_t)size);
+	PacketBuffer b(*this);
+	b.m_data -= size;
+	b.m_size += size;
+	return b;
+}
+
+PacketBuffer PacketBuffer::prepend(u32 size) const
+{
+	if (m_storage) {
+		u32 offset = m_data - m_storage->data;
+		u32 front = offset;
+		if (offset >= size &&
+				m_storage->front.compare_exchange_strong(front, offset - size))
+			return expand(size);
+	}
+
+	PacketBuffer b;
+	b.m_storage = newStorage(size + m_size);
+	b.m_data = b.m_storage->data + PACKET_BUFFER_HEADROOM;
+	b.m_size = size + m_size;
+	if (m_size > 0)
+		memcpy(b.m_data + size, m_data, m_size);
+	return b;
+}
+
+void PacketBuffer::resize(u32 size)
+{
+	if (!m_storage) {
+		*this = PacketBuffer(size);
+		return;
+	}
+
+	u32 offset = m_data - m_storage->data;
+	if (offset + size > m_storage->capacity)
+		reallocate(MYMAX(size, 2 * m_size));
+	else if (!isUnique())
+		reallocate(size);
+
+	if (size > m_size)
+		memset(m_data + m_size, 0, size - m_size);
+	m_size = size;
+}
+
+bool PacketBuffer::isUnique() const
+{
+	return !m_storage || m_storage->refcount == 1;
+}
+
+void PacketBuffer::makeUnique()
+{
+	if (!isUnique())
+		reallocate(m_size);
+}
+
+void PacketBuffer::reallocate(u32 size)
+{
+	u32 offset = m_data - m_storage->data;
+	u32 front = MYMIN((u32)m_storage->front, offset);
+	u32 keep = offset - front + MYMIN(m_size, size);
+
+	PacketStorage *storage = g_packet_pool.allocate(offset + size);
+	storage->refcount = 1;
+	storage->front = front;
+	memcpy(storage->data + front, m_storage->data + front, keep);
+
+	drop();
+	m_storage = storage;
+	m_data = storage->data + offset;
+	m_size = MYMIN(m_size, size);
+}
@@ -0,0 +1,118 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PACKETBUFFER_HEADER
+#define PACKETBUFFER_HEADER
+
+#include "irrlichttypes.h"
+#include "threading/atomic.h"
+#include "debug.h"
+
+/*
+	Bytes kept free in front of the data of a new PacketBuffer, enough
+	for all the headers the connection puts in front of a packet
+	(split: 7 + 3 + 7 bytes).
+*/
+#define PACKET_BUFFER_HEADROOM 32
+
+// Released storages of up to this size are kept for reuse
+#define PACKET_POOL_MAX_STORAGE (64 * 1024)
+// Bytes of free storages kept per storage size
+#define PACKET_POOL_MAX_BYTES_PER_SIZE (1024 * 1024)
+
+struct PacketStorage;
+
+/*
+	Reference counted buffer for network packets, safe to pass between
+	threads.
+
+	A PacketBuffer is a view of a part of a storage, and views of the same
+	storage share it instead of copying. Storages come from a pool and
+	have free room in front of the data: prepend() puts a header in front
+	of a view by claiming that room, so a packet is serialized once and
+	the connection only writes its headers around it.
+
+	The bytes a view covers must not be changed while other views of them
+	exist; use isUnique() or makeUnique() before writing into a buffer
+	that has been handed out.
+*/
+class PacketBuffer
+{
+public:
+	PacketBuffer();
+	// New buffer of size bytes, zeroed
+	explicit PacketBuffer(u32 size);
+	// Copies size bytes from data
+	PacketBuffer(const u8 *data, u32 size);
+	PacketBuffer(const PacketBuffer &buffer);
+	PacketBuffer &operator=(const PacketBuffer &buffer);
+	~PacketBuffer();
+
+	u8 &operator[](u32 i) const
+	{
+		assert(i < m_size);
+		return m_data[i];
+	}
+	u8 *operator*() const
+	{
+		return m_data;
+	}
+	u32 getSize() const
+	{
+		return m_size;
+	}
+
+	// View of size bytes from offset on, sharing the storage
+	PacketBuffer view(u32 offset, u32 size) const;
+
+	/*
+		View that starts size bytes earlier. The bytes must have been
+		written by the owner of this buffer, e.g. when it made this
+		buffer as a view past them.
+	*/
+	PacketBuffer expand(u32 size) const;
+
+	/*
+		Returns a buffer with size bytes in front of the data of this one
+		for the caller to write a header into. The free room in front of
+		the storage is used if this view starts where the room ends,
+		otherwise the data is copied into a new buffer.
+	*/
+	PacketBuffer prepend(u32 size) const;
+
+	// Changes the size, new bytes are zeroed. Makes the buffer unique.
+	void resize(u32 size);
+
+	// True if no other buffer shares the storage
+	bool isUnique() const;
+	// Copies the data into an own storage if it is shared
+	void makeUnique();
+
+private:
+	void drop();
+	// Moves the data and the bytes in front of it up to the claimed
+	// front into a new storage with room for size bytes of data
+	void reallocate(u32 size);
+
+	PacketStorage *m_storage;
+	u8 *m_data;
+	u32 m_size;
+};
+
+#endif
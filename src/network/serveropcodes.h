@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "server.h"
 #include "networkprotocol.h"
 #include "networkpacket.h"
+#include "connection.h"
 
 enum ToServerConnectionState {
 	TOSERVER_STATE_NOT_CONNECTED,
@@ -31,11 +32,28 @@ enum ToServerConnectionState {
 	TOSERVER_STATE_INGAME,
 	TOSERVER_STATE_ALL,
 };
+
+// Whether a handler needs the environment locked while it runs
+enum ToServerEnvAccess {
+	TOSERVER_ENV_LOCKED,
+	/*
+		Runs without m_env_mutex, on a packet thread, in parallel with
+		the packets of other peers (see PacketBatch). Such a handler may
+		only use what is safe to share between threads: the client list
+		through its locking methods, Send(), settings and the members set
+		at startup, like m_block_codec. It must lock m_env_mutex itself
+		around anything else, in particular script calls and m_env.
+		Exceptions are caught by Server::processPacket().
+	*/
+	TOSERVER_ENV_FREE,
+};
+
 struct ToServerCommandHandler
 {
     const std::string name;
     ToServerConnectionState state;
     void (Server::*handler)(NetworkPacket* pkt);
+    ToServerEnvAccess env_access;
 };
 
 struct ClientCommandFactory
@@ -43,6 +61,8 @@ struct ClientCommandFactory
 	const char* name;
 	u16 channel;
 	bool reliable;
+	// Class the packet is scheduled in when sending
+	con::SendClass send_class;
 };
 
 extern const ToServerCommandHandler toServerCommandTable[TOSERVER_NUM_MSG_TYPES];
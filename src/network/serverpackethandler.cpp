@@ -192,7 +192,12 @@ void Server::handleCommand_Init(NetworkPacket* pkt)
 		return;
 	}
 
+	/*
+		This handler runs without the environment locked; it is only
+		locked around the script calls, where mods might touch it.
+	*/
 	{
+		MutexAutoLock envlock(m_env_mutex);
 		std::string reason;
 		if (m_script->on_prejoinplayer(playername, addr_s, &reason)) {
 			actionstream << "Server: Player with the name \"" << playerName << "\" "
@@ -210,24 +215,29 @@ void Server::handleCommand_Init(NetworkPacket* pkt)
 
 	// Enforce user limit.
 	// Don't enforce for users that have some admin right
-	if (m_clients.getClientIDs(CS_Created).size() >= g_settings->getU16("max_users") &&
-			!checkPriv(playername, "server") &&
-			!checkPriv(playername, "ban") &&
-			!checkPriv(playername, "privs") &&
-			!checkPriv(playername, "password") &&
-			playername != g_settings->get("name")) {
-		actionstream << "Server: " << playername << " tried to join from "
-				<< addr_s << ", but there" << " are already max_users="
-				<< g_settings->getU16("max_users") << " players." << std::endl;
-		DenyAccess(pkt->getPeerId(), SERVER_ACCESSDENIED_TOO_MANY_USERS);
-		return;
+	std::string encpwd; // encrypted Password field for the user
+	bool has_auth;
+	{
+		MutexAutoLock envlock(m_env_mutex);
+		if (m_clients.getClientIDs(CS_Created).size() >= g_settings->getU16("max_users") &&
+				!checkPriv(playername, "server") &&
+				!checkPriv(playername, "ban") &&
+				!checkPriv(playername, "privs") &&
+				!checkPriv(playername, "password") &&
+				playername != g_settings->get("name")) {
+			actionstream << "Server: " << playername << " tried to join from "
+					<< addr_s << ", but there" << " are already max_users="
+					<< g_settings->getU16("max_users") << " players." << std::endl;
+			DenyAccess(pkt->getPeerId(), SERVER_ACCESSDENIED_TOO_MANY_USERS);
+			return;
+		}
+
+		has_auth = m_script->getAuth(playername, &encpwd, NULL);
 	}
 
 	/*
 		Compose auth methods for answer
 	*/
-	std::string encpwd; // encrypted Password field for the user
-	bool has_auth = m_script->getAuth(playername, &encpwd, NULL);
 	u32 auth_mechs = 0;
 
 	client->chosen_mech = AUTH_MECHANISM_NONE;
@@ -278,7 +288,12 @@ void Server::handleCommand_Init(NetworkPacket* pkt)
 	NetworkPacket resp_pkt(TOCLIENT_HELLO, 1 + 4
 		+ legacyPlayerNameCasing.size(), pkt->getPeerId());
 
+	// Map blocks use the codec of the map if the client can read it
 	u16 depl_compress_mode = NETPROTO_COMPRESSION_NONE;
+	if (depl_serial_v >= SER_FMT_VER_BLOCK_CODEC
+			&& m_block_codec != BLOCK_CODEC_ZLIB
+			&& (supp_compr_modes & (1 << m_block_codec)))
+		depl_compress_mode = 1 << m_block_codec;
 	resp_pkt << depl_serial_v << depl_compress_mode << net_proto_version
 		<< auth_mechs << legacyPlayerNameCasing;
 
@@ -678,7 +693,7 @@ void Server::handleCommand_RequestMedia(NetworkPacket* pkt)
 	*pkt >> numfiles;
 
 	infostream << "Sending " << numfiles << " files to "
-			<< getPlayerName(pkt->getPeerId()) << std::endl;
+			<< getClient(pkt->getPeerId(), CS_InitDone)->getName() << std::endl;
 	verbosestream << "TOSERVER_REQUEST_MEDIA: " << std::endl;
 
 	for (u16 i = 0; i < numfiles; i++) {
@@ -2035,6 +2050,7 @@ void Server::handleCommand_SrpBytesM(NetworkPacket* pkt)
 	}
 
 	if (client->create_player_on_auth_success) {
+		MutexAutoLock envlock(m_env_mutex);
 		std::string playername = client->getName();
 		m_script->createAuth(playername, client->enc_pwd);
 
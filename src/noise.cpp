@@ -31,20 +31,7 @@
 #include "util/numeric.h"
 #include "util/string.h"
 #include "exceptions.h"
-
-#define NOISE_MAGIC_X    1619
-#define NOISE_MAGIC_Y    31337
-#define NOISE_MAGIC_Z    52591
-#define NOISE_MAGIC_SEED 1013
-
-typedef float (*Interp2dFxn)(
-		float v00, float v10, float v01, float v11,
-		float x, float y);
-
-typedef float (*Interp3dFxn)(
-		float v000, float v100, float v010, float v110,
-		float v001, float v101, float v011, float v111,
-		float x, float y, float z);
+#include "noise_kernels.h"
 
 float cos_lookup[16] = {
 	1.0,  0.9238,  0.7071,  0.3826, 0, -0.3826, -0.7071, -0.9238,
@@ -158,21 +145,15 @@ s32 PcgRandom::randNormalDist(s32 min, s32 max, int num_trials)
 
 float noise2d(int x, int y, int seed)
 {
-	unsigned int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
-	n = (n >> 13) ^ n;
-	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)(int)n / 0x40000000;
+	return noise_lattice_value(NOISE_MAGIC_X * (u32)x + NOISE_MAGIC_Y * (u32)y
+			+ NOISE_MAGIC_SEED * (u32)seed);
 }
 
 
 float noise3d(int x, int y, int z, int seed)
 {
-	unsigned int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y + NOISE_MAGIC_Z * z
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
-	n = (n >> 13) ^ n;
-	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)(int)n / 0x40000000;
+	return noise_lattice_value(NOISE_MAGIC_X * (u32)x + NOISE_MAGIC_Y * (u32)y
+			+ NOISE_MAGIC_Z * (u32)z + NOISE_MAGIC_SEED * (u32)seed);
 }
 
 
@@ -424,9 +405,13 @@ Noise::Noise(NoiseParams *np_, int seed, u32 sx, u32 sy, u32 sz)
 	this->sy   = sy;
 	this->sz   = sz;
 
-	this->persist_buf  = NULL;
-	this->gradient_buf = NULL;
-	this->result       = NULL;
+	this->persist_buf   = NULL;
+	this->gradient_buf  = NULL;
+	this->result        = NULL;
+	this->interp_buf    = NULL;
+	this->lattice_index = NULL;
+	this->lattice_t     = NULL;
+	this->kernels       = getBestNoiseKernels();
 
 	allocBuffers();
 }
@@ -438,6 +423,9 @@ Noise::~Noise()
 	delete[] persist_buf;
 	delete[] noise_buf;
 	delete[] result;
+	delete[] interp_buf;
+	delete[] lattice_index;
+	delete[] lattice_t;
 }
 
 
@@ -456,12 +444,16 @@ void Noise::allocBuffers()
 	delete[] gradient_buf;
 	delete[] persist_buf;
 	delete[] result;
+	delete[] lattice_index;
+	delete[] lattice_t;
 
 	try {
 		size_t bufsize = sx * sy * sz;
-		this->persist_buf  = NULL;
-		this->gradient_buf = new float[bufsize];
-		this->result       = new float[bufsize];
+		this->persist_buf   = NULL;
+		this->gradient_buf  = new float[bufsize];
+		this->result        = new float[bufsize];
+		this->lattice_index = new u32[sx + sy + sz];
+		this->lattice_t     = new float[sx + sy + sz];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
@@ -520,8 +512,10 @@ void Noise::resizeNoiseBuf(bool is3d)
 	size_t nlz = is3d ? (size_t)ceil(num_noise_points_z) + 3 : 1;
 
 	delete[] noise_buf;
+	delete[] interp_buf;
 	try {
-		noise_buf = new float[nlx * nly * nlz];
+		noise_buf  = new float[nlx * nly * nlz];
+		interp_buf = new float[sx * nly * nlz];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
@@ -529,95 +523,96 @@ void Noise::resizeNoiseBuf(bool is3d)
 
 
 /*
+ * Walks the noise lattice along one axis the way the interpolation steps
+ * through it, storing the lattice index and interpolation factor of each
+ * of the count points.
+ */
+static void walkLattice(u32 *index, float *t,
+		float frac, float step, u32 count, bool eased)
+{
+	u32 n = 0;
+	for (u32 i = 0; i != count; i++) {
+		index[i] = n;
+		t[i] = eased ? easeCurve(frac) : frac;
+
+		frac += step;
+		if (frac >= 1.0) {
+			frac -= 1.0;
+			n++;
+		}
+	}
+}
+
+
+/*
+ * The lattice rows are interpolated along x first, into interp_buf. The
+ * points of a map row then only interpolate between two of those rows
+ * (four in 3D), which takes the same operations in the same order as
+ * interpolating each point from its lattice corners, and runs over whole
+ * rows at once.
+ *
  * NB:  This algorithm is not optimal in terms of space complexity.  The entire
  * integer lattice of noise points could be done as 2 lines instead, and for 3D,
  * 2 lines + 2 planes.
- * However, this would require the noise calls to be interposed with the
- * interpolation loops, which may trash the icache, leading to lower overall
- * performance.
  * Another optimization that could save half as many noise calls is to carry over
  * values from the previous noise lattice as midpoints in the new lattice for the
  * next octave.
  */
-#define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(
 		float x, float y,
 		float step_x, float step_y,
 		int seed)
 {
-	float v00, v01, v10, v11, u, v, orig_u;
-	u32 index, i, j, noisex, noisey;
-	u32 nlx, nly;
+	u32 j, nlx, nly, nrows;
 	s32 x0, y0;
+	float u, v;
 
 	bool eased = np.flags & (NOISE_FLAG_DEFAULTS | NOISE_FLAG_EASED);
-	Interp2dFxn interpolate = eased ?
-		biLinearInterpolation : biLinearInterpolationNoEase;
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (u32)(u + sx * step_x) + 2;
 	nly = (u32)(v + sy * step_y) + 2;
-	index = 0;
-	for (j = 0; j != nly; j++)
-		for (i = 0; i != nlx; i++)
-			noise_buf[index++] = noise2d(x0 + i, y0 + j, seed);
+	for (j = 0; j != nly; j++) {
+		kernels->fillLattice(noise_buf + j * nlx, nlx, x0,
+			NOISE_MAGIC_Y * (u32)(y0 + j) + NOISE_MAGIC_SEED * (u32)seed);
+	}
+
+	u32 *index_x = lattice_index;
+	u32 *index_y = lattice_index + sx;
+	float *t_x = lattice_t;
+	float *t_y = lattice_t + sx;
+	walkLattice(index_x, t_x, u, step_x, sx, eased);
+	walkLattice(index_y, t_y, v, step_y, sy, eased);
 
 	//calculate interpolations
-	index  = 0;
-	noisey = 0;
-	for (j = 0; j != sy; j++) {
-		v00 = noise_buf[idx(0, noisey)];
-		v10 = noise_buf[idx(1, noisey)];
-		v01 = noise_buf[idx(0, noisey + 1)];
-		v11 = noise_buf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			gradient_buf[index++] = interpolate(v00, v10, v01, v11, u, v);
-
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noise_buf[idx(noisex + 1, noisey)];
-				v11 = noise_buf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+	nrows = index_y[sy - 1] + 2;
+	for (j = 0; j != nrows; j++)
+		kernels->interpolateX(interp_buf + j * sx, noise_buf + j * nlx,
+			index_x, t_x, sx);
 
-		v += step_y;
-		if (v >= 1.0) {
-			v -= 1.0;
-			noisey++;
-		}
+	for (j = 0; j != sy; j++) {
+		const float *row = interp_buf + index_y[j] * sx;
+		kernels->interpolateY(gradient_buf + j * sx, row, row + sx,
+			t_y[j], sx);
 	}
 }
-#undef idx
 
 
-#define idx(x, y, z) ((z) * nly * nlx + (y) * nlx + (x))
 void Noise::gradientMap3D(
 		float x, float y, float z,
 		float step_x, float step_y, float step_z,
 		int seed)
 {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	u32 index, i, j, k, noisex, noisey, noisez;
-	u32 nlx, nly, nlz;
+	u32 j, k, nlx, nly, nlz, nrows, nplanes;
 	s32 x0, y0, z0;
+	float u, v, w;
 
-	Interp3dFxn interpolate = (np.flags & NOISE_FLAG_EASED) ?
-		triLinearInterpolation : triLinearInterpolationNoEase;
+	bool eased = np.flags & NOISE_FLAG_EASED;
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -625,74 +620,47 @@ void Noise::gradientMap3D(
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
-	orig_v = v;
 
 	//calculate noise point lattice
 	nlx = (u32)(u + sx * step_x) + 2;
 	nly = (u32)(v + sy * step_y) + 2;
 	nlz = (u32)(w + sz * step_z) + 2;
-	index = 0;
 	for (k = 0; k != nlz; k++)
-		for (j = 0; j != nly; j++)
-			for (i = 0; i != nlx; i++)
-				noise_buf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
+	for (j = 0; j != nly; j++) {
+		kernels->fillLattice(noise_buf + (k * nly + j) * nlx, nlx, x0,
+			NOISE_MAGIC_Y * (u32)(y0 + j) + NOISE_MAGIC_Z * (u32)(z0 + k)
+			+ NOISE_MAGIC_SEED * (u32)seed);
+	}
+
+	u32 *index_x = lattice_index;
+	u32 *index_y = lattice_index + sx;
+	u32 *index_z = lattice_index + sx + sy;
+	float *t_x = lattice_t;
+	float *t_y = lattice_t + sx;
+	float *t_z = lattice_t + sx + sy;
+	walkLattice(index_x, t_x, u, step_x, sx, eased);
+	walkLattice(index_y, t_y, v, step_y, sy, eased);
+	walkLattice(index_z, t_z, w, step_z, sz, eased);
 
 	//calculate interpolations
-	index  = 0;
-	noisey = 0;
-	noisez = 0;
-	for (k = 0; k != sz; k++) {
-		v = orig_v;
-		noisey = 0;
-		for (j = 0; j != sy; j++) {
-			v000 = noise_buf[idx(0, noisey,     noisez)];
-			v100 = noise_buf[idx(1, noisey,     noisez)];
-			v010 = noise_buf[idx(0, noisey + 1, noisez)];
-			v110 = noise_buf[idx(1, noisey + 1, noisez)];
-			v001 = noise_buf[idx(0, noisey,     noisez + 1)];
-			v101 = noise_buf[idx(1, noisey,     noisez + 1)];
-			v011 = noise_buf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noise_buf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				gradient_buf[index++] = interpolate(
-					v000, v100, v010, v110,
-					v001, v101, v011, v111,
-					u, v, w);
-
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noise_buf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noise_buf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noise_buf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noise_buf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
-
-			v += step_y;
-			if (v >= 1.0) {
-				v -= 1.0;
-				noisey++;
-			}
-		}
+	nrows   = index_y[sy - 1] + 2;
+	nplanes = index_z[sz - 1] + 2;
+	for (k = 0; k != nplanes; k++)
+	for (j = 0; j != nrows; j++) {
+		kernels->interpolateX(interp_buf + (k * nrows + j) * sx,
+			noise_buf + (k * nly + j) * nlx, index_x, t_x, sx);
+	}
 
-		w += step_z;
-		if (w >= 1.0) {
-			w -= 1.0;
-			noisez++;
-		}
+	float *out = gradient_buf;
+	for (k = 0; k != sz; k++)
+	for (j = 0; j != sy; j++) {
+		const float *row0 = interp_buf + (index_z[k] * nrows + index_y[j]) * sx;
+		const float *row1 = row0 + nrows * sx;
+		kernels->interpolateYZ(out, row0, row0 + sx, row1, row1 + sx,
+			t_y[j], t_z[k], sx);
+		out += sx;
 	}
 }
-#undef idx
 
 
 float *Noise::perlinMap2D(float x, float y, float *persistence_map)
@@ -773,27 +741,17 @@ float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
 void Noise::updateResults(float g, float *gmap,
 	float *persistence_map, size_t bufsize)
 {
-	// This looks very ugly, but it is 50-70% faster than having
-	// conditional statements inside the loop
 	if (np.flags & NOISE_FLAG_ABSVALUE) {
-		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * fabs(gradient_buf[i]);
-				gmap[i] *= persistence_map[i];
-			}
-		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * fabs(gradient_buf[i]);
-		}
+		if (persistence_map)
+			kernels->accumulatePersistAbs(result, gmap, gradient_buf,
+				persistence_map, bufsize);
+		else
+			kernels->accumulateAbs(result, gradient_buf, g, bufsize);
 	} else {
-		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * gradient_buf[i];
-				gmap[i] *= persistence_map[i];
-			}
-		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * gradient_buf[i];
-		}
+		if (persistence_map)
+			kernels->accumulatePersist(result, gmap, gradient_buf,
+				persistence_map, bufsize);
+		else
+			kernels->accumulate(result, gradient_buf, g, bufsize);
 	}
 }
@@ -32,6 +32,8 @@
 
 extern FlagDesc flagdesc_noiseparams[];
 
+struct NoiseKernels;
+
 // Note: this class is not polymorphic so that its high level of
 // optimizability may be preserved in the common use case
 class PseudoRandom {
@@ -156,6 +158,12 @@ class Noise {
 	float *gradient_buf;
 	float *persist_buf;
 	float *result;
+	// Lattice rows of noise_buf interpolated along x, one value per x
+	float *interp_buf;
+	// Lattice index and interpolation factor of each x, y and z
+	u32 *lattice_index;
+	float *lattice_t;
+	const NoiseKernels *kernels;
 
 	Noise(NoiseParams *np, int seed, u32 sx, u32 sy, u32 sz=1);
 	~Noise();
@@ -0,0 +1,507 @@
+/*
+ * Minetest
+ * Copyright (C) 2010-2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+ * Copyright (C) 2010-2014 kwolekr, Ryan Kwolek <kwolekr@minetest.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "noise_kernels.h"
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+		(defined(__clang__) || __GNUC__ > 4 || \
+		(__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+	// Built with target attributes, picked by what the CPU supports
+	#include <immintrin.h>
+	#define NOISE_HAVE_SSE2 1
+	#define NOISE_HAVE_AVX2 1
+	#define NOISE_TARGET(t) __attribute__((target(t)))
+#elif defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define NOISE_HAVE_SSE2 1
+	#define NOISE_TARGET(t)
+#endif
+
+/*
+	Scalar kernels, also used for the values left over by the others
+*/
+
+static inline float lerp(float v0, float v1, float t)
+{
+	return v0 + (v1 - v0) * t;
+}
+
+static void fillLatticeScalar(float *out, u32 count, s32 x0, u32 base)
+{
+	for (u32 i = 0; i != count; i++)
+		out[i] = noise_lattice_value(NOISE_MAGIC_X * (u32)(x0 + i) + base);
+}
+
+static void interpolateXScalar(float *out, const float *row,
+		const u32 *index, const float *t, u32 count)
+{
+	for (u32 i = 0; i != count; i++)
+		out[i] = lerp(row[index[i]], row[index[i] + 1], t[i]);
+}
+
+static void interpolateYScalar(float *out, const float *a, const float *b,
+		float t, u32 count)
+{
+	for (u32 i = 0; i != count; i++)
+		out[i] = lerp(a[i], b[i], t);
+}
+
+static void interpolateYZScalar(float *out,
+		const float *a0, const float *b0,
+		const float *a1, const float *b1,
+		float ty, float tz, u32 count)
+{
+	for (u32 i = 0; i != count; i++)
+		out[i] = lerp(lerp(a0[i], b0[i], ty), lerp(a1[i], b1[i], ty), tz);
+}
+
+static void accumulateScalar(float *result, const float *gradient,
+		float g, u32 count)
+{
+	for (u32 i = 0; i != count; i++)
+		result[i] += g * gradient[i];
+}
+
+static void accumulateAbsScalar(float *result, const float *gradient,
+		float g, u32 count)
+{
+	for (u32 i = 0; i != count; i++)
+		result[i] += g * fabs(gradient[i]);
+}
+
+static void accumulatePersistScalar(float *result, float *gmap,
+		const float *gradient, const float *persistence, u32 count)
+{
+	for (u32 i = 0; i != count; i++) {
+		result[i] += gmap[i] * gradient[i];
+		gmap[i] *= persistence[i];
+	}
+}
+
+static void accumulatePersistAbsScalar(float *result, float *gmap,
+		const float *gradient, const float *persistence, u32 count)
+{
+	for (u32 i = 0; i != count; i++) {
+		result[i] += gmap[i] * fabs(gradient[i]);
+		gmap[i] *= persistence[i];
+	}
+}
+
+static const NoiseKernels noise_kernels_scalar = {
+	"scalar",
+	fillLatticeScalar,
+	interpolateXScalar,
+	interpolateYScalar,
+	interpolateYZScalar,
+	accumulateScalar,
+	accumulateAbsScalar,
+	accumulatePersistScalar,
+	accumulatePersistAbsScalar,
+};
+
+#ifdef NOISE_HAVE_SSE2
+
+/*
+	SSE2 kernels, 4 values at once
+*/
+
+// SSE2 has no 32 bit multiply keeping the low halves, so multiply
+// the even and the odd lanes separately and put them back together
+NOISE_TARGET("sse2")
+static inline __m128i mulloSSE2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(
+			_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+			_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+NOISE_TARGET("sse2")
+static inline __m128 lerpSSE2(__m128 v0, __m128 v1, __m128 t)
+{
+	return _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), t));
+}
+
+NOISE_TARGET("sse2")
+static void fillLatticeSSE2(float *out, u32 count, s32 x0, u32 base)
+{
+	const __m128i mask = _mm_set1_epi32(0x7fffffff);
+	const __m128i magic_x = _mm_set1_epi32(NOISE_MAGIC_X);
+	const __m128i vbase = _mm_set1_epi32(base);
+	const __m128i c1 = _mm_set1_epi32(60493);
+	const __m128i c2 = _mm_set1_epi32(19990303);
+	const __m128i c3 = _mm_set1_epi32(1376312589);
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 divisor = _mm_set1_ps(0x40000000);
+	__m128i x = _mm_add_epi32(_mm_set1_epi32(x0), _mm_set_epi32(3, 2, 1, 0));
+	const __m128i four = _mm_set1_epi32(4);
+
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i n = _mm_add_epi32(mulloSSE2(x, magic_x), vbase);
+		n = _mm_and_si128(n, mask);
+		n = _mm_xor_si128(_mm_srli_epi32(n, 13), n);
+		__m128i p = _mm_add_epi32(mulloSSE2(mulloSSE2(n, n), c1), c2);
+		n = _mm_and_si128(_mm_add_epi32(mulloSSE2(n, p), c3), mask);
+		_mm_storeu_ps(out + i, _mm_sub_ps(one,
+				_mm_div_ps(_mm_cvtepi32_ps(n), divisor)));
+		x = _mm_add_epi32(x, four);
+	}
+	fillLatticeScalar(out + i, count - i, x0 + i, base);
+}
+
+NOISE_TARGET("sse2")
+static void interpolateXSSE2(float *out, const float *row,
+		const u32 *index, const float *t, u32 count)
+{
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 v0 = _mm_set_ps(row[index[i + 3]], row[index[i + 2]],
+				row[index[i + 1]], row[index[i]]);
+		__m128 v1 = _mm_set_ps(row[index[i + 3] + 1], row[index[i + 2] + 1],
+				row[index[i + 1] + 1], row[index[i] + 1]);
+		_mm_storeu_ps(out + i, lerpSSE2(v0, v1, _mm_loadu_ps(t + i)));
+	}
+	interpolateXScalar(out + i, row, index + i, t + i, count - i);
+}
+
+NOISE_TARGET("sse2")
+static void interpolateYSSE2(float *out, const float *a, const float *b,
+		float t, u32 count)
+{
+	const __m128 vt = _mm_set1_ps(t);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(out + i, lerpSSE2(_mm_loadu_ps(a + i),
+				_mm_loadu_ps(b + i), vt));
+	}
+	interpolateYScalar(out + i, a + i, b + i, t, count - i);
+}
+
+NOISE_TARGET("sse2")
+static void interpolateYZSSE2(float *out,
+		const float *a0, const float *b0,
+		const float *a1, const float *b1,
+		float ty, float tz, u32 count)
+{
+	const __m128 vty = _mm_set1_ps(ty);
+	const __m128 vtz = _mm_set1_ps(tz);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 u = lerpSSE2(_mm_loadu_ps(a0 + i), _mm_loadu_ps(b0 + i), vty);
+		__m128 v = lerpSSE2(_mm_loadu_ps(a1 + i), _mm_loadu_ps(b1 + i), vty);
+		_mm_storeu_ps(out + i, lerpSSE2(u, v, vtz));
+	}
+	interpolateYZScalar(out + i, a0 + i, b0 + i, a1 + i, b1 + i,
+			ty, tz, count - i);
+}
+
+NOISE_TARGET("sse2")
+static void accumulateSSE2(float *result, const float *gradient,
+		float g, u32 count)
+{
+	const __m128 vg = _mm_set1_ps(g);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 r = _mm_add_ps(_mm_loadu_ps(result + i),
+				_mm_mul_ps(vg, _mm_loadu_ps(gradient + i)));
+		_mm_storeu_ps(result + i, r);
+	}
+	accumulateScalar(result + i, gradient + i, g, count - i);
+}
+
+NOISE_TARGET("sse2")
+static void accumulateAbsSSE2(float *result, const float *gradient,
+		float g, u32 count)
+{
+	const __m128 vg = _mm_set1_ps(g);
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 grad = _mm_and_ps(_mm_loadu_ps(gradient + i), abs_mask);
+		__m128 r = _mm_add_ps(_mm_loadu_ps(result + i), _mm_mul_ps(vg, grad));
+		_mm_storeu_ps(result + i, r);
+	}
+	accumulateAbsScalar(result + i, gradient + i, g, count - i);
+}
+
+NOISE_TARGET("sse2")
+static void accumulatePersistSSE2(float *result, float *gmap,
+		const float *gradient, const float *persistence, u32 count)
+{
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 gm = _mm_loadu_ps(gmap + i);
+		__m128 r = _mm_add_ps(_mm_loadu_ps(result + i),
+				_mm_mul_ps(gm, _mm_loadu_ps(gradient + i)));
+		_mm_storeu_ps(result + i, r);
+		_mm_storeu_ps(gmap + i, _mm_mul_ps(gm, _mm_loadu_ps(persistence + i)));
+	}
+	accumulatePersistScalar(result + i, gmap + i, gradient + i,
+			persistence + i, count - i);
+}
+
+NOISE_TARGET("sse2")
+static void accumulatePersistAbsSSE2(float *result, float *gmap,
+		const float *gradient, const float *persistence, u32 count)
+{
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 gm = _mm_loadu_ps(gmap + i);
+		__m128 grad = _mm_and_ps(_mm_loadu_ps(gradient + i), abs_mask);
+		__m128 r = _mm_add_ps(_mm_loadu_ps(result + i), _mm_mul_ps(gm, grad));
+		_mm_storeu_ps(result + i, r);
+		_mm_storeu_ps(gmap + i, _mm_mul_ps(gm, _mm_loadu_ps(persistence + i)));
+	}
+	accumulatePersistAbsScalar(result + i, gmap + i, gradient + i,
+			persistence + i, count - i);
+}
+
+static const NoiseKernels noise_kernels_sse2 = {
+	"SSE2",
+	fillLatticeSSE2,
+	interpolateXSSE2,
+	interpolateYSSE2,
+	interpolateYZSSE2,
+	accumulateSSE2,
+	accumulateAbsSSE2,
+	accumulatePersistSSE2,
+	accumulatePersistAbsSSE2,
+};
+
+#endif
+
+#ifdef NOISE_HAVE_AVX2
+
+/*
+	AVX2 kernels, 8 values at once. FMA is left out on purpose: fusing
+	the multiply and add would round differently from the other sets.
+*/
+
+NOISE_TARGET("avx2")
+static inline __m256 lerpAVX2(__m256 v0, __m256 v1, __m256 t)
+{
+	return _mm256_add_ps(v0, _mm256_mul_ps(_mm256_sub_ps(v1, v0), t));
+}
+
+NOISE_TARGET("avx2")
+static void fillLatticeAVX2(float *out, u32 count, s32 x0, u32 base)
+{
+	const __m256i mask = _mm256_set1_epi32(0x7fffffff);
+	const __m256i magic_x = _mm256_set1_epi32(NOISE_MAGIC_X);
+	const __m256i vbase = _mm256_set1_epi32(base);
+	const __m256i c1 = _mm256_set1_epi32(60493);
+	const __m256i c2 = _mm256_set1_epi32(19990303);
+	const __m256i c3 = _mm256_set1_epi32(1376312589);
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256 divisor = _mm256_set1_ps(0x40000000);
+	__m256i x = _mm256_add_epi32(_mm256_set1_epi32(x0),
+			_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	const __m256i eight = _mm256_set1_epi32(8);
+
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i n = _mm256_add_epi32(_mm256_mullo_epi32(x, magic_x), vbase);
+		n = _mm256_and_si256(n, mask);
+		n = _mm256_xor_si256(_mm256_srli_epi32(n, 13), n);
+		__m256i p = _mm256_add_epi32(
+				_mm256_mullo_epi32(_mm256_mullo_epi32(n, n), c1), c2);
+		n = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(n, p), c3),
+				mask);
+		_mm256_storeu_ps(out + i, _mm256_sub_ps(one,
+				_mm256_div_ps(_mm256_cvtepi32_ps(n), divisor)));
+		x = _mm256_add_epi32(x, eight);
+	}
+	fillLatticeScalar(out + i, count - i, x0 + i, base);
+}
+
+NOISE_TARGET("avx2")
+static void interpolateXAVX2(float *out, const float *row,
+		const u32 *index, const float *t, u32 count)
+{
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i idx = _mm256_loadu_si256((const __m256i *)(index + i));
+		__m256 v0 = _mm256_i32gather_ps(row, idx, 4);
+		__m256 v1 = _mm256_i32gather_ps(row + 1, idx, 4);
+		_mm256_storeu_ps(out + i, lerpAVX2(v0, v1, _mm256_loadu_ps(t + i)));
+	}
+	interpolateXScalar(out + i, row, index + i, t + i, count - i);
+}
+
+NOISE_TARGET("avx2")
+static void interpolateYAVX2(float *out, const float *a, const float *b,
+		float t, u32 count)
+{
+	const __m256 vt = _mm256_set1_ps(t);
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(out + i, lerpAVX2(_mm256_loadu_ps(a + i),
+				_mm256_loadu_ps(b + i), vt));
+	}
+	interpolateYScalar(out + i, a + i, b + i, t, count - i);
+}
+
+NOISE_TARGET("avx2")
+static void interpolateYZAVX2(float *out,
+		const float *a0, const float *b0,
+		const float *a1, const float *b1,
+		float ty, float tz, u32 count)
+{
+	const __m256 vty = _mm256_set1_ps(ty);
+	const __m256 vtz = _mm256_set1_ps(tz);
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 u = lerpAVX2(_mm256_loadu_ps(a0 + i),
+				_mm256_loadu_ps(b0 + i), vty);
+		__m256 v = lerpAVX2(_mm256_loadu_ps(a1 + i),
+				_mm256_loadu_ps(b1 + i), vty);
+		_mm256_storeu_ps(out + i, lerpAVX2(u, v, vtz));
+	}
+	interpolateYZScalar(out + i, a0 + i, b0 + i, a1 + i, b1 + i,
+			ty, tz, count - i);
+}
+
+NOISE_TARGET("avx2")
+static void accumulateAVX2(float *result, const float *gradient,
+		float g, u32 count)
+{
+	const __m256 vg = _mm256_set1_ps(g);
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(result + i),
+				_mm256_mul_ps(vg, _mm256_loadu_ps(gradient + i)));
+		_mm256_storeu_ps(result + i, r);
+	}
+	accumulateScalar(result + i, gradient + i, g, count - i);
+}
+
+NOISE_TARGET("avx2")
+static void accumulateAbsAVX2(float *result, const float *gradient,
+		float g, u32 count)
+{
+	const __m256 vg = _mm256_set1_ps(g);
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 grad = _mm256_and_ps(_mm256_loadu_ps(gradient + i), abs_mask);
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(result + i),
+				_mm256_mul_ps(vg, grad));
+		_mm256_storeu_ps(result + i, r);
+	}
+	accumulateAbsScalar(result + i, gradient + i, g, count - i);
+}
+
+NOISE_TARGET("avx2")
+static void accumulatePersistAVX2(float *result, float *gmap,
+		const float *gradient, const float *persistence, u32 count)
+{
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 gm = _mm256_loadu_ps(gmap + i);
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(result + i),
+				_mm256_mul_ps(gm, _mm256_loadu_ps(gradient + i)));
+		_mm256_storeu_ps(result + i, r);
+		_mm256_storeu_ps(gmap + i,
+				_mm256_mul_ps(gm, _mm256_loadu_ps(persistence + i)));
+	}
+	accumulatePersistScalar(result + i, gmap + i, gradient + i,
+			persistence + i, count - i);
+}
+
+NOISE_TARGET("avx2")
+static void accumulatePersistAbsAVX2(float *result, float *gmap,
+		const float *gradient, const float *persistence, u32 count)
+{
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 gm = _mm256_loadu_ps(gmap + i);
+		__m256 grad = _mm256_and_ps(_mm256_loadu_ps(gradient + i), abs_mask);
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(result + i),
+				_mm256_mul_ps(gm, grad));
+		_mm256_storeu_ps(result + i, r);
+		_mm256_storeu_ps(gmap + i,
+				_mm256_mul_ps(gm, _mm256_loadu_ps(persistence + i)));
+	}
+	accumulatePersistAbsScalar(result + i, gmap + i, gradient + i,
+			persistence + i, count - i);
+}
+
+static const NoiseKernels noise_kernels_avx2 = {
+	"AVX2",
+	fillLatticeAVX2,
+	interpolateXAVX2,
+	interpolateYAVX2,
+	interpolateYZAVX2,
+	accumulateAVX2,
+	accumulateAbsAVX2,
+	accumulatePersistAVX2,
+	accumulatePersistAbsAVX2,
+};
+
+#endif
+
+const NoiseKernels *getNoiseKernels(NoiseKernelSet set)
+{
+#ifdef NOISE_HAVE_AVX2
+	__builtin_cpu_init();
+#endif
+
+	switch (set) {
+	case NOISE_KERNELS_SCALAR:
+		return &noise_kernels_scalar;
+#ifdef NOISE_HAVE_SSE2
+	case NOISE_KERNELS_SSE2:
+#if defined(__GNUC__)
+		if (!__builtin_cpu_supports("sse2"))
+			return NULL;
+#endif
+		return &noise_kernels_sse2;
+#endif
+#ifdef NOISE_HAVE_AVX2
+	case NOISE_KERNELS_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return NULL;
+		return &noise_kernels_avx2;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+const NoiseKernels *getBestNoiseKernels()
+{
+	for (int set = NOISE_KERNELS_COUNT - 1; set > NOISE_KERNELS_SCALAR; set--) {
+		const NoiseKernels *kernels = getNoiseKernels((NoiseKernelSet)set);
+		if (kernels)
+			return kernels;
+	}
+	return &noise_kernels_scalar;
+}
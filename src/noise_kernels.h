@@ -0,0 +1,101 @@
+/*
+ * Minetest
+ * Copyright (C) 2010-2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+ * Copyright (C) 2010-2014 kwolekr, Ryan Kwolek <kwolekr@minetest.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef NOISE_KERNELS_HEADER
+#define NOISE_KERNELS_HEADER
+
+#include "irrlichttypes.h"
+
+#define NOISE_MAGIC_X    1619
+#define NOISE_MAGIC_Y    31337
+#define NOISE_MAGIC_Z    52591
+#define NOISE_MAGIC_SEED 1013
+
+// Value of a lattice point, from the sum of its coordinates and seed each
+// multiplied by their NOISE_MAGIC. Return value: -1 ... 1
+inline float noise_lattice_value(u32 n)
+{
+	n &= 0x7fffffff;
+	n = (n >> 13) ^ n;
+	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
+	return 1.f - (float)(int)n / 0x40000000;
+}
+
+/*
+	The inner loops of Noise::perlinMap2D() and perlinMap3D().
+	Every set does the same float operations in the same order, so they
+	all give bit-identical results; they only differ in how many values
+	they do at once.
+*/
+struct NoiseKernels
+{
+	const char *name;
+
+	// out[i] = noise_lattice_value(NOISE_MAGIC_X * (x0 + i) + base)
+	void (*fillLattice)(float *out, u32 count, s32 x0, u32 base);
+
+	// out[i] = lerp(row[index[i]], row[index[i] + 1], t[i])
+	void (*interpolateX)(float *out, const float *row,
+			const u32 *index, const float *t, u32 count);
+
+	// out[i] = lerp(a[i], b[i], t)
+	void (*interpolateY)(float *out, const float *a, const float *b,
+			float t, u32 count);
+
+	// out[i] = lerp(lerp(a0[i], b0[i], ty), lerp(a1[i], b1[i], ty), tz)
+	void (*interpolateYZ)(float *out,
+			const float *a0, const float *b0,
+			const float *a1, const float *b1,
+			float ty, float tz, u32 count);
+
+	// result[i] += g * gradient[i], or g * fabs(gradient[i])
+	void (*accumulate)(float *result, const float *gradient,
+			float g, u32 count);
+	void (*accumulateAbs)(float *result, const float *gradient,
+			float g, u32 count);
+
+	// result[i] += gmap[i] * gradient[i], or gmap[i] * fabs(gradient[i]);
+	// then gmap[i] *= persistence[i]
+	void (*accumulatePersist)(float *result, float *gmap,
+			const float *gradient, const float *persistence, u32 count);
+	void (*accumulatePersistAbs)(float *result, float *gmap,
+			const float *gradient, const float *persistence, u32 count);
+};
+
+enum NoiseKernelSet {
+	NOISE_KERNELS_SCALAR,
+	NOISE_KERNELS_SSE2,
+	NOISE_KERNELS_AVX2,
+	NOISE_KERNELS_COUNT
+};
+
+// Returns NULL if the set isn't built in or the CPU can't run it
+const NoiseKernels *getNoiseKernels(NoiseKernelSet set);
+
+// The fastest set the CPU can run
+const NoiseKernels *getBestNoiseKernels();
+
+#endif
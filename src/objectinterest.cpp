@@ -0,0 +1,150 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "objectinterest.h"
+#include "constants.h"
+#include "settings.h"
+#include "util/numeric.h"
+#include "util/serialize.h"
+
+// Cosine of the angle from the look direction up to which objects count
+// as in view
+#define OBJECT_VIEW_COS 0.5f
+// A base is assumed to be known by the client after this many round
+// trip times plus OBJECT_BASE_WAIT_MIN seconds
+#define OBJECT_BASE_WAIT_RTTS 3
+#define OBJECT_BASE_WAIT_MIN 0.1f
+// First protocol version with GENERIC_CMD_UPDATE_POSITION_DELTA
+#define OBJECT_DELTA_PROTOCOL_VERSION 27
+
+static void append_message(std::string &data, u16 id,
+		const std::string &message)
+{
+	char buf[2];
+	writeU16((u8 *)buf, id);
+	data.append(buf, 2);
+	data += serializeString(message);
+}
+
+ObjectInterest::ObjectInterest():
+	m_has_viewer(false),
+	m_send_range(0)
+{
+	m_full_update_range = g_settings->getFloat(
+			"active_object_full_update_range") * BS;
+	m_max_update_interval = g_settings->getFloat(
+			"active_object_max_update_interval");
+}
+
+void ObjectInterest::setViewer(v3f position, v3f look_dir, f32 send_range)
+{
+	m_has_viewer = true;
+	m_viewer_position = position;
+	m_viewer_look_dir = look_dir;
+	m_send_range = send_range;
+}
+
+void ObjectInterest::queuePositionUpdate(u16 id,
+		const ObjectPositionUpdate &update)
+{
+	Object &obj = m_objects[id];
+	if (obj.pending)
+		obj.deferred = true;
+	obj.update = update;
+	obj.pending = true;
+}
+
+void ObjectInterest::removeObject(u16 id)
+{
+	m_objects.erase(id);
+}
+
+void ObjectInterest::step(float dtime, float rtt, u16 net_proto_version,
+		std::string &reliable_data, std::string &unreliable_data)
+{
+	float base_wait = OBJECT_BASE_WAIT_RTTS * MYMAX(rtt, 0) +
+			OBJECT_BASE_WAIT_MIN;
+
+	for (std::map<u16, Object>::iterator i = m_objects.begin();
+			i != m_objects.end(); ++i) {
+		u16 id = i->first;
+		Object &obj = i->second;
+		obj.since_update += dtime;
+		obj.base_age += dtime;
+
+		if (!obj.pending)
+			continue;
+		if (obj.sent &&
+				obj.since_update < getUpdateInterval(obj.update.position)) {
+			obj.deferred = true;
+			continue;
+		}
+
+		ObjectPositionUpdate update = obj.update;
+		// Let the client interpolate over the time the update was held back
+		if (obj.sent && obj.deferred)
+			update.update_interval = MYMAX(update.update_interval,
+					obj.since_update);
+
+		std::string message;
+		if (net_proto_version >= OBJECT_DELTA_PROTOCOL_VERSION) {
+			bool base_known = obj.has_base && obj.base_age >= base_wait;
+			if (base_known)
+				message = gob_cmd_update_position_delta(obj.base_id,
+						obj.base, update);
+			// Objects that keep moving get a base when they have none
+			// or moved too far from theirs
+			if (message.empty() && obj.sent &&
+					(!obj.has_base || base_known)) {
+				obj.base_id++;
+				obj.base = update;
+				obj.has_base = true;
+				obj.base_age = 0;
+				append_message(reliable_data, id,
+						gob_cmd_update_position_base(obj.base_id, update));
+			}
+		}
+		if (message.empty())
+			message = gob_cmd_update_position(update);
+		append_message(unreliable_data, id, message);
+
+		obj.pending = false;
+		obj.deferred = false;
+		obj.sent = true;
+		obj.since_update = 0;
+	}
+}
+
+float ObjectInterest::getUpdateInterval(v3f pos) const
+{
+	if (!m_has_viewer)
+		return 0;
+
+	v3f dir = pos - m_viewer_position;
+	f32 distance = dir.getLength();
+	if (distance <= m_full_update_range)
+		return 0;
+
+	f32 range = MYMAX(m_send_range - m_full_update_range, BS);
+	f32 interval = m_max_update_interval *
+			MYMIN((distance - m_full_update_range) / range, 1.0f);
+	if (dir.dotProduct(m_viewer_look_dir) < distance * OBJECT_VIEW_COS)
+		interval *= 2;
+	return interval;
+}
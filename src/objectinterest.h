@@ -0,0 +1,111 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef OBJECTINTEREST_HEADER
+#define OBJECTINTEREST_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include "genericobject.h"
+#include <map>
+#include <string>
+
+/*
+	Decides when a client gets the position updates of the generic active
+	objects it knows, and how they are encoded for it.
+
+	Only the latest position update of an object is kept, and it is sent
+	once the update interval of the object for this client has passed.
+	The interval is zero near the player of the client, grows with the
+	distance up to the send range and is doubled for objects outside the
+	view of the player.
+
+	Clients of protocol 27 and later get positions as deltas against a
+	base that is sent reliably when an object starts moving or got too
+	far from its base. A base is used once the client can be expected to
+	have it, a few round trips after sending; until then full positions
+	are sent.
+*/
+class ObjectInterest
+{
+public:
+	ObjectInterest();
+
+	// Sets the position and look direction of the player of the client
+	void setViewer(v3f position, v3f look_dir, f32 send_range);
+
+	// Keeps the position update for sending with the next due step()
+	void queuePositionUpdate(u16 id, const ObjectPositionUpdate &update);
+
+	// Forgets about an object the client doesn't know anymore
+	void removeObject(u16 id);
+
+	/*
+		Appends the due position updates to the data of the
+		TOCLIENT_ACTIVE_OBJECT_MESSAGES packets to the client.
+		rtt is the average round trip time to the client.
+	*/
+	void step(float dtime, float rtt, u16 net_proto_version,
+			std::string &reliable_data, std::string &unreliable_data);
+
+	// Interval of updates of an object at position pos
+	float getUpdateInterval(v3f pos) const;
+
+private:
+	struct Object
+	{
+		Object():
+			pending(false),
+			deferred(false),
+			sent(false),
+			since_update(0),
+			has_base(false),
+			base_id(0),
+			base_age(0)
+		{}
+
+		// Latest update, sent when the interval has passed
+		ObjectPositionUpdate update;
+		bool pending;
+		// If an update was replaced or held back since the last one sent
+		bool deferred;
+		bool sent;
+		// Seconds since the last update was sent
+		float since_update;
+
+		bool has_base;
+		u8 base_id;
+		ObjectPositionUpdate base;
+		// Seconds since the base was sent
+		float base_age;
+	};
+
+	std::map<u16, Object> m_objects;
+
+	bool m_has_viewer;
+	v3f m_viewer_position;
+	v3f m_viewer_look_dir;
+	f32 m_send_range;
+
+	// Distance up to which objects are updated at full rate
+	f32 m_full_update_range;
+	// Interval of updates at the send range
+	f32 m_max_update_interval;
+};
+
+#endif
@@ -171,6 +171,8 @@ void ScriptApiEnv::on_emerge_area_completion(
 
 	SCRIPTAPI_PRECHECKHEADER
 
+	state->refcount--;
+
 	int error_handler = PUSH_ERROR_HANDLER(L);
 
 	lua_rawgeti(L, LUA_REGISTRYINDEX, state->callback_ref);
@@ -194,5 +196,6 @@ void ScriptApiEnv::on_emerge_area_completion(
 	if (state->refcount == 0) {
 		luaL_unref(L, LUA_REGISTRYINDEX, state->callback_ref);
 		luaL_unref(L, LUA_REGISTRYINDEX, state->args_ref);
+		delete state;
 	}
 }
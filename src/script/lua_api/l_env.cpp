@@ -90,12 +90,9 @@ void LuaEmergeAreaCallback(v3s16 blockpos, EmergeAction action, void *param)
 	assert(state->script != NULL);
 	assert(state->refcount > 0);
 
-	state->refcount--;
-
+	// Counts down and frees the state under the script lock, as the
+	// blocks of an area finish on several emerge threads at once
 	state->script->on_emerge_area_completion(blockpos, action, state);
-
-	if (state->refcount == 0)
-		delete state;
 }
 
 // Exported functions
@@ -159,7 +156,8 @@ int ModApiEnvMod::l_get_node(lua_State *L)
 
 	// pos
 	v3s16 pos = read_v3s16(L, 1);
-	// Do it
+	// Do it; the light of the edits of this step is left to the end of the
+	// step, flushing it here would light every edit on its own again
 	MapNode n = env->getMap().getNodeNoEx(pos);
 	// Return node
 	pushnode(L, n, env->getGameDef()->ndef());
@@ -201,6 +199,9 @@ int ModApiEnvMod::l_get_node_light(lua_State *L)
 	time_of_day %= 24000;
 	u32 dnr = time_to_daynight_ratio(time_of_day, true);
 
+	// Light the edits made so far in this step
+	env->getMap().flushDeferredLighting();
+
 	bool is_position_ok;
 	MapNode n = env->getMap().getNodeNoEx(pos, &is_position_ok);
 	if (is_position_ok) {
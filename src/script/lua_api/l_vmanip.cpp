@@ -39,7 +39,7 @@ int LuaVoxelManip::gc_object(lua_State *L)
 
 int LuaVoxelManip::l_read_from_map(lua_State *L)
 {
-	MAP_LOCK_REQUIRED;
+	GET_ENV_PTR;
 
 	LuaVoxelManip *o = checkobject(L, 1);
 	MMVManip *vm = o->vm;
@@ -48,6 +48,8 @@ int LuaVoxelManip::l_read_from_map(lua_State *L)
 	v3s16 bp2 = getNodeBlockPos(check_v3s16(L, 3));
 	sortBoxVerticies(bp1, bp2);
 
+	// Light the edits made so far in this step
+	env->getMap().flushDeferredLighting();
 	vm->initialEmerge(bp1, bp2);
 
 	push_v3s16(L, vm->m_area.MinEdge);
@@ -158,8 +160,13 @@ int LuaVoxelManip::l_update_liquids(lua_State *L)
 	mg.vm   = vm;
 	mg.ndef = ndef;
 
-	mg.updateLiquid(&map->m_transforming_liquid,
+	UniqueQueue<v3s16> transforming_liquid;
+	mg.updateLiquid(&transforming_liquid,
 			vm->m_area.MinEdge, vm->m_area.MaxEdge);
+	while (transforming_liquid.size()) {
+		map->transforming_liquid_add(transforming_liquid.front());
+		transforming_liquid.pop_front();
+	}
 
 	return 0;
 }
@@ -390,6 +397,8 @@ LuaVoxelManip::LuaVoxelManip(Map *map, v3s16 p1, v3s16 p2)
 	v3s16 bp1 = getNodeBlockPos(p1);
 	v3s16 bp2 = getNodeBlockPos(p2);
 	sortBoxVerticies(bp1, bp2);
+	// Light the edits made so far in this step
+	map->flushDeferredLighting();
 	vm->initialEmerge(bp1, bp2);
 }
 
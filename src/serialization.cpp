@@ -19,11 +19,22 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "serialization.h"
 
+#include "config.h"
 #include "util/serialize.h"
 #ifdef _WIN32
 	#define ZLIB_WINAPI
 #endif
 #include "zlib.h"
+#if USE_ZSTD
+	#include <zstd.h>
+	#include <zdict.h>
+#endif
+#if USE_LZ4
+	#include <lz4.h>
+#endif
+
+// zstd level of map blocks, and of the dictionaries trained for them
+#define ZSTD_BLOCK_LEVEL 3
 
 /* report a zlib or i/o error */
 void zerr(int ret)
@@ -70,7 +81,7 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os, int level)
 		throw SerializationError("compressZlib: deflateInit failed");
 	
 	// Point zlib to our input buffer
-	z.next_in = (Bytef*)&data[0];
+	z.next_in = data.getSize() ? (Bytef*)&data[0] : Z_NULL;
 	z.avail_in = data.getSize();
 	// And get all output
 	for(;;)
@@ -265,4 +276,221 @@ void decompress(std::istream &is, std::ostream &os, u8 version)
 	}
 }
 
+bool isBlockCodecSupported(u8 codec)
+{
+	switch (codec) {
+	case BLOCK_CODEC_ZLIB:
+	case BLOCK_CODEC_NONE:
+		return true;
+	case BLOCK_CODEC_ZSTD:
+		return USE_ZSTD;
+	case BLOCK_CODEC_LZ4:
+		return USE_LZ4;
+	default:
+		return false;
+	}
+}
+
+static const char *block_codec_names[BLOCK_CODEC_MAX] = {
+	"zlib",
+	"none",
+	"zstd",
+	"lz4",
+};
+
+bool parseBlockCodec(const std::string &name, u8 *codec)
+{
+	for (u8 i = 0; i < BLOCK_CODEC_MAX; i++) {
+		if (name == block_codec_names[i]) {
+			*codec = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *getBlockCodecName(u8 codec)
+{
+	if (codec >= BLOCK_CODEC_MAX)
+		return "unknown";
+	return block_codec_names[codec];
+}
+
+ZstdDictionary::ZstdDictionary(const std::string &data):
+	m_data(data),
+	m_id(0),
+	m_cdict(NULL),
+	m_ddict(NULL)
+{
+#if USE_ZSTD
+	m_id = ZDICT_getDictID(m_data.c_str(), m_data.size());
+	if (m_id == 0)
+		throw SerializationError("ZstdDictionary: invalid dictionary");
+	m_cdict = ZSTD_createCDict(m_data.c_str(), m_data.size(),
+			ZSTD_BLOCK_LEVEL);
+	m_ddict = ZSTD_createDDict(m_data.c_str(), m_data.size());
+	if (m_cdict == NULL || m_ddict == NULL) {
+		ZSTD_freeCDict(m_cdict);
+		ZSTD_freeDDict(m_ddict);
+		throw SerializationError("ZstdDictionary: invalid dictionary");
+	}
+#else
+	throw SerializationError("ZstdDictionary: zstd is not supported");
+#endif
+}
+
+ZstdDictionary::~ZstdDictionary()
+{
+#if USE_ZSTD
+	ZSTD_freeCDict(m_cdict);
+	ZSTD_freeDDict(m_ddict);
+#endif
+}
+
+ZstdDictionary *ZstdDictionary::train(const std::vector<std::string> &samples,
+		u32 max_size)
+{
+#if USE_ZSTD
+	std::string buffer;
+	std::vector<size_t> sizes;
+	sizes.reserve(samples.size());
+	for (size_t i = 0; i < samples.size(); i++) {
+		buffer += samples[i];
+		sizes.push_back(samples[i].size());
+	}
+
+	std::string dict(max_size, '\0');
+	size_t size = ZDICT_trainFromBuffer(&dict[0], dict.size(),
+			buffer.c_str(), &sizes[0], sizes.size());
+	if (ZDICT_isError(size)) {
+		infostream << "ZstdDictionary::train(): " << ZDICT_getErrorName(size)
+				<< std::endl;
+		return NULL;
+	}
+	dict.resize(size);
+	return new ZstdDictionary(dict);
+#else
+	return NULL;
+#endif
+}
+
+void compressBlockData(const std::string &data, std::ostream &os, u8 codec,
+		const ZstdDictionary *dict)
+{
+	if (codec == BLOCK_CODEC_ZLIB) {
+		compressZlib(data, os);
+		return;
+	}
+
+	std::string out;
+	switch (codec) {
+	case BLOCK_CODEC_NONE:
+		out = data;
+		break;
+#if USE_ZSTD
+	case BLOCK_CODEC_ZSTD: {
+		out.resize(ZSTD_compressBound(data.size()));
+		ZSTD_CCtx *cctx = ZSTD_createCCtx();
+		size_t size;
+		if (dict)
+			size = ZSTD_compress_usingCDict(cctx, &out[0], out.size(),
+					data.c_str(), data.size(), dict->getCDict());
+		else
+			size = ZSTD_compressCCtx(cctx, &out[0], out.size(),
+					data.c_str(), data.size(), ZSTD_BLOCK_LEVEL);
+		ZSTD_freeCCtx(cctx);
+		if (ZSTD_isError(size))
+			throw SerializationError(std::string("compressBlockData: ")
+					+ ZSTD_getErrorName(size));
+		out.resize(size);
+		break;
+	}
+#endif
+#if USE_LZ4
+	case BLOCK_CODEC_LZ4: {
+		out.resize(LZ4_compressBound(data.size()));
+		int size = LZ4_compress_default(data.c_str(), &out[0],
+				data.size(), out.size());
+		if (size <= 0)
+			throw SerializationError("compressBlockData: LZ4 failed");
+		out.resize(size);
+		break;
+	}
+#endif
+	default:
+		throw SerializationError("compressBlockData: unsupported codec");
+	}
+
+	writeU32(os, data.size());
+	writeU32(os, out.size());
+	os.write(out.c_str(), out.size());
+}
+
+void decompressBlockData(std::istream &is, std::ostream &os, u8 codec,
+		const ZstdDictionary *dict)
+{
+	if (codec == BLOCK_CODEC_ZLIB) {
+		decompressZlib(is, os);
+		return;
+	}
+	if (!isBlockCodecSupported(codec))
+		throw SerializationError("decompressBlockData: unsupported codec");
+
+	u32 raw_size = readU32(is);
+	u32 size = readU32(is);
+	if (raw_size > LONG_STRING_MAX_LEN || size > LONG_STRING_MAX_LEN)
+		throw SerializationError("decompressBlockData: data too large");
 
+	std::string in(size, '\0');
+	if (size != 0) {
+		is.read(&in[0], size);
+		if ((u32)is.gcount() != size)
+			throw SerializationError("decompressBlockData: "
+					"not enough input data");
+	}
+	if (codec == BLOCK_CODEC_NONE) {
+		if (raw_size != size)
+			throw SerializationError("decompressBlockData: size mismatch");
+		os.write(in.c_str(), in.size());
+		return;
+	}
+
+	// One more byte keeps the buffer valid for empty data
+	std::string out(raw_size + 1, '\0');
+	switch (codec) {
+#if USE_ZSTD
+	case BLOCK_CODEC_ZSTD: {
+		unsigned dict_id = ZSTD_getDictID_fromFrame(in.c_str(), in.size());
+		if (dict_id != 0 && (dict == NULL || dict->getId() != dict_id))
+			throw SerializationError("decompressBlockData: "
+					"zstd dictionary not available");
+		ZSTD_DCtx *dctx = ZSTD_createDCtx();
+		size_t result;
+		if (dict_id != 0)
+			result = ZSTD_decompress_usingDDict(dctx, &out[0], raw_size,
+					in.c_str(), in.size(), dict->getDDict());
+		else
+			result = ZSTD_decompressDCtx(dctx, &out[0], raw_size,
+					in.c_str(), in.size());
+		ZSTD_freeDCtx(dctx);
+		if (ZSTD_isError(result) || result != raw_size)
+			throw SerializationError("decompressBlockData: "
+					"invalid zstd data");
+		break;
+	}
+#endif
+#if USE_LZ4
+	case BLOCK_CODEC_LZ4: {
+		int result = LZ4_decompress_safe(in.c_str(), &out[0],
+				size, raw_size);
+		if (result < 0 || (u32)result != raw_size)
+			throw SerializationError("decompressBlockData: "
+					"invalid LZ4 data");
+		break;
+	}
+#endif
+	default:
+		throw SerializationError("decompressBlockData: unsupported codec");
+	}
+	os.write(out.c_str(), raw_size);
+}
@@ -23,7 +23,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes.h"
 #include "exceptions.h"
 #include <iostream>
+#include <string>
+#include <vector>
 #include "util/pointer.h"
+#include "util/basic_macros.h"
 
 /*
 	Map format serialization version
@@ -62,11 +65,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	24: 16-bit node ids and node timers (never released as stable)
 	25: Improved node timer format
 	26: Never written; read the same as 25
+	27: Node data and metadata compressed with a selectable BlockCodec
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
-#define SER_FMT_VER_HIGHEST_READ 26
+#define SER_FMT_VER_HIGHEST_READ 27
 // Saved on disk version
 #define SER_FMT_VER_HIGHEST_WRITE 25
 // Lowest supported serialization version
@@ -75,6 +79,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // Can't do < 24 anymore; we have 16-bit dynamically allocated node IDs
 // in memory; conversion just won't work in this direction.
 #define SER_FMT_VER_LOWEST_WRITE 24
+// Lowest version that stores the codec of a block. Blocks are saved in
+// it only if they use another codec than zlib.
+#define SER_FMT_VER_BLOCK_CODEC 27
 
 inline bool ser_ver_supported(s32 v) {
 	return v >= SER_FMT_VER_LOWEST_READ && v <= SER_FMT_VER_HIGHEST_READ;
@@ -93,5 +100,64 @@ void compress(SharedBuffer<u8> data, std::ostream &os, u8 version);
 //void compress(const std::string &data, std::ostream &os, u8 version);
 void decompress(std::istream &is, std::ostream &os, u8 version);
 
+/*
+	Codecs for the node data and metadata of map blocks
+
+	zlib data is written as is. The other codecs write the uncompressed
+	and the compressed size (u32 each) in front of the data.
+*/
+enum BlockCodec {
+	BLOCK_CODEC_ZLIB = 0,
+	BLOCK_CODEC_NONE = 1,
+	BLOCK_CODEC_ZSTD = 2,
+	BLOCK_CODEC_LZ4 = 3,
+	BLOCK_CODEC_MAX
+};
+
+// Whether this build can read and write the codec
+bool isBlockCodecSupported(u8 codec);
+// Returns false if the name is unknown
+bool parseBlockCodec(const std::string &name, u8 *codec);
+const char *getBlockCodecName(u8 codec);
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+/*
+	A trained zstd dictionary. Frames compressed with it record its id,
+	and can only be decompressed by passing the same dictionary.
+*/
+class ZstdDictionary
+{
+public:
+	// Throws SerializationError if data is not a zstd dictionary
+	ZstdDictionary(const std::string &data);
+	~ZstdDictionary();
+
+	// Returns NULL if zstd is not supported or the samples are unsuitable
+	static ZstdDictionary *train(const std::vector<std::string> &samples,
+			u32 max_size);
+
+	u32 getId() const { return m_id; }
+	const std::string &getData() const { return m_data; }
+
+	const ZSTD_CDict_s *getCDict() const { return m_cdict; }
+	const ZSTD_DDict_s *getDDict() const { return m_ddict; }
+
+private:
+	std::string m_data;
+	u32 m_id;
+	ZSTD_CDict_s *m_cdict;
+	ZSTD_DDict_s *m_ddict;
+
+	DISABLE_CLASS_COPY(ZstdDictionary);
+};
+
+// dict is only used by zstd, and only if not NULL
+void compressBlockData(const std::string &data, std::ostream &os, u8 codec,
+		const ZstdDictionary *dict = NULL);
+void decompressBlockData(std::istream &is, std::ostream &os, u8 codec,
+		const ZstdDictionary *dict = NULL);
+
 #endif
 
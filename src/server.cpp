@@ -27,6 +27,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "map.h"
 #include "threading/mutex_auto_lock.h"
+#include "threading/semaphore.h"
+#include "threading/workerpool.h"
 #include "constants.h"
 #include "voxel.h"
 #include "config.h"
@@ -43,6 +45,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "itemdef.h"
 #include "craftdef.h"
 #include "emerge.h"
+#include "blockselectthread.h"
 #include "mapgen.h"
 #include "mg_biome.h"
 #include "content_mapnode.h"
@@ -165,6 +168,10 @@ Server::Server(
 	m_rollback(NULL),
 	m_enable_rollback_recording(false),
 	m_emerge(NULL),
+	m_block_select(NULL),
+	m_block_select_dtime(0.0),
+	m_packet_pool(NULL),
+	m_block_codec(BLOCK_CODEC_ZLIB),
 	m_script(NULL),
 	m_itemdef(createItemDefManager()),
 	m_nodedef(createNodeDefManager()),
@@ -217,6 +224,12 @@ Server::Server(
 	// Create emerge manager
 	m_emerge = new EmergeManager(this);
 
+	m_block_select = new BlockSelectThread(m_emerge,
+			g_settings->getS16("num_block_select_threads"));
+	m_block_select->start();
+	m_packet_pool = new WorkerPool("Packets",
+			g_settings->getS16("num_packet_threads"));
+
 	// Create ban manager
 	std::string ban_path = m_path_world + DIR_DELIM "ipban.txt";
 	m_banmanager = new BanManager(ban_path);
@@ -271,6 +284,7 @@ Server::Server(
 
 	// Create the Map (loads map_meta.txt, overriding configured mapgen params)
 	ServerMap *servermap = new ServerMap(path_world, this, m_emerge);
+	m_block_codec = servermap->getBlockCodec();
 
 	// Initialize scripting
 	infostream<<"Server: Initializing Lua"<<std::endl;
@@ -393,6 +407,9 @@ Server::~Server()
 	stop();
 	delete m_thread;
 
+	// Block selection queues emerges as well
+	delete m_block_select;
+
 	// stop all emerge threads before deleting players that may have
 	// requested blocks to be emerged
 	m_emerge->stopThreads();
@@ -403,6 +420,7 @@ Server::~Server()
 	// N.B. the EmergeManager should be deleted after the Environment since Map
 	// depends on EmergeManager to write its current params to the map meta
 	delete m_emerge;
+	delete m_packet_pool;
 	delete m_rollback;
 	delete m_banmanager;
 	delete m_event;
@@ -470,6 +488,155 @@ void Server::stop()
 	infostream<<"Server: Threads stopped"<<std::endl;
 }
 
+/*
+	Progress of Server::pregenerate(), updated by the emerge threads
+*/
+struct PregenerateState
+{
+	Mutex mutex;
+	u32 generated;
+	u32 existing;
+	u32 failed;
+	// Posted once for each finished chunk
+	Semaphore finished;
+
+	PregenerateState() :
+		generated(0),
+		existing(0),
+		failed(0)
+	{}
+};
+
+static void pregenerate_callback(v3s16 blockpos, EmergeAction action,
+	void *param)
+{
+	PregenerateState *state = (PregenerateState *)param;
+
+	{
+		MutexAutoLock lock(state->mutex);
+		if (action == EMERGE_GENERATED)
+			state->generated++;
+		else if (action == EMERGE_FROM_MEMORY || action == EMERGE_FROM_DISK)
+			state->existing++;
+		else
+			state->failed++;
+	}
+
+	state->finished.post();
+}
+
+static void print_pregenerate_progress(PregenerateState &state, u32 total,
+	u32 skipped, u32 start_time, bool last)
+{
+	u32 generated, existing, failed;
+	{
+		MutexAutoLock lock(state.mutex);
+		generated = state.generated;
+		existing  = state.existing;
+		failed    = state.failed;
+	}
+
+	u32 done = generated + existing + failed + skipped;
+	float seconds = (porting::getTimeMs() - start_time) / 1000.0;
+	float rate = seconds > 0 ? generated / seconds : 0;
+
+	std::cerr << " Pregenerated " << done << "/" << total << " chunks ("
+		<< generated << " generated, " << existing << " existing, "
+		<< (failed + skipped) << " failed), " << rate << " chunks/s";
+
+	// Chunks that exist already take almost no time, so the rate of
+	// all finished chunks estimates the time left best
+	if (done != 0 && done != total) {
+		u32 eta = (total - done) * seconds / done;
+		std::cerr << ", ETA " << eta / 3600 << "h "
+			<< eta / 60 % 60 << "m " << eta % 60 << "s";
+	}
+
+	std::cerr << "   " << (last ? "\n" : "\r") << std::flush;
+}
+
+bool Server::pregenerate(v3s16 nodemin, v3s16 nodemax, bool &kill)
+{
+	DSTACK(FUNCTION_NAME);
+
+	sortBoxVerticies(nodemin, nodemax);
+	s16 chunksize = m_emerge->params.chunksize;
+	v3s16 cmin = m_emerge->getContainingChunk(getNodeBlockPos(nodemin));
+	v3s16 cmax = m_emerge->getContainingChunk(getNodeBlockPos(nodemax));
+
+	v3s16 count = (cmax - cmin) / chunksize + v3s16(1, 1, 1);
+	u32 total = (u32)count.X * count.Y * count.Z;
+
+	actionstream << "Pregenerating " << total << " chunks between "
+		<< PP(nodemin) << " and " << PP(nodemax) << " using "
+		<< m_emerge->getThreadCount() << " emerge threads" << std::endl;
+
+	m_emerge->startThreads();
+
+	PregenerateState state;
+	u32 skipped = 0;
+	u32 in_flight = 0;
+	u32 batch = 0;
+	// Keep every emerge thread busy, with some chunks queued up
+	u32 max_in_flight = m_emerge->getThreadCount() * 4;
+	u32 start_time = porting::getTimeMs();
+	u32 last_report = start_time;
+
+	// Stacked chunks are queued one after another, so that
+	// the emerge threads share their 2D noise
+	for (s16 z = cmin.Z; z <= cmax.Z && !kill; z += chunksize)
+	for (s16 x = cmin.X; x <= cmax.X && !kill; x += chunksize)
+	for (s16 y = cmin.Y; y <= cmax.Y && !kill; y += chunksize) {
+		v3s16 chunkpos(x, y, z);
+		if (blockpos_over_limit(chunkpos) || !m_emerge->enqueueBlockEmergeEx(
+				chunkpos, PEER_ID_INEXISTENT,
+				BLOCK_EMERGE_ALLOW_GEN | BLOCK_EMERGE_FORCE_QUEUE,
+				pregenerate_callback, &state)) {
+			skipped++;
+			continue;
+		}
+		in_flight++;
+		batch++;
+
+		// Write the batch out once all of it is finished, so that no
+		// block is unloaded while a thread is generating around it
+		bool flush = batch == PREGENERATE_BATCH_CHUNKS;
+		while (in_flight != 0 && (flush || in_flight >= max_in_flight)) {
+			if (state.finished.wait(1000))
+				in_flight--;
+
+			u32 now = porting::getTimeMs();
+			if (now - last_report >= 1000) {
+				print_pregenerate_progress(state, total, skipped,
+					start_time, false);
+				last_report = now;
+			}
+		}
+
+		if (flush) {
+			MutexAutoLock envlock(m_env_mutex);
+			m_env->getMap().unloadUnreferencedBlocks();
+			batch = 0;
+		}
+	}
+
+	// The callbacks refer to state, so wait for them even if killed
+	while (in_flight != 0) {
+		state.finished.wait();
+		in_flight--;
+	}
+
+	{
+		MutexAutoLock envlock(m_env_mutex);
+		m_env->getMap().unloadUnreferencedBlocks();
+		m_env->saveMeta();
+	}
+
+	print_pregenerate_progress(state, total, skipped, start_time, true);
+
+	return !kill;
+}
+
 void Server::step(float dtime)
 {
 	DSTACK(FUNCTION_NAME);
@@ -572,9 +739,13 @@ void Server::AsyncRunStep(bool initial_step)
 		MutexAutoLock lock(m_env_mutex);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
+		std::vector<v3s16> unloaded_blocks;
 		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
 			g_settings->getFloat("server_unload_unused_data_timeout"),
-			U32_MAX);
+			U32_MAX, &unloaded_blocks);
+		for (std::vector<v3s16>::iterator i = unloaded_blocks.begin();
+				i != unloaded_blocks.end(); ++i)
+			m_block_select->blockChanged(*i);
 	}
 
 	/*
@@ -730,6 +901,7 @@ void Server::AsyncRunStep(bool initial_step)
 
 				// Remove from known objects
 				client->m_known_objects.erase(id);
+				client->m_object_interest.removeObject(id);
 
 				if(obj && obj->m_known_by_count > 0)
 					obj->m_known_by_count--;
@@ -792,6 +964,9 @@ void Server::AsyncRunStep(bool initial_step)
 		// Key = object id
 		// Value = data sent by object
 		std::map<u16, std::vector<ActiveObjectMessage>* > buffered_messages;
+		// Latest position updates of generic objects, these are sent
+		// by the interest management of each client
+		std::map<u16, ObjectPositionUpdate> position_updates;
 
 		// Get active object messages from environment
 		for(;;) {
@@ -799,6 +974,17 @@ void Server::AsyncRunStep(bool initial_step)
 			if (aom.id == 0)
 				break;
 
+			if (!aom.reliable && !aom.datastring.empty() &&
+					aom.datastring[0] == GENERIC_CMD_UPDATE_POSITION) {
+				ServerActiveObject *obj = m_env->getActiveObject(aom.id);
+				if (obj && obj->getSendType() == ACTIVEOBJECT_TYPE_GENERIC) {
+					std::istringstream is(aom.datastring, std::ios::binary);
+					readU8(is);
+					position_updates[aom.id] = gob_read_update_position(is);
+					continue;
+				}
+			}
+
 			std::vector<ActiveObjectMessage>* message_list = NULL;
 			std::map<u16, std::vector<ActiveObjectMessage>* >::iterator n;
 			n = buffered_messages.find(aom.id);
@@ -812,6 +998,9 @@ void Server::AsyncRunStep(bool initial_step)
 			message_list->push_back(aom);
 		}
 
+		f32 send_range = g_settings->getS16("active_object_send_range_blocks")
+				* MAP_BLOCKSIZE * BS;
+
 		m_clients.lock();
 		std::map<u16, RemoteClient*> clients = m_clients.getClientList();
 		// Route data to every client
@@ -821,6 +1010,23 @@ void Server::AsyncRunStep(bool initial_step)
 			RemoteClient *client = i->second;
 			std::string reliable_data;
 			std::string unreliable_data;
+
+			Player *player = m_env->getPlayer(client->peer_id);
+			if (player) {
+				v3f look_dir(0, 0, 1);
+				look_dir.rotateYZBy(player->getPitch());
+				look_dir.rotateXZBy(player->getYaw());
+				client->m_object_interest.setViewer(
+						player->getEyePosition(), look_dir, send_range);
+			}
+			for (std::map<u16, ObjectPositionUpdate>::iterator
+					j = position_updates.begin();
+					j != position_updates.end(); ++j) {
+				if (client->m_known_objects.find(j->first) !=
+						client->m_known_objects.end())
+					client->m_object_interest.queuePositionUpdate(
+							j->first, j->second);
+			}
 			// Go through all objects in message buffer
 			for (std::map<u16, std::vector<ActiveObjectMessage>* >::iterator
 					j = buffered_messages.begin();
@@ -851,6 +1057,11 @@ void Server::AsyncRunStep(bool initial_step)
 						unreliable_data += new_data;
 				}
 			}
+			client->m_object_interest.step(dtime,
+					m_con.getPeerStat(client->peer_id, con::AVG_RTT),
+					client->net_proto_version,
+					reliable_data, unreliable_data);
+
 			/*
 				reliable_data and unreliable_data are now ready.
 				Send them.
@@ -893,11 +1104,25 @@ void Server::AsyncRunStep(bool initial_step)
 		// We'll log the amount of each
 		Profiler prof;
 
+		// Light the node edits queued since the last step in one batch
+		std::map<v3s16, MapBlock*> lighting_blocks;
+		m_env->getMap().updateDeferredLighting(lighting_blocks);
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = lighting_blocks.begin();
+				i != lighting_blocks.end(); ++i)
+			m_block_select->blockChanged(i->first);
+		std::set<u16> lighting_far_players;
+
 		while(m_unsent_map_edit_queue.size() != 0)
 		{
 			MapEditEvent* event = m_unsent_map_edit_queue.front();
 			m_unsent_map_edit_queue.pop();
 
+			for(std::set<v3s16>::iterator
+					i = event->modified_blocks.begin();
+					i != event->modified_blocks.end(); ++i)
+				m_block_select->blockChanged(*i);
+
 			// Players far away from the change are stored here.
 			// Instead of sending the changes, MapBlocks are set not sent
 			// for them.
@@ -957,6 +1182,8 @@ void Server::AsyncRunStep(bool initial_step)
 					if(RemoteClient *client = getClient(*i))
 						client->SetBlocksNotSent(modified_blocks2);
 				}
+				lighting_far_players.insert(far_players.begin(),
+						far_players.end());
 			}
 
 			delete event;
@@ -967,6 +1194,19 @@ void Server::AsyncRunStep(bool initial_step)
 				break;*/
 		}
 
+		/*
+			Blocks relit by the edits are sent again to the players that
+			were too far away to get the edits themselves
+		*/
+		if(!lighting_blocks.empty()) {
+			for(std::set<u16>::iterator
+					i = lighting_far_players.begin();
+					i != lighting_far_players.end(); ++i) {
+				if(RemoteClient *client = getClient(*i))
+					client->SetBlocksNotSent(lighting_blocks);
+			}
+		}
+
 		if(event_count >= 5){
 			infostream<<"Server: MapEditEvents:"<<std::endl;
 			prof.print(infostream);
@@ -1023,13 +1263,52 @@ void Server::AsyncRunStep(bool initial_step)
 void Server::Receive()
 {
 	DSTACK(FUNCTION_NAME);
-	SharedBuffer<u8> data;
-	u16 peer_id;
+
+	// Wait for a packet, then take the others that are already there
+	std::vector<NetworkPacket*> received;
+	received.push_back(new NetworkPacket());
+	try {
+		m_con.Receive(received.back());
+	} catch (...) {
+		delete received.back();
+		throw;
+	}
+	while (received.size() < SERVER_RECEIVE_BATCH_MAX) {
+		NetworkPacket *pkt = new NetworkPacket();
+		if (!m_con.TryReceive(pkt)) {
+			delete pkt;
+			break;
+		}
+		received.push_back(pkt);
+	}
+
+	PacketBatch batch;
+	for (size_t i = 0; i < received.size(); i++)
+		batch.add(received[i]);
+
+	g_profiler->avg("Server: received packets per step", received.size());
+
+	batch.process(m_packet_pool, this);
+
+	for (size_t i = 0; i < received.size(); i++)
+		delete received[i];
+}
+
+void Server::processPacket(NetworkPacket *pkt)
+{
+	DSTACK(FUNCTION_NAME);
+	u16 peer_id = pkt->getPeerId();
+	u16 command = pkt->getCommand();
 	try {
-		NetworkPacket pkt;
-		m_con.Receive(&pkt);
-		peer_id = pkt.getPeerId();
-		ProcessData(&pkt);
+		// Environment is locked first, unless the handler doesn't need
+		// it; then it goes on in parallel with other peers' packets.
+		if (command < TOSERVER_NUM_MSG_TYPES &&
+				toServerCommandTable[command].env_access == TOSERVER_ENV_FREE) {
+			ProcessData(pkt);
+		} else {
+			MutexAutoLock envlock(m_env_mutex);
+			ProcessData(pkt);
+		}
 	}
 	catch(con::InvalidIncomingDataException &e) {
 		infostream<<"Server::Receive(): "
@@ -1049,6 +1328,16 @@ void Server::Receive()
 	catch(con::PeerNotFoundException &e) {
 		// Do nothing
 	}
+	catch(ClientNotFoundException &e) {
+		// Do nothing
+	}
+	catch(LuaError &e) {
+		setAsyncFatalError("Lua: " + std::string(e.what()));
+	}
+	catch(std::exception &e) {
+		// This may run on a packet thread, where nothing would catch it
+		setAsyncFatalError(std::string("ProcessData: ") + e.what());
+	}
 }
 
 PlayerSAO* Server::StageTwoClientInit(u16 peer_id)
@@ -1163,9 +1452,6 @@ inline void Server::handleCommand(NetworkPacket* pkt)
 void Server::ProcessData(NetworkPacket *pkt)
 {
 	DSTACK(FUNCTION_NAME);
-	// Environment is locked first.
-	MutexAutoLock envlock(m_env_mutex);
-
 	ScopeProfiler sp(g_profiler, "Server::ProcessData");
 	u32 peer_id = pkt->getPeerId();
 
@@ -1345,6 +1631,10 @@ void Server::setInventoryModified(const InventoryLocation &loc, bool playerSend)
 
 void Server::SetBlocksNotSent(std::map<v3s16, MapBlock *>& block)
 {
+	for (std::map<v3s16, MapBlock *>::iterator i = block.begin();
+			i != block.end(); ++i)
+		m_block_select->blockChanged(i->first);
+
 	std::vector<u16> clients = m_clients.getClientIDs();
 	m_clients.lock();
 	// Set the modified blocks unsent for all the clients
@@ -2122,6 +2412,8 @@ void Server::sendAddNode(v3s16 p, MapNode n, u16 ignore_id,
 
 void Server::setBlockNotSent(v3s16 p)
 {
+	m_block_select->blockChanged(p);
+
 	std::vector<u16> clients = m_clients.getClientIDs();
 	m_clients.lock();
 	for(std::vector<u16>::iterator i = clients.begin();
@@ -2132,7 +2424,8 @@ void Server::setBlockNotSent(v3s16 p)
 	m_clients.unlock();
 }
 
-void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version)
+void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version,
+		u8 codec)
 {
 	DSTACK(FUNCTION_NAME);
 
@@ -2142,15 +2435,13 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 		Create a packet with the block in the right format
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	block->serializeNetworkSpecific(os, net_proto_version);
-	std::string s = os.str();
+	SharedBuffer<u8> data = block->serializeNetwork(ver, net_proto_version,
+		codec);
 
-	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + 2 + s.size(), peer_id);
+	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + 2 + data.getSize(), peer_id);
 
 	pkt << p;
-	pkt.putRawString(s.c_str(), s.size());
+	pkt.putRawString((const char *)*data, data.getSize());
 	Send(&pkt);
 }
 
@@ -2163,35 +2454,54 @@ void Server::SendBlocks(float dtime)
 
 	ScopeProfiler sp(g_profiler, "Server: sel and send blocks to clients");
 
-	std::vector<PrioritySortedBlockTransfer> queue;
-
-	s32 total_sending = 0;
+	// The blocks are selected beside the server step, which only sends
+	// them and starts the next selection when the last one is done
+	m_block_select_dtime += dtime;
+	if (!m_block_select->isIdle())
+		return;
 
-	{
-		ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
+	std::vector<BlockSelectResult> results;
+	m_block_select->takeResults(results);
 
-		std::vector<u16> clients = m_clients.getClientIDs();
+	std::vector<PrioritySortedBlockTransfer> queue;
 
-		m_clients.lock();
-		for(std::vector<u16>::iterator i = clients.begin();
-			i != clients.end(); ++i) {
-			RemoteClient *client = m_clients.lockedGetClientNoEx(*i, CS_Active);
+	m_clients.lock();
+	for (std::vector<BlockSelectResult>::iterator i = results.begin();
+			i != results.end(); ++i) {
+		RemoteClient *client = m_clients.lockedGetClientNoEx(i->peer_id,
+				CS_Active);
+		if (client == NULL)
+			continue;
 
-			if (client == NULL)
-				continue;
+		client->FinishNextBlocks(*i);
+		queue.insert(queue.end(), i->blocks.begin(), i->blocks.end());
 
-			total_sending += client->SendingCount();
-			client->GetNextBlocks(m_env,m_emerge, dtime, queue);
+		// Blocks the player may need soon are kept loaded
+		for (std::vector<v3s16>::iterator p = i->touched_blocks.begin();
+				p != i->touched_blocks.end(); ++p) {
+			MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(*p);
+			if (block)
+				block->resetUsageTimer();
 		}
-		m_clients.unlock();
 	}
+	m_clients.unlock();
 
 	// Sort.
 	// Lowest priority number comes first.
 	// Lowest is most important.
 	std::sort(queue.begin(), queue.end());
 
+	std::vector<u16> clients = m_clients.getClientIDs();
+
 	m_clients.lock();
+	s32 total_sending = 0;
+	for (std::vector<u16>::iterator i = clients.begin();
+			i != clients.end(); ++i) {
+		RemoteClient *client = m_clients.lockedGetClientNoEx(*i, CS_Active);
+		if (client)
+			total_sending += client->SendingCount();
+	}
+
 	for(u32 i=0; i<queue.size(); i++)
 	{
 		//TODO: Calculate limit dynamically
@@ -2201,13 +2511,10 @@ void Server::SendBlocks(float dtime)
 
 		PrioritySortedBlockTransfer q = queue[i];
 
-		MapBlock *block = NULL;
-		try
-		{
-			block = m_env->getMap().getBlockNoCreate(q.pos);
-		}
-		catch(InvalidPositionException &e)
-		{
+		// The blocks were selected from a copy that may be out of date
+		MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(q.pos);
+		if (block == NULL || !block->isValid() || !block->isGenerated()) {
+			m_block_select->blockChanged(q.pos);
 			continue;
 		}
 
@@ -2216,12 +2523,40 @@ void Server::SendBlocks(float dtime)
 		if(!client)
 			continue;
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version, client->net_proto_version);
+		SendBlockNoLock(q.peer_id, block, client->serialization_version, client->net_proto_version,
+			client->getBlockCodec());
 
 		client->SentBlock(q.pos);
 		total_sending++;
 	}
+
+	/*
+		Start selecting the next blocks, with the blocks just sent
+	*/
+	std::vector<BlockSelectRequest> requests;
+	std::vector<u16> active;
+	for (std::vector<u16>::iterator i = clients.begin();
+			i != clients.end(); ++i) {
+		RemoteClient *client = m_clients.lockedGetClientNoEx(*i, CS_Active);
+		if (client == NULL)
+			continue;
+		active.push_back(*i);
+
+		// Blocks this player waits for are emerged nearest first
+		Player *player = m_env->getPlayer(*i);
+		if (player != NULL)
+			m_emerge->setPeerPosition(*i, getNodeBlockPos(
+				floatToInt(player->getPosition(), BS)));
+
+		requests.push_back(BlockSelectRequest());
+		if (!client->PrepareNextBlocks(m_env, m_block_select_dtime,
+				&requests.back()))
+			requests.pop_back();
+	}
 	m_clients.unlock();
+
+	m_block_select->startRound(&m_env->getMap(), requests, active);
+	m_block_select_dtime = 0.0;
 }
 
 void Server::fillMediaCache()
@@ -2709,6 +3044,8 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 			MutexAutoLock env_lock(m_env_mutex);
 			m_clients.DeleteClient(peer_id);
 		}
+
+		m_emerge->removePeer(peer_id);
 	}
 
 	// Send leave chat message to all remaining clients
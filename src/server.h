@@ -35,6 +35,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "chat_interface.h"
 #include "clientiface.h"
 #include "network/networkpacket.h"
+#include "network/packetbatch.h"
 #include <string>
 #include <list>
 #include <map>
@@ -53,6 +54,8 @@ class PlayerSAO;
 class IRollbackManager;
 struct RollbackAction;
 class EmergeManager;
+class WorkerPool;
+class BlockSelectThread;
 class GameScripting;
 class ServerEnvironment;
 struct SimpleSoundSpec;
@@ -161,7 +164,7 @@ struct ServerPlayingSound
 };
 
 class Server : public con::PeerHandler, public MapEventReceiver,
-		public InventoryManager, public IGameDef
+		public InventoryManager, public IGameDef, public PacketBatchHandler
 {
 public:
 	/*
@@ -178,6 +181,10 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	~Server();
 	void start(Address bind_addr);
 	void stop();
+	// Generates every chunk touching the area between nodemin and nodemax,
+	// without a network thread or environment steps. Must not be called
+	// while the server is running. Returns false if interrupted by kill.
+	bool pregenerate(v3s16 nodemin, v3s16 nodemax, bool &kill);
 	// This is mainly a way to pass the time to the server.
 	// Actual processing is done in an another thread.
 	void step(float dtime);
@@ -219,6 +226,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void handleCommand_SrpBytesM(NetworkPacket* pkt);
 
 	void ProcessData(NetworkPacket *pkt);
+	// Handles a received packet, catching what handlers throw
+	void processPacket(NetworkPacket *pkt);
 
 	void Send(NetworkPacket* pkt);
 
@@ -435,7 +444,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void setBlockNotSent(v3s16 p);
 
 	// Environment and Connection must be locked when called
-	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version);
+	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version,
+		u8 codec);
 
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
@@ -547,6 +557,16 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Emerge manager
 	EmergeManager *m_emerge;
 
+	// Selects the blocks to send to clients beside the server thread
+	BlockSelectThread *m_block_select;
+	// Seconds since the last block selection was started
+	float m_block_select_dtime;
+	// Threads handling received packets, one peer per item
+	WorkerPool *m_packet_pool;
+	// Codec of the map blocks, for the handlers that run without the
+	// environment locked
+	u8 m_block_codec;
+
 	// Scripting
 	// Envlock and conlock should be locked when using Lua
 	GameScripting *m_script;
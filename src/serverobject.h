@@ -79,7 +79,8 @@ class ServerActiveObject : public ActiveObject
 		Some simple getters/setters
 	*/
 	v3f getBasePosition(){ return m_base_position; }
-	void setBasePosition(v3f pos){ m_base_position = pos; }
+	// Also keeps the environment's object grid up to date
+	void setBasePosition(v3f pos);
 	ServerEnvironment* getEnv(){ return m_env; }
 	
 	/*
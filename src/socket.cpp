@@ -59,11 +59,25 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	typedef int socket_t;
 #endif
 
+#if defined(__linux__) && !defined(__ANDROID__)
+	#include <sys/epoll.h>
+	#define HAVE_EPOLL 1
+	#define HAVE_MMSG 1
+#endif
+
+// Most datagrams passed to one sendmmsg() or recvmmsg() call
+#define SOCKET_MMSG_BATCH 64
+
 // Set to true to enable verbose debug output
 bool socket_enable_debug_output = false;        // yuck
 
 static bool g_sockets_initialized = false;
 
+#ifdef HAVE_MMSG
+// Cleared if the kernel turns out not to have sendmmsg()/recvmmsg()
+static bool g_mmsg_supported = true;
+#endif
+
 // Initialize sockets
 void sockets_init()
 {
@@ -310,6 +324,40 @@ void Address::print(std::ostream *s) const
 		*s << serializeString() << ":" << m_port;
 }
 
+/*
+	Conversion between Address and the socket API addresses
+*/
+
+union SocketAddress
+{
+	struct sockaddr addr;
+	struct sockaddr_in ipv4;
+	struct sockaddr_in6 ipv6;
+};
+
+// Returns the length of the address written to sa
+static socklen_t toSocketAddress(const Address &address, SocketAddress *sa)
+{
+	if (address.isIPv6()) {
+		sa->ipv6 = address.getAddress6();
+		sa->ipv6.sin6_port = htons(address.getPort());
+		return sizeof(struct sockaddr_in6);
+	}
+	sa->ipv4 = address.getAddress();
+	sa->ipv4.sin_port = htons(address.getPort());
+	return sizeof(struct sockaddr_in);
+}
+
+static Address fromSocketAddress(const SocketAddress &sa, int family)
+{
+	if (family == AF_INET6) {
+		IPv6AddressBytes bytes;
+		memcpy(bytes.bytes, sa.ipv6.sin6_addr.s6_addr, 16);
+		return Address(&bytes, ntohs(sa.ipv6.sin6_port));
+	}
+	return Address(ntohl(sa.ipv4.sin_addr.s_addr), ntohs(sa.ipv4.sin_port));
+}
+
 /*
 	UDPSocket
 */
@@ -346,6 +394,22 @@ bool UDPSocket::init(bool ipv6, bool noExceptions)
 		}
 	}
 
+	m_epoll_handle = -1;
+#ifdef HAVE_EPOLL
+	// Fall back to select() if epoll can't be set up
+	m_epoll_handle = epoll_create(1);
+	if (m_epoll_handle >= 0) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = m_handle;
+		if (epoll_ctl(m_epoll_handle, EPOLL_CTL_ADD, m_handle, &event) < 0) {
+			close(m_epoll_handle);
+			m_epoll_handle = -1;
+		}
+	}
+#endif
+
 	setTimeoutMs(0);
 
 	return true;
@@ -363,6 +427,8 @@ UDPSocket::~UDPSocket()
 	closesocket(m_handle);
 #else
 	close(m_handle);
+	if (m_epoll_handle >= 0)
+		close(m_epoll_handle);
 #endif
 }
 
@@ -452,62 +518,97 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 	if(destination.getFamily() != m_addr_family)
 		throw SendFailedException("Address family mismatch");
 
-	int sent;
-	if(m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address = destination.getAddress6();
-		address.sin6_port = htons(destination.getPort());
-		sent = sendto(m_handle, (const char *)data, size,
-				0, (struct sockaddr *)&address, sizeof(struct sockaddr_in6));
-	} else {
-		struct sockaddr_in address = destination.getAddress();
-		address.sin_port = htons(destination.getPort());
-		sent = sendto(m_handle, (const char *)data, size,
-				0, (struct sockaddr *)&address, sizeof(struct sockaddr_in));
-	}
+	SocketAddress address;
+	socklen_t address_len = toSocketAddress(destination, &address);
+	int sent = sendto(m_handle, (const char *)data, size,
+			0, &address.addr, address_len);
 
 	if(sent != size)
 		throw SendFailedException("Failed to send packet");
 }
 
-int UDPSocket::Receive(Address & sender, void *data, int size)
+int UDPSocket::SendMany(const UDPDatagram *datagrams, int count)
 {
-	// Return on timeout
-	if(WaitData(m_timeout_ms) == false)
-		return -1;
-
-	int received;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address;
-		memset(&address, 0, sizeof(address));
-		socklen_t address_len = sizeof(address);
+	int sent = 0;
+	int i = 0;
+
+#ifdef HAVE_MMSG
+	// The internet simulator and the debug output work per datagram
+	while (i < count && g_mmsg_supported && !INTERNET_SIMULATOR &&
+			!socket_enable_debug_output) {
+		SocketAddress addresses[SOCKET_MMSG_BATCH];
+		struct iovec iovecs[SOCKET_MMSG_BATCH];
+		struct mmsghdr msgs[SOCKET_MMSG_BATCH];
+		int indices[SOCKET_MMSG_BATCH];
+
+		int n = 0;
+		for (; i < count && n < SOCKET_MMSG_BATCH; i++) {
+			const UDPDatagram &datagram = datagrams[i];
+			if (datagram.address.getFamily() != m_addr_family)
+				continue;
+
+			iovecs[n].iov_base = datagram.data;
+			iovecs[n].iov_len = datagram.size;
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &addresses[n];
+			msgs[n].msg_hdr.msg_namelen =
+				toSocketAddress(datagram.address, &addresses[n]);
+			msgs[n].msg_hdr.msg_iov = &iovecs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			indices[n] = i;
+			n++;
+		}
 
-		received = recvfrom(m_handle, (char *) data,
-				size, 0, (struct sockaddr *) &address, &address_len);
+		int done = 0;
+		while (done < n) {
+			int result = sendmmsg(m_handle, &msgs[done], n - done, 0);
+			if (result > 0) {
+				sent += result;
+				done += result;
+			} else if (result < 0 && errno == EINTR) {
+				continue;
+			} else if (result < 0 && errno == ENOSYS) {
+				// Send the rest one by one
+				g_mmsg_supported = false;
+				i = indices[done];
+				break;
+			} else {
+				// The first datagram failed, go on with the next one
+				done++;
+			}
+		}
+	}
+#endif
 
-		if(received < 0)
-			return -1;
+	for (; i < count; i++) {
+		const UDPDatagram &datagram = datagrams[i];
+		try {
+			Send(datagram.address, datagram.data, datagram.size);
+			sent++;
+		} catch (SendFailedException &e) {
+		}
+	}
 
-		u16 address_port = ntohs(address.sin6_port);
-		IPv6AddressBytes bytes;
-		memcpy(bytes.bytes, address.sin6_addr.s6_addr, 16);
-		sender = Address(&bytes, address_port);
-	} else {
-		struct sockaddr_in address;
-		memset(&address, 0, sizeof(address));
+	return sent;
+}
 
-		socklen_t address_len = sizeof(address);
+int UDPSocket::Receive(Address & sender, void *data, int size)
+{
+	// Return on timeout
+	if(WaitData(m_timeout_ms) == false)
+		return -1;
 
-		received = recvfrom(m_handle, (char *)data,
-				size, 0, (struct sockaddr *)&address, &address_len);
+	SocketAddress address;
+	memset(&address, 0, sizeof(address));
+	socklen_t address_len = sizeof(address);
 
-		if(received < 0)
-			return -1;
+	int received = recvfrom(m_handle, (char *) data,
+			size, 0, &address.addr, &address_len);
 
-		u32 address_ip = ntohl(address.sin_addr.s_addr);
-		u16 address_port = ntohs(address.sin_port);
+	if(received < 0)
+		return -1;
 
-		sender = Address(address_ip, address_port);
-	}
+	sender = fromSocketAddress(address, m_addr_family);
 
 	if (socket_enable_debug_output) {
 		// Print packet sender and size
@@ -532,6 +633,64 @@ int UDPSocket::Receive(Address & sender, void *data, int size)
 	return received;
 }
 
+int UDPSocket::ReceiveMany(UDPDatagram *datagrams, int count, int size)
+{
+	int received = 0;
+
+#ifdef HAVE_MMSG
+	while (received < count && g_mmsg_supported &&
+			!socket_enable_debug_output) {
+		SocketAddress addresses[SOCKET_MMSG_BATCH];
+		struct iovec iovecs[SOCKET_MMSG_BATCH];
+		struct mmsghdr msgs[SOCKET_MMSG_BATCH];
+
+		int n = MYMIN(count - received, SOCKET_MMSG_BATCH);
+		for (int i = 0; i < n; i++) {
+			iovecs[i].iov_base = datagrams[received + i].data;
+			iovecs[i].iov_len = size;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			memset(&addresses[i], 0, sizeof(addresses[i]));
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int result = recvmmsg(m_handle, msgs, n, MSG_DONTWAIT, NULL);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOSYS)
+				return received;
+			// Receive one by one
+			g_mmsg_supported = false;
+			break;
+		}
+
+		for (int i = 0; i < result; i++) {
+			UDPDatagram &datagram = datagrams[received + i];
+			datagram.address = fromSocketAddress(addresses[i], m_addr_family);
+			datagram.size = msgs[i].msg_len;
+		}
+		received += result;
+
+		if (result < n)
+			return received;
+	}
+#endif
+
+	for (; received < count; received++) {
+		UDPDatagram &datagram = datagrams[received];
+		if (!WaitData(0))
+			break;
+		datagram.size = Receive(datagram.address, datagram.data, size);
+		if (datagram.size < 0)
+			break;
+	}
+
+	return received;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
@@ -544,6 +703,23 @@ void UDPSocket::setTimeoutMs(int timeout_ms)
 
 bool UDPSocket::WaitData(int timeout_ms)
 {
+#ifdef HAVE_EPOLL
+	if (m_epoll_handle >= 0) {
+		struct epoll_event event;
+		int result = epoll_wait(m_epoll_handle, &event, 1, timeout_ms);
+
+		if (result > 0)
+			return true;
+		// See below for EBADF
+		if (result == 0 || errno == EINTR || errno == EBADF)
+			return false;
+
+		dstream << (int) m_handle << ": epoll_wait failed: "
+		        << strerror(errno) << std::endl;
+		throw SocketException("epoll_wait failed");
+	}
+#endif
+
 	fd_set readset;
 	int result;
 
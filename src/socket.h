@@ -112,10 +112,22 @@ class Address
 	u16 m_port; // Port is separate from sockaddr structures
 };
 
+/*
+	A datagram for UDPSocket::SendMany() and UDPSocket::ReceiveMany().
+	When receiving, data must point to a buffer of the size given to
+	ReceiveMany() and size is set to the received size.
+*/
+struct UDPDatagram
+{
+	Address address;
+	void *data;
+	int size;
+};
+
 class UDPSocket
 {
 public:
-	UDPSocket() { }
+	UDPSocket(): m_handle(-1), m_epoll_handle(-1) { }
 	UDPSocket(bool ipv6);
 	~UDPSocket();
 	void Bind(Address addr);
@@ -125,14 +137,22 @@ class UDPSocket
 	//void Close();
 	//bool IsOpen();
 	void Send(const Address & destination, const void * data, int size);
+	// Sends the datagrams, several per system call where supported.
+	// Returns the number of datagrams that were sent.
+	int SendMany(const UDPDatagram *datagrams, int count);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	// Receives up to count datagrams of up to size bytes that are
+	// already waiting. Returns the number received.
+	int ReceiveMany(UDPDatagram *datagrams, int count, int size);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
 	bool WaitData(int timeout_ms);
 private:
 	int m_handle;
+	// epoll instance watching m_handle, -1 if WaitData() uses select()
+	int m_epoll_handle;
 	int m_timeout_ms;
 	int m_addr_family;
 };
@@ -0,0 +1,121 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "threading/workerpool.h"
+#include "threading/thread.h"
+#include "util/numeric.h"
+#include "log.h"
+
+class WorkerThread : public Thread
+{
+public:
+	WorkerThread(const std::string &name, WorkerPool *pool, u32 index):
+		Thread(name),
+		m_pool(pool),
+		m_index(index)
+	{
+	}
+
+	void stop()
+	{
+		Thread::stop();
+		m_start.post();
+	}
+
+	// Starts working on the current job of the pool
+	void startWork() { m_start.post(); }
+
+protected:
+	void *run()
+	{
+		while (!stopRequested()) {
+			m_start.wait();
+			if (stopRequested())
+				break;
+			m_pool->work(m_index);
+			m_pool->workDone();
+		}
+		return NULL;
+	}
+
+private:
+	WorkerPool *m_pool;
+	u32 m_index;
+	Semaphore m_start;
+};
+
+WorkerPool::WorkerPool(const std::string &name, s32 num_threads):
+	m_job(NULL),
+	m_num_items(0),
+	m_next_item(0)
+{
+	if (num_threads <= 0)
+		num_threads = rangelim(Thread::getNumberOfProcessors() / 2,
+				1, WORKER_POOL_DEFAULT_MAX_THREADS);
+
+	// The thread calling run() works too, so it needs one helper less
+	for (s32 i = 1; i < num_threads; i++) {
+		WorkerThread *thread = new WorkerThread(name, this, i);
+		if (!thread->start()) {
+			errorstream << "WorkerPool: Failed to start thread "
+					<< name << std::endl;
+			delete thread;
+			break;
+		}
+		m_threads.push_back(thread);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	for (size_t i = 0; i < m_threads.size(); i++) {
+		m_threads[i]->stop();
+		m_threads[i]->wait();
+		delete m_threads[i];
+	}
+}
+
+void WorkerPool::run(WorkerJob *job, u32 num_items, u32 min_items)
+{
+	m_job = job;
+	m_num_items = num_items;
+	m_next_item = 0;
+
+	// Not worth waking up the helpers for a few items
+	u32 num_helpers = MYMIN(m_threads.size(), num_items / MYMAX(min_items, 1));
+	for (u32 i = 0; i < num_helpers; i++)
+		m_threads[i]->startWork();
+
+	work(0);
+
+	for (u32 i = 0; i < num_helpers; i++)
+		m_done.wait();
+
+	m_job = NULL;
+}
+
+void WorkerPool::work(u32 thread)
+{
+	for (;;) {
+		u32 i = m_next_item++;
+		if (i >= m_num_items)
+			break;
+		m_job->work(i, thread);
+	}
+}
@@ -0,0 +1,87 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef THREADING_WORKERPOOL_H
+#define THREADING_WORKERPOOL_H
+
+#include <string>
+#include <vector>
+#include "irrlichttypes.h"
+#include "threading/atomic.h"
+#include "threading/semaphore.h"
+#include "util/basic_macros.h"
+
+/*
+	A job for WorkerPool: work() is called once for every item.
+	thread is the index of the thread doing it, below
+	WorkerPool::getThreadCount(), for keeping per-thread state.
+*/
+class WorkerJob
+{
+public:
+	virtual ~WorkerJob() {}
+	virtual void work(u32 item, u32 thread) = 0;
+};
+
+class WorkerThread;
+
+/*
+	Most threads a pool uses when not told how many, including the calling
+	thread. The server has several pools that are used one after another,
+	so each is kept to a part of the processors.
+*/
+#define WORKER_POOL_DEFAULT_MAX_THREADS 4
+
+/*
+	A fixed set of helper threads that work on jobs together with the
+	thread calling run(). The helpers sleep between jobs.
+*/
+class WorkerPool
+{
+public:
+	// num_threads includes the calling thread; 0 means one per two
+	// processors, at most WORKER_POOL_DEFAULT_MAX_THREADS
+	WorkerPool(const std::string &name, s32 num_threads);
+	~WorkerPool();
+
+	// Threads working on a job, including the calling one
+	u32 getThreadCount() const { return m_threads.size() + 1; }
+
+	// Runs job for items 0 .. num_items-1 and returns once all are done.
+	// Helpers are only woken if each gets at least min_items items.
+	void run(WorkerJob *job, u32 num_items, u32 min_items = 2);
+
+	// Used by the helper threads
+	void work(u32 thread);
+	void workDone() { m_done.post(); }
+
+private:
+	std::vector<WorkerThread*> m_threads;
+
+	// Current job
+	WorkerJob *m_job;
+	u32 m_num_items;
+	Atomic<u32> m_next_item;
+
+	Semaphore m_done;
+
+	DISABLE_CLASS_COPY(WorkerPool);
+};
+
+#endif
@@ -54,6 +54,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	typedef pthread_t threadhandle_t;
 #endif
 
+//
+// THREAD_LOCAL: storage class for per-thread variables of POD type
+//
+#if USE_CPP11_THREADS
+	#define THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 //
 // ThreadStartFunc
 //
@@ -139,6 +139,7 @@ extern content_t t_CONTENT_STONE;
 extern content_t t_CONTENT_GRASS;
 extern content_t t_CONTENT_TORCH;
 extern content_t t_CONTENT_WATER;
+extern content_t t_CONTENT_WATER_FLOWING;
 extern content_t t_CONTENT_LAVA;
 extern content_t t_CONTENT_BRICK;
 
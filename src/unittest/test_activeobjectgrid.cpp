@@ -0,0 +1,258 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "activeobjectgrid.h"
+#include "constants.h"
+#include "noise.h"
+#include <algorithm>
+#include <limits>
+
+class TestActiveObjectGrid : public TestBase {
+public:
+	TestActiveObjectGrid() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestActiveObjectGrid"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testInsertRemove();
+	void testMoveAcrossCells();
+	void testLargeRadius();
+	void testFarAndNaNPositions();
+	void testRandomEdits();
+};
+
+static TestActiveObjectGrid g_test_instance;
+
+void TestActiveObjectGrid::runTests(IGameDef *gamedef)
+{
+	TEST(testInsertRemove);
+	TEST(testMoveAcrossCells);
+	TEST(testLargeRadius);
+	TEST(testFarAndNaNPositions);
+	TEST(testRandomEdits);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+	Checks getObjectsNear() against a scan of all positions: it must find
+	every object within the radius, and each object at most once.
+*/
+static bool checkNear(const ActiveObjectGrid &grid,
+		const std::map<u16, v3f> &positions, v3f pos, f32 radius)
+{
+	std::vector<u16> found;
+	grid.getObjectsNear(pos, radius, found);
+	std::sort(found.begin(), found.end());
+	if (std::adjacent_find(found.begin(), found.end()) != found.end())
+		return false;
+
+	std::vector<u16> found_within;
+	for (size_t i = 0; i < found.size(); i++) {
+		std::map<u16, v3f>::const_iterator it = positions.find(found[i]);
+		// Removed objects must not be found
+		if (it == positions.end())
+			return false;
+		if (it->second.getDistanceFrom(pos) <= radius)
+			found_within.push_back(found[i]);
+	}
+
+	std::vector<u16> within;
+	for (std::map<u16, v3f>::const_iterator it = positions.begin();
+			it != positions.end(); ++it) {
+		if (it->second.getDistanceFrom(pos) <= radius)
+			within.push_back(it->first);
+	}
+	return found_within == within;
+}
+
+static bool isFound(const ActiveObjectGrid &grid, u16 id, v3f pos,
+		f32 radius)
+{
+	std::vector<u16> found;
+	grid.getObjectsNear(pos, radius, found);
+	return std::find(found.begin(), found.end(), id) != found.end();
+}
+
+void TestActiveObjectGrid::testInsertRemove()
+{
+	ActiveObjectGrid grid;
+	std::map<u16, v3f> positions;
+
+	positions[1] = v3f(0, 0, 0);
+	positions[2] = v3f(5, 5, 5) * BS;
+	positions[3] = v3f(-20, 3, 40) * BS;
+	positions[4] = v3f(15.9, 0, 0) * BS;
+	for (std::map<u16, v3f>::iterator it = positions.begin();
+			it != positions.end(); ++it)
+		grid.insert(it->first, it->second);
+
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 10 * BS));
+	UASSERT(checkNear(grid, positions, v3f(-20, 3, 40) * BS, 1 * BS));
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 100 * BS));
+	UASSERT(isFound(grid, 2, v3f(5, 5, 5) * BS, 0));
+
+	// Inserting again moves the object instead of adding it twice
+	positions[2] = v3f(-20, 4, 40) * BS;
+	grid.insert(2, positions[2]);
+	UASSERT(checkNear(grid, positions, v3f(-20, 3, 40) * BS, 2 * BS));
+	UASSERT(!isFound(grid, 2, v3f(5, 5, 5) * BS, 1 * BS));
+
+	grid.remove(3);
+	positions.erase(3);
+	UASSERT(checkNear(grid, positions, v3f(-20, 3, 40) * BS, 2 * BS));
+	// Removing an unknown id does nothing
+	grid.remove(3);
+	grid.remove(100);
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 100 * BS));
+
+	grid.clear();
+	positions.clear();
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 100 * BS));
+}
+
+void TestActiveObjectGrid::testMoveAcrossCells()
+{
+	ActiveObjectGrid grid;
+	std::map<u16, v3f> positions;
+
+	positions[1] = v3f(15.9, 8, 8) * BS;
+	grid.insert(1, positions[1]);
+
+	// Across a cell border in each direction, and into negative cells
+	v3f moves[] = {
+		v3f(16.1, 8, 8) * BS,
+		v3f(16.1, 16.1, 8) * BS,
+		v3f(16.1, 16.1, -0.1) * BS,
+		v3f(-0.1, -0.1, -0.1) * BS,
+		v3f(-0.1, -0.1, -0.2) * BS,
+		v3f(200, -100, 50) * BS,
+	};
+	for (size_t i = 0; i < ARRLEN(moves); i++) {
+		v3f old_pos = positions[1];
+		positions[1] = moves[i];
+		grid.update(1, moves[i]);
+		UASSERT(isFound(grid, 1, moves[i], 0));
+		UASSERT(checkNear(grid, positions, moves[i], 1 * BS));
+		UASSERT(checkNear(grid, positions, old_pos, 1 * BS));
+	}
+
+	// Updating an unknown id doesn't add it
+	grid.update(2, v3f(0, 0, 0));
+	UASSERT(!isFound(grid, 2, v3f(0, 0, 0), 100 * BS));
+}
+
+void TestActiveObjectGrid::testLargeRadius()
+{
+	ActiveObjectGrid grid;
+	std::map<u16, v3f> positions;
+
+	// A few objects far apart, so that the query box covers far more
+	// cells than there are occupied ones
+	positions[1] = v3f(0, 0, 0);
+	positions[2] = v3f(1000, 0, 0) * BS;
+	positions[3] = v3f(-1000, -1000, 1000) * BS;
+	positions[4] = v3f(30000, 30000, -30000) * BS;
+	for (std::map<u16, v3f>::iterator it = positions.begin();
+			it != positions.end(); ++it)
+		grid.insert(it->first, it->second);
+
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 1500 * BS));
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 1000 * BS));
+	UASSERT(checkNear(grid, positions, v3f(500, 0, 0) * BS, 600 * BS));
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 100000 * BS));
+
+	std::vector<u16> found;
+	grid.getObjectsNear(v3f(0, 0, 0), 100000 * BS, found);
+	UASSERTEQ(size_t, found.size(), 4);
+}
+
+void TestActiveObjectGrid::testFarAndNaNPositions()
+{
+	ActiveObjectGrid grid;
+	std::map<u16, v3f> positions;
+
+	// Beyond the range of the cell coordinates; clamped to the last cell
+	positions[1] = v3f(1e9, 0, -1e9);
+	grid.insert(1, positions[1]);
+	UASSERT(isFound(grid, 1, positions[1], 1 * BS));
+	UASSERT(checkNear(grid, positions, positions[1], 1 * BS));
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 100 * BS));
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 1e10));
+
+	// A NaN position neither hangs nor breaks the other objects
+	f32 nan = std::numeric_limits<f32>::quiet_NaN();
+	positions[2] = v3f(8, 8, 8) * BS;
+	grid.insert(2, positions[2]);
+	grid.insert(3, v3f(nan, 0, 0));
+	std::vector<u16> found;
+	grid.getObjectsNear(v3f(nan, nan, nan), 10 * BS, found);
+	grid.getObjectsNear(v3f(0, 0, 0), nan, found);
+	UASSERT(isFound(grid, 2, positions[2], 1 * BS));
+
+	// It can still be moved out and removed
+	positions[3] = v3f(-40, 0, 0) * BS;
+	grid.update(3, positions[3]);
+	UASSERT(checkNear(grid, positions, positions[3], 1 * BS));
+	grid.remove(3);
+	positions.erase(3);
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 1e10));
+}
+
+void TestActiveObjectGrid::testRandomEdits()
+{
+	ActiveObjectGrid grid;
+	std::map<u16, v3f> positions;
+	PcgRandom pr(42);
+
+	for (u32 step = 0; step < 2000; step++) {
+		u16 id = pr.range(1, 200);
+		v3f pos(pr.range(-100, 100), pr.range(-100, 100),
+				pr.range(-100, 100));
+		pos *= BS;
+		switch (pr.range(0, 3)) {
+		case 0:
+			grid.insert(id, pos);
+			positions[id] = pos;
+			break;
+		case 1:
+			grid.remove(id);
+			positions.erase(id);
+			break;
+		default:
+			// Small moves, mostly within the cell
+			if (positions.find(id) != positions.end()) {
+				pos = positions[id] + pos / 40;
+				positions[id] = pos;
+			}
+			grid.update(id, pos);
+			break;
+		}
+
+		if (step % 20 == 0) {
+			v3f center(pr.range(-100, 100), pr.range(-100, 100),
+					pr.range(-100, 100));
+			f32 radius = pr.range(0, 60);
+			UASSERT(checkNear(grid, positions, center * BS, radius * BS));
+		}
+	}
+	UASSERT(checkNear(grid, positions, v3f(0, 0, 0), 1000 * BS));
+}
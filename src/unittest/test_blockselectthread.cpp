@@ -0,0 +1,223 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "blockselectthread.h"
+#include "emerge.h"
+#include "filesys.h"
+#include "map.h"
+#include "mapblock.h"
+#include "mapsector.h"
+#include "porting.h"
+#include <algorithm>
+#include <sstream>
+
+class TestBlockSelectThread : public TestBase {
+public:
+	TestBlockSelectThread() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestBlockSelectThread"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testSelect(IGameDef *gamedef);
+	void testServerMap(IGameDef *gamedef);
+};
+
+static TestBlockSelectThread g_test_instance;
+
+void TestBlockSelectThread::runTests(IGameDef *gamedef)
+{
+	TEST(testSelect, gamedef);
+	TEST(testServerMap, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void runRound(BlockSelectThread &thread, Map *map,
+		const BlockSelectRequest &request,
+		std::vector<BlockSelectResult> &results)
+{
+	std::vector<BlockSelectRequest> requests(1, request);
+	std::vector<u16> clients(1, request.peer_id);
+	thread.startRound(map, requests, clients);
+	while (!thread.isIdle())
+		sleep_ms(1);
+	thread.takeResults(results);
+}
+
+static bool hasBlock(const BlockSelectResult &result, v3s16 p)
+{
+	for (size_t i = 0; i < result.blocks.size(); i++) {
+		if (result.blocks[i].pos == p)
+			return true;
+	}
+	return false;
+}
+
+static bool hasEmergedBlock(const BlockSelectResult &result, v3s16 p)
+{
+	return std::find(result.emerged_blocks.begin(),
+		result.emerged_blocks.end(), p) != result.emerged_blocks.end();
+}
+
+void TestBlockSelectThread::testSelect(IGameDef *gamedef)
+{
+	// All blocks within the distances looked at in one round are loaded,
+	// so that nothing needs to be emerged
+	std::ostringstream dout;
+	Map map(dout, gamedef);
+	BlockSelectThread thread(NULL, 1);
+	thread.start();
+
+	v3s16 p;
+	for (p.Z = -2; p.Z <= 2; p.Z++)
+	for (p.X = -2; p.X <= 2; p.X++) {
+		MapSector *sector = new ServerMapSector(&map, v2s16(p.X, p.Z),
+			gamedef);
+		(*map.getSectorsPtr())[v2s16(p.X, p.Z)] = sector;
+		for (p.Y = -2; p.Y <= 2; p.Y++) {
+			MapBlock *block = sector->createBlankBlock(p.Y);
+			block->setGenerated(true);
+			block->setLightingExpired(false);
+			thread.blockChanged(p);
+		}
+	}
+
+	BlockSelectRequest request;
+	request.peer_id = 1;
+	request.new_client = true;
+	request.center = v3s16(0, 0, 0);
+	request.camera_pos = v3f(8, 8, 8) * BS;
+	request.camera_dir = v3f(0, 0, 1);
+	request.nearest_unsent_d = 0;
+	request.num_sending = 0;
+	request.building = false;
+	request.visible_blocks_expired = false;
+	request.dtime = 0.0;
+
+	std::vector<BlockSelectResult> results;
+	runRound(thread, &map, request, results);
+	UASSERTEQ(size_t, results.size(), 1);
+	UASSERTEQ(u16, results[0].peer_id, 1);
+	UASSERT(!results[0].blocks.empty());
+	UASSERT(results[0].blocks.size() <= g_settings->getU16(
+		"max_simultaneous_block_sends_per_client"));
+
+	// Nearest first, nothing out of sight, and at most two distances
+	// further than the last time
+	UASSERT(hasBlock(results[0], v3s16(0, 0, 0)));
+	UASSERT(!hasBlock(results[0], v3s16(0, 0, -2)));
+	for (size_t i = 0; i < results[0].blocks.size(); i++)
+		UASSERT(results[0].blocks[i].priority <= 2);
+
+	// Blocks the client has are not selected again
+	std::vector<PrioritySortedBlockTransfer> sent = results[0].blocks;
+	request.new_client = false;
+	for (size_t i = 0; i < sent.size(); i++)
+		request.known_changes.push_back(std::make_pair(sent[i].pos, true));
+	runRound(thread, &map, request, results);
+	UASSERTEQ(size_t, results.size(), 1);
+	for (size_t i = 0; i < sent.size(); i++)
+		UASSERT(!hasBlock(results[0], sent[i].pos));
+
+	// Unless they have to be sent again
+	request.known_changes.clear();
+	request.known_changes.push_back(std::make_pair(v3s16(0, 0, 0), false));
+	runRound(thread, &map, request, results);
+	UASSERT(hasBlock(results[0], v3s16(0, 0, 0)));
+
+	// A new client starts from scratch
+	request.new_client = true;
+	request.known_changes.clear();
+	runRound(thread, &map, request, results);
+	UASSERT(hasBlock(results[0], v3s16(0, 0, 0)));
+}
+
+void TestBlockSelectThread::testServerMap(IGameDef *gamedef)
+{
+	std::string savedir = getTestTempDirectory() + DIR_DELIM "world";
+	UASSERT(fs::CreateDir(savedir));
+
+	// Nothing may stop the walk before the nearest blocks to emerge
+	std::string max_sends = g_settings->get(
+		"max_simultaneous_block_sends_per_client");
+	g_settings->set("max_simultaneous_block_sends_per_client", "100");
+
+	{
+		// The emerge threads aren't started, so queued blocks stay queued
+		EmergeManager emerge(gamedef);
+		emerge.loadMapgenParams();
+		emerge.initMapgens();
+		ServerMap map(savedir, gamedef, &emerge);
+		BlockSelectThread thread(&emerge, 2);
+		thread.start();
+
+		// A cube of blocks around the player, the one in front of it
+		// not generated yet
+		v3s16 p;
+		for (p.Z = -1; p.Z <= 1; p.Z++)
+		for (p.X = -1; p.X <= 1; p.X++) {
+			ServerMapSector *sector = map.createSector(v2s16(p.X, p.Z));
+			for (p.Y = -1; p.Y <= 1; p.Y++) {
+				MapBlock *block = sector->createBlankBlock(p.Y);
+				block->setGenerated(p != v3s16(0, 0, 1));
+				block->setLightingExpired(false);
+				thread.blockChanged(p);
+			}
+		}
+
+		BlockSelectRequest request;
+		request.peer_id = 1;
+		request.new_client = true;
+		request.center = v3s16(0, 0, 0);
+		request.camera_pos = v3f(8, 8, 8) * BS;
+		request.camera_dir = v3f(0, 0, 1);
+		request.nearest_unsent_d = 0;
+		request.num_sending = 0;
+		request.building = false;
+		request.visible_blocks_expired = false;
+		request.dtime = 0.0;
+
+		std::vector<BlockSelectResult> results;
+		runRound(thread, &map, request, results);
+		UASSERTEQ(size_t, results.size(), 1);
+		const BlockSelectResult &result = results[0];
+
+		// Loaded, generated blocks are sent
+		UASSERT(hasBlock(result, v3s16(0, 0, 0)));
+		UASSERT(!hasBlock(result, v3s16(0, 0, 1)));
+		for (size_t i = 0; i < result.blocks.size(); i++) {
+			MapBlock *block = map.getBlockNoCreateNoEx(result.blocks[i].pos);
+			UASSERT(block != NULL && block->isGenerated());
+			UASSERT(!hasEmergedBlock(result, result.blocks[i].pos));
+		}
+
+		// The others are emerged, the not generated one first
+		UASSERT(!result.emerged_blocks.empty());
+		UASSERT(result.emerged_blocks[0] == v3s16(0, 0, 1));
+		for (size_t i = 1; i < result.emerged_blocks.size(); i++)
+			UASSERT(map.getBlockNoCreateNoEx(result.emerged_blocks[i]) == NULL);
+
+		// Nothing else is looked at before they are there
+		UASSERT(result.nearest_unsent_d == 1);
+	}
+
+	g_settings->set("max_simultaneous_block_sends_per_client", max_sends);
+}
@@ -0,0 +1,136 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "compactnodearray.h"
+#include "mapblock.h"
+
+class TestCompactNodeArray : public TestBase {
+public:
+	TestCompactNodeArray() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestCompactNodeArray"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testSingleValue();
+	void testIndexWidths();
+	void testTooManyNodes();
+	void testMapBlock(IGameDef *gamedef);
+};
+
+static TestCompactNodeArray g_test_instance;
+
+void TestCompactNodeArray::runTests(IGameDef *gamedef)
+{
+	TEST(testSingleValue);
+	TEST(testIndexWidths);
+	TEST(testTooManyNodes);
+	TEST(testMapBlock, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define TEST_NODECOUNT 4096
+
+void TestCompactNodeArray::testSingleValue()
+{
+	MapNode nodes[TEST_NODECOUNT];
+	for (u32 i = 0; i < TEST_NODECOUNT; i++)
+		nodes[i] = MapNode(CONTENT_AIR, 15, 0);
+
+	CompactNodeArray array;
+	UASSERT(array.empty());
+	UASSERT(array.pack(nodes, TEST_NODECOUNT));
+	UASSERT(!array.empty());
+	UASSERTEQ(int, array.getBitsPerNode(), 0);
+	UASSERT(array.getMemoryUsage(TEST_NODECOUNT) < 64);
+	UASSERT(array.get(1234) == MapNode(CONTENT_AIR, 15, 0));
+
+	array.clear();
+	UASSERT(array.empty());
+}
+
+void TestCompactNodeArray::testIndexWidths()
+{
+	static const u32 distinct[] = {2, 3, 16, 17, 256};
+	static const int expected_bits[] = {1, 2, 4, 8, 8};
+
+	MapNode nodes[TEST_NODECOUNT];
+	MapNode unpacked[TEST_NODECOUNT];
+	for (u32 t = 0; t < ARRLEN(distinct); t++) {
+		for (u32 i = 0; i < TEST_NODECOUNT; i++)
+			nodes[i] = MapNode(i % distinct[t], 0, (i * 7) % distinct[t] == 0);
+
+		CompactNodeArray array;
+		UASSERT(array.pack(nodes, TEST_NODECOUNT));
+		UASSERTEQ(int, array.getBitsPerNode(), expected_bits[t]);
+
+		for (u32 i = 0; i < TEST_NODECOUNT; i++)
+			UASSERT(array.get(i) == nodes[i]);
+
+		array.unpack(unpacked, TEST_NODECOUNT);
+		for (u32 i = 0; i < TEST_NODECOUNT; i++)
+			UASSERT(unpacked[i] == nodes[i]);
+	}
+}
+
+void TestCompactNodeArray::testTooManyNodes()
+{
+	MapNode nodes[TEST_NODECOUNT];
+	for (u32 i = 0; i < TEST_NODECOUNT; i++)
+		nodes[i] = MapNode(CONTENT_AIR);
+
+	CompactNodeArray array;
+	UASSERT(array.pack(nodes, TEST_NODECOUNT));
+
+	// A failed pack leaves the previous contents in place
+	for (u32 i = 0; i < TEST_NODECOUNT; i++)
+		nodes[i] = MapNode(i % 257);
+	UASSERT(!array.pack(nodes, TEST_NODECOUNT));
+	UASSERTEQ(int, array.getBitsPerNode(), 0);
+	UASSERT(array.get(300) == MapNode(CONTENT_AIR));
+}
+
+void TestCompactNodeArray::testMapBlock(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapNode air(CONTENT_AIR), stone(1), other(2);
+	bool valid;
+
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		block.setNodeNoCheck(x, y, z, y < 8 ? air : stone);
+
+	UASSERT(block.compact());
+	UASSERT(block.isCompact());
+	UASSERT(!block.isDummy());
+	UASSERT(block.getNodeMemoryUsage() < 1024);
+	UASSERT(block.getNodeNoCheck(3, 4, 5, &valid) == air);
+	UASSERT(valid);
+	UASSERT(block.getNodeNoCheck(0, 9, 0, &valid) == stone);
+
+	// The first write expands the block again
+	block.setNodeNoCheck(3, 4, 5, other);
+	UASSERT(!block.isCompact());
+	UASSERT(block.getNodeNoCheck(3, 4, 5, &valid) == other);
+	UASSERT(block.getNodeNoCheck(0, 9, 0, &valid) == stone);
+	UASSERT(block.getNodeNoCheck(0, 0, 0, &valid) == air);
+}
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"
 #include "nodedef.h"
 #include "noise.h"
+#include "config.h"
 
 class TestCompression : public TestBase {
 public:
@@ -37,6 +38,10 @@ class TestCompression : public TestBase {
 	void testRLECompression();
 	void testZlibCompression();
 	void testZlibLargeData();
+	void testBlockCodecNames();
+	void testBlockCodecs();
+	void testZstdDictionary();
+	void benchmarkBlockCodecs();
 };
 
 static TestCompression g_test_instance;
@@ -46,6 +51,10 @@ void TestCompression::runTests(IGameDef *gamedef)
 	TEST(testRLECompression);
 	TEST(testZlibCompression);
 	TEST(testZlibLargeData);
+	TEST(testBlockCodecNames);
+	TEST(testBlockCodecs);
+	TEST(testZstdDictionary);
+	TEST(benchmarkBlockCodecs);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -170,3 +179,195 @@ void TestCompression::testZlibLargeData()
 				i, str_decompressed[i], i, data_in[i]);
 	}
 }
+
+// Bulk node data of a block with terrain of the given seed
+static std::string makeBlockData(int seed)
+{
+	PseudoRandom pr(seed);
+	s16 ground = pr.range(0, MAP_BLOCKSIZE);
+	MapNode nodes[MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE];
+	u32 i = 0;
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++, i++) {
+		s16 h = ground + (x + z) / 8;
+		if (y > h)
+			nodes[i] = MapNode(CONTENT_AIR, 15, 0);
+		else if (y == h)
+			nodes[i] = MapNode(20, 0, 0);
+		else if (pr.range(0, 50) == 0)
+			nodes[i] = MapNode(30 + pr.range(0, 3), 0, 0);
+		else
+			nodes[i] = MapNode(y > h - 3 ? 21 : 22, 0, 0);
+	}
+
+	std::ostringstream os(std::ios_base::binary);
+	MapNode::serializeBulk(os, SER_FMT_VER_HIGHEST_WRITE, nodes, i,
+		2, 2, false);
+	return os.str();
+}
+
+static std::string roundTripBlockData(const std::string &data, u8 codec,
+	const ZstdDictionary *dict = NULL, size_t *compressed_size = NULL)
+{
+	std::ostringstream os(std::ios_base::binary);
+	compressBlockData(data, os, codec, dict);
+	// Data after the compressed data must stay in the stream
+	os << "tail";
+	if (compressed_size)
+		*compressed_size = os.str().size() - 4;
+
+	std::istringstream is(os.str(), std::ios_base::binary);
+	std::ostringstream os2(std::ios_base::binary);
+	decompressBlockData(is, os2, codec, dict);
+	std::string tail;
+	is >> tail;
+	UASSERT(tail == "tail");
+	return os2.str();
+}
+
+void TestCompression::testBlockCodecNames()
+{
+	u8 codec = BLOCK_CODEC_MAX;
+	UASSERT(parseBlockCodec("zstd", &codec));
+	UASSERTEQ(int, codec, BLOCK_CODEC_ZSTD);
+	UASSERT(!parseBlockCodec("gzip", &codec));
+	UASSERTEQ(int, codec, BLOCK_CODEC_ZSTD);
+
+	for (u8 i = 0; i < BLOCK_CODEC_MAX; i++) {
+		UASSERT(parseBlockCodec(getBlockCodecName(i), &codec));
+		UASSERTEQ(int, codec, i);
+	}
+
+	UASSERT(isBlockCodecSupported(BLOCK_CODEC_ZLIB));
+	UASSERT(isBlockCodecSupported(BLOCK_CODEC_NONE));
+	UASSERT(!isBlockCodecSupported(BLOCK_CODEC_MAX));
+}
+
+void TestCompression::testBlockCodecs()
+{
+	std::string block = makeBlockData(1);
+	std::string random;
+	PseudoRandom pr(9420);
+	for (u32 i = 0; i < 20000; i++)
+		random += (char)pr.range(0, 255);
+
+	for (u8 codec = 0; codec < BLOCK_CODEC_MAX; codec++) {
+		if (!isBlockCodecSupported(codec))
+			continue;
+		UASSERT(roundTripBlockData(block, codec) == block);
+		UASSERT(roundTripBlockData(random, codec) == random);
+		UASSERT(roundTripBlockData("", codec) == "");
+	}
+
+	// Truncated data is an error, not a short result
+	std::ostringstream os(std::ios_base::binary);
+	compressBlockData(block, os, BLOCK_CODEC_NONE);
+	std::string truncated = os.str().substr(0, 100);
+	std::istringstream is(truncated, std::ios_base::binary);
+	std::ostringstream os2(std::ios_base::binary);
+	EXCEPTION_CHECK(SerializationError,
+		decompressBlockData(is, os2, BLOCK_CODEC_NONE));
+}
+
+#if USE_ZSTD
+// Node metadata of a chest, small enough for a dictionary to pay off
+static std::string makeChestMetadata(int seed)
+{
+	PseudoRandom pr(seed);
+	std::ostringstream os(std::ios_base::binary);
+	os << "formspec size[8,9]list[current_name;main;0,0;8,4;]"
+		"list[current_player;main;0,5;8,4;]\n"
+		"infotext Chest owned by player" << pr.range(0, 1000) << "\n"
+		"List main 32\nWidth 0\n";
+	for (int i = 0; i < 32; i++) {
+		if (pr.range(0, 3) == 0)
+			os << "Item default:" << (pr.range(0, 1) ? "cobble " : "dirt ")
+				<< pr.range(1, 99) << "\n";
+		else
+			os << "Empty\n";
+	}
+	os << "EndInventoryList\nEndInventory\n";
+	return os.str();
+}
+
+#endif
+
+void TestCompression::testZstdDictionary()
+{
+#if USE_ZSTD
+	std::vector<std::string> samples;
+	for (int i = 0; i < 200; i++)
+		samples.push_back(makeChestMetadata(i));
+
+	ZstdDictionary *dict = ZstdDictionary::train(samples, 8 * 1024);
+	UASSERT(dict != NULL);
+	UASSERT(dict->getId() != 0);
+
+	// A copy of the data is the same dictionary
+	ZstdDictionary loaded(dict->getData());
+	UASSERTEQ(u32, loaded.getId(), dict->getId());
+
+	std::string meta = makeChestMetadata(1000);
+	size_t plain_size, dict_size;
+	UASSERT(roundTripBlockData(meta, BLOCK_CODEC_ZSTD, NULL,
+		&plain_size) == meta);
+	UASSERT(roundTripBlockData(meta, BLOCK_CODEC_ZSTD, &loaded,
+		&dict_size) == meta);
+	infostream << "zstd: " << plain_size << " bytes, "
+		<< dict_size << " bytes with dictionary" << std::endl;
+	UASSERT(dict_size < plain_size);
+
+	// Without the dictionary the data can not be read
+	std::ostringstream os(std::ios_base::binary);
+	compressBlockData(meta, os, BLOCK_CODEC_ZSTD, dict);
+	std::istringstream is(os.str(), std::ios_base::binary);
+	std::ostringstream os2(std::ios_base::binary);
+	EXCEPTION_CHECK(SerializationError,
+		decompressBlockData(is, os2, BLOCK_CODEC_ZSTD));
+
+	delete dict;
+
+	EXCEPTION_CHECK(SerializationError, ZstdDictionary("not a dictionary"));
+#endif
+}
+
+void TestCompression::benchmarkBlockCodecs()
+{
+	const int rounds = 50;
+	std::vector<std::string> blocks;
+	size_t total = 0;
+	for (int i = 0; i < rounds; i++) {
+		blocks.push_back(makeBlockData(i));
+		total += blocks.back().size();
+	}
+
+	for (u8 codec = 0; codec < BLOCK_CODEC_MAX; codec++) {
+		if (!isBlockCodecSupported(codec))
+			continue;
+
+		std::vector<std::string> compressed;
+		u32 t0 = porting::getTimeUs();
+		for (int i = 0; i < rounds; i++) {
+			std::ostringstream os(std::ios_base::binary);
+			compressBlockData(blocks[i], os, codec);
+			compressed.push_back(os.str());
+		}
+		u32 t1 = porting::getTimeUs();
+		size_t compressed_total = 0;
+		for (int i = 0; i < rounds; i++) {
+			std::istringstream is(compressed[i], std::ios_base::binary);
+			std::ostringstream os(std::ios_base::binary);
+			decompressBlockData(is, os, codec);
+			UASSERT(os.str() == blocks[i]);
+			compressed_total += compressed[i].size();
+		}
+		u32 t2 = porting::getTimeUs();
+
+		infostream << "Block codec " << getBlockCodecName(codec)
+			<< ": ratio " << (float)total / compressed_total
+			<< ", compress " << (float)total / MYMAX(t1 - t0, 1)
+			<< " MB/s, decompress " << (float)total / MYMAX(t2 - t1, 1)
+			<< " MB/s" << std::endl;
+	}
+}
@@ -23,7 +23,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "socket.h"
 #include "settings.h"
 #include "util/serialize.h"
+#include "util/numeric.h"
 #include "network/connection.h"
+#include "threading/thread.h"
 
 class TestConnection : public TestBase {
 public:
@@ -38,7 +40,15 @@ class TestConnection : public TestBase {
 	void runTests(IGameDef *gamedef);
 
 	void testHelpers();
+	void testPacketBuffer();
+	void testReliablePacketBuffer();
+	void testReliablePacketBufferTimeouts();
+	void testReliablePacketBufferLosses();
+	void testIncomingSplitBuffer();
+	void testCongestionWindow();
+	void testSendScheduler();
 	void testConnectSendReceive();
+	void testLossyLink();
 };
 
 static TestConnection g_test_instance;
@@ -46,7 +56,15 @@ static TestConnection g_test_instance;
 void TestConnection::runTests(IGameDef *gamedef)
 {
 	TEST(testHelpers);
+	TEST(testPacketBuffer);
+	TEST(testReliablePacketBuffer);
+	TEST(testReliablePacketBufferTimeouts);
+	TEST(testReliablePacketBufferLosses);
+	TEST(testIncomingSplitBuffer);
+	TEST(testCongestionWindow);
+	TEST(testSendScheduler);
 	TEST(testConnectSendReceive);
+	TEST(testLossyLink);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -81,13 +99,103 @@ struct Handler : public con::PeerHandler
 	const char *name;
 };
 
+/*
+	Relays the datagrams between a client and a server like a congested
+	link: the way to the client takes rate datagrams a second with room for
+	queue more waiting, on top of that both ways delay the datagrams and
+	lose some.
+*/
+class LossyLink : public Thread
+{
+public:
+	LossyLink(Address server, u16 port, u32 loss_percent, u32 delay_ms,
+			u32 rate, u32 queue) :
+		Thread("LossyLink"),
+		dropped(0),
+		m_socket(false),
+		m_server(server),
+		m_loss_percent(loss_percent),
+		m_delay_us(delay_ms * 1000),
+		m_rate(rate),
+		m_queue(queue)
+	{
+		m_socket.Bind(Address(127, 0, 0, 1, port));
+		m_socket.setTimeoutMs(0);
+	}
+
+	u32 dropped;
+
+private:
+	struct Datagram
+	{
+		Address destination;
+		std::string data;
+	};
+
+	void *run()
+	{
+		// Times are microseconds from the start
+		u32 start = porting::getTimeUs();
+		u32 downlink_free = 0;
+		std::multimap<u32, Datagram> in_flight;
+		char buf[1500];
+		while (!stopRequested()) {
+			Address sender;
+			int size;
+			if (m_socket.WaitData(1)) {
+				while ((size = m_socket.Receive(sender, buf, sizeof(buf))) >= 0) {
+					u32 now = porting::getTimeUs() - start;
+					if ((u32)myrand_range(0, 99) < m_loss_percent) {
+						dropped++;
+						continue;
+					}
+					Datagram d;
+					d.data.assign(buf, size);
+					u32 arrival = now + m_delay_us;
+					if (sender == m_server) {
+						u32 departure = MYMAX(now, downlink_free) +
+								1000000 / m_rate;
+						if ((u64)(departure - now) * m_rate / 1000000 > m_queue) {
+							dropped++;
+							continue;
+						}
+						downlink_free = departure;
+						arrival = departure + m_delay_us;
+						d.destination = m_client;
+					} else {
+						m_client = sender;
+						d.destination = m_server;
+					}
+					in_flight.insert(std::make_pair(arrival, d));
+				}
+			}
+
+			u32 now = porting::getTimeUs() - start;
+			while (!in_flight.empty() && in_flight.begin()->first <= now) {
+				Datagram &d = in_flight.begin()->second;
+				m_socket.Send(d.destination, d.data.c_str(), d.data.size());
+				in_flight.erase(in_flight.begin());
+			}
+		}
+		return NULL;
+	}
+
+	UDPSocket m_socket;
+	Address m_server;
+	Address m_client;
+	u32 m_loss_percent;
+	u32 m_delay_us;
+	u32 m_rate;
+	u32 m_queue;
+};
+
 void TestConnection::testHelpers()
 {
 	// Some constants for testing
 	u32 proto_id = 0x12345678;
 	u16 peer_id = 123;
 	u8 channel = 2;
-	SharedBuffer<u8> data1(1);
+	PacketBuffer data1(1);
 	data1[0] = 100;
 	Address a(127,0,0,1, 10);
 	const u16 seqnum = 34352;
@@ -110,7 +218,7 @@ void TestConnection::testHelpers()
 
 	//infostream<<"initial data1[0]="<<((u32)data1[0]&0xff)<<std::endl;
 
-	SharedBuffer<u8> p2 = con::makeReliablePacket(data1, seqnum);
+	PacketBuffer p2 = con::makeReliablePacket(data1, seqnum);
 
 	/*infostream<<"p2.getSize()="<<p2.getSize()<<", data1.getSize()="
 			<<data1.getSize()<<std::endl;
@@ -125,6 +233,412 @@ void TestConnection::testHelpers()
 }
 
 
+void TestConnection::testPacketBuffer()
+{
+	PacketBuffer data(10);
+	for (u32 i = 0; i < data.getSize(); i++)
+		data[i] = i;
+
+	// Views share the data
+	PacketBuffer view = data.view(4, 3);
+	UASSERT(view.getSize() == 3);
+	UASSERT(*view == *data + 4);
+	UASSERT(!data.isUnique());
+
+	// The first header goes into the free room in front of the data,
+	// later ones and headers in front of views in the middle are copied
+	PacketBuffer original = con::makeOriginalPacket(data);
+	UASSERT(*original + ORIGINAL_HEADER_SIZE == *data);
+	UASSERT(original[0] == TYPE_ORIGINAL);
+	PacketBuffer reliable = con::makeReliablePacket(original, 7);
+	UASSERT(*reliable + RELIABLE_HEADER_SIZE == *original);
+	PacketBuffer again = con::makeOriginalPacket(data);
+	UASSERT(*again + ORIGINAL_HEADER_SIZE != *data);
+	UASSERT(again[0] == TYPE_ORIGINAL && again[10] == 9);
+	PacketBuffer middle = con::makeOriginalPacket(view);
+	UASSERT(*middle + ORIGINAL_HEADER_SIZE != *view);
+	UASSERT(middle.getSize() == 4 && middle[1] == 4 && middle[3] == 6);
+
+	// Only the first chunk of a split packet can use the room
+	PacketBuffer big(100);
+	big[0] = 1;
+	big[99] = 2;
+	std::list<PacketBuffer> chunks = con::makeSplitPacket(big, 57, 3);
+	UASSERT(chunks.size() == 2);
+	UASSERT(*chunks.front() + 7 == *big);
+	UASSERT(chunks.front()[7] == 1);
+	UASSERT(chunks.back().getSize() == 7 + 50);
+	UASSERT(chunks.back()[56] == 2);
+	UASSERT(readU16(&chunks.back()[3]) == 2);
+
+	// Writing into a shared buffer copies it first
+	PacketBuffer copy = data;
+	copy.makeUnique();
+	UASSERT(*copy != *data && copy.isUnique());
+	copy[0] = 100;
+	UASSERT(data[0] == 0);
+	copy.resize(1000);
+	UASSERT(copy.getSize() == 1000);
+	UASSERT(copy[0] == 100 && copy[9] == 9 && copy[999] == 0);
+
+	// Packets are sent and received without copying the data
+	NetworkPacket pkt(TOSERVER_INIT, 0);
+	pkt << (u16)12345;
+	PacketBuffer raw = pkt.getRawPacket();
+	UASSERT(raw.getSize() == 4);
+	UASSERT(*raw + 2 == pkt.getU8Ptr(0));
+	UASSERT(readU16(&raw[0]) == TOSERVER_INIT);
+	UASSERT(readU16(&raw[2]) == 12345);
+	pkt << (u16)54321;
+	UASSERT(readU16(&raw[2]) == 12345 && raw.getSize() == 4);
+
+	NetworkPacket received;
+	received.putRawPacket(raw, 0);
+	UASSERT(received.getCommand() == TOSERVER_INIT);
+	UASSERT(received.getU8Ptr(0) == *raw + 2);
+	u16 value;
+	received >> value;
+	UASSERT(value == 12345);
+}
+
+static con::BufferedPacket makeReliable(u16 seqnum)
+{
+	PacketBuffer data(1);
+	data[0] = seqnum & 0xff;
+	PacketBuffer reliable = con::makeReliablePacket(data, seqnum);
+	Address a(127,0,0,1, 10);
+	return con::makePacket(a, reliable, 0x12345678, 123, 0);
+}
+
+static u16 getSeqnum(const con::BufferedPacket &p)
+{
+	return readU16(&p.data[BASE_HEADER_SIZE + 1]);
+}
+
+void TestConnection::testReliablePacketBuffer()
+{
+	con::ReliablePacketBuffer buf;
+	u16 first;
+
+	// Out of order around the seqnum wrap
+	const u16 next_expected = 65530;
+	const u16 seqnums[] = {65533, 2, 65531, 0};
+	for (size_t i = 0; i < ARRLEN(seqnums); i++) {
+		con::BufferedPacket p = makeReliable(seqnums[i]);
+		buf.insert(p, next_expected);
+	}
+	UASSERTEQ(u32, buf.size(), 4);
+	UASSERT(buf.getFirstSeqnum(first));
+	UASSERTEQ(u16, first, 65531);
+
+	// Resent packets are only kept once
+	con::BufferedPacket dup = makeReliable(2);
+	buf.insert(dup, next_expected);
+	UASSERTEQ(u32, buf.size(), 4);
+	UASSERT(buf.containsPacket(65533));
+	UASSERT(!buf.containsPacket(65532));
+
+	UASSERTEQ(u16, getSeqnum(buf.popFirst()), 65531);
+	UASSERTEQ(u16, getSeqnum(buf.popSeqnum(2)), 2);
+	UASSERTEQ(u16, getSeqnum(buf.popFirst()), 65533);
+	UASSERTEQ(u16, getSeqnum(buf.popFirst()), 0);
+	UASSERT(buf.empty());
+	UASSERT(!buf.getFirstSeqnum(first));
+
+	// A window far larger than the initial ring, acked in a scrambled order
+	const u16 count = 3000;
+	for (u16 i = 0; i < count; i++) {
+		con::BufferedPacket p = makeReliable(100 + (i * 7) % count);
+		buf.insert(p, 99);
+	}
+	UASSERTEQ(u32, buf.size(), count);
+	for (u16 i = 0; i < count; i += 2)
+		UASSERTEQ(u16, getSeqnum(buf.popSeqnum(100 + (i * 11) % count)),
+				100 + (i * 11) % count);
+	UASSERTEQ(u32, buf.size(), count / 2);
+	UASSERT(buf.getFirstSeqnum(first));
+	UASSERTEQ(u16, first, 101);
+	for (u16 i = 1; i < count; i += 2)
+		UASSERTEQ(u16, getSeqnum(buf.popFirst()), 100 + i);
+	UASSERT(buf.empty());
+}
+
+void TestConnection::testReliablePacketBufferTimeouts()
+{
+	con::ReliablePacketBuffer buf;
+	for (u16 i = 0; i < 3; i++) {
+		con::BufferedPacket p = makeReliable(i);
+		buf.insert(p, 65535);
+	}
+	buf.incrementTimeouts(0.3);
+	con::BufferedPacket p = makeReliable(3);
+	buf.insert(p, 65535);
+	buf.incrementTimeouts(0.3);
+
+	// Only the packets sent long enough ago, and each only once
+	std::list<con::BufferedPacket> timed_outs = buf.getTimedOuts(0.5, 10);
+	UASSERTEQ(size_t, timed_outs.size(), 3);
+	UASSERTEQ(u16, getSeqnum(timed_outs.front()), 0);
+	UASSERT(timed_outs.front().time >= 0.5);
+	UASSERT(buf.getTimedOuts(0.5, 10).empty());
+
+	buf.popSeqnum(1);
+	buf.incrementTimeouts(0.3);
+	timed_outs = buf.getTimedOuts(0.5, 10);
+	UASSERTEQ(size_t, timed_outs.size(), 1);
+	UASSERTEQ(u16, getSeqnum(timed_outs.front()), 3);
+
+	buf.incrementTimeouts(0.3);
+	timed_outs = buf.getTimedOuts(0.5, 1);
+	UASSERTEQ(size_t, timed_outs.size(), 1);
+	UASSERTEQ(u16, getSeqnum(timed_outs.front()), 0);
+	UASSERT(timed_outs.front().totaltime >= 1.1);
+	timed_outs = buf.getTimedOuts(0.5, 10);
+	UASSERTEQ(size_t, timed_outs.size(), 1);
+	UASSERTEQ(u16, getSeqnum(timed_outs.front()), 2);
+}
+
+void TestConnection::testReliablePacketBufferLosses()
+{
+	con::ReliablePacketBuffer buf;
+	for (u16 i = 0; i < 8; i++) {
+		con::BufferedPacket p = makeReliable(i);
+		buf.insert(p, 65535);
+	}
+
+	// 0 and 2 don't arrive, each is lost once a packet three after it is
+	buf.popSeqnum(1);
+	UASSERTEQ(u32, buf.markLosses(1), 0);
+	buf.popSeqnum(3);
+	UASSERTEQ(u32, buf.markLosses(3), 1);
+	buf.popSeqnum(4);
+	UASSERTEQ(u32, buf.markLosses(4), 0);
+	buf.popSeqnum(5);
+	UASSERTEQ(u32, buf.markLosses(5), 1);
+
+	std::list<con::BufferedPacket> losses = buf.getLosses(10);
+	UASSERTEQ(size_t, losses.size(), 2);
+	UASSERTEQ(u16, getSeqnum(losses.front()), 0);
+	UASSERTEQ(u16, getSeqnum(losses.back()), 2);
+	UASSERTEQ(u32, losses.front().resend_count, 1);
+
+	// Only once, later the timeout takes care of them
+	buf.popSeqnum(6);
+	UASSERTEQ(u32, buf.markLosses(6), 0);
+	UASSERT(buf.getLosses(10).empty());
+	buf.incrementTimeouts(0.5);
+	UASSERTEQ(size_t, buf.getTimedOuts(0.5, 10).size(), 3);
+
+	// Acks of old packets don't mark anything
+	buf.popSeqnum(0);
+	UASSERTEQ(u32, buf.markLosses(0), 0);
+	UASSERTEQ(u32, buf.markLosses(65000), 0);
+
+	// A packet acked after it was taken as lost isn't resent
+	con::ReliablePacketBuffer buf2;
+	for (u16 i = 0; i < 5; i++) {
+		con::BufferedPacket p = makeReliable(i);
+		buf2.insert(p, 65535);
+	}
+	buf2.popSeqnum(4);
+	UASSERTEQ(u32, buf2.markLosses(4), 2);
+	buf2.popSeqnum(0);
+	losses = buf2.getLosses(10);
+	UASSERTEQ(size_t, losses.size(), 1);
+	UASSERTEQ(u16, getSeqnum(losses.front()), 1);
+}
+
+void TestConnection::testIncomingSplitBuffer()
+{
+	con::IncomingSplitBuffer buf;
+	Address a(127,0,0,1, 10);
+
+	PacketBuffer data(2000);
+	for (u32 i = 0; i < data.getSize(); i++)
+		data[i] = i % 251;
+	std::list<PacketBuffer> chunks =
+		con::makeSplitPacket(data, 500, 42);
+	UASSERT(chunks.size() > 2);
+
+	// Last chunk first, and one twice
+	chunks.push_front(chunks.back());
+	chunks.pop_back();
+	chunks.push_back(chunks.front());
+
+	PacketBuffer result;
+	u32 n = 0;
+	for (std::list<PacketBuffer>::iterator i = chunks.begin();
+			i != chunks.end(); ++i, ++n) {
+		con::BufferedPacket p = con::makePacket(a, *i, 0x12345678, 123, 0);
+		result = buf.insert(p, true);
+		if (n + 2 < chunks.size())
+			UASSERTEQ(u32, result.getSize(), 0);
+		if (result.getSize() != 0)
+			break;
+	}
+	UASSERTEQ(u32, n + 2, chunks.size());
+	UASSERTEQ(u32, result.getSize(), data.getSize());
+	UASSERT(memcmp(*result, *data, data.getSize()) == 0);
+}
+
+void TestConnection::testCongestionWindow()
+{
+	con::Channel legacy;
+	u32 initial = legacy.getWindowSize();
+	legacy.reportLoss();
+	UASSERTEQ(u32, legacy.getWindowSize(), initial);
+	UASSERT(legacy.takePacingCredit());
+
+	con::Channel channel;
+	channel.setCongestionControl(con::CONGESTION_CONTROL_CUBIC);
+	UASSERTEQ(u32, channel.getWindowSize(), initial);
+
+	// A window that isn't used doesn't grow
+	channel.reportAck(0.1);
+	UASSERTEQ(u32, channel.getWindowSize(), initial);
+
+	for (u16 i = 0; i < 2000; i++) {
+		con::BufferedPacket p = makeReliable(i);
+		channel.outgoing_reliables_sent.insert(p, 65535);
+	}
+
+	// Slow start, one packet more for each ack
+	for (u32 i = 0; i < 200; i++)
+		channel.reportAck(0.1);
+	UASSERTEQ(u32, channel.getWindowSize(), initial + 200);
+
+	// One reduction for the losses of a round trip
+	u32 w_max = channel.getWindowSize();
+	channel.reportLoss();
+	u32 reduced = channel.getWindowSize();
+	UASSERTEQ(u32, reduced, (u32)(w_max * 0.7));
+	channel.UpdateTimers(0.05, false);
+	channel.reportLoss();
+	UASSERTEQ(u32, channel.getWindowSize(), reduced);
+
+	// Back to the window of the loss after some seconds, slowly around
+	// it and faster beyond
+	u32 windows[10];
+	for (u32 s = 0; s < 10; s++) {
+		for (u32 step = 0; step < 10; step++) {
+			channel.UpdateTimers(0.1, false);
+			u32 acks = channel.getWindowSize();
+			for (u32 i = 0; i < acks; i++)
+				channel.reportAck(0.1);
+		}
+		windows[s] = channel.getWindowSize();
+	}
+	UASSERT(windows[0] > reduced);
+	UASSERT(windows[2] < w_max);
+	UASSERT(windows[9] > w_max);
+	UASSERT(windows[4] - windows[3] < windows[1] - windows[0]);
+	UASSERT(windows[9] - windows[8] > windows[6] - windows[5]);
+
+	// Paced sends: short bursts, then wait for the next
+	u32 burst = 0;
+	while (channel.takePacingCredit())
+		burst++;
+	UASSERT(burst >= 1);
+	UASSERT(burst < channel.getWindowSize() / 4);
+	float delay = channel.getPacingDelay();
+	UASSERT(delay > 0 && delay < 0.1);
+	channel.UpdateTimers(delay + 0.001, false);
+	UASSERT(channel.takePacingCredit());
+}
+
+static con::ConnectionCommand make_send_command(u8 channelnum, bool reliable,
+		con::SendClass send_class, u32 size)
+{
+	con::ConnectionCommand c;
+	c.type = con::CONNCMD_SEND;
+	c.channelnum = channelnum;
+	c.reliable = reliable;
+	c.send_class = send_class;
+	c.data = PacketBuffer(size);
+	return c;
+}
+
+void TestConnection::testSendScheduler()
+{
+	con::SendScheduler scheduler;
+	con::ConnectionCommand c;
+	bool ready[CHANNEL_COUNT] = {true, true, true};
+
+	// Classes on different channels get shares by their weights
+	for (u32 i = 0; i < 20; i++) {
+		scheduler.push(make_send_command(2, true, con::SEND_CLASS_BLOCKS, 1000));
+		scheduler.push(make_send_command(1, true, con::SEND_CLASS_MEDIA, 1000));
+	}
+	u32 counts[con::SEND_CLASS_COUNT] = {0};
+	for (u32 i = 0; i < 12; i++) {
+		UASSERT(scheduler.pop(ready, c));
+		counts[c.send_class]++;
+	}
+	UASSERTEQ(u32, counts[con::SEND_CLASS_BLOCKS], 8);
+	UASSERTEQ(u32, counts[con::SEND_CLASS_MEDIA], 4);
+
+	// A burst of blocks doesn't hold back later packets of other classes
+	scheduler.push(make_send_command(0, true, con::SEND_CLASS_INTERFACE, 100));
+	scheduler.push(make_send_command(1, false, con::SEND_CLASS_OBJECTS, 100));
+	counts[con::SEND_CLASS_INTERFACE] = counts[con::SEND_CLASS_OBJECTS] = 0;
+	for (u32 i = 0; i < 4; i++) {
+		UASSERT(scheduler.pop(ready, c));
+		counts[c.send_class]++;
+	}
+	UASSERTEQ(u32, counts[con::SEND_CLASS_INTERFACE], 1);
+	UASSERTEQ(u32, counts[con::SEND_CLASS_OBJECTS], 1);
+
+	// Reliable packets of a channel keep their order across classes
+	scheduler.push(make_send_command(0, true, con::SEND_CLASS_OBJECTS, 100));
+	scheduler.push(make_send_command(0, true, con::SEND_CLASS_CONTROL, 100));
+	scheduler.push(make_send_command(0, false, con::SEND_CLASS_CONTROL, 100));
+	u32 order = 0;
+	for (u32 i = 0; order < 2 && i < 40; i++) {
+		UASSERT(scheduler.pop(ready, c));
+		if (c.channelnum != 0 || !c.reliable)
+			continue;
+		UASSERT(c.send_class == (order == 0 ?
+				con::SEND_CLASS_OBJECTS : con::SEND_CLASS_CONTROL));
+		order++;
+	}
+	UASSERTEQ(u32, order, 2);
+	while (scheduler.getQueueSize(con::SEND_CLASS_CONTROL) > 0)
+		UASSERT(scheduler.pop(ready, c));
+
+	// Reliable packets wait for their channel, unreliable ones don't
+	ready[1] = ready[2] = false;
+	scheduler.push(make_send_command(0, true, con::SEND_CLASS_CONTROL, 100));
+	scheduler.push(make_send_command(2, false, con::SEND_CLASS_CONTROL, 100));
+	UASSERT(scheduler.pop(ready, c));
+	UASSERT(c.channelnum == 0);
+	UASSERT(scheduler.pop(ready, c));
+	UASSERT(c.channelnum == 2 && !c.reliable);
+	UASSERT(!scheduler.pop(ready, c));
+	UASSERTEQ(u32, scheduler.getQueueSize(con::SEND_CLASS_CONTROL), 0);
+	UASSERT(scheduler.getQueueSize(con::SEND_CLASS_BLOCKS) > 0);
+
+	// The budget limits the bytes sent per second
+	ready[1] = ready[2] = true;
+	scheduler.step(0.05, 10000);
+	UASSERT(scheduler.pop(ready, c));
+	UASSERT(!scheduler.pop(ready, c));
+	scheduler.step(0.02, 10000);
+	UASSERT(!scheduler.pop(ready, c));
+	scheduler.step(1.0, 10000);
+	UASSERT(scheduler.pop(ready, c));
+	UASSERT(!scheduler.pop(ready, c));
+
+	// Everything can be taken when disconnecting, in order per channel
+	scheduler.step(0, 0);
+	u32 left = scheduler.getQueueSize(con::SEND_CLASS_BLOCKS) +
+			scheduler.getQueueSize(con::SEND_CLASS_MEDIA);
+	UASSERT(left > 0);
+	while (scheduler.popAny(c))
+		left--;
+	UASSERTEQ(u32, left, 0);
+	UASSERT(scheduler.empty());
+}
+
 void TestConnection::testConnectSendReceive()
 {
 	DSTACK("TestConnection::Run");
@@ -248,9 +762,9 @@ void TestConnection::testConnectSendReceive()
 	*/
 	{
 		NetworkPacket pkt;
-		pkt.putRawPacket((u8*) "Hello World !", 14, 0);
+		pkt.putRawPacket(PacketBuffer((u8*) "Hello World !", 14), 0);
 
-		Buffer<u8> sentdata = pkt.oldForgePacket();
+		PacketBuffer sentdata = pkt.getRawPacket();
 
 		infostream<<"** running client.Send()"<<std::endl;
 		client.Send(PEER_ID_SERVER, 0, &pkt, true);
@@ -265,7 +779,7 @@ void TestConnection::testConnectSendReceive()
 				<< ", data=" << (const char*)pkt.getU8Ptr(0)
 				<< std::endl;
 
-		Buffer<u8> recvdata = pkt.oldForgePacket();
+		PacketBuffer recvdata = pkt.getRawPacket();
 
 		UASSERT(memcmp(*sentdata, *recvdata, recvdata.getSize()) == 0);
 	}
@@ -294,13 +808,13 @@ void TestConnection::testConnectSendReceive()
 			infostream << "...";
 		infostream << std::endl;
 
-		Buffer<u8> sentdata = pkt.oldForgePacket();
+		PacketBuffer sentdata = pkt.getRawPacket();
 
 		server.Send(peer_id_client, 0, &pkt, true);
 
 		//sleep_ms(3000);
 
-		Buffer<u8> recvdata;
+		PacketBuffer recvdata;
 		infostream << "** running client.Receive()" << std::endl;
 		u16 peer_id = 132;
 		u16 size = 0;
@@ -314,7 +828,7 @@ void TestConnection::testConnectSendReceive()
 				client.Receive(&pkt);
 				size = pkt.getSize();
 				peer_id = pkt.getPeerId();
-				recvdata = pkt.oldForgePacket();
+				recvdata = pkt.getRawPacket();
 				received = true;
 			} catch (con::NoIncomingDataException &e) {
 			}
@@ -346,3 +860,75 @@ void TestConnection::testConnectSendReceive()
 	UASSERT(hand_server.count == 1);
 	UASSERT(hand_server.last_id == 2);
 }
+
+void TestConnection::testLossyLink()
+{
+	/*
+		Send a lot of reliable data over a slow link with a short queue,
+		that also loses and delays packets
+	*/
+	u32 proto_id = 0xad26846a;
+
+	Handler hand_server("server");
+	Handler hand_client("client");
+
+	con::Connection server(proto_id, 512, 5.0, false, &hand_server);
+	server.setCongestionControl(con::CONGESTION_CONTROL_CUBIC);
+	server.Serve(Address(0, 0, 0, 0, 30002));
+
+	LossyLink link(Address(127, 0, 0, 1, 30002), 30003, 2, 20, 2000, 50);
+	link.start();
+
+	con::Connection client(proto_id, 512, 5.0, false, &hand_client);
+	client.Connect(Address(127, 0, 0, 1, 30003));
+
+	u32 timems0 = porting::getTimeMs();
+	while (!client.Connected() && porting::getTimeMs() - timems0 < 5000) {
+		try {
+			NetworkPacket pkt;
+			client.Receive(&pkt);
+		} catch (con::NoIncomingDataException &e) {
+		}
+		sleep_ms(10);
+	}
+	UASSERT(client.Connected());
+
+	const u32 count = 300;
+	const u32 datasize = 1000;
+	for (u32 i = 0; i < count; i++) {
+		NetworkPacket pkt(0x10, datasize);
+		pkt << i;
+		for (u32 j = 4; j < datasize; j++)
+			pkt << (u8)(i * 7 + j);
+		server.Send(2, 0, &pkt, true);
+	}
+
+	// All of it, in order
+	u32 received = 0;
+	timems0 = porting::getTimeMs();
+	while (received < count && porting::getTimeMs() - timems0 < 10000) {
+		try {
+			NetworkPacket pkt;
+			client.Receive(&pkt);
+			u32 index;
+			pkt >> index;
+			UASSERTEQ(u32, index, received);
+			UASSERTEQ(u32, pkt.getSize(), datasize);
+			for (u32 j = 4; j < datasize; j++)
+				UASSERT(*pkt.getU8Ptr(j) == (u8)(index * 7 + j));
+			received++;
+		} catch (con::NoIncomingDataException &e) {
+			sleep_ms(1);
+		}
+	}
+	infostream << "** Lossy link: " << received << " packets in "
+		<< (porting::getTimeMs() - timems0) << "ms, " << link.dropped
+		<< " datagrams dropped" << std::endl;
+	UASSERTEQ(u32, received, count);
+	// The window stays about as large as the link takes, instead of
+	// overflowing its queue
+	UASSERT(link.dropped < count);
+
+	link.stop();
+	link.wait();
+}
@@ -0,0 +1,163 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "emerge.h"
+
+class TestEmergeScheduler : public TestBase {
+public:
+	TestEmergeScheduler() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestEmergeScheduler"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testNearestFirst();
+	void testPeersTakeTurns();
+	void testBulkLane();
+	void testRemovePeer();
+};
+
+static TestEmergeScheduler g_test_instance;
+
+void TestEmergeScheduler::runTests(IGameDef *gamedef)
+{
+	TEST(testNearestFirst);
+	TEST(testPeersTakeTurns);
+	TEST(testBulkLane);
+	TEST(testRemovePeer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestEmergeScheduler::testNearestFirst()
+{
+	EmergeScheduler scheduler;
+	v3s16 pos;
+
+	// Without a position, blocks are taken in the order they came
+	scheduler.pushPeerBlock(1, v3s16(10, 0, 0));
+	scheduler.pushPeerBlock(1, v3s16(1, 0, 0));
+	UASSERT(scheduler.popPeerBlock(&pos));
+	UASSERT(pos == v3s16(10, 0, 0));
+	UASSERT(scheduler.popPeerBlock(&pos));
+	UASSERT(pos == v3s16(1, 0, 0));
+	UASSERT(!scheduler.popPeerBlock(&pos));
+
+	scheduler.pushPeerBlock(1, v3s16(10, 0, 0));
+	scheduler.pushPeerBlock(1, v3s16(1, 0, 0));
+	scheduler.pushPeerBlock(1, v3s16(-5, 0, 0));
+	scheduler.setPeerPosition(1, v3s16(0, 0, 0));
+	UASSERT(scheduler.popPeerBlock(&pos));
+	UASSERT(pos == v3s16(1, 0, 0));
+
+	// The player moved; what is nearest now comes next
+	scheduler.setPeerPosition(1, v3s16(12, 0, 0));
+	UASSERT(scheduler.popPeerBlock(&pos));
+	UASSERT(pos == v3s16(10, 0, 0));
+	UASSERT(scheduler.popPeerBlock(&pos));
+	UASSERT(pos == v3s16(-5, 0, 0));
+	UASSERT(!scheduler.popPeerBlock(&pos));
+}
+
+void TestEmergeScheduler::testPeersTakeTurns()
+{
+	EmergeScheduler scheduler;
+	v3s16 pos;
+
+	scheduler.setPeerPosition(2, v3s16(0, 0, 0));
+	scheduler.setPeerPosition(3, v3s16(0, 0, 0));
+	for (s16 i = 0; i != 4; i++)
+		scheduler.pushPeerBlock(2, v3s16(i, 0, 0));
+	scheduler.pushPeerBlock(3, v3s16(100, 0, 0));
+	scheduler.pushPeerBlock(3, v3s16(101, 0, 0));
+
+	// A peer with many requests doesn't hold up the others
+	s16 expected_x[] = {0, 100, 1, 101, 2, 3};
+	for (size_t i = 0; i != ARRLEN(expected_x); i++) {
+		UASSERT(scheduler.popPeerBlock(&pos));
+		UASSERTEQ(s16, pos.X, expected_x[i]);
+	}
+	UASSERT(!scheduler.popPeerBlock(&pos));
+}
+
+void TestEmergeScheduler::testBulkLane()
+{
+	EmergeScheduler scheduler;
+	v3s16 pos;
+
+	scheduler.setPeerPosition(1, v3s16(0, 0, 0));
+	scheduler.pushBulkBlock(v3s16(7, 0, 0));
+	scheduler.pushBulkBlock(v3s16(-3, 0, 0));
+	scheduler.pushBulkBlock(v3s16(1, 0, 0));
+
+	// Bulk blocks are not taken for players, and keep their order
+	UASSERT(!scheduler.popPeerBlock(&pos));
+
+	std::vector<v3s16> next;
+	scheduler.getNextBulkBlocks(&next, 2);
+	UASSERTEQ(size_t, next.size(), 2);
+	UASSERT(next[0] == v3s16(7, 0, 0));
+	UASSERT(next[1] == v3s16(-3, 0, 0));
+
+	UASSERT(scheduler.popBulkBlock(&pos));
+	UASSERT(pos == v3s16(7, 0, 0));
+	UASSERT(scheduler.popBulkBlock(&pos));
+	UASSERT(pos == v3s16(-3, 0, 0));
+	UASSERT(scheduler.popBulkBlock(&pos));
+	UASSERT(pos == v3s16(1, 0, 0));
+	UASSERT(!scheduler.popBulkBlock(&pos));
+}
+
+void TestEmergeScheduler::testRemovePeer()
+{
+	EmergeScheduler scheduler;
+	v3s16 pos;
+
+	scheduler.setPeerPosition(2, v3s16(0, 0, 0));
+	scheduler.pushPeerBlock(2, v3s16(1, 0, 0));
+	scheduler.pushPeerBlock(2, v3s16(2, 0, 0));
+	scheduler.pushPeerBlock(3, v3s16(100, 0, 0));
+	scheduler.pushBulkBlock(v3s16(7, 0, 0));
+
+	// The blocks of a peer that left are handed back and not taken
+	std::vector<v3s16> dropped;
+	scheduler.removePeer(2, &dropped);
+	UASSERTEQ(size_t, dropped.size(), 2);
+	UASSERT(dropped[0] == v3s16(1, 0, 0));
+	UASSERT(dropped[1] == v3s16(2, 0, 0));
+
+	UASSERT(scheduler.popPeerBlock(&pos));
+	UASSERT(pos == v3s16(100, 0, 0));
+	UASSERT(!scheduler.popPeerBlock(&pos));
+	UASSERT(scheduler.popBulkBlock(&pos));
+	UASSERT(pos == v3s16(7, 0, 0));
+
+	// Removing it again, or a peer without blocks, drops nothing
+	dropped.clear();
+	scheduler.removePeer(2, &dropped);
+	scheduler.removePeer(3, &dropped);
+	UASSERT(dropped.empty());
+
+	// A peer id that is used again starts with no blocks
+	scheduler.pushPeerBlock(2, v3s16(5, 0, 0));
+	UASSERT(scheduler.popPeerBlock(&pos));
+	UASSERT(pos == v3s16(5, 0, 0));
+	UASSERT(!scheduler.popPeerBlock(&pos));
+}
@@ -0,0 +1,154 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "liquidqueue.h"
+#include "map.h"
+#include "mapblock.h"
+#include "mapsector.h"
+#include "nodedef.h"
+#include <sstream>
+
+class TestLiquidQueue : public TestBase {
+public:
+	TestLiquidQueue() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestLiquidQueue"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testUnique();
+	void testPopBlocks();
+	void testTransformLiquids(IGameDef *gamedef);
+};
+
+static TestLiquidQueue g_test_instance;
+
+void TestLiquidQueue::runTests(IGameDef *gamedef)
+{
+	TEST(testUnique);
+	TEST(testPopBlocks);
+	TEST(testTransformLiquids, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestLiquidQueue::testUnique()
+{
+	LiquidQueue queue;
+
+	queue.push_back(v3s16(1, 2, 3));
+	queue.push_back(v3s16(-1, 2, 3));
+	queue.push_back(v3s16(1, 2, 3));
+	UASSERTEQ(u32, queue.size(), 2);
+
+	std::vector<LiquidBlockNodes> blocks;
+	queue.popBlocks(100, blocks);
+	UASSERTEQ(u32, queue.size(), 0);
+	UASSERTEQ(size_t, blocks.size(), 2);
+
+	// Popped nodes can be queued again
+	queue.push_back(v3s16(1, 2, 3));
+	UASSERTEQ(u32, queue.size(), 1);
+
+	queue.clear();
+	UASSERTEQ(u32, queue.size(), 0);
+}
+
+void TestLiquidQueue::testPopBlocks()
+{
+	LiquidQueue queue;
+
+	// Three nodes in block (0,0,0), two in (1,0,0), one in (0,-1,0)
+	queue.push_back(v3s16(0, 0, 0));
+	queue.push_back(v3s16(16, 0, 0));
+	queue.push_back(v3s16(0, -1, 0));
+	queue.push_back(v3s16(15, 15, 15));
+	queue.push_back(v3s16(17, 0, 0));
+	queue.push_back(v3s16(1, 0, 0));
+	UASSERTEQ(u32, queue.size(), 6);
+
+	// Whole blocks are taken, in the order they were queued
+	std::vector<LiquidBlockNodes> blocks;
+	queue.popBlocks(1, blocks);
+	UASSERTEQ(size_t, blocks.size(), 1);
+	UASSERT(blocks[0].blockpos == v3s16(0, 0, 0));
+	UASSERTEQ(size_t, blocks[0].nodes.size(), 3);
+	UASSERT(blocks[0].nodes[1] == v3s16(15, 15, 15));
+	UASSERTEQ(u32, queue.size(), 3);
+
+	blocks.clear();
+	queue.popBlocks(3, blocks);
+	UASSERTEQ(size_t, blocks.size(), 2);
+	UASSERT(blocks[0].blockpos == v3s16(1, 0, 0));
+	UASSERTEQ(size_t, blocks[0].nodes.size(), 2);
+	UASSERT(blocks[1].blockpos == v3s16(0, -1, 0));
+	UASSERTEQ(u32, queue.size(), 0);
+}
+
+void TestLiquidQueue::testTransformLiquids(IGameDef *gamedef)
+{
+	std::ostringstream dout;
+	Map map(dout, gamedef);
+	MapSector *sector = new ServerMapSector(&map, v2s16(0, 0), gamedef);
+	(*map.getSectorsPtr())[v2s16(0, 0)] = sector;
+	sector->createBlankBlock(0);
+
+	// A water source on a brick floor, with air around it
+	MapNode air(CONTENT_AIR);
+	MapNode brick(t_CONTENT_BRICK);
+	MapNode water(t_CONTENT_WATER);
+	v3s16 p;
+	for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+	for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+	for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++)
+		map.setNode(p, p.Y == 0 ? brick : air);
+	map.setNode(v3s16(8, 1, 8), water);
+
+	// Two nodes in a row next to it are queued for the same pass. Each
+	// is decided from the map as it was before the pass, so only the
+	// first one fills, whatever the order of the queue.
+	map.transforming_liquid_add(v3s16(10, 1, 8));
+	map.transforming_liquid_add(v3s16(9, 1, 8));
+	std::map<v3s16, MapBlock*> modified_blocks;
+	map.transformLiquids(modified_blocks);
+	UASSERTEQ(size_t, modified_blocks.size(), 1);
+
+	MapNode n = map.getNodeNoEx(v3s16(9, 1, 8));
+	UASSERTEQ(content_t, n.getContent(), t_CONTENT_WATER_FLOWING);
+	UASSERTEQ(int, n.param2 & LIQUID_LEVEL_MASK, LIQUID_LEVEL_MAX);
+	n = map.getNodeNoEx(v3s16(10, 1, 8));
+	UASSERTEQ(content_t, n.getContent(), CONTENT_AIR);
+
+	// The next pass continues from there
+	map.transformLiquids(modified_blocks);
+	n = map.getNodeNoEx(v3s16(10, 1, 8));
+	UASSERTEQ(content_t, n.getContent(), t_CONTENT_WATER_FLOWING);
+	UASSERTEQ(int, n.param2 & LIQUID_LEVEL_MASK, LIQUID_LEVEL_MAX - 1);
+
+	// Until the flow has settled
+	for (u32 i = 0; i < 20 && map.transforming_liquid_size() != 0; i++)
+		map.transformLiquids(modified_blocks);
+	UASSERTEQ(s32, map.transforming_liquid_size(), 0);
+	n = map.getNodeNoEx(v3s16(8, 1, 14));
+	UASSERTEQ(content_t, n.getContent(), t_CONTENT_WATER_FLOWING);
+	UASSERTEQ(int, n.param2 & LIQUID_LEVEL_MASK, LIQUID_LEVEL_MAX - 5);
+	n = map.getNodeNoEx(v3s16(8, 2, 8));
+	UASSERTEQ(content_t, n.getContent(), CONTENT_AIR);
+}
@@ -0,0 +1,205 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <sstream>
+
+#include "mapblock.h"
+#include "serialization.h"
+#include "voxel.h"
+
+class TestMapBlock : public TestBase {
+public:
+	TestMapBlock() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapBlock"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testNetworkCache(IGameDef *gamedef);
+	void testFaceConnectivity(IGameDef *gamedef);
+	void testContentBitmap(IGameDef *gamedef);
+};
+
+static TestMapBlock g_test_instance;
+
+void TestMapBlock::runTests(IGameDef *gamedef)
+{
+	TEST(testNetworkCache, gamedef);
+	TEST(testFaceConnectivity, gamedef);
+	TEST(testContentBitmap, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestMapBlock::testNetworkCache(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapNode stone(1);
+
+	// Clients of the same format share the serialization
+	SharedBuffer<u8> first = block.serializeNetwork(25, 26, BLOCK_CODEC_ZLIB);
+	SharedBuffer<u8> second = block.serializeNetwork(25, 26, BLOCK_CODEC_ZLIB);
+	UASSERT(*first == *second);
+
+	SharedBuffer<u8> other = block.serializeNetwork(27, 26, BLOCK_CODEC_NONE);
+	UASSERT(*other != *first);
+	UASSERT(*block.serializeNetwork(25, 26, BLOCK_CODEC_ZLIB) == *first);
+
+	// Changes make a new one
+	block.setNodeNoCheck(1, 2, 3, stone);
+	SharedBuffer<u8> changed = block.serializeNetwork(25, 26, BLOCK_CODEC_ZLIB);
+	UASSERT(*changed != *first);
+
+	std::istringstream is(std::string((const char *)*changed,
+		changed.getSize()), std::ios_base::binary);
+	MapBlock copy(NULL, v3s16(0, 0, 0), gamedef);
+	copy.deSerialize(is, 25, false);
+	bool valid;
+	UASSERT(copy.getNodeNoCheck(1, 2, 3, &valid) == stone);
+
+	block.clearNetworkCache();
+	UASSERT(*block.serializeNetwork(25, 26, BLOCK_CODEC_ZLIB) != *changed);
+}
+
+void TestMapBlock::testFaceConnectivity(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapNode stone(t_CONTENT_STONE);
+	MapNode air(CONTENT_AIR);
+
+	// Unknown nodes don't hide anything
+	UASSERT(block.getFaceConnectivity() == FACE_CONNECTIVITY_ALL);
+
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		block.setNodeNoCheck(x, y, z, stone);
+	UASSERT(block.getFaceConnectivity() == 0);
+
+	// A tunnel from the left to the right face (see g_6dirs)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		block.setNodeNoCheck(x, 8, 8, air);
+	UASSERTEQ(u16, block.getFaceConnectivity(), face_connectivity_bit(5, 2));
+
+	// A shaft from it to the top face
+	for (s16 y = 9; y < MAP_BLOCKSIZE; y++)
+		block.setNodeNoCheck(8, y, 8, air);
+	UASSERTEQ(u16, block.getFaceConnectivity(), face_connectivity_bit(5, 2) |
+			face_connectivity_bit(1, 5) | face_connectivity_bit(2, 1));
+
+	// A separate cave from the back to the bottom face
+	for (s16 z = 12; z < MAP_BLOCKSIZE; z++)
+		block.setNodeNoCheck(2, 0, z, air);
+	UASSERTEQ(u16, block.getFaceConnectivity(), face_connectivity_bit(5, 2) |
+			face_connectivity_bit(1, 5) | face_connectivity_bit(2, 1) |
+			face_connectivity_bit(0, 4));
+
+	// Every pair has its own bit
+	u16 bits = 0;
+	for (u8 a = 0; a < 6; a++)
+	for (u8 b = a + 1; b < 6; b++) {
+		UASSERT(face_connectivity_bit(a, b) == face_connectivity_bit(b, a));
+		UASSERT(!(bits & face_connectivity_bit(a, b)));
+		bits |= face_connectivity_bit(a, b);
+	}
+	UASSERTEQ(u16, bits, FACE_CONNECTIVITY_ALL);
+}
+
+// Whether the content bitmap of the block holds all of its contents
+static bool hasAllContents(MapBlock &block)
+{
+	const ContentBitmap &bitmap = block.getContentBitmap();
+	bool valid;
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++) {
+		if (!bitmap.contains(block.getNodeNoCheck(x, y, z, &valid)
+				.getContent()))
+			return false;
+	}
+	return true;
+}
+
+void TestMapBlock::testContentBitmap(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapNode stone(t_CONTENT_STONE);
+	MapNode grass(t_CONTENT_GRASS);
+	MapNode water(t_CONTENT_WATER);
+	MapNode brick(t_CONTENT_BRICK);
+	MapNode ignore(CONTENT_IGNORE);
+	UASSERT(hasAllContents(block));
+
+	block.setNode(v3s16(1, 2, 3), stone);
+	block.setNodeNoCheck(15, 15, 15, grass);
+	UASSERT(hasAllContents(block));
+	UASSERT(block.getContentBitmap().contains(t_CONTENT_STONE));
+
+	// Setting a node of a compacted block
+	block.compact();
+	block.setNode(v3s16(4, 4, 4), water);
+	UASSERT(hasAllContents(block));
+
+	// Copying from a VoxelManipulator keeps the nodes it has no data for
+	VoxelManipulator vm;
+	vm.addArea(VoxelArea(v3s16(0, 0, 0), v3s16(15, 15, 15)));
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		vm.setNode(v3s16(x, y, z), y < 8 ? brick : ignore);
+	block.copyFrom(vm);
+	UASSERT(hasAllContents(block));
+	UASSERT(block.getContentBitmap().contains(t_CONTENT_BRICK));
+
+	// Swapping in a whole array with its bitmap
+	MapNode *nodes = new MapNode[MapBlock::nodecount];
+	ContentBitmap content;
+	for (u32 i = 0; i < MapBlock::nodecount; i++)
+		nodes[i] = i % 3 ? stone : grass;
+	content.add(t_CONTENT_STONE);
+	content.add(t_CONTENT_GRASS);
+	block.swapNodes(nodes, content, false);
+	UASSERT(hasAllContents(block));
+	delete[] nodes;
+
+	// Ignored nodes in the new array keep the old ones
+	nodes = new MapNode[MapBlock::nodecount];
+	content.clear();
+	for (u32 i = 0; i < MapBlock::nodecount; i++)
+		nodes[i] = i % 2 ? water : ignore;
+	content.add(t_CONTENT_WATER);
+	content.add(CONTENT_IGNORE);
+	block.swapNodes(nodes, content, true);
+	UASSERT(hasAllContents(block));
+	UASSERT(block.getContentBitmap().contains(t_CONTENT_STONE));
+	delete[] nodes;
+
+	// And when the block was compact before
+	block.compact();
+	nodes = new MapNode[MapBlock::nodecount];
+	content.clear();
+	for (u32 i = 0; i < MapBlock::nodecount; i++)
+		nodes[i] = i % 5 ? brick : ignore;
+	content.add(t_CONTENT_BRICK);
+	content.add(CONTENT_IGNORE);
+	block.swapNodes(nodes, content, true);
+	UASSERT(hasAllContents(block));
+	delete[] nodes;
+}
@@ -0,0 +1,102 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "mapblockindex.h"
+
+class TestMapBlockIndex : public TestBase {
+public:
+	TestMapBlockIndex() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapBlockIndex"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testInsertGet();
+	void testRemove();
+};
+
+static TestMapBlockIndex g_test_instance;
+
+// The index never dereferences blocks, so any distinct addresses will do
+static char g_fake_blocks[4096];
+#define FAKE_BLOCK(i) ((MapBlock *)&g_fake_blocks[(i)])
+
+void TestMapBlockIndex::runTests(IGameDef *gamedef)
+{
+	TEST(testInsertGet);
+	TEST(testRemove);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestMapBlockIndex::testInsertGet()
+{
+	MapBlockIndex index;
+
+	// Enough entries to force the table to grow several times
+	u32 n = 0;
+	for (s16 z = -8; z < 8; z++)
+	for (s16 y = -4; y < 4; y++)
+	for (s16 x = -16; x < 16; x++)
+		index.insert(v3s16(x, y, z), FAKE_BLOCK(n++));
+	UASSERTEQ(u32, index.size(), n);
+
+	n = 0;
+	for (s16 z = -8; z < 8; z++)
+	for (s16 y = -4; y < 4; y++)
+	for (s16 x = -16; x < 16; x++)
+		UASSERT(index.get(v3s16(x, y, z)) == FAKE_BLOCK(n++));
+
+	UASSERT(index.get(v3s16(16, 0, 0)) == NULL);
+	UASSERT(index.get(v3s16(-2048, 2047, -2048)) == NULL);
+
+	// Replacing keeps the size
+	index.insert(v3s16(0, 0, 0), FAKE_BLOCK(4095));
+	UASSERTEQ(u32, index.size(), n);
+	UASSERT(index.get(v3s16(0, 0, 0)) == FAKE_BLOCK(4095));
+
+	index.clear();
+	UASSERTEQ(u32, index.size(), 0);
+	UASSERT(index.get(v3s16(1, 1, 1)) == NULL);
+}
+
+void TestMapBlockIndex::testRemove()
+{
+	MapBlockIndex index;
+
+	u32 n = 0;
+	for (s16 z = 0; z < 16; z++)
+	for (s16 x = 0; x < 64; x++)
+		index.insert(v3s16(x, 0, z), FAKE_BLOCK(n++));
+
+	// Remove every other entry; the remaining ones must stay reachable
+	for (s16 z = 0; z < 16; z++)
+	for (s16 x = 0; x < 64; x += 2)
+		UASSERT(index.remove(v3s16(x, 0, z)));
+	UASSERT(!index.remove(v3s16(0, 0, 0)));
+	UASSERTEQ(u32, index.size(), n / 2);
+
+	n = 0;
+	for (s16 z = 0; z < 16; z++)
+	for (s16 x = 0; x < 64; x++, n++) {
+		MapBlock *block = index.get(v3s16(x, 0, z));
+		UASSERT(block == (x % 2 ? FAKE_BLOCK(n) : NULL));
+	}
+}
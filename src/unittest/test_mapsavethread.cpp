@@ -0,0 +1,174 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "database.h"
+#include "mapsavethread.h"
+#include "threading/mutex_auto_lock.h"
+
+class TestMapSaveThread : public TestBase {
+public:
+	TestMapSaveThread() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapSaveThread"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testQueue();
+	void testFailedWrite();
+	void testThread();
+};
+
+static TestMapSaveThread g_test_instance;
+
+void TestMapSaveThread::runTests(IGameDef *gamedef)
+{
+	TEST(testQueue);
+	TEST(testFailedWrite);
+	TEST(testThread);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+class TestDatabase : public Database
+{
+public:
+	TestDatabase() : fail(false) {}
+
+	bool saveBlock(const v3s16 &pos, const std::string &data)
+	{
+		if (fail)
+			return false;
+		blocks[pos] = data;
+		return true;
+	}
+
+	std::string loadBlock(const v3s16 &pos)
+	{
+		std::map<v3s16, std::string>::const_iterator it = blocks.find(pos);
+		return it != blocks.end() ? it->second : "";
+	}
+
+	bool deleteBlock(const v3s16 &pos)
+	{
+		blocks.erase(pos);
+		return true;
+	}
+
+	void listAllLoadableBlocks(std::vector<v3s16> &dst)
+	{
+		for (std::map<v3s16, std::string>::const_iterator
+				it = blocks.begin(); it != blocks.end(); ++it)
+			dst.push_back(it->first);
+	}
+
+	std::map<v3s16, std::string> blocks;
+	bool fail;
+};
+
+void TestMapSaveThread::testQueue()
+{
+	TestDatabase db;
+	MapSaveThread thread(&db, 4, 2);
+	std::string data;
+
+	UASSERT(!thread.getQueuedBlock(v3s16(1, 2, 3), &data));
+
+	// The newest copy of a block is handed out until it is written
+	thread.queueBlock(v3s16(1, 2, 3), "old");
+	thread.queueBlock(v3s16(1, 2, 3), "new");
+	UASSERT(thread.getQueuedBlock(v3s16(1, 2, 3), &data));
+	UASSERT(data == "new");
+	UASSERTEQ(u32, thread.getQueueSize(), 1);
+
+	thread.queueBlock(v3s16(4, 5, 6), "deleted");
+	{
+		MutexAutoLock dblock(thread.getDatabaseMutex());
+		thread.dequeueBlock(v3s16(4, 5, 6));
+	}
+	UASSERT(!thread.getQueuedBlock(v3s16(4, 5, 6), &data));
+
+	thread.flush();
+	UASSERTEQ(u32, thread.getQueueSize(), 0);
+	UASSERT(!thread.getQueuedBlock(v3s16(1, 2, 3), &data));
+	UASSERTEQ(size_t, db.blocks.size(), 1);
+	UASSERT(db.loadBlock(v3s16(1, 2, 3)) == "new");
+
+	// A full queue is written out to make room
+	for (s16 i = 0; i < 10; i++)
+		thread.queueBlock(v3s16(i, 0, 0), "x");
+	UASSERT(thread.getQueueSize() <= 4);
+	thread.flush();
+	UASSERTEQ(size_t, db.blocks.size(), 11);
+}
+
+void TestMapSaveThread::testFailedWrite()
+{
+	TestDatabase db;
+	MapSaveThread thread(&db, 4, 2);
+	std::string data;
+
+	db.fail = true;
+	thread.queueBlock(v3s16(1, 2, 3), "a");
+	thread.flush();
+
+	// The block is kept and still handed out
+	UASSERT(thread.getQueuedBlock(v3s16(1, 2, 3), &data));
+	UASSERT(data == "a");
+	UASSERT(db.blocks.empty());
+
+	// Nothing is dropped while writes fail, even with the queue full
+	for (s16 i = 0; i < 10; i++)
+		thread.queueBlock(v3s16(i, 0, 0), "x");
+	UASSERTEQ(u32, thread.getQueueSize(), 11);
+
+	db.fail = false;
+	thread.flush();
+	UASSERTEQ(u32, thread.getQueueSize(), 0);
+	UASSERTEQ(size_t, db.blocks.size(), 11);
+	UASSERT(db.loadBlock(v3s16(1, 2, 3)) == "a");
+}
+
+void TestMapSaveThread::testThread()
+{
+	TestDatabase db;
+	{
+		MapSaveThread thread(&db, 16, 4);
+		thread.start();
+
+		for (s16 i = 0; i < 100; i++)
+			thread.queueBlock(v3s16(i, 0, 0), "x");
+		thread.commit();
+		thread.flush();
+		UASSERTEQ(u32, thread.getQueueSize(), 0);
+		UASSERTEQ(size_t, db.blocks.size(), 100);
+
+		{
+			MutexAutoLock dblock(thread.getDatabaseMutex());
+			thread.dequeueBlock(v3s16(5, 0, 0));
+			db.deleteBlock(v3s16(5, 0, 0));
+		}
+
+		// Whatever is still queued is written when the thread ends
+		thread.queueBlock(v3s16(-1, 0, 0), "y");
+	}
+	UASSERTEQ(size_t, db.blocks.size(), 100);
+	UASSERT(db.loadBlock(v3s16(-1, 0, 0)) == "y");
+	UASSERT(db.loadBlock(v3s16(5, 0, 0)) == "");
+}
@@ -20,7 +20,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include "exceptions.h"
+#include "mapgen.h"
 #include "noise.h"
+#include "noise_kernels.h"
+#include <string.h>
 
 class TestNoise : public TestBase {
 public:
@@ -34,6 +37,8 @@ class TestNoise : public TestBase {
 	void testNoise3dPoint();
 	void testNoise3dBulk();
 	void testNoiseInvalidParams();
+	void testNoiseKernels();
+	void testNoiseMapCache();
 
 	static const float expected_2d_results[10 * 10];
 	static const float expected_3d_results[10 * 10 * 10];
@@ -48,6 +53,8 @@ void TestNoise::runTests(IGameDef *gamedef)
 	TEST(testNoise3dPoint);
 	TEST(testNoise3dBulk);
 	TEST(testNoiseInvalidParams);
+	TEST(testNoiseKernels);
+	TEST(testNoiseMapCache);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -120,6 +127,101 @@ void TestNoise::testNoiseInvalidParams()
 	UASSERT(exception_thrown);
 }
 
+void TestNoise::testNoiseKernels()
+{
+	// Odd sizes so the vector kernels have values left over
+	NoiseParams np_eased(20, 40, v3f(7, 11, 5), 9, 4, 0.6, 2.0,
+		NOISE_FLAG_EASED | NOISE_FLAG_ABSVALUE);
+	float persistence[19 * 13 * 7];
+	for (u32 i = 0; i != 19 * 13 * 7; i++)
+		persistence[i] = 0.4 + (i % 5) * 0.1;
+
+	Noise scalar_2d(&np_eased, 1337, 19, 13);
+	Noise scalar_3d(&np_eased, 1337, 19, 13, 7);
+	scalar_2d.kernels = getNoiseKernels(NOISE_KERNELS_SCALAR);
+	scalar_3d.kernels = getNoiseKernels(NOISE_KERNELS_SCALAR);
+	float *expected_2d = scalar_2d.perlinMap2D(-20.5, 31.25, persistence);
+	float *expected_3d = scalar_3d.perlinMap3D(-20.5, 31.25, 7, persistence);
+
+	// All the sets this CPU can run must give the exact same values
+	for (int set = 0; set != NOISE_KERNELS_COUNT; set++) {
+		const NoiseKernels *kernels = getNoiseKernels((NoiseKernelSet)set);
+		if (!kernels)
+			continue;
+
+		Noise noise_2d(&np_eased, 1337, 19, 13);
+		Noise noise_3d(&np_eased, 1337, 19, 13, 7);
+		noise_2d.kernels = kernels;
+		noise_3d.kernels = kernels;
+		float *actual_2d = noise_2d.perlinMap2D(-20.5, 31.25, persistence);
+		float *actual_3d = noise_3d.perlinMap3D(-20.5, 31.25, 7, persistence);
+
+		UASSERT(memcmp(actual_2d, expected_2d, sizeof(float) * 19 * 13) == 0);
+		UASSERT(memcmp(actual_3d, expected_3d, sizeof(float) * 19 * 13 * 7) == 0);
+	}
+}
+
+void TestNoise::testNoiseMapCache()
+{
+	NoiseParams np_normal(20, 40, v3f(50, 50, 50), 9, 5, 0.6, 2.0);
+	float persistence[10 * 10];
+	for (u32 i = 0; i != 10 * 10; i++)
+		persistence[i] = 0.4 + (i % 5) * 0.1;
+
+	Noise direct(&np_normal, 1337, 10, 10);
+	float expected[10 * 10];
+	memcpy(expected, direct.perlinMap2D(30, -40), sizeof(expected));
+	float expected_persist[10 * 10];
+	memcpy(expected_persist, direct.perlinMap2D(30, -40, persistence),
+		sizeof(expected_persist));
+
+	NoiseMapCache cache(2);
+	Noise noise(&np_normal, 1337, 10, 10);
+
+	float *result = cache.perlinMap2D(&noise, 30, -40);
+	UASSERT(memcmp(result, expected, sizeof(expected)) == 0);
+	UASSERTEQ(u32, cache.size(), 1);
+
+	// A hit must give back the calculated values, not what the mapgen
+	// did to the result buffer afterwards
+	for (u32 i = 0; i != 10 * 10; i++)
+		noise.result[i] += 1.0;
+	result = cache.perlinMap2D(&noise, 30, -40);
+	UASSERT(memcmp(result, expected, sizeof(expected)) == 0);
+	UASSERTEQ(u32, cache.size(), 1);
+
+	// Maps of other positions or seeds are not mixed up with it
+	Noise other_seed(&np_normal, 1338, 10, 10);
+	cache.perlinMap2D(&other_seed, 30, -40);
+	UASSERT(memcmp(other_seed.result, expected, sizeof(expected)) != 0);
+
+	// Without an id, maps made with a persistence map are never cached
+	cache.perlinMap2D(&noise, 30, -40, persistence);
+	UASSERT(memcmp(noise.result, expected_persist, sizeof(expected)) == 0);
+	UASSERTEQ(u32, cache.size(), 2);
+
+	// With one, they are, and the least recently used map makes room
+	u64 persist_id = 1234;
+	cache.perlinMap2D(&noise, 30, -40, persistence, persist_id);
+	UASSERT(memcmp(noise.result, expected_persist, sizeof(expected)) == 0);
+	UASSERTEQ(u32, cache.size(), 2);
+	result = cache.perlinMap2D(&noise, 30, -40, persistence, persist_id);
+	UASSERT(memcmp(result, expected_persist, sizeof(expected)) == 0);
+	result = cache.perlinMap2D(&noise, 30, -40);
+	UASSERT(memcmp(result, expected, sizeof(expected)) == 0);
+
+	UASSERT(NoiseMapCache::getMapId(&noise, 30, -40) !=
+		NoiseMapCache::getMapId(&noise, 31, -40));
+	UASSERT(NoiseMapCache::getMapId(&noise, 30, -40) !=
+		NoiseMapCache::getMapId(&other_seed, 30, -40));
+
+	// A cache of size 0 only calculates
+	NoiseMapCache disabled(0);
+	result = disabled.perlinMap2D(&noise, 30, -40);
+	UASSERT(memcmp(result, expected, sizeof(expected)) == 0);
+	UASSERTEQ(u32, disabled.size(), 0);
+}
+
 const float TestNoise::expected_2d_results[10 * 10] = {
 	19.11726, 18.49626, 16.48476, 15.02135, 14.75713, 16.26008, 17.54822,
 	18.06860, 18.57016, 18.48407, 18.49649, 17.89160, 15.94162, 14.54901,
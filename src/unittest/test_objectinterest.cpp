@@ -0,0 +1,236 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <sstream>
+#include "objectinterest.h"
+#include "settings.h"
+#include "util/serialize.h"
+
+class TestObjectInterest : public TestBase {
+public:
+	TestObjectInterest() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestObjectInterest"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testPositionDelta();
+	void testUpdateIntervals();
+	void testStep();
+};
+
+static TestObjectInterest g_test_instance;
+
+void TestObjectInterest::runTests(IGameDef *gamedef)
+{
+	TEST(testPositionDelta);
+	TEST(testUpdateIntervals);
+	TEST(testStep);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef std::vector<std::pair<u16, std::string> > MessageList;
+
+static MessageList parse_messages(const std::string &data)
+{
+	MessageList messages;
+	std::istringstream is(data, std::ios::binary);
+	while (is.peek() != EOF) {
+		u16 id = readU16(is);
+		messages.push_back(std::make_pair(id, deSerializeString(is)));
+	}
+	return messages;
+}
+
+static ObjectPositionUpdate make_update(v3f position)
+{
+	ObjectPositionUpdate update;
+	update.position = position;
+	update.velocity = v3f(1, 0, 0);
+	update.acceleration = v3f(0, -10, 0);
+	update.yaw = 90;
+	update.do_interpolate = true;
+	update.update_interval = 0.2;
+	return update;
+}
+
+void TestObjectInterest::testPositionDelta()
+{
+	ObjectPositionUpdate base = make_update(v3f(10, 20, 30));
+	std::string data = gob_cmd_update_position_base(7, base);
+	std::istringstream is(data, std::ios::binary);
+	UASSERT(readU8(is) == GENERIC_CMD_UPDATE_POSITION_BASE);
+	u8 base_id;
+	ObjectPositionUpdate read_base = gob_read_update_position_base(is, &base_id);
+	UASSERT(base_id == 7);
+	UASSERT(read_base.position.equals(base.position, 0.001));
+	UASSERT(read_base.acceleration.equals(base.acceleration, 0.001));
+	UASSERT(read_base.do_interpolate && !read_base.is_movement_end);
+
+	// Only the changed fields are sent
+	ObjectPositionUpdate update = base;
+	update.position = v3f(10.5, 20, 29.25);
+	update.is_movement_end = true;
+	data = gob_cmd_update_position_delta(7, base, update);
+	UASSERTEQ(size_t, data.size(), 3 + 6);
+
+	ObjectPositionUpdate read;
+	is.str(data);
+	is.clear();
+	UASSERT(readU8(is) == GENERIC_CMD_UPDATE_POSITION_DELTA);
+	UASSERT(gob_read_update_position_delta(is, 7, read_base, &read));
+	UASSERT(read.position.equals(update.position, 0.001));
+	UASSERT(read.velocity.equals(update.velocity, 0.001));
+	// Unchanged fields are taken from the base
+	UASSERT(read.yaw == read_base.yaw);
+	UASSERT(read.do_interpolate && read.is_movement_end);
+
+	update.yaw = 180;
+	update.velocity = v3f(-2, 3, 0.5);
+	data = gob_cmd_update_position_delta(7, base, update);
+	is.str(data);
+	is.clear();
+	readU8(is);
+	UASSERT(gob_read_update_position_delta(is, 7, read_base, &read));
+	UASSERT(read.velocity.equals(update.velocity, 0.001));
+	UASSERT(fabs(read.yaw - 180) < 0.001);
+
+	// Deltas against another base are dropped
+	is.str(data);
+	is.clear();
+	readU8(is);
+	UASSERT(!gob_read_update_position_delta(is, 6, read_base, &read));
+
+	// Too far from the base
+	update.position = base.position + v3f(0, 40, 0);
+	UASSERT(gob_cmd_update_position_delta(7, base, update).empty());
+}
+
+void TestObjectInterest::testUpdateIntervals()
+{
+	f32 full_range = g_settings->getFloat("active_object_full_update_range") * BS;
+	f32 max_interval = g_settings->getFloat("active_object_max_update_interval");
+	f32 send_range = full_range + 32 * BS;
+
+	ObjectInterest interest;
+	// Without a player everything is sent right away
+	UASSERT(interest.getUpdateInterval(v3f(0, 0, send_range)) == 0);
+
+	interest.setViewer(v3f(0, 0, 0), v3f(0, 0, 1), send_range);
+	UASSERT(interest.getUpdateInterval(v3f(0, 0, full_range / 2)) == 0);
+	UASSERT(interest.getUpdateInterval(v3f(0, 0, -full_range / 2)) == 0);
+	UASSERT(fabs(interest.getUpdateInterval(v3f(0, 0, full_range + 16 * BS))
+			- max_interval / 2) < 0.001);
+	UASSERT(fabs(interest.getUpdateInterval(v3f(0, 0, send_range))
+			- max_interval) < 0.001);
+	UASSERT(fabs(interest.getUpdateInterval(v3f(0, 0, 2 * send_range))
+			- max_interval) < 0.001);
+	// Out of view
+	UASSERT(fabs(interest.getUpdateInterval(v3f(send_range, 0, 0))
+			- 2 * max_interval) < 0.001);
+	UASSERT(fabs(interest.getUpdateInterval(v3f(0, 0, -send_range))
+			- 2 * max_interval) < 0.001);
+}
+
+void TestObjectInterest::testStep()
+{
+	f32 max_interval = g_settings->getFloat("active_object_max_update_interval");
+	f32 send_range = g_settings->getFloat("active_object_full_update_range") * BS
+			+ 32 * BS;
+	float rtt = 0.05;
+
+	ObjectInterest interest;
+	interest.setViewer(v3f(0, 0, 0), v3f(0, 0, 1), send_range);
+
+	std::string reliable, unreliable;
+	MessageList messages;
+
+	// Near objects get every update, the first one in full
+	interest.queuePositionUpdate(1, make_update(v3f(0, 0, BS)));
+	interest.step(0.1, rtt, 27, reliable, unreliable);
+	UASSERT(reliable.empty());
+	messages = parse_messages(unreliable);
+	UASSERTEQ(size_t, messages.size(), 1);
+	UASSERT(messages[0].first == 1);
+	UASSERT(messages[0].second[0] == GENERIC_CMD_UPDATE_POSITION);
+
+	// Moving objects get a base, which is used after some round trips
+	unreliable.clear();
+	interest.queuePositionUpdate(1, make_update(v3f(0, 0, 2 * BS)));
+	interest.step(0.1, rtt, 27, reliable, unreliable);
+	messages = parse_messages(reliable);
+	UASSERTEQ(size_t, messages.size(), 1);
+	UASSERT(messages[0].second[0] == GENERIC_CMD_UPDATE_POSITION_BASE);
+	messages = parse_messages(unreliable);
+	UASSERTEQ(size_t, messages.size(), 1);
+	UASSERT(messages[0].second[0] == GENERIC_CMD_UPDATE_POSITION);
+
+	reliable.clear();
+	unreliable.clear();
+	interest.queuePositionUpdate(1, make_update(v3f(0, 0, 3 * BS)));
+	interest.step(0.1, rtt, 27, reliable, unreliable);
+	UASSERT(reliable.empty());
+	messages = parse_messages(unreliable);
+	UASSERT(messages[0].second[0] == GENERIC_CMD_UPDATE_POSITION);
+
+	unreliable.clear();
+	interest.queuePositionUpdate(1, make_update(v3f(0, 0, 4 * BS)));
+	interest.step(0.2, rtt, 27, reliable, unreliable);
+	UASSERT(reliable.empty());
+	messages = parse_messages(unreliable);
+	UASSERT(messages[0].second[0] == GENERIC_CMD_UPDATE_POSITION_DELTA);
+
+	// Older clients only get full updates
+	ObjectInterest old_interest;
+	for (u32 i = 0; i < 5; i++) {
+		unreliable.clear();
+		old_interest.queuePositionUpdate(1, make_update(v3f(0, 0, i * BS)));
+		old_interest.step(0.5, rtt, 26, reliable, unreliable);
+		UASSERT(reliable.empty());
+		messages = parse_messages(unreliable);
+		UASSERT(messages[0].second[0] == GENERIC_CMD_UPDATE_POSITION);
+	}
+
+	// Far objects get the latest update once their interval has passed
+	unreliable.clear();
+	interest.removeObject(1);
+	interest.queuePositionUpdate(2, make_update(v3f(0, 0, send_range)));
+	interest.step(0.1, rtt, 26, reliable, unreliable);
+	UASSERTEQ(size_t, parse_messages(unreliable).size(), 1);
+
+	unreliable.clear();
+	interest.queuePositionUpdate(2, make_update(v3f(0, 0, send_range - BS)));
+	interest.step(max_interval / 2, rtt, 26, reliable, unreliable);
+	interest.queuePositionUpdate(2, make_update(v3f(0, 0, send_range - 2 * BS)));
+	interest.step(max_interval / 4, rtt, 26, reliable, unreliable);
+	UASSERT(unreliable.empty());
+
+	interest.step(max_interval / 2, rtt, 26, reliable, unreliable);
+	messages = parse_messages(unreliable);
+	UASSERTEQ(size_t, messages.size(), 1);
+	UASSERT(messages[0].first == 2);
+	std::istringstream is(messages[0].second, std::ios::binary);
+	readU8(is);
+	ObjectPositionUpdate update = gob_read_update_position(is);
+	UASSERT(update.position.equals(v3f(0, 0, send_range - 2 * BS), 0.001));
+	// Interpolated over the time since the last update
+	UASSERT(fabs(update.update_interval - max_interval * 1.25) < 0.01);
+}
@@ -0,0 +1,108 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "network/networkpacket.h"
+#include "network/networkprotocol.h"
+#include "network/packetbatch.h"
+#include "network/packetbuffer.h"
+#include "threading/mutex.h"
+#include "threading/mutex_auto_lock.h"
+#include "threading/workerpool.h"
+#include "util/serialize.h"
+
+class TestPacketBatch : public TestBase {
+public:
+	TestPacketBatch() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestPacketBatch"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testPeerOrder();
+};
+
+static TestPacketBatch g_test_instance;
+
+void TestPacketBatch::runTests(IGameDef *gamedef)
+{
+	TEST(testPeerOrder);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Remembers the sequence numbers of the packets of each peer
+class RecordingHandler : public PacketBatchHandler
+{
+public:
+	void processPacket(NetworkPacket *pkt)
+	{
+		u32 seq;
+		*pkt >> seq;
+
+		// Give the other threads time to get ahead
+		volatile u32 sum = 0;
+		for (u32 i = 0; i < 10000; i++)
+			sum += i;
+
+		MutexAutoLock lock(m_mutex);
+		handled[pkt->getPeerId()].push_back(seq);
+	}
+
+	std::map<u16, std::vector<u32> > handled;
+
+private:
+	Mutex m_mutex;
+};
+
+void TestPacketBatch::testPeerOrder()
+{
+	WorkerPool pool("TestPacketBatch", 4);
+
+	// Packets that run without the environment locked and ones that
+	// lock it, mixed, so that the peers are handled in parallel
+	std::vector<NetworkPacket*> packets;
+	std::map<u16, std::vector<u32> > sent;
+	for (u32 i = 0; i < 200; i++) {
+		u16 peer_id = i < 100 ? 2 : 2 + i % 4;
+		u16 command = i % 3 ? TOSERVER_PLAYERPOS : TOSERVER_REQUEST_MEDIA;
+		// As it comes from the connection
+		PacketBuffer data(6);
+		writeU16(&data[0], command);
+		writeU32(&data[2], i);
+		NetworkPacket *pkt = new NetworkPacket();
+		pkt->putRawPacket(data, peer_id);
+		packets.push_back(pkt);
+		sent[peer_id].push_back(i);
+	}
+
+	PacketBatch batch;
+	for (size_t i = 0; i < packets.size(); i++)
+		batch.add(packets[i]);
+	UASSERTEQ(size_t, batch.getPeerCount(), 4);
+
+	RecordingHandler handler;
+	batch.process(&pool, &handler);
+
+	// Every packet is handled once, those of a peer in the order added
+	UASSERT(handler.handled == sent);
+
+	for (size_t i = 0; i < packets.size(); i++)
+		delete packets[i];
+}
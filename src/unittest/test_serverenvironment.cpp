@@ -0,0 +1,204 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "emerge.h"
+#include "environment.h"
+#include "filesys.h"
+#include "map.h"
+#include "mapblock.h"
+#include "mapsector.h"
+#include "settings.h"
+#include <algorithm>
+
+class TestServerEnvironment : public TestBase {
+public:
+	TestServerEnvironment() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestServerEnvironment"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testApplyABMs(IGameDef *gamedef);
+};
+
+static TestServerEnvironment g_test_instance;
+
+void TestServerEnvironment::runTests(IGameDef *gamedef)
+{
+	TEST(testApplyABMs, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Remembers where it was triggered, on every node it is triggered by
+class RecordingABM : public ActiveBlockModifier
+{
+public:
+	RecordingABM(const std::string &content, const std::string &neighbor,
+			std::vector<v3s16> &triggered):
+		m_content(content),
+		m_neighbor(neighbor),
+		m_triggered(triggered)
+	{
+	}
+
+	std::set<std::string> getTriggerContents()
+	{
+		std::set<std::string> s;
+		s.insert(m_content);
+		return s;
+	}
+	std::set<std::string> getRequiredNeighbors()
+	{
+		std::set<std::string> s;
+		if (!m_neighbor.empty())
+			s.insert(m_neighbor);
+		return s;
+	}
+	float getTriggerInterval() { return 1.0; }
+	u32 getTriggerChance() { return 1; }
+	bool getSimpleCatchUp() { return false; }
+
+	void trigger(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count, u32 active_object_count_wider)
+	{
+		m_triggered.push_back(p);
+	}
+
+private:
+	std::string m_content;
+	std::string m_neighbor;
+	std::vector<v3s16> &m_triggered;
+};
+
+static content_t getTestContent(v3s16 p)
+{
+	// Stone and grass everywhere but in the blocks with y = 1, some
+	// grass next to water
+	if (getNodeBlockPos(p).Y == 1)
+		return CONTENT_AIR;
+	switch ((p.X * 7 + p.Y * 13 + p.Z * 3) & 15) {
+	case 0:
+		return t_CONTENT_STONE;
+	case 1:
+	case 2:
+		return t_CONTENT_GRASS;
+	case 5:
+		return t_CONTENT_WATER;
+	default:
+		return CONTENT_AIR;
+	}
+}
+
+static bool hasWaterNeighbor(Map &map, v3s16 p)
+{
+	v3s16 p1;
+	for (p1.X = p.X - 1; p1.X <= p.X + 1; p1.X++)
+	for (p1.Y = p.Y - 1; p1.Y <= p.Y + 1; p1.Y++)
+	for (p1.Z = p.Z - 1; p1.Z <= p.Z + 1; p1.Z++) {
+		if (p1 != p && map.getNodeNoEx(p1).getContent() == t_CONTENT_WATER)
+			return true;
+	}
+	return false;
+}
+
+void TestServerEnvironment::testApplyABMs(IGameDef *gamedef)
+{
+	std::string savedir = getTestTempDirectory() + DIR_DELIM "abm_world";
+	UASSERT(fs::CreateDir(savedir));
+
+	// Scan the blocks on several threads
+	std::string num_abm_threads = g_settings->get("num_abm_threads");
+	g_settings->set("num_abm_threads", "4");
+
+	std::vector<v3s16> stone_triggered;
+	std::vector<v3s16> grass_triggered;
+	std::vector<v3s16> stone_expected;
+	std::vector<v3s16> grass_expected;
+	{
+		EmergeManager emerge(gamedef);
+		emerge.loadMapgenParams();
+		emerge.initMapgens();
+		ServerMap *map = new ServerMap(savedir, gamedef, &emerge);
+		ServerEnvironment env(map, NULL, gamedef, savedir);
+		env.addActiveBlockModifier(new RecordingABM("default:stone", "",
+				stone_triggered));
+		env.addActiveBlockModifier(new RecordingABM("default:dirt_with_grass",
+				"default:water", grass_triggered));
+
+		// The blocks with x = 3 are loaded but not active
+		v3s16 p;
+		for (p.Z = -2; p.Z <= 1; p.Z++)
+		for (p.X = -2; p.X <= 3; p.X++) {
+			ServerMapSector *sector = map->createSector(v2s16(p.X, p.Z));
+			for (p.Y = -1; p.Y <= 1; p.Y++) {
+				MapBlock *block = sector->createBlankBlock(p.Y);
+				v3s16 p0;
+				for (p0.Z = 0; p0.Z < MAP_BLOCKSIZE; p0.Z++)
+				for (p0.Y = 0; p0.Y < MAP_BLOCKSIZE; p0.Y++)
+				for (p0.X = 0; p0.X < MAP_BLOCKSIZE; p0.X++) {
+					MapNode n(getTestContent(
+						p0 + p * MAP_BLOCKSIZE));
+					block->setNodeNoCheck(p0, n);
+				}
+			}
+		}
+
+		// One of the active blocks is not loaded
+		std::set<v3s16> active_blocks;
+		for (p.Z = -2; p.Z <= 2; p.Z++)
+		for (p.Y = -1; p.Y <= 1; p.Y++)
+		for (p.X = -2; p.X <= 2; p.X++) {
+			if (p.Z < 2 || p == v3s16(0, 0, 2))
+				active_blocks.insert(p);
+		}
+
+		for (std::set<v3s16>::iterator i = active_blocks.begin();
+				i != active_blocks.end(); ++i) {
+			if (map->getBlockNoCreateNoEx(*i) == NULL)
+				continue;
+			v3s16 p0;
+			for (p0.Z = 0; p0.Z < MAP_BLOCKSIZE; p0.Z++)
+			for (p0.Y = 0; p0.Y < MAP_BLOCKSIZE; p0.Y++)
+			for (p0.X = 0; p0.X < MAP_BLOCKSIZE; p0.X++) {
+				p = p0 + *i * MAP_BLOCKSIZE;
+				content_t c = map->getNodeNoEx(p).getContent();
+				if (c == t_CONTENT_STONE)
+					stone_expected.push_back(p);
+				else if (c == t_CONTENT_GRASS && hasWaterNeighbor(*map, p))
+					grass_expected.push_back(p);
+			}
+		}
+
+		env.applyActiveBlockModifiers(active_blocks, 1.0);
+	}
+
+	g_settings->set("num_abm_threads", num_abm_threads);
+
+	// Every node is triggered once, in the active blocks only
+	UASSERT(!stone_expected.empty());
+	UASSERT(!grass_expected.empty());
+	std::sort(stone_triggered.begin(), stone_triggered.end());
+	std::sort(stone_expected.begin(), stone_expected.end());
+	UASSERT(stone_triggered == stone_expected);
+	std::sort(grass_triggered.begin(), grass_triggered.end());
+	std::sort(grass_expected.begin(), grass_expected.end());
+	UASSERT(grass_triggered == grass_expected);
+}
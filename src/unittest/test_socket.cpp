@@ -37,6 +37,7 @@ class TestSocket : public TestBase {
 
 	void testIPv4Socket();
 	void testIPv6Socket();
+	void testBatches();
 
 	static const int port = 30003;
 };
@@ -46,6 +47,7 @@ static TestSocket g_test_instance;
 void TestSocket::runTests(IGameDef *gamedef)
 {
 	TEST(testIPv4Socket);
+	TEST(testBatches);
 
 	if (g_settings->getBool("enable_ipv6"))
 		TEST(testIPv6Socket);
@@ -149,3 +151,43 @@ void TestSocket::testIPv6Socket()
 					<< std::endl;
 	}
 }
+
+void TestSocket::testBatches()
+{
+	UDPSocket socket(false);
+	socket.Bind(Address(0, 0, 0, 0, port));
+	Address address(127, 0, 0, 1, port);
+
+	// More than go through one system call
+	const int count = 100;
+	char sendbuffers[count][8];
+	UDPDatagram datagrams[count];
+	for (int i = 0; i < count; i++) {
+		snprintf(sendbuffers[i], sizeof(sendbuffers[i]), "dg %d", i);
+		datagrams[i].address = address;
+		datagrams[i].data = sendbuffers[i];
+		datagrams[i].size = strlen(sendbuffers[i]) + 1;
+	}
+	UASSERTEQ(int, socket.SendMany(datagrams, count), count);
+
+	char rcvbuffers[count][16];
+	UDPDatagram received[count];
+	for (int i = 0; i < count; i++)
+		received[i].data = rcvbuffers[i];
+
+	int num_received = 0;
+	while (num_received < count && socket.WaitData(100)) {
+		num_received += socket.ReceiveMany(&received[num_received],
+			count - num_received, sizeof(rcvbuffers[0]));
+	}
+	UASSERTEQ(int, num_received, count);
+
+	for (int i = 0; i < count; i++) {
+		UASSERTEQ(int, received[i].size, datagrams[i].size);
+		UASSERT(strcmp(rcvbuffers[i], sendbuffers[i]) == 0);
+		UASSERT(received[i].address == address);
+	}
+
+	// Nothing is left waiting
+	UASSERTEQ(int, socket.ReceiveMany(received, count, sizeof(rcvbuffers[0])), 0);
+}
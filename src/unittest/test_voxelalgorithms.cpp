@@ -20,7 +20,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include "gamedef.h"
+#include "map.h"
+#include "mapblock.h"
+#include "mapsector.h"
 #include "voxelalgorithms.h"
+#include "threading/workerpool.h"
+#include <sstream>
 
 class TestVoxelAlgorithms : public TestBase {
 public:
@@ -31,6 +36,7 @@ class TestVoxelAlgorithms : public TestBase {
 
 	void testPropogateSunlight(INodeDefManager *ndef);
 	void testClearLightAndCollectSources(INodeDefManager *ndef);
+	void testUpdateLightingNodes(IGameDef *gamedef);
 };
 
 static TestVoxelAlgorithms g_test_instance;
@@ -41,6 +47,7 @@ void TestVoxelAlgorithms::runTests(IGameDef *gamedef)
 
 	TEST(testPropogateSunlight, ndef);
 	TEST(testClearLightAndCollectSources, ndef);
+	TEST(testUpdateLightingNodes, gamedef);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -202,3 +209,161 @@ void TestVoxelAlgorithms::testClearLightAndCollectSources(INodeDefManager *ndef)
 		UASSERT(unlight_from.size() == 1);
 	}
 }
+
+// Blocks of the map used by testUpdateLightingNodes()
+#define LIGHTING_TEST_MIN -1
+#define LIGHTING_TEST_MAX 1
+
+// A Map whose lighting pool can be set, as ServerMap sets its own
+class LightingTestMap : public Map
+{
+public:
+	LightingTestMap(std::ostream &dout, IGameDef *gamedef):
+		Map(dout, gamedef)
+	{
+	}
+
+	void setLightingPool(WorkerPool *pool) { m_lighting_pool = pool; }
+};
+
+static void getLightingTestBlocks(Map &map,
+		std::map<v3s16, MapBlock*> &blocks)
+{
+	v3s16 p;
+	for (p.Z = LIGHTING_TEST_MIN; p.Z <= LIGHTING_TEST_MAX; p.Z++)
+	for (p.Y = LIGHTING_TEST_MIN; p.Y <= LIGHTING_TEST_MAX; p.Y++)
+	for (p.X = LIGHTING_TEST_MIN; p.X <= LIGHTING_TEST_MAX; p.X++)
+		blocks[p] = map.getBlockNoCreate(p);
+}
+
+/*
+	Relights the whole map from scratch with Map::updateLighting() and
+	returns the number of nodes whose light differs from the light they
+	had before.
+*/
+static u32 relightAndCompare(Map &map)
+{
+	std::map<v3s16, MapBlock*> blocks;
+	getLightingTestBlocks(map, blocks);
+
+	std::map<v3s16, u8> oldlight;
+	bool is_valid_position;
+	for (std::map<v3s16, MapBlock*>::iterator
+			i = blocks.begin(); i != blocks.end(); ++i) {
+		MapBlock *block = i->second;
+		for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+		for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+		for (s16 x = 0; x < MAP_BLOCKSIZE; x++) {
+			MapNode n = block->getNodeNoCheck(x, y, z, &is_valid_position);
+			oldlight[block->getPosRelative() + v3s16(x, y, z)] = n.param1;
+			n.param1 = 0;
+			block->setNodeNoCheck(x, y, z, n);
+		}
+	}
+
+	std::map<v3s16, MapBlock*> modified_blocks;
+	map.updateLighting(blocks, modified_blocks);
+
+	u32 differences = 0;
+	for (std::map<v3s16, u8>::iterator
+			i = oldlight.begin(); i != oldlight.end(); ++i) {
+		if (map.getNodeNoEx(i->first).param1 != i->second)
+			differences++;
+	}
+	return differences;
+}
+
+static void setNodes(Map &map, v3s16 from, v3s16 to, MapNode n)
+{
+	std::map<v3s16, MapBlock*> modified_blocks;
+	v3s16 p;
+	for (p.Z = from.Z; p.Z <= to.Z; p.Z++)
+	for (p.Y = from.Y; p.Y <= to.Y; p.Y++)
+	for (p.X = from.X; p.X <= to.X; p.X++)
+		map.addNodeAndUpdate(p, n, modified_blocks);
+	map.updateDeferredLighting(modified_blocks);
+}
+
+void TestVoxelAlgorithms::testUpdateLightingNodes(IGameDef *gamedef)
+{
+	// Stone below y=0 and air above, lit from scratch
+	std::ostringstream dout;
+	LightingTestMap map(dout, gamedef);
+	v3s16 p;
+	for (p.Z = LIGHTING_TEST_MIN; p.Z <= LIGHTING_TEST_MAX; p.Z++)
+	for (p.X = LIGHTING_TEST_MIN; p.X <= LIGHTING_TEST_MAX; p.X++) {
+		MapSector *sector = new ServerMapSector(&map, v2s16(p.X, p.Z),
+			gamedef);
+		(*map.getSectorsPtr())[v2s16(p.X, p.Z)] = sector;
+		for (p.Y = LIGHTING_TEST_MIN; p.Y <= LIGHTING_TEST_MAX; p.Y++) {
+			MapBlock *block = sector->createBlankBlock(p.Y);
+			MapNode n(p.Y < 0 ? t_CONTENT_STONE : CONTENT_AIR);
+			for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+			for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+			for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+				block->setNodeNoCheck(x, y, z, n);
+		}
+	}
+	relightAndCompare(map);
+
+	// The edits are lit together, like on the server
+	map.setLightingDeferred(true);
+	WorkerPool pool("Lighting", 2);
+
+	MapNode air(CONTENT_AIR);
+	MapNode stone(t_CONTENT_STONE);
+	MapNode torch(t_CONTENT_TORCH);
+
+	// A dark tunnel crossing the block borders in X and Z. It is dug
+	// in one batch, on the pool.
+	map.setLightingPool(&pool);
+	setNodes(map, v3s16(8, -3, 15), v3s16(24, -3, 15), air);
+	setNodes(map, v3s16(12, -3, 10), v3s16(12, -3, 20), air);
+	map.setLightingPool(NULL);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+	UASSERT(map.getNodeNoEx(v3s16(12, -3, 15))
+			.getLight(LIGHTBANK_DAY, gamedef->ndef()) == 0);
+
+	// A torch at the corner of four blocks
+	setNodes(map, v3s16(15, -3, 15), v3s16(15, -3, 15), torch);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+	UASSERT(map.getNodeNoEx(v3s16(16, -3, 15))
+			.getLight(LIGHTBANK_NIGHT, gamedef->ndef()) > 0);
+	setNodes(map, v3s16(15, -3, 15), v3s16(15, -3, 15), air);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+	UASSERT(map.getNodeNoEx(v3s16(16, -3, 15))
+			.getLight(LIGHTBANK_NIGHT, gamedef->ndef()) == 0);
+
+	// A shaft lets sunlight into the tunnel; closing it at the top cuts
+	// the sunlight column, and opening it restores it
+	setNodes(map, v3s16(20, -2, 15), v3s16(20, -1, 15), air);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+	UASSERT(map.getNodeNoEx(v3s16(20, -3, 15))
+			.getLight(LIGHTBANK_DAY, gamedef->ndef()) == LIGHT_SUN);
+	setNodes(map, v3s16(20, -1, 15), v3s16(20, -1, 15), stone);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+	UASSERT(map.getNodeNoEx(v3s16(20, -3, 15))
+			.getLight(LIGHTBANK_DAY, gamedef->ndef()) < LIGHT_SUN);
+	setNodes(map, v3s16(20, -1, 15), v3s16(20, -1, 15), air);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+
+	// A roof above the border between two blocks on top of each other
+	// shades the column below it through both
+	setNodes(map, v3s16(4, 16, 4), v3s16(6, 16, 6), stone);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+	UASSERT(map.getNodeNoEx(v3s16(5, 15, 5))
+			.getLight(LIGHTBANK_DAY, gamedef->ndef()) < LIGHT_SUN);
+	setNodes(map, v3s16(4, 16, 4), v3s16(6, 16, 6), air);
+	UASSERTEQ(u32, relightAndCompare(map), 0);
+
+	// Placing and removing in the same batch
+	{
+		std::map<v3s16, MapBlock*> modified_blocks;
+		map.addNodeAndUpdate(v3s16(23, -3, 15), torch, modified_blocks);
+		map.addNodeAndUpdate(v3s16(20, -1, 15), stone, modified_blocks);
+		map.removeNodeAndUpdate(v3s16(23, -3, 15), modified_blocks);
+		map.addNodeAndUpdate(v3s16(9, -3, 15), torch, modified_blocks);
+		map.updateDeferredLighting(modified_blocks);
+		UASSERTEQ(u32, relightAndCompare(map), 0);
+	}
+}
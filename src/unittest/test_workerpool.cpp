@@ -0,0 +1,112 @@
+/*
+Minetest
+Copyright (C) 2026 agent <agent@local>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "threading/atomic.h"
+#include "threading/workerpool.h"
+
+class TestWorkerPool : public TestBase {
+public:
+	TestWorkerPool() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestWorkerPool"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testEachItemOnce();
+	void testFewItems();
+	void testDefaultThreadCount();
+};
+
+static TestWorkerPool g_test_instance;
+
+void TestWorkerPool::runTests(IGameDef *gamedef)
+{
+	TEST(testEachItemOnce);
+	TEST(testFewItems);
+	TEST(testDefaultThreadCount);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define TEST_NUM_ITEMS 1000
+
+// Counts how often each item was worked on
+class CountingJob : public WorkerJob
+{
+public:
+	CountingJob(u32 num_threads):
+		num_threads(num_threads),
+		bad_threads(0)
+	{
+	}
+
+	void work(u32 item, u32 thread)
+	{
+		runs[item]++;
+		if (thread >= num_threads)
+			bad_threads++;
+	}
+
+	Atomic<u32> runs[TEST_NUM_ITEMS];
+	u32 num_threads;
+	// Items worked on with a thread index out of range
+	Atomic<u32> bad_threads;
+};
+
+void TestWorkerPool::testEachItemOnce()
+{
+	s32 num_threads[] = {1, 2, 4};
+	for (size_t t = 0; t < ARRLEN(num_threads); t++) {
+		WorkerPool pool("TestWorkerPool", num_threads[t]);
+		UASSERT(pool.getThreadCount() <= (u32)num_threads[t]);
+
+		// The pool is used again after each job
+		CountingJob job(pool.getThreadCount());
+		for (u32 round = 1; round <= 3; round++) {
+			pool.run(&job, TEST_NUM_ITEMS, 1);
+			for (u32 i = 0; i < TEST_NUM_ITEMS; i++)
+				UASSERTEQ(u32, job.runs[i], round);
+		}
+		UASSERTEQ(u32, job.bad_threads, 0);
+	}
+}
+
+void TestWorkerPool::testFewItems()
+{
+	WorkerPool pool("TestWorkerPool", 4);
+
+	// Fewer items than the helpers need to be woken for
+	CountingJob job(pool.getThreadCount());
+	pool.run(&job, 3);
+	for (u32 i = 0; i < 3; i++)
+		UASSERTEQ(u32, job.runs[i], 1);
+	UASSERTEQ(u32, job.runs[3], 0);
+
+	pool.run(&job, 0);
+	UASSERTEQ(u32, job.runs[0], 1);
+	UASSERTEQ(u32, job.bad_threads, 0);
+}
+
+void TestWorkerPool::testDefaultThreadCount()
+{
+	WorkerPool pool("TestWorkerPool", 0);
+	UASSERT(pool.getThreadCount() >= 1);
+	UASSERT(pool.getThreadCount() <= WORKER_POOL_DEFAULT_MAX_THREADS);
+}
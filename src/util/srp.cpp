@@ -48,6 +48,7 @@
 #include <util/sha2.h>
 
 #include "srp.h"
+#include "threading/mutex_auto_lock.h"
 //#define CSRP_USE_SHA1
 #define CSRP_USE_SHA256
 
@@ -68,6 +69,8 @@ static int g_initialized = 0;
 #define RAND_BUFF_MAX 128
 static unsigned int g_rand_idx;
 static unsigned char g_rand_buff[RAND_BUFF_MAX];
+// Verifiers may be created by several threads at once
+static Mutex g_rand_mutex;
 
 void *(*srp_alloc) (size_t) = &malloc;
 void *(*srp_realloc) (void *, size_t) = &realloc;
@@ -566,6 +569,7 @@ static SRP_Result fill_buff()
 static SRP_Result mpz_fill_random(mpz_t num)
 {
 	// was call: BN_rand(num, 256, -1, 0);
+	MutexAutoLock lock(g_rand_mutex);
 	if (RAND_BUFF_MAX - g_rand_idx < 32)
 		if (fill_buff() != SRP_OK)
 			return SRP_ERR;
@@ -576,6 +580,7 @@ static SRP_Result mpz_fill_random(mpz_t num)
 
 static SRP_Result init_random()
 {
+	MutexAutoLock lock(g_rand_mutex);
 	if (g_initialized)
 		return SRP_OK;
 	SRP_Result ret = fill_buff();
@@ -622,6 +627,7 @@ SRP_Result srp_create_salted_verification_key( SRP_HashAlgorithm alg,
 	if (*bytes_s == NULL) {
 		size_t size_to_fill = 16;
 		*len_s = size_to_fill;
+		MutexAutoLock lock(g_rand_mutex);
 		if (RAND_BUFF_MAX - g_rand_idx < size_to_fill)
 			if (fill_buff() != SRP_OK)
 				goto error_and_exit;
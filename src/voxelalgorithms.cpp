@@ -19,6 +19,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "voxelalgorithms.h"
 #include "nodedef.h"
+#include "map.h"
+#include "mapblock.h"
+#include "light.h"
+#include "threading/workerpool.h"
 
 namespace voxalgo
 {
@@ -153,5 +157,387 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 	return SunlightPropagateResult(bottom_sunlight_valid);
 }
 
+/*
+	Lighting of node edits
+*/
+
+static const v3s16 light_dirs[6] = {
+	v3s16(0, 0, 1), // back
+	v3s16(0, 1, 0), // top
+	v3s16(1, 0, 0), // right
+	v3s16(0, 0, -1), // front
+	v3s16(0, -1, 0), // bottom
+	v3s16(-1, 0, 0), // left
+};
+
+// Light stored in param1, without the light of a light source
+static inline u8 getRawLight(const MapNode &n, LightBank bank)
+{
+	return bank == LIGHTBANK_DAY ? n.param1 & 0x0f : (n.param1 >> 4) & 0x0f;
+}
+
+/*
+	Copy of a map block with the light of one bank, so that the banks
+	can be lit at the same time without writing to the map.
+*/
+struct LightScratchBlock
+{
+	MapBlock *block;
+	content_t content[MapBlock::nodecount];
+	// Raw light value; 0 for nodes that do not store light
+	u8 light[MapBlock::nodecount];
+	bool changed;
+};
+
+class LightBankUpdate
+{
+public:
+	LightBankUpdate(Map *map, INodeDefManager *ndef, LightBank bank);
+	~LightBankUpdate();
+
+	void run(const std::vector<std::pair<v3s16, MapNode> > &oldnodes);
+	// Writes the light values changed by run() to the map
+	void apply(std::map<v3s16, MapBlock*> &modified_blocks);
+
+private:
+	// Returns false if the block of p is not loaded
+	bool locate(v3s16 p, LightScratchBlock *&sb, u32 &i);
+	LightScratchBlock *loadBlock(v3s16 blockpos);
+
+	inline u8 getLight(LightScratchBlock *sb, u32 i,
+			const ContentFeatures &f)
+	{
+		return MYMAX(f.light_source, sb->light[i]);
+	}
+	inline void setLight(LightScratchBlock *sb, u32 i,
+			const ContentFeatures &f, u8 light)
+	{
+		if (f.param_type != CPT_LIGHT)
+			return;
+		sb->light[i] = light;
+		sb->changed = true;
+	}
+
+	void pushRelight(v3s16 p);
+	bool isSunlit(v3s16 p);
+	void sunlightDown(v3s16 p);
+	void unsunlightDown(v3s16 p);
+	void unspread();
+	void spread();
+
+	Map *m_map;
+	INodeDefManager *m_ndef;
+	LightBank m_bank;
+
+	std::map<v3s16, LightScratchBlock*> m_blocks;
+	bool m_last_valid;
+	v3s16 m_last_pos;
+	LightScratchBlock *m_last;
+
+	// Nodes that were darkened, with the light they had
+	std::vector<std::pair<v3s16, u8> > m_unlight;
+	// Nodes to spread light from, by their light level
+	std::vector<v3s16> m_relight[LIGHT_SUN + 1];
+};
+
+LightBankUpdate::LightBankUpdate(Map *map, INodeDefManager *ndef,
+		LightBank bank):
+	m_map(map),
+	m_ndef(ndef),
+	m_bank(bank),
+	m_last_valid(false),
+	m_last(NULL)
+{
+}
+
+LightBankUpdate::~LightBankUpdate()
+{
+	for (std::map<v3s16, LightScratchBlock*>::iterator
+			i = m_blocks.begin(); i != m_blocks.end(); ++i)
+		delete i->second;
+}
+
+LightScratchBlock *LightBankUpdate::loadBlock(v3s16 blockpos)
+{
+	MapBlock *block = m_map->getBlockNoCreateNoEx(blockpos);
+	if (block == NULL || block->isDummy())
+		return NULL;
+
+	LightScratchBlock *sb = new LightScratchBlock;
+	sb->block = block;
+	sb->changed = false;
+	bool is_valid_position;
+	u32 i = 0;
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++, i++) {
+		MapNode n = block->getNodeNoCheck(x, y, z, &is_valid_position);
+		const ContentFeatures &f = m_ndef->get(n);
+		sb->content[i] = n.getContent();
+		sb->light[i] = f.param_type == CPT_LIGHT ?
+				getRawLight(n, m_bank) : 0;
+	}
+	return sb;
+}
+
+bool LightBankUpdate::locate(v3s16 p, LightScratchBlock *&sb, u32 &i)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	if (!m_last_valid || blockpos != m_last_pos) {
+		std::map<v3s16, LightScratchBlock*>::iterator it =
+				m_blocks.find(blockpos);
+		if (it == m_blocks.end()) {
+			m_last = loadBlock(blockpos);
+			m_blocks[blockpos] = m_last;
+		} else {
+			m_last = it->second;
+		}
+		m_last_pos = blockpos;
+		m_last_valid = true;
+	}
+	if (m_last == NULL)
+		return false;
+
+	v3s16 relpos = p - blockpos * MAP_BLOCKSIZE;
+	sb = m_last;
+	i = relpos.Z * MapBlock::zstride + relpos.Y * MapBlock::ystride
+			+ relpos.X;
+	return true;
+}
+
+void LightBankUpdate::pushRelight(v3s16 p)
+{
+	LightScratchBlock *sb;
+	u32 i;
+	if (!locate(p, sb, i))
+		return;
+	u8 light = getLight(sb, i, m_ndef->get(sb->content[i]));
+	if (light > 0)
+		m_relight[light].push_back(p);
+}
+
+bool LightBankUpdate::isSunlit(v3s16 p)
+{
+	LightScratchBlock *sb;
+	u32 i;
+	// A node at the top of the loaded area is lit by the sun
+	if (!locate(p, sb, i))
+		return true;
+	return sb->light[i] == LIGHT_SUN;
+}
+
+// Lets sunlight fall down from p
+void LightBankUpdate::sunlightDown(v3s16 p)
+{
+	LightScratchBlock *sb;
+	u32 i;
+	for (p.Y--; locate(p, sb, i); p.Y--) {
+		const ContentFeatures &f = m_ndef->get(sb->content[i]);
+		if (!f.sunlight_propagates || sb->light[i] == LIGHT_SUN)
+			break;
+		setLight(sb, i, f, LIGHT_SUN);
+		m_relight[LIGHT_SUN].push_back(p);
+	}
+}
+
+// Removes the sunlight falling down from p
+void LightBankUpdate::unsunlightDown(v3s16 p)
+{
+	LightScratchBlock *sb;
+	u32 i;
+	for (p.Y--; locate(p, sb, i); p.Y--) {
+		if (sb->light[i] != LIGHT_SUN)
+			break;
+		sb->light[i] = 0;
+		sb->changed = true;
+		m_unlight.push_back(std::make_pair(p, (u8)LIGHT_SUN));
+	}
+}
+
+/*
+	Darkens the nodes that got their light from the nodes in m_unlight.
+	The brighter nodes found at the border are queued for spreading
+	their light back.
+*/
+void LightBankUpdate::unspread()
+{
+	LightScratchBlock *sb;
+	u32 i;
+	// m_unlight grows while it is walked through
+	for (size_t k = 0; k < m_unlight.size(); k++) {
+		v3s16 pos = m_unlight[k].first;
+		u8 oldlight = m_unlight[k].second;
+		for (u16 d = 0; d < 6; d++) {
+			v3s16 p2 = pos + light_dirs[d];
+			if (!locate(p2, sb, i))
+				continue;
+			const ContentFeatures &f2 = m_ndef->get(sb->content[i]);
+			u8 light2 = getLight(sb, i, f2);
+			if (light2 == 0)
+				continue;
+			if (light2 < oldlight) {
+				if (f2.light_propagates && sb->light[i] != 0) {
+					sb->light[i] = 0;
+					sb->changed = true;
+					m_unlight.push_back(std::make_pair(p2, light2));
+				}
+				if (f2.light_source > 0)
+					m_relight[f2.light_source].push_back(p2);
+			} else {
+				m_relight[light2].push_back(p2);
+			}
+		}
+	}
+	m_unlight.clear();
+}
+
+/*
+	Spreads light from the queued nodes, brightest first so that each
+	node is usually set only once.
+*/
+void LightBankUpdate::spread()
+{
+	LightScratchBlock *sb;
+	u32 i;
+	for (u8 level = LIGHT_SUN; level > 0; level--) {
+		std::vector<v3s16> &queue = m_relight[level];
+		for (size_t k = 0; k < queue.size(); k++) {
+			v3s16 pos = queue[k];
+			if (!locate(pos, sb, i))
+				continue;
+			u8 newlight = diminish_light(
+					getLight(sb, i, m_ndef->get(sb->content[i])));
+			if (newlight == 0)
+				continue;
+			for (u16 d = 0; d < 6; d++) {
+				v3s16 p2 = pos + light_dirs[d];
+				if (!locate(p2, sb, i))
+					continue;
+				const ContentFeatures &f2 = m_ndef->get(sb->content[i]);
+				if (!f2.light_propagates || getLight(sb, i, f2) >= newlight)
+					continue;
+				setLight(sb, i, f2, newlight);
+				// newlight < level, so this goes to a later queue
+				m_relight[newlight].push_back(p2);
+			}
+		}
+		queue.clear();
+	}
+}
+
+void LightBankUpdate::run(
+		const std::vector<std::pair<v3s16, MapNode> > &oldnodes)
+{
+	LightScratchBlock *sb;
+	u32 i;
+	for (std::vector<std::pair<v3s16, MapNode> >::const_iterator
+			it = oldnodes.begin(); it != oldnodes.end(); ++it) {
+		v3s16 p = it->first;
+		if (!locate(p, sb, i))
+			continue;
+		const ContentFeatures &f = m_ndef->get(sb->content[i]);
+
+		u8 newlight = 0;
+		if (m_bank == LIGHTBANK_DAY && f.sunlight_propagates &&
+				isSunlit(p + v3s16(0, 1, 0)))
+			newlight = LIGHT_SUN;
+		// isSunlit() may have moved the cached block
+		locate(p, sb, i);
+		sb->light[i] = f.param_type == CPT_LIGHT ? newlight : 0;
+		sb->changed = true;
+
+		u8 oldlight = it->second.getLight(m_bank, m_ndef);
+		if (oldlight > 0)
+			m_unlight.push_back(std::make_pair(p, oldlight));
+
+		// The node and its neighbours light the node again
+		pushRelight(p);
+		for (u16 d = 0; d < 6; d++)
+			pushRelight(p + light_dirs[d]);
+
+		if (m_bank == LIGHTBANK_DAY) {
+			if (newlight == LIGHT_SUN)
+				sunlightDown(p);
+			else
+				unsunlightDown(p);
+		}
+	}
+
+	unspread();
+	spread();
+}
+
+void LightBankUpdate::apply(std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	for (std::map<v3s16, LightScratchBlock*>::iterator
+			it = m_blocks.begin(); it != m_blocks.end(); ++it) {
+		LightScratchBlock *sb = it->second;
+		if (sb == NULL || !sb->changed)
+			continue;
+		MapBlock *block = sb->block;
+		bool block_changed = false;
+		bool is_valid_position;
+		u32 i = 0;
+		for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+		for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+		for (s16 x = 0; x < MAP_BLOCKSIZE; x++, i++) {
+			MapNode n = block->getNodeNoCheck(x, y, z, &is_valid_position);
+			const ContentFeatures &f = m_ndef->get(n);
+			if (f.param_type != CPT_LIGHT ||
+					getRawLight(n, m_bank) == sb->light[i])
+				continue;
+			n.setLight(m_bank, sb->light[i], m_ndef);
+			block->setNodeNoCheck(x, y, z, n);
+			block_changed = true;
+		}
+		if (block_changed)
+			modified_blocks[it->first] = block;
+	}
+}
+
+// Computes the light banks, one per item
+class LightBankJob : public WorkerJob
+{
+public:
+	LightBankJob(LightBankUpdate **updates,
+			const std::vector<std::pair<v3s16, MapNode> > &oldnodes):
+		m_updates(updates),
+		m_oldnodes(oldnodes)
+	{}
+
+	void work(u32 item, u32 thread)
+	{
+		m_updates[item]->run(m_oldnodes);
+	}
+
+private:
+	LightBankUpdate **m_updates;
+	const std::vector<std::pair<v3s16, MapNode> > &m_oldnodes;
+};
+
+void updateLightingNodes(Map *map, INodeDefManager *ndef,
+		const std::vector<std::pair<v3s16, MapNode> > &oldnodes,
+		std::map<v3s16, MapBlock*> &modified_blocks,
+		WorkerPool *pool)
+{
+	if (oldnodes.empty())
+		return;
+
+	LightBankUpdate day(map, ndef, LIGHTBANK_DAY);
+	LightBankUpdate night(map, ndef, LIGHTBANK_NIGHT);
+
+	if (pool != NULL) {
+		LightBankUpdate *updates[2] = {&day, &night};
+		LightBankJob job(updates, oldnodes);
+		pool->run(&job, 2, 1);
+	} else {
+		day.run(oldnodes);
+		night.run(oldnodes);
+	}
+
+	day.apply(modified_blocks);
+	night.apply(modified_blocks);
+}
+
 } // namespace voxalgo
 
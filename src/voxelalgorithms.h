@@ -24,6 +24,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include <set>
 #include <map>
+#include <vector>
+
+class Map;
+class MapBlock;
+class WorkerPool;
 
 namespace voxalgo
 {
@@ -52,6 +57,20 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 		std::set<v3s16> & light_sources,
 		INodeDefManager *ndef);
 
+/*
+	Updates the lighting of the map after node edits.
+
+	oldnodes holds the edited positions together with the nodes that
+	were there before; the map already contains the new nodes. All
+	edits are lit in one pass per light bank. If pool is not NULL, the
+	two banks are computed on it in parallel; the map is only written
+	after both have finished.
+*/
+void updateLightingNodes(Map *map, INodeDefManager *ndef,
+		const std::vector<std::pair<v3s16, MapNode> > &oldnodes,
+		std::map<v3s16, MapBlock*> &modified_blocks,
+		WorkerPool *pool);
+
 } // namespace voxalgo
 
 #endif